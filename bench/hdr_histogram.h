@@ -0,0 +1,98 @@
+#ifndef HDR_HISTOGRAM_H
+#define HDR_HISTOGRAM_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// --- Log-Linear Latency Histogram ---
+// HDR-style bucketing: values below 2^HDR_SUB_BITS are counted exactly,
+// and every power of two above is split into 2^(HDR_SUB_BITS - 1) linear
+// sub-buckets. Any recorded value is thus known to within 1/512 (three
+// significant digits), at a fixed cost of one array of counters.
+
+#define HDR_SUB_BITS 10
+#define HDR_HALF (1u << (HDR_SUB_BITS - 1))
+#define HDR_BUCKETS ((64 - HDR_SUB_BITS + 2) * HDR_HALF)
+
+typedef struct
+{
+    uint64_t counts[HDR_BUCKETS];
+    uint64_t total;
+    uint64_t min;
+    uint64_t max;
+} hdr_histogram_t;
+
+static inline hdr_histogram_t *hdr_create(void)
+{
+    hdr_histogram_t *h = (hdr_histogram_t *)calloc(1, sizeof(hdr_histogram_t));
+    if (h)
+        h->min = UINT64_MAX;
+    return h;
+}
+
+static inline size_t _hdr_index(uint64_t v)
+{
+    if (v < (1u << HDR_SUB_BITS))
+        return (size_t)v;
+    int shift = 63 - __builtin_clzll(v) - (HDR_SUB_BITS - 1);
+    return ((size_t)shift << (HDR_SUB_BITS - 1)) + (size_t)(v >> shift);
+}
+
+/**
+ * @brief Highest value that falls into bucket 'idx'.
+ */
+static inline uint64_t _hdr_value(size_t idx)
+{
+    if (idx < (1u << HDR_SUB_BITS))
+        return idx;
+    int shift = (int)(idx >> (HDR_SUB_BITS - 1)) - 1;
+    uint64_t sub = (idx & (HDR_HALF - 1)) + HDR_HALF;
+    return ((sub + 1) << shift) - 1;
+}
+
+static inline void hdr_record(hdr_histogram_t *h, uint64_t v)
+{
+    h->counts[_hdr_index(v)]++;
+    h->total++;
+    if (v < h->min)
+        h->min = v;
+    if (v > h->max)
+        h->max = v;
+}
+
+/**
+ * @brief Adds every count of 'from' into 'to'.
+ */
+static inline void hdr_merge(hdr_histogram_t *to, const hdr_histogram_t *from)
+{
+    for (size_t i = 0; i < HDR_BUCKETS; i++)
+        to->counts[i] += from->counts[i];
+    to->total += from->total;
+    if (from->min < to->min)
+        to->min = from->min;
+    if (from->max > to->max)
+        to->max = from->max;
+}
+
+/**
+ * @return The value at percentile 'p' (0-100), or 0 when empty.
+ */
+static inline uint64_t hdr_percentile(const hdr_histogram_t *h, double p)
+{
+    if (h->total == 0)
+        return 0;
+    uint64_t rank = (uint64_t)(p / 100.0 * (double)h->total + 0.5);
+    if (rank == 0)
+        rank = 1;
+    uint64_t seen = 0;
+    for (size_t i = 0; i < HDR_BUCKETS; i++)
+    {
+        seen += h->counts[i];
+        if (seen >= rank)
+            return _hdr_value(i) < h->max ? _hdr_value(i) : h->max;
+    }
+    return h->max;
+}
+
+#endif // HDR_HISTOGRAM_H
@@ -0,0 +1,247 @@
+/**
+ * redis-microbench: times the data-structure kernels in isolation, with
+ * no sockets or event loop in the way. Each case reports ns per operation.
+ *
+ * Usage: redis-microbench [--count N] [filter]
+ * Only cases whose name contains 'filter' run.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include "zset.h"
+#include "minheap.h"
+#include "parser.h"
+
+static size_t bench_count = 1000000;
+static volatile uint64_t bench_sink; // Keeps results alive past the optimizer
+
+static long long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static uint64_t xorshift64(uint64_t *s)
+{
+    uint64_t x = *s;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *s = x;
+}
+
+static void report(const char *name, size_t ops, long long ns)
+{
+    printf("%-28s %10zu ops %10.1f ns/op %12.0f ops/sec\n", name, ops, (double)ns / (double)ops,
+           ns > 0 ? (double)ops * 1e9 / (double)ns : 0);
+}
+
+// --- Sorted Sets ---
+
+static void bench_zset(const char *engine_name, zset_engine engine)
+{
+    char name[64], member[32];
+    uint64_t rng = 42;
+    size_t n = bench_count;
+    RedisZSet *z = zset_create_engine(engine);
+    if (z == NULL)
+        return;
+
+    long long t0 = now_ns();
+    for (size_t i = 0; i < n; i++)
+    {
+        int len = snprintf(member, sizeof(member), "m:%zu", i);
+        zset_add(z, (double)(xorshift64(&rng) % 1000000000), member, (size_t)len);
+    }
+    snprintf(name, sizeof(name), "zset.%s.add", engine_name);
+    report(name, n, now_ns() - t0);
+
+    double score;
+    t0 = now_ns();
+    for (size_t i = 0; i < n; i++)
+    {
+        int len = snprintf(member, sizeof(member), "m:%llu", (unsigned long long)(xorshift64(&rng) % n));
+        bench_sink += (uint64_t)zset_score(z, member, (size_t)len, &score);
+    }
+    snprintf(name, sizeof(name), "zset.%s.score", engine_name);
+    report(name, n, now_ns() - t0);
+
+    size_t rank;
+    t0 = now_ns();
+    for (size_t i = 0; i < n; i++)
+    {
+        int len = snprintf(member, sizeof(member), "m:%llu", (unsigned long long)(xorshift64(&rng) % n));
+        bench_sink += (uint64_t)zset_rank(z, member, (size_t)len, &rank);
+    }
+    snprintf(name, sizeof(name), "zset.%s.rank", engine_name);
+    report(name, n, now_ns() - t0);
+
+    // ZRANGE-style: seek to a random rank, then walk 10 elements
+    zset_iter_t it;
+    zset_elem_t e;
+    t0 = now_ns();
+    for (size_t i = 0; i < n; i++)
+    {
+        zset_iter_seek_rank(&it, z, (size_t)(xorshift64(&rng) % n), 0);
+        for (int k = 0; k < 10 && zset_iter_next(&it, &e); k++)
+            bench_sink += e.member_len;
+    }
+    snprintf(name, sizeof(name), "zset.%s.range10", engine_name);
+    report(name, n, now_ns() - t0);
+
+    t0 = now_ns();
+    zset_free(z);
+    snprintf(name, sizeof(name), "zset.%s.free", engine_name);
+    report(name, n, now_ns() - t0);
+}
+
+// --- Min-Heap ---
+
+typedef struct
+{
+    long long when;
+    size_t index;
+} heap_item_t;
+
+static int heap_item_cmp(const void *a, const void *b)
+{
+    long long x = ((const heap_item_t *)a)->when, y = ((const heap_item_t *)b)->when;
+    return (x > y) - (x < y);
+}
+
+static void heap_item_set_index(void *item, size_t index)
+{
+    ((heap_item_t *)item)->index = index;
+}
+
+static void bench_minheap(void)
+{
+    uint64_t rng = 7;
+    size_t n = bench_count;
+    heap_item_t *items = (heap_item_t *)malloc(n * sizeof(heap_item_t));
+    size_t *order = (size_t *)malloc(n * sizeof(size_t));
+    heap_t *h = heap_create_indexed(heap_item_cmp, heap_item_set_index);
+    if (items == NULL || order == NULL || h == NULL)
+        return;
+
+    long long t0 = now_ns();
+    for (size_t i = 0; i < n; i++)
+    {
+        items[i].when = (long long)(xorshift64(&rng) % 1000000000);
+        heap_push(h, &items[i]);
+    }
+    report("minheap.push", n, now_ns() - t0);
+
+    // A TTL change: the item moves in place, found through its index
+    t0 = now_ns();
+    for (size_t i = 0; i < n; i++)
+    {
+        heap_item_t *it = &items[xorshift64(&rng) % n];
+        it->when = (long long)(xorshift64(&rng) % 1000000000);
+        heap_update(h, it->index);
+    }
+    report("minheap.update", n, now_ns() - t0);
+
+    // Half of the items, each removed once, in shuffled order
+    for (size_t i = 0; i < n; i++)
+        order[i] = i;
+    for (size_t i = n; i > 1; i--)
+    {
+        size_t j = xorshift64(&rng) % i, tmp = order[i - 1];
+        order[i - 1] = order[j];
+        order[j] = tmp;
+    }
+    t0 = now_ns();
+    for (size_t i = 0; i < n / 2; i++)
+        heap_remove(h, items[order[i]].index);
+    report("minheap.remove", n / 2, now_ns() - t0);
+
+    size_t left = heap_size(h);
+    t0 = now_ns();
+    while (heap_size(h) > 0)
+        bench_sink += (uint64_t)((heap_item_t *)heap_pop(h))->when;
+    report("minheap.pop", left, now_ns() - t0);
+
+    heap_destroy(h);
+    free(order);
+    free(items);
+}
+
+// --- RESP Parser ---
+
+static void bench_parser(void)
+{
+    size_t n = bench_count;
+    size_t cap = n * 64, len = 0;
+    char *buf = (char *)malloc(cap);
+    if (buf == NULL)
+        return;
+    for (size_t i = 0; i < n; i++)
+    {
+        char key[32];
+        int klen = snprintf(key, sizeof(key), "key:%zu", i);
+        len += (size_t)snprintf(buf + len, cap - len, "*3\r\n$3\r\nSET\r\n$%d\r\n%s\r\n$16\r\nxxxxxxxxxxxxxxxx\r\n", klen, key);
+    }
+
+    resp_parser_t p;
+    resp_parser_init(&p);
+    size_t cmds = 0;
+    long long t0 = now_ns();
+    while (resp_parse_command(&p, buf, len) == RESP_PARSE_OK)
+    {
+        resp_arg_t *argv = resp_parser_argv(&p, buf);
+        bench_sink += argv[1].len;
+        cmds++;
+    }
+    long long ns = now_ns() - t0;
+    report("parser.set.pipelined", cmds, ns);
+    printf("%-28s %10.1f MB/s\n", "parser.set.throughput", (double)len / 1e6 / ((double)ns / 1e9));
+
+    // The same bytes arriving in 1500-byte segments
+    resp_parser_free(&p);
+    resp_parser_init(&p);
+    cmds = 0;
+    t0 = now_ns();
+    for (size_t avail = 1500;; avail += 1500)
+    {
+        size_t have = avail < len ? avail : len;
+        while (resp_parse_command(&p, buf, have) == RESP_PARSE_OK)
+            cmds++;
+        if (have == len)
+            break;
+    }
+    report("parser.set.segmented", cmds, now_ns() - t0);
+
+    resp_parser_free(&p);
+    free(buf);
+}
+
+int main(int argc, char **argv)
+{
+    const char *filter = "";
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "--count") && i + 1 < argc)
+            bench_count = (size_t)atol(argv[++i]);
+        else
+            filter = argv[i];
+    }
+    if (bench_count < 2)
+    {
+        fprintf(stderr, "Usage: redis-microbench [--count N] [filter]\n");
+        return 1;
+    }
+
+    if (strstr("zset.avl", filter))
+        bench_zset("avl", ZSET_ENGINE_AVL);
+    if (strstr("zset.btree", filter))
+        bench_zset("btree", ZSET_ENGINE_BTREE);
+    if (strstr("minheap", filter))
+        bench_minheap();
+    if (strstr("parser", filter))
+        bench_parser();
+    return 0;
+}
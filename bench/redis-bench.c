@@ -0,0 +1,672 @@
+/**
+ * redis-bench: a closed-loop load generator for the server.
+ *
+ * Every connection sends a batch of --pipeline commands, waits for all of
+ * their replies, and sends the next batch. Commands are drawn at random
+ * from a weighted --mix of SET/GET/RPUSH/LRANGE/ZADD/ZRANGE over
+ * --keyspace keys per type. Connections are spread over --threads
+ * threads, each running its own epoll loop. The latency of a command is
+ * the time from its batch being written to its reply being read, recorded
+ * in a log-linear histogram (hdr_histogram.h) per thread and merged at
+ * the end.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "hdr_histogram.h"
+
+#define BENCH_READ_CHUNK (16 * 1024)
+#define BENCH_KEY_MAX 32
+
+// --- Configuration ---
+
+typedef enum
+{
+    BENCH_SET,
+    BENCH_GET,
+    BENCH_RPUSH,
+    BENCH_LRANGE,
+    BENCH_ZADD,
+    BENCH_ZRANGE,
+    BENCH_OP_COUNT
+} bench_op;
+
+static const char *bench_op_names[BENCH_OP_COUNT] = {"set", "get", "rpush", "lrange", "zadd", "zrange"};
+
+typedef struct
+{
+    const char *host;
+    int port;
+    int clients;
+    int threads;
+    int pipeline;
+    long long requests; // Stop after this many replies...
+    double duration;    // ...or after this many seconds, if set
+    long keyspace;      // Distinct keys per type
+    size_t datasize;    // Bytes per SET/RPUSH value
+    int range;          // Elements per LRANGE/ZRANGE
+    int weights[BENCH_OP_COUNT];
+    int weight_total;
+} bench_config_t;
+
+static bench_config_t cfg = {
+    .host = "127.0.0.1",
+    .port = 6379,
+    .clients = 50,
+    .threads = 1,
+    .pipeline = 1,
+    .requests = 100000,
+    .duration = 0,
+    .keyspace = 100000,
+    .datasize = 16,
+    .range = 10,
+    .weights = {50, 50, 0, 0, 0, 0},
+    .weight_total = 100,
+};
+
+static char *bench_value; // cfg.datasize bytes of 'x'
+static _Atomic long long bench_issued = 0;
+static long long bench_deadline_ns = 0;
+
+static long long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * @brief Parses a mix such as "set=20,get=80".
+ * @return 0 on success, -1 on a malformed entry or an all-zero mix.
+ */
+static int parse_mix(const char *val)
+{
+    int weights[BENCH_OP_COUNT] = {0};
+    int total = 0;
+    char buf[256];
+    snprintf(buf, sizeof(buf), "%s", val);
+
+    for (char *save, *tok = strtok_r(buf, ",", &save); tok; tok = strtok_r(NULL, ",", &save))
+    {
+        char *eq = strchr(tok, '=');
+        if (eq == NULL)
+            return -1;
+        *eq = '\0';
+        int w = atoi(eq + 1);
+        int op;
+        for (op = 0; op < BENCH_OP_COUNT; op++)
+            if (!strcasecmp(tok, bench_op_names[op]))
+                break;
+        if (op == BENCH_OP_COUNT || w < 0)
+            return -1;
+        weights[op] = w;
+        total += w;
+    }
+    if (total == 0)
+        return -1;
+    memcpy(cfg.weights, weights, sizeof(weights));
+    cfg.weight_total = total;
+    return 0;
+}
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "Usage: redis-bench [--name value ...]\n"
+            "  --host H          Server address (127.0.0.1)\n"
+            "  --port P          Server port (6379)\n"
+            "  --clients N       Connections (50)\n"
+            "  --threads N       Threads driving them (1)\n"
+            "  --pipeline N      Commands in flight per connection (1)\n"
+            "  --requests N      Total commands (100000)\n"
+            "  --duration S      Run for S seconds instead\n"
+            "  --keyspace N      Distinct keys per type (100000)\n"
+            "  --datasize N      Value size in bytes (16)\n"
+            "  --range N         Elements per LRANGE/ZRANGE (10)\n"
+            "  --mix SPEC        Weights, e.g. set=20,get=70,zadd=5,zrange=5 (set=50,get=50)\n"
+            "                    Commands: set get rpush lrange zadd zrange\n");
+}
+
+/**
+ * @brief Parses "--name value" pairs from argv.
+ * @return 0 on success, -1 on an unknown or malformed option.
+ */
+static int parse_args(int argc, char **argv)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        const char *opt = argv[i];
+        if (i + 1 >= argc)
+        {
+            fprintf(stderr, "Missing value for option %s\n", opt);
+            return -1;
+        }
+        const char *val = argv[++i];
+
+        if (!strcmp(opt, "--host"))
+            cfg.host = val;
+        else if (!strcmp(opt, "--port"))
+            cfg.port = atoi(val);
+        else if (!strcmp(opt, "--clients"))
+            cfg.clients = atoi(val);
+        else if (!strcmp(opt, "--threads"))
+            cfg.threads = atoi(val);
+        else if (!strcmp(opt, "--pipeline"))
+            cfg.pipeline = atoi(val);
+        else if (!strcmp(opt, "--requests"))
+            cfg.requests = atoll(val);
+        else if (!strcmp(opt, "--duration"))
+            cfg.duration = atof(val);
+        else if (!strcmp(opt, "--keyspace"))
+            cfg.keyspace = atol(val);
+        else if (!strcmp(opt, "--datasize"))
+            cfg.datasize = (size_t)atol(val);
+        else if (!strcmp(opt, "--range"))
+            cfg.range = atoi(val);
+        else if (!strcmp(opt, "--mix"))
+        {
+            if (parse_mix(val) != 0)
+            {
+                fprintf(stderr, "Invalid mix: %s\n", val);
+                return -1;
+            }
+        }
+        else
+        {
+            fprintf(stderr, "Unknown option: %s\n", opt);
+            return -1;
+        }
+    }
+
+    if (cfg.port <= 0 || cfg.port > 65535 || cfg.clients < 1 || cfg.threads < 1 || cfg.pipeline < 1 ||
+        cfg.requests < 1 || cfg.duration < 0 || cfg.keyspace < 1 || cfg.range < 1)
+    {
+        fprintf(stderr, "Invalid option value\n");
+        return -1;
+    }
+    if (cfg.threads > cfg.clients)
+        cfg.threads = cfg.clients;
+    return 0;
+}
+
+// --- Connections ---
+
+/**
+ * @brief One connection and the batch it has in flight.
+ */
+typedef struct
+{
+    int fd;
+    char *out; // Encoded batch
+    size_t out_len;
+    size_t out_cap;
+    size_t out_sent;
+    char *in; // Replies read so far
+    size_t in_len;
+    size_t in_cap;
+    int inflight;     // Replies still expected
+    long long sent_ns; // When the batch went out
+    int epollout;
+    int done;          // No batch left for it to send
+} bench_conn_t;
+
+typedef struct
+{
+    pthread_t tid;
+    int epfd;
+    bench_conn_t *conns;
+    int nconns;
+    uint64_t rng;
+    hdr_histogram_t *hist;
+    long long errors;
+    long long ops[BENCH_OP_COUNT];
+    int failed;
+} bench_thread_t;
+
+static int conn_open(bench_conn_t *conn)
+{
+    char port[16];
+    struct addrinfo hints = {0}, *res;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(port, sizeof(port), "%d", cfg.port);
+    int rc = getaddrinfo(cfg.host, port, &hints, &res);
+    if (rc != 0)
+    {
+        fprintf(stderr, "Can't resolve %s: %s\n", cfg.host, gai_strerror(rc));
+        return -1;
+    }
+
+    int fd = socket(res->ai_family, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, res->ai_addr, res->ai_addrlen) < 0)
+    {
+        fprintf(stderr, "Can't connect to %s:%d: %s\n", cfg.host, cfg.port, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        freeaddrinfo(res);
+        return -1;
+    }
+    freeaddrinfo(res);
+
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    memset(conn, 0, sizeof(*conn));
+    conn->fd = fd;
+    return 0;
+}
+
+static int buf_reserve(char **buf, size_t *cap, size_t len, size_t need)
+{
+    if (*cap - len >= need)
+        return 0;
+    size_t c = *cap ? *cap : 4096;
+    while (c - len < need)
+        c *= 2;
+    char *p = (char *)realloc(*buf, c);
+    if (p == NULL)
+        return -1;
+    *buf = p;
+    *cap = c;
+    return 0;
+}
+
+/**
+ * @brief Appends one command in RESP form to the connection's batch.
+ */
+static int conn_append(bench_conn_t *conn, int argc, const char **argv, const size_t *lens)
+{
+    size_t need = 16;
+    for (int i = 0; i < argc; i++)
+        need += lens[i] + 24;
+    if (buf_reserve(&conn->out, &conn->out_cap, conn->out_len, need) != 0)
+        return -1;
+
+    char *p = conn->out + conn->out_len;
+    p += sprintf(p, "*%d\r\n", argc);
+    for (int i = 0; i < argc; i++)
+    {
+        p += sprintf(p, "$%zu\r\n", lens[i]);
+        memcpy(p, argv[i], lens[i]);
+        p += lens[i];
+        *p++ = '\r';
+        *p++ = '\n';
+    }
+    conn->out_len = (size_t)(p - conn->out);
+    return 0;
+}
+
+static uint64_t xorshift64(uint64_t *s)
+{
+    uint64_t x = *s;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *s = x;
+}
+
+static bench_op pick_op(bench_thread_t *t)
+{
+    int r = (int)(xorshift64(&t->rng) % (uint64_t)cfg.weight_total);
+    for (int op = 0; op < BENCH_OP_COUNT; op++)
+    {
+        if (r < cfg.weights[op])
+            return (bench_op)op;
+        r -= cfg.weights[op];
+    }
+    return BENCH_GET;
+}
+
+static int append_random_command(bench_thread_t *t, bench_conn_t *conn)
+{
+    static const char *prefixes[BENCH_OP_COUNT] = {"key:", "key:", "list:", "list:", "zset:", "zset:"};
+    bench_op op = pick_op(t);
+    char key[BENCH_KEY_MAX], member[BENCH_KEY_MAX], score[BENCH_KEY_MAX], stop[BENCH_KEY_MAX];
+    long n = (long)(xorshift64(&t->rng) % (uint64_t)cfg.keyspace);
+    const char *argv[4];
+    size_t lens[4];
+    int argc;
+
+    argv[1] = key;
+    lens[1] = (size_t)snprintf(key, sizeof(key), "%s%ld", prefixes[op], n);
+    argv[0] = bench_op_names[op];
+    lens[0] = strlen(argv[0]);
+    switch (op)
+    {
+    case BENCH_SET:
+    case BENCH_RPUSH:
+        argv[2] = bench_value;
+        lens[2] = cfg.datasize;
+        argc = 3;
+        break;
+    case BENCH_GET:
+        argc = 2;
+        break;
+    case BENCH_ZADD:
+        argv[2] = score;
+        lens[2] = (size_t)snprintf(score, sizeof(score), "%llu", (unsigned long long)(xorshift64(&t->rng) % 1000000));
+        argv[3] = member;
+        lens[3] = (size_t)snprintf(member, sizeof(member), "m:%llu", (unsigned long long)(xorshift64(&t->rng) % 1000));
+        argc = 4;
+        break;
+    default: // LRANGE, ZRANGE
+        argv[2] = "0";
+        lens[2] = 1;
+        argv[3] = stop;
+        lens[3] = (size_t)snprintf(stop, sizeof(stop), "%d", cfg.range - 1);
+        argc = 4;
+        break;
+    }
+    t->ops[op]++;
+    return conn_append(conn, argc, argv, lens);
+}
+
+/**
+ * @brief Sends as much of the batch as the socket takes, watching for
+ * EPOLLOUT while some is left.
+ * @return 0 on success, -1 on a write error.
+ */
+static int conn_flush(bench_thread_t *t, bench_conn_t *conn)
+{
+    while (conn->out_sent < conn->out_len)
+    {
+        ssize_t n = write(conn->fd, conn->out + conn->out_sent, conn->out_len - conn->out_sent);
+        if (n < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "write: %s\n", strerror(errno));
+            return -1;
+        }
+        conn->out_sent += (size_t)n;
+    }
+    int want = conn->out_sent < conn->out_len;
+    if (want != conn->epollout)
+    {
+        struct epoll_event ev = {.events = EPOLLIN | (want ? EPOLLOUT : 0), .data.ptr = conn};
+        epoll_ctl(t->epfd, EPOLL_CTL_MOD, conn->fd, &ev);
+        conn->epollout = want;
+    }
+    return 0;
+}
+
+/**
+ * @brief Claims and sends the connection's next batch.
+ * @return 1 if a batch went out, 0 if the run is over, -1 on error.
+ */
+static int conn_send_batch(bench_thread_t *t, bench_conn_t *conn)
+{
+    long long n = cfg.pipeline;
+    if (cfg.duration > 0)
+    {
+        if (now_ns() >= bench_deadline_ns)
+            return 0;
+    }
+    else
+    {
+        long long prev = atomic_fetch_add(&bench_issued, n);
+        if (prev >= cfg.requests)
+            return 0;
+        if (prev + n > cfg.requests)
+            n = cfg.requests - prev;
+    }
+
+    conn->out_len = conn->out_sent = 0;
+    for (long long i = 0; i < n; i++)
+    {
+        if (append_random_command(t, conn) != 0)
+        {
+            fprintf(stderr, "Out of memory\n");
+            return -1;
+        }
+    }
+    conn->inflight = (int)n;
+    conn->sent_ns = now_ns();
+    return conn_flush(t, conn) == 0 ? 1 : -1;
+}
+
+/**
+ * @return Bytes of the complete reply at the start of buf[0..len), 0 if
+ * it is not complete yet, -1 if it is malformed.
+ */
+static long reply_len(const char *buf, size_t len)
+{
+    const char *nl = len ? memchr(buf, '\n', len) : NULL;
+    if (nl == NULL)
+        return 0;
+    long line = (long)(nl - buf) + 1;
+    long long n;
+    switch (buf[0])
+    {
+    case '+':
+    case '-':
+    case ':':
+        return line;
+    case '$':
+        n = atoll(buf + 1);
+        if (n < 0)
+            return line;
+        return (size_t)(line + n + 2) <= len ? line + (long)n + 2 : 0;
+    case '*':
+    {
+        n = atoll(buf + 1);
+        long off = line;
+        for (long long i = 0; i < n; i++)
+        {
+            long r = reply_len(buf + off, len - (size_t)off);
+            if (r <= 0)
+                return r;
+            off += r;
+        }
+        return off;
+    }
+    default:
+        return -1;
+    }
+}
+
+/**
+ * @brief Reads replies, records their latency and starts the next batch
+ * once the current one is fully answered.
+ * @return 1 while the connection is busy, 0 once it is done, -1 on error.
+ */
+static int conn_read(bench_thread_t *t, bench_conn_t *conn)
+{
+    for (;;)
+    {
+        if (buf_reserve(&conn->in, &conn->in_cap, conn->in_len, BENCH_READ_CHUNK) != 0)
+            return -1;
+        ssize_t n = read(conn->fd, conn->in + conn->in_len, conn->in_cap - conn->in_len);
+        if (n == 0)
+        {
+            fprintf(stderr, "Server closed the connection\n");
+            return -1;
+        }
+        if (n < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "read: %s\n", strerror(errno));
+            return -1;
+        }
+        conn->in_len += (size_t)n;
+    }
+
+    long long now = now_ns();
+    size_t off = 0;
+    while (conn->inflight > 0)
+    {
+        long r = reply_len(conn->in + off, conn->in_len - off);
+        if (r < 0)
+        {
+            fprintf(stderr, "Protocol error in reply\n");
+            return -1;
+        }
+        if (r == 0)
+            break;
+        if (conn->in[off] == '-')
+            t->errors++;
+        hdr_record(t->hist, (uint64_t)(now - conn->sent_ns));
+        conn->inflight--;
+        off += (size_t)r;
+    }
+    memmove(conn->in, conn->in + off, conn->in_len - off);
+    conn->in_len -= off;
+
+    if (conn->inflight > 0)
+        return 1;
+    return conn_send_batch(t, conn);
+}
+
+static void *bench_thread_main(void *arg)
+{
+    bench_thread_t *t = (bench_thread_t *)arg;
+    struct epoll_event events[64];
+    int busy = 0;
+
+    for (int i = 0; i < t->nconns; i++)
+    {
+        bench_conn_t *conn = &t->conns[i];
+        struct epoll_event ev = {.events = EPOLLIN, .data.ptr = conn};
+        epoll_ctl(t->epfd, EPOLL_CTL_ADD, conn->fd, &ev);
+        int rc = conn_send_batch(t, conn);
+        if (rc < 0)
+            goto fail;
+        conn->done = rc == 0;
+        busy += rc;
+    }
+
+    while (busy > 0)
+    {
+        int n = epoll_wait(t->epfd, events, 64, 1000);
+        if (n < 0 && errno != EINTR)
+            goto fail;
+        for (int i = 0; i < n; i++)
+        {
+            bench_conn_t *conn = (bench_conn_t *)events[i].data.ptr;
+            if (conn->done)
+                continue;
+            if ((events[i].events & EPOLLOUT) && conn_flush(t, conn) != 0)
+                goto fail;
+            if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+            {
+                int rc = conn_read(t, conn);
+                if (rc < 0)
+                    goto fail;
+                if (rc == 0)
+                {
+                    conn->done = 1;
+                    busy--;
+                }
+            }
+        }
+    }
+    return NULL;
+
+fail:
+    t->failed = 1;
+    return NULL;
+}
+
+// --- Report ---
+
+static void report(bench_thread_t *threads, double secs)
+{
+    hdr_histogram_t *all = hdr_create();
+    long long errors = 0, ops[BENCH_OP_COUNT] = {0};
+    for (int i = 0; i < cfg.threads; i++)
+    {
+        hdr_merge(all, threads[i].hist);
+        errors += threads[i].errors;
+        for (int op = 0; op < BENCH_OP_COUNT; op++)
+            ops[op] += threads[i].ops[op];
+    }
+
+    printf("%llu requests in %.2f s, %d clients, pipeline %d, %d thread(s)\n", (unsigned long long)all->total, secs,
+           cfg.clients, cfg.pipeline, cfg.threads);
+    printf("throughput: %.0f ops/sec\n", secs > 0 ? (double)all->total / secs : 0);
+    printf("mix:");
+    for (int op = 0; op < BENCH_OP_COUNT; op++)
+        if (ops[op])
+            printf(" %s=%lld", bench_op_names[op], ops[op]);
+    printf("\nerrors: %lld\n", errors);
+    printf("latency (ms): min %.3f p50 %.3f p99 %.3f p99.9 %.3f max %.3f\n", all->total ? all->min / 1e6 : 0,
+           hdr_percentile(all, 50) / 1e6, hdr_percentile(all, 99) / 1e6, hdr_percentile(all, 99.9) / 1e6,
+           all->max / 1e6);
+    free(all);
+}
+
+int main(int argc, char **argv)
+{
+    if (parse_args(argc, argv) != 0)
+    {
+        usage();
+        return 1;
+    }
+    bench_value = (char *)malloc(cfg.datasize + 1);
+    bench_thread_t *threads = (bench_thread_t *)calloc((size_t)cfg.threads, sizeof(bench_thread_t));
+    if (bench_value == NULL || threads == NULL)
+    {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    memset(bench_value, 'x', cfg.datasize);
+
+    // Connect everything before the clock starts
+    for (int i = 0; i < cfg.threads; i++)
+    {
+        bench_thread_t *t = &threads[i];
+        t->nconns = cfg.clients / cfg.threads + (i < cfg.clients % cfg.threads);
+        t->conns = (bench_conn_t *)calloc((size_t)t->nconns, sizeof(bench_conn_t));
+        t->hist = hdr_create();
+        t->epfd = epoll_create1(0);
+        t->rng = 0x9E3779B97F4A7C15ULL * (uint64_t)(i + 1);
+        if (t->conns == NULL || t->hist == NULL || t->epfd < 0)
+        {
+            fprintf(stderr, "Can't set up thread %d: %s\n", i, strerror(errno));
+            return 1;
+        }
+        for (int j = 0; j < t->nconns; j++)
+            if (conn_open(&t->conns[j]) != 0)
+                return 1;
+    }
+
+    long long start = now_ns();
+    if (cfg.duration > 0)
+        bench_deadline_ns = start + (long long)(cfg.duration * 1e9);
+    for (int i = 0; i < cfg.threads; i++)
+    {
+        if (pthread_create(&threads[i].tid, NULL, bench_thread_main, &threads[i]) != 0)
+        {
+            fprintf(stderr, "Can't start thread %d\n", i);
+            return 1;
+        }
+    }
+    int failed = 0;
+    for (int i = 0; i < cfg.threads; i++)
+    {
+        pthread_join(threads[i].tid, NULL);
+        failed |= threads[i].failed;
+    }
+    double secs = (double)(now_ns() - start) / 1e9;
+
+    report(threads, secs);
+    return failed ? 1 : 0;
+}
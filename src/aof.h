@@ -0,0 +1,1012 @@
+#ifndef AOF_H
+#define AOF_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "parser.h"
+#include "handler.h"
+#include "server.h"
+#include "shard.h"
+#include "rdb.h"
+#include "log.h"
+#include "time_utils.h"
+
+/**
+ * Append-only file (--appendonly yes, BGREWRITEAOF).
+ *
+ * Every write is logged in RESP as a command that repeats it: as the
+ * client sent it, unless its effect depends on when or how it ran. SET
+ * with a TTL is logged with PXAT, its absolute deadline; a pop served to
+ * BLPOP/BRPOP as the LPOP/RPOP it amounted to; a key that expired or was
+ * evicted as a DEL. Replaying the log at startup, with expiry off,
+ * rebuilds the keyspace.
+ *
+ * Each shard feeds its own buffer and writes it out with one write() at
+ * the top of its next loop iteration, before any reply of that iteration
+ * goes out (group commit). The shards share one O_APPEND file; their keys
+ * never overlap, so how their writes interleave does not matter. Then,
+ * per --appendfsync:
+ *   always   - the shard fdatasync()s before replying: an acknowledged
+ *              write is on disk;
+ *   everysec - a background thread fdatasync()s once a second if
+ *              anything was written: a crash loses about a second;
+ *   no       - the kernel flushes when it likes.
+ *
+ * BGREWRITEAOF forks like BGSAVE. The child writes the shortest log that
+ * rebuilds the keyspace as of the fork (SET/RPUSH/ZADD) to a temporary
+ * file, while the shards keep appending to the current one and also keep
+ * a copy of what they wrote since the fork. When the child is done,
+ * shard 0 parks the others, appends those copies to the new file and
+ * renames it over the old one.
+ *
+ * The same feed is what a primary streams to its replicas: a flushed
+ * buffer is also appended to the replication backlog (repl.h) once
+ * replicas have attached, whether or not the AOF is on.
+ */
+
+#define AOF_REWRITE_ITEMS_PER_CMD 64         // List elements or sorted set pairs per rewritten RPUSH/ZADD
+#define AOF_BUF_KEEP (4 * 1024 * 1024)       // Larger shard buffers are freed once written
+#define AOF_FSYNC_INTERVAL_SEC 1
+
+static inline void repl_backlog_feed(int shard_id, const char *buf, size_t len); // repl.h
+
+// --- Data Structures ---
+
+typedef struct
+{
+    char *p;
+    size_t len;
+    size_t cap;
+} aof_buf_t;
+
+/**
+ * @brief What one shard logs. Only that shard touches it, except shard 0
+ * while the others are parked.
+ */
+typedef enum
+{
+    AOF_MULTI_NONE,
+    AOF_MULTI_DEFERRED, // In an EXEC: MULTI goes out before its first write
+    AOF_MULTI_OPEN      // MULTI went out: EXEC must follow
+} aof_multi_state;
+
+typedef struct
+{
+    aof_buf_t pending;  // Fed since the last flush
+    size_t pre_rewrite; // Leading bytes of 'pending' fed before the rewrite fork
+    aof_buf_t diff;     // Written since the rewrite fork, for the new file
+    int diff_oom;       // 'diff' is missing bytes: the rewrite must be dropped
+    int multi;          // aof_multi_state of the EXEC running on the shard
+} aof_shard_t;
+
+/**
+ * @brief AOF bookkeeping. Rewrites, INFO and BGREWRITEAOF run on shard 0.
+ */
+typedef struct
+{
+    int fd;                     // O_APPEND; -1 while logging is off
+    aof_shard_t *shards;
+    pthread_mutex_t write_lock; // Serialises the shards' write()s
+    long long size;             // Of the file (under write_lock)
+    int last_write_ok;          // Under write_lock
+    long long base_size;        // Size after the last rewrite (or at startup)
+
+    pthread_t fsync_thread;     // everysec only
+    int fsync_thread_running;
+    pthread_mutex_t fsync_lock; // Held by the fsync thread while it syncs
+    pthread_cond_t fsync_cond;
+    int fsync_stop;             // Under fsync_lock
+    _Atomic int fsync_pending;  // Written since the last fsync
+
+    _Atomic int feed_backlog;   // Feed the replication backlog too (repl.h)
+
+    _Atomic int rewriting;      // The shards copy what they write to 'diff'
+    int rewrite_scheduled;      // BGREWRITEAOF waiting for a BGSAVE to end
+    long long rewrite_start_ms;
+    int last_rewrite_ok;
+    long long last_rewrite_ms;  // Duration of the last rewrite, -1 if none yet
+} aof_state_t;
+
+static aof_state_t aof_state = {
+    .fd = -1,
+    .write_lock = PTHREAD_MUTEX_INITIALIZER,
+    .last_write_ok = 1,
+    .fsync_lock = PTHREAD_MUTEX_INITIALIZER,
+    .fsync_cond = PTHREAD_COND_INITIALIZER,
+    .last_rewrite_ok = 1,
+    .last_rewrite_ms = -1,
+};
+
+// --- Buffers ---
+
+static inline int _aof_buf_reserve(aof_buf_t *b, size_t need)
+{
+    if (b->cap - b->len >= need)
+        return 0;
+    size_t cap = b->cap ? b->cap : 4096;
+    while (cap - b->len < need)
+        cap *= 2;
+    char *p = (char *)realloc(b->p, cap);
+    if (p == NULL)
+        return -1;
+    b->p = p;
+    b->cap = cap;
+    return 0;
+}
+
+static inline void _aof_buf_free(aof_buf_t *b)
+{
+    free(b->p);
+    b->p = NULL;
+    b->len = b->cap = 0;
+}
+
+/**
+ * @brief (Internal) write()s all of 'buf', resuming after short writes.
+ * @return Bytes written; fewer than 'len' (errno set) on failure.
+ */
+static inline size_t _aof_write_all(int fd, const char *buf, size_t len)
+{
+    size_t off = 0;
+    while (off < len)
+    {
+        ssize_t n = write(fd, buf + off, len - off);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        off += (size_t)n;
+    }
+    return off;
+}
+
+// --- Feeding ---
+
+static inline int _aof_feeding(void)
+{
+    return aof_state.fd >= 0 || atomic_load_explicit(&aof_state.feed_backlog, memory_order_relaxed);
+}
+
+/**
+ * @brief (Internal) Appends one RESP-encoded command to 'b'.
+ */
+static inline void _aof_append(aof_buf_t *b, const resp_arg_t *argv, int argc)
+{
+    size_t need = RESP_HEADER_MAX;
+    for (int i = 0; i < argc; i++)
+        need += RESP_BULK_OVERHEAD_MAX + argv[i].len;
+    if (_aof_buf_reserve(b, need) != 0)
+    {
+        log_error("AOF buffer: out of memory, a write was not logged");
+        return;
+    }
+    b->len += resp_encode_array_header(b->p + b->len, argc);
+    for (int i = 0; i < argc; i++)
+        b->len += resp_encode_bulk(b->p + b->len, argv[i].ptr, argv[i].len);
+}
+
+/**
+ * @brief Logs a write that ran on 'db', RESP-encoded into the buffer of
+ * the shard owning it. Does nothing while neither the AOF nor replicas
+ * take it: always during the replay at startup.
+ */
+static inline void aof_feed(redis_db_t *db, const resp_arg_t *argv, int argc)
+{
+    if (!_aof_feeding())
+        return;
+    aof_shard_t *as = &aof_state.shards[db->shard_id];
+    if (as->multi == AOF_MULTI_DEFERRED)
+    {
+        static const resp_arg_t multi = {(char *)"MULTI", 5};
+        _aof_append(&as->pending, &multi, 1);
+        as->multi = AOF_MULTI_OPEN;
+    }
+    _aof_append(&as->pending, argv, argc);
+}
+
+/**
+ * @brief Brackets the commands of an EXEC on 'db': whatever they log is
+ * wrapped in MULTI ... EXEC, so a replay or a replica applies all of it or
+ * none. An EXEC that writes nothing logs nothing.
+ */
+static inline void aof_multi_begin(redis_db_t *db)
+{
+    if (_aof_feeding())
+        aof_state.shards[db->shard_id].multi = AOF_MULTI_DEFERRED;
+}
+
+static inline void aof_multi_end(redis_db_t *db)
+{
+    if (!_aof_feeding())
+        return;
+    aof_shard_t *as = &aof_state.shards[db->shard_id];
+    if (as->multi == AOF_MULTI_OPEN)
+    {
+        static const resp_arg_t exec = {(char *)"EXEC", 4};
+        _aof_append(&as->pending, &exec, 1);
+    }
+    as->multi = AOF_MULTI_NONE;
+}
+
+/**
+ * @brief (Internal) Drops the first 'n' bytes of the pending buffer, now
+ * in the file, handing them to the replication backlog. During a rewrite,
+ * those fed after the fork are also kept for the new file.
+ */
+static inline void _aof_consume(int shard_id, aof_shard_t *as, size_t n)
+{
+    if (atomic_load_explicit(&aof_state.feed_backlog, memory_order_relaxed))
+        repl_backlog_feed(shard_id, as->pending.p, n);
+    if (atomic_load_explicit(&aof_state.rewriting, memory_order_relaxed) && n > as->pre_rewrite && !as->diff_oom)
+    {
+        size_t len = n - as->pre_rewrite;
+        if (_aof_buf_reserve(&as->diff, len) == 0)
+        {
+            memcpy(as->diff.p + as->diff.len, as->pending.p + as->pre_rewrite, len);
+            as->diff.len += len;
+        }
+        else
+        {
+            as->diff_oom = 1;
+        }
+    }
+    as->pre_rewrite = as->pre_rewrite > n ? as->pre_rewrite - n : 0;
+    memmove(as->pending.p, as->pending.p + n, as->pending.len - n);
+    as->pending.len -= n;
+}
+
+/**
+ * @brief Writes what the shard logged in its last iteration with a single
+ * write(), then syncs per --appendfsync. Runs at the top of every
+ * iteration, before the replies of the iteration are sent.
+ */
+static inline void aof_flush(int shard_id)
+{
+    aof_shard_t *as = &aof_state.shards[shard_id];
+    if (as->pending.len == 0)
+        return;
+    if (aof_state.fd < 0)
+    {
+        _aof_consume(shard_id, as, as->pending.len); // Fed for the replicas only
+        if (as->pending.cap > AOF_BUF_KEEP)
+            _aof_buf_free(&as->pending);
+        return;
+    }
+
+    pthread_mutex_lock(&aof_state.write_lock);
+    size_t n = _aof_write_all(aof_state.fd, as->pending.p, as->pending.len);
+    int err = errno;
+    // Take a torn command back, so the retry does not append to half of it
+    if (n > 0 && n < as->pending.len && ftruncate(aof_state.fd, aof_state.size) == 0)
+        n = 0;
+    aof_state.size += (long long)n;
+    int was_ok = aof_state.last_write_ok;
+    aof_state.last_write_ok = n == as->pending.len;
+    pthread_mutex_unlock(&aof_state.write_lock);
+
+    if (n < as->pending.len)
+    {
+        if (server.config.appendfsync == AOF_FSYNC_ALWAYS)
+        {
+            // Replies would go out for writes that are not on disk
+            log_error("Can't write to the AOF with appendfsync always: %s. Exiting", strerror(err));
+            log_shutdown();
+            _exit(1);
+        }
+        if (was_ok)
+            log_error("Error writing to the AOF (will retry): %s", strerror(err));
+        if (n > 0)
+            _aof_consume(shard_id, as, n);
+        return;
+    }
+    if (!was_ok)
+        log_info("AOF write error resolved");
+
+    _aof_consume(shard_id, as, n);
+    if (as->pending.cap > AOF_BUF_KEEP)
+        _aof_buf_free(&as->pending);
+
+    if (server.config.appendfsync == AOF_FSYNC_ALWAYS)
+    {
+        if (fdatasync(aof_state.fd) != 0)
+        {
+            log_error("Can't fsync the AOF with appendfsync always: %s. Exiting", strerror(errno));
+            log_shutdown();
+            _exit(1);
+        }
+    }
+    else if (server.config.appendfsync == AOF_FSYNC_EVERYSEC)
+    {
+        atomic_store_explicit(&aof_state.fsync_pending, 1, memory_order_release);
+    }
+}
+
+static inline void *_aof_fsync_main(void *arg)
+{
+    (void)arg;
+    pthread_mutex_lock(&aof_state.fsync_lock);
+    while (!aof_state.fsync_stop)
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += AOF_FSYNC_INTERVAL_SEC;
+        pthread_cond_timedwait(&aof_state.fsync_cond, &aof_state.fsync_lock, &ts);
+        if (atomic_exchange_explicit(&aof_state.fsync_pending, 0, memory_order_acq_rel) &&
+            fdatasync(aof_state.fd) != 0)
+            log_error("AOF fsync: %s", strerror(errno));
+    }
+    pthread_mutex_unlock(&aof_state.fsync_lock);
+    return NULL;
+}
+
+// --- Rewrite ---
+
+static inline void _aof_write_array_len(rdb_writer_t *w, size_t n)
+{
+    char buf[RESP_HEADER_MAX];
+    rdb_write(w, buf, resp_encode_array_header(buf, (long long)n));
+}
+
+static inline void _aof_write_bulk(rdb_writer_t *w, const char *s, size_t len)
+{
+    char buf[RESP_HEADER_MAX];
+    rdb_write(w, buf, resp_encode_bulk_header(buf, len));
+    rdb_write(w, s, len);
+    rdb_write(w, "\r\n", 2);
+}
+
+/**
+ * @brief (Internal) Splits the elements of one collection over commands
+ * of at most AOF_REWRITE_ITEMS_PER_CMD items each.
+ */
+typedef struct
+{
+    rdb_writer_t *w;
+    const char *cmd;
+    const db_entry *e;
+    size_t left;   // Items not written yet
+    size_t in_cmd; // Items the current command still takes
+} _aof_items_t;
+
+/**
+ * @brief (Internal) Call before writing the 'args' arguments of an item.
+ */
+static inline void _aof_item(_aof_items_t *it, size_t args)
+{
+    if (it->in_cmd == 0)
+    {
+        it->in_cmd = it->left < AOF_REWRITE_ITEMS_PER_CMD ? it->left : AOF_REWRITE_ITEMS_PER_CMD;
+        _aof_write_array_len(it->w, 2 + it->in_cmd * args);
+        _aof_write_bulk(it->w, it->cmd, strlen(it->cmd));
+        _aof_write_bulk(it->w, it->e->key, it->e->key_len);
+    }
+    it->in_cmd--;
+    it->left--;
+}
+
+static inline void _aof_rewrite_list_lp(_aof_items_t *it, unsigned char *lp)
+{
+    for (unsigned char *p = lp_first(lp); p; p = lp_next(lp, p))
+    {
+        size_t len;
+        const char *v = lp_get(p, &len);
+        _aof_item(it, 1);
+        _aof_write_bulk(it->w, v, len);
+    }
+}
+
+static inline void _aof_rewrite_pair(_aof_items_t *it, double score, const char *member, size_t len)
+{
+    char buf[DOUBLE_STR_SIZE];
+    _aof_item(it, 2);
+    _aof_write_bulk(it->w, buf, double_to_str(buf, score));
+    _aof_write_bulk(it->w, member, len);
+}
+
+static inline void _aof_rewrite_entry(rdb_writer_t *w, db_entry *e, long long now_ms)
+{
+    if (e->expiry_ms != -1 && e->expiry_ms <= now_ms)
+        return; // Logically gone already
+
+    if (e->type == VAL_TYPE_STRING)
+    {
+        char buf[LL_STR_SIZE];
+        size_t len;
+        const char *s = db_string_get(e, buf, &len);
+        _aof_write_array_len(w, e->expiry_ms == -1 ? 3 : 5);
+        _aof_write_bulk(w, "SET", 3);
+        _aof_write_bulk(w, e->key, e->key_len);
+        _aof_write_bulk(w, s, len);
+        if (e->expiry_ms != -1)
+        {
+            _aof_write_bulk(w, "PXAT", 4);
+            _aof_write_bulk(w, buf, ll_to_str(buf, e->expiry_ms));
+        }
+    }
+    else if (e->type == VAL_TYPE_LIST)
+    {
+        _aof_items_t it = {w, "RPUSH", e, _list_length(e), 0};
+        if (e->encoding == VAL_ENC_LISTPACK)
+        {
+            _aof_rewrite_list_lp(&it, (unsigned char *)e->value);
+        }
+        else
+        {
+            for (quicklist_node_t *node = ((quicklist_t *)e->value)->head; node; node = node->next)
+                _aof_rewrite_list_lp(&it, node->lp);
+        }
+    }
+    else
+    {
+        _aof_items_t it = {w, "ZADD", e, _zset_length(e), 0};
+        if (e->encoding == VAL_ENC_LISTPACK)
+        {
+            unsigned char *lp = (unsigned char *)e->value;
+            for (unsigned char *p = lp_first(lp); p; p = lp_next(lp, lp_next(lp, p)))
+            {
+                size_t len;
+                const char *member = lp_get(p, &len);
+                _aof_rewrite_pair(&it, zlp_score_at(lp, p), member, len);
+            }
+        }
+        else
+        {
+            zset_iter_t zit;
+            zset_elem_t el;
+            zset_iter_seek_rank(&zit, (RedisZSet *)e->value, 0, 0);
+            while (zset_iter_next(&zit, &el))
+                _aof_rewrite_pair(&it, el.score, el.member, el.member_len);
+        }
+    }
+}
+
+typedef struct
+{
+    rdb_writer_t *w;
+    long long now_ms;
+} _aof_rewrite_ctx_t;
+
+static inline void _aof_rewrite_node(void *privdata, dict_node_t *node)
+{
+    _aof_rewrite_ctx_t *ctx = (_aof_rewrite_ctx_t *)privdata;
+    _aof_rewrite_entry(ctx->w, DB_ENTRY_OF(node), ctx->now_ms);
+}
+
+/**
+ * @brief Writes the commands that rebuild 'dbs' to 'fd' (through the
+ * snapshot writer's buffering). Nothing may modify them meanwhile.
+ * @return 0 on success, -1 with errno set on a write error.
+ */
+static inline int aof_rewrite_fd(int fd, redis_db_t **dbs, int ndbs, long long now_ms)
+{
+    rdb_writer_t w;
+    rdb_writer_init(&w, fd);
+
+    _aof_rewrite_ctx_t ctx = {&w, now_ms};
+    for (int i = 0; i < ndbs && !w.error; i++)
+    {
+        uint64_t cursor = 0;
+        do
+            cursor = dict_scan(&dbs[i]->entries, cursor, _aof_rewrite_node, &ctx);
+        while (cursor != 0 && !w.error);
+    }
+    _rdb_flush(&w);
+    if (w.error)
+    {
+        errno = w.error;
+        return -1;
+    }
+    return 0;
+}
+
+static inline void _aof_temp_path(char *buf, size_t cap, pid_t pid)
+{
+    snprintf(buf, cap, "%s.rewrite-%d", server.config.appendfilename, (int)pid);
+}
+
+/**
+ * @brief (Internal) Writes and fsync()s a rewrite of every shard to
+ * 'tmp'. Logs nothing, as it also runs in the BGREWRITEAOF child.
+ * @return 0 on success, -1 with errno set (and 'tmp' removed).
+ */
+static inline int _aof_rewrite_to_temp(const char *tmp, long long now_ms)
+{
+    redis_db_t *dbs[SHARDS_MAX];
+    for (int i = 0; i < server.nshards; i++)
+        dbs[i] = &server.shards[i].db;
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return -1;
+    if (aof_rewrite_fd(fd, dbs, server.nshards, now_ms) != 0 || fsync(fd) != 0 || close(fd) != 0)
+    {
+        int err = errno;
+        close(fd);
+        unlink(tmp);
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Forks a child that rewrites the log. The shards are parked only
+ * for the fork() itself.
+ * @return 0 if the child is running, -1 on failure (logged).
+ */
+static inline int aof_rewrite_start(void)
+{
+    if (server.child_type != CHILD_NONE)
+        return -1;
+    if (shard_pause_others(server.shards, server.nshards, &server.shutdown_asap) != 0)
+        return -1;
+
+    long long now = current_time_ms();
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        // As for BGSAVE: a frozen image, and no logging
+        char tmp[4096];
+        _aof_temp_path(tmp, sizeof(tmp), getpid());
+        _exit(_aof_rewrite_to_temp(tmp, now) == 0 ? 0 : 1);
+    }
+    if (pid > 0 && aof_state.shards)
+    {
+        // What is still pending was fed before the fork: the child has it
+        for (int i = 0; i < server.nshards; i++)
+            aof_state.shards[i].pre_rewrite = aof_state.shards[i].pending.len;
+        atomic_store_explicit(&aof_state.rewriting, 1, memory_order_relaxed);
+    }
+    shard_resume_others(server.nshards);
+
+    aof_state.rewrite_scheduled = 0;
+    if (pid < 0)
+    {
+        log_error("Can't fork for BGREWRITEAOF: %s", strerror(errno));
+        aof_state.last_rewrite_ok = 0;
+        return -1;
+    }
+    log_info("Background append only file rewriting started by pid %d", (int)pid);
+    server.child_type = CHILD_AOF;
+    server.child_pid = pid;
+    aof_state.rewrite_start_ms = now;
+    return 0;
+}
+
+/**
+ * @brief (Internal) Ends the copying to the diff buffers. 'installed':
+ * the new file holds what the shards fed before the fork, so that part of
+ * their pending writes goes; otherwise it is still due for the old file.
+ */
+static inline void _aof_rewrite_reset(int installed)
+{
+    atomic_store_explicit(&aof_state.rewriting, 0, memory_order_relaxed);
+    if (aof_state.shards == NULL)
+        return;
+    for (int i = 0; i < server.nshards; i++)
+    {
+        aof_shard_t *as = &aof_state.shards[i];
+        if (installed && as->pre_rewrite > 0)
+        {
+            memmove(as->pending.p, as->pending.p + as->pre_rewrite, as->pending.len - as->pre_rewrite);
+            as->pending.len -= as->pre_rewrite;
+        }
+        as->pre_rewrite = 0;
+        _aof_buf_free(&as->diff);
+        as->diff_oom = 0;
+    }
+}
+
+/**
+ * @brief (Internal) With the shards parked: appends what they wrote since
+ * the fork to the child's file, renames it over the log and switches to it.
+ * @return 0 on success, -1 on failure (logged, the old log stays).
+ */
+static inline int _aof_rewrite_install(const char *tmp)
+{
+    int fd = open(tmp, O_WRONLY | O_APPEND | O_CLOEXEC);
+    if (fd < 0)
+    {
+        log_error("Can't open the rewritten AOF %s: %s", tmp, strerror(errno));
+        return -1;
+    }
+    size_t diff = 0;
+    for (int i = 0; aof_state.shards && i < server.nshards; i++)
+    {
+        aof_shard_t *as = &aof_state.shards[i];
+        if (as->diff_oom)
+        {
+            log_error("Out of memory buffering writes for the AOF rewrite");
+            close(fd);
+            return -1;
+        }
+        if (_aof_write_all(fd, as->diff.p, as->diff.len) != as->diff.len)
+        {
+            log_error("Can't append to the rewritten AOF: %s", strerror(errno));
+            close(fd);
+            return -1;
+        }
+        diff += as->diff.len;
+    }
+    struct stat st;
+    if (fsync(fd) != 0 || fstat(fd, &st) != 0 || rename(tmp, server.config.appendfilename) != 0)
+    {
+        log_error("Can't install the rewritten AOF: %s", strerror(errno));
+        close(fd);
+        return -1;
+    }
+    log_info("Residual parent diff successfully flushed to the rewritten AOF (%.2f MB)", (double)diff / (1024 * 1024));
+
+    if (aof_state.fd < 0)
+    {
+        close(fd); // The log is off: the rewrite only leaves its file behind
+        return 0;
+    }
+    // The fsync thread may be using the old descriptor
+    pthread_mutex_lock(&aof_state.fsync_lock);
+    int old = aof_state.fd;
+    aof_state.fd = fd;
+    atomic_store_explicit(&aof_state.fsync_pending, 0, memory_order_relaxed);
+    pthread_mutex_unlock(&aof_state.fsync_lock);
+    close(old);
+    aof_state.size = aof_state.base_size = (long long)st.st_size;
+    return 0;
+}
+
+/**
+ * @brief (Internal) The rewrite child exited; 'ok' if it succeeded.
+ */
+static inline void _aof_rewrite_done(int ok)
+{
+    char tmp[4096];
+    _aof_temp_path(tmp, sizeof(tmp), server.child_pid);
+    server.child_type = CHILD_NONE;
+    aof_state.last_rewrite_ms = current_time_ms() - aof_state.rewrite_start_ms;
+
+    if (!ok)
+        log_error("Background AOF rewrite terminated with error");
+    else
+        log_info("Background AOF rewrite terminated with success");
+
+    if (shard_pause_others(server.shards, server.nshards, &server.shutdown_asap) != 0)
+    {
+        // Shutting down: the shards are stopping, aof_shutdown() cleans up
+        atomic_store_explicit(&aof_state.rewriting, 0, memory_order_relaxed);
+        unlink(tmp);
+        aof_state.last_rewrite_ok = 0;
+        return;
+    }
+    if (ok && _aof_rewrite_install(tmp) != 0)
+        ok = 0;
+    _aof_rewrite_reset(ok);
+    shard_resume_others(server.nshards);
+
+    if (!ok)
+        unlink(tmp);
+    else
+        log_info("Background AOF rewrite finished successfully");
+    aof_state.last_rewrite_ok = ok;
+}
+
+/**
+ * @brief Runs on shard 0 every loop iteration, after rdb_cron(): reaps a
+ * finished rewrite child, and starts a scheduled rewrite once no other
+ * child is running.
+ */
+static inline void aof_cron(void)
+{
+    if (server.child_type == CHILD_AOF)
+    {
+        int status;
+        pid_t pid = waitpid(server.child_pid, &status, WNOHANG);
+        if (pid == 0 || (pid < 0 && errno == EINTR))
+            return;
+        _aof_rewrite_done(pid > 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+        return;
+    }
+    if (server.child_type == CHILD_NONE && aof_state.rewrite_scheduled)
+        aof_rewrite_start();
+}
+
+// --- Startup and Shutdown ---
+
+typedef int (*aof_exec_fn)(const resp_arg_t *argv, int argc);
+
+/**
+ * @brief (Internal) 'p' just parsed a MULTI: checks that its EXEC follows
+ * in buf[0..len) without consuming anything.
+ * @return RESP_PARSE_OK if it does. Otherwise RESP_PARSE_INCOMPLETE, with
+ * p->cmd_start still at the MULTI, or RESP_PARSE_ERROR, with p->cmd_start
+ * and p->err describing the error.
+ */
+static inline resp_status _aof_find_exec(resp_parser_t *p, char *buf, size_t len)
+{
+    resp_parser_t ahead;
+    resp_parser_init(&ahead);
+    ahead.pos = ahead.cmd_start = p->pos;
+    resp_status status;
+    while ((status = resp_parse_command(&ahead, buf, len)) == RESP_PARSE_OK)
+    {
+        resp_arg_t *argv = resp_parser_argv(&ahead, buf);
+        if (ahead.argc == 1 && resp_arg_eq_nocase(&argv[0], "exec"))
+            break;
+    }
+    if (status == RESP_PARSE_ERROR)
+    {
+        p->cmd_start = ahead.cmd_start;
+        p->err = ahead.err;
+    }
+    resp_parser_free(&ahead);
+    return status;
+}
+
+/**
+ * @brief Replays the log at 'path', if there is one, through 'exec', with
+ * expiry off (db_replaying). A command cut short at the end, as by a crash
+ * mid-write, is dropped and the file truncated before it, and so is a
+ * MULTI block missing its EXEC; anything else malformed is an error.
+ * @return 0 on success or without a file, -1 on failure (logged).
+ */
+static inline int aof_load(const char *path, aof_exec_fn exec)
+{
+    int fd = open(path, O_RDWR | O_CLOEXEC);
+    if (fd < 0)
+    {
+        if (errno == ENOENT)
+            return 0;
+        log_error("Can't open the AOF %s: %s", path, strerror(errno));
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        log_error("Can't stat the AOF %s: %s", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    size_t size = (size_t)st.st_size;
+    char *map = NULL;
+    if (size > 0)
+    {
+        map = (char *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED)
+        {
+            log_error("Can't map the AOF %s: %s", path, strerror(errno));
+            close(fd);
+            return -1;
+        }
+        madvise(map, size, MADV_SEQUENTIAL);
+    }
+
+    long long start_us = monotonic_us();
+    resp_parser_t p;
+    resp_parser_init(&p);
+    resp_status status;
+    size_t commands = 0;
+    int ret = 0;
+    db_replaying = 1;
+    while ((status = resp_parse_command(&p, map, size)) == RESP_PARSE_OK)
+    {
+        resp_arg_t *argv = resp_parser_argv(&p, map);
+        if (p.argc == 1 && resp_arg_eq_nocase(&argv[0], "multi"))
+        {
+            // A transaction cut short is dropped whole, like a truncated command
+            if ((status = _aof_find_exec(&p, map, size)) != RESP_PARSE_OK)
+                break;
+            continue;
+        }
+        if (p.argc == 1 && resp_arg_eq_nocase(&argv[0], "exec"))
+            continue;
+        if (exec(argv, p.argc) != 0)
+        {
+            log_error("Bad command in the AOF %s at offset %zu", path, p.cmd_start);
+            ret = -1;
+            break;
+        }
+        commands++;
+    }
+    db_replaying = 0;
+
+    if (ret == 0 && status == RESP_PARSE_ERROR)
+    {
+        log_error("Corrupt AOF %s at offset %zu: %s", path, p.cmd_start, p.err);
+        ret = -1;
+    }
+    else if (ret == 0 && p.cmd_start < size)
+    {
+        log_warn("The AOF %s ends with a truncated command: dropping its last %zu bytes", path, size - p.cmd_start);
+        if (ftruncate(fd, (off_t)p.cmd_start) != 0)
+        {
+            log_error("Can't truncate the AOF %s: %s", path, strerror(errno));
+            ret = -1;
+        }
+    }
+    if (ret == 0)
+        log_info("DB loaded from append only file: %.3f seconds (%zu commands)",
+                 (double)(monotonic_us() - start_us) / 1e6, commands);
+
+    resp_parser_free(&p);
+    if (map)
+        munmap(map, size);
+    close(fd);
+    return ret;
+}
+
+/**
+ * @brief Allocates the shards' feed buffers, before any command runs.
+ * @return 0 on success, -1 on failure (logged).
+ */
+static inline int aof_init(void)
+{
+    aof_state.shards = (aof_shard_t *)calloc(server.nshards, sizeof(aof_shard_t));
+    if (aof_state.shards == NULL)
+    {
+        log_error("Failed to allocate AOF buffers.");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Turns logging on, once the dataset is loaded. Without a log yet
+ * one is first written from the dataset, the way a rewrite would.
+ * @return 0 on success, -1 on failure (logged).
+ */
+static inline int aof_start(void)
+{
+    const char *path = server.config.appendfilename;
+
+    if (access(path, F_OK) != 0)
+    {
+        char tmp[4096];
+        _aof_temp_path(tmp, sizeof(tmp), getpid());
+        if (_aof_rewrite_to_temp(tmp, current_time_ms()) != 0 || rename(tmp, path) != 0)
+        {
+            log_error("Can't create the AOF %s: %s", path, strerror(errno));
+            unlink(tmp);
+            return -1;
+        }
+        log_info("Created the AOF %s from the loaded dataset", path);
+    }
+
+    int fd = open(path, O_WRONLY | O_APPEND | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0)
+    {
+        log_error("Can't open the AOF %s: %s", path, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    aof_state.fd = fd;
+    aof_state.size = aof_state.base_size = (long long)st.st_size;
+
+    if (server.config.appendfsync == AOF_FSYNC_EVERYSEC)
+    {
+        // SIGINT/SIGTERM are for the main thread
+        sigset_t block, old;
+        sigemptyset(&block);
+        sigaddset(&block, SIGINT);
+        sigaddset(&block, SIGTERM);
+        pthread_sigmask(SIG_BLOCK, &block, &old);
+        int rc = pthread_create(&aof_state.fsync_thread, NULL, _aof_fsync_main, NULL);
+        pthread_sigmask(SIG_SETMASK, &old, NULL);
+        if (rc != 0)
+        {
+            log_error("Can't create the AOF fsync thread");
+            return -1;
+        }
+        aof_state.fsync_thread_running = 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief At shutdown, once every shard has stopped: abandons a running
+ * rewrite, then writes and syncs whatever the shards still hold.
+ */
+static inline void aof_shutdown(void)
+{
+    if (server.child_type == CHILD_AOF)
+    {
+        kill(server.child_pid, SIGKILL);
+        waitpid(server.child_pid, NULL, 0);
+        char tmp[4096];
+        _aof_temp_path(tmp, sizeof(tmp), server.child_pid);
+        unlink(tmp);
+        server.child_type = CHILD_NONE;
+        _aof_rewrite_reset(0);
+    }
+    if (aof_state.fsync_thread_running)
+    {
+        pthread_mutex_lock(&aof_state.fsync_lock);
+        aof_state.fsync_stop = 1;
+        pthread_cond_signal(&aof_state.fsync_cond);
+        pthread_mutex_unlock(&aof_state.fsync_lock);
+        pthread_join(aof_state.fsync_thread, NULL);
+        aof_state.fsync_thread_running = 0;
+    }
+    if (aof_state.fd >= 0)
+    {
+        for (int i = 0; i < server.nshards; i++)
+            aof_flush(i);
+        if (fsync(aof_state.fd) != 0)
+            log_error("AOF fsync: %s", strerror(errno));
+        close(aof_state.fd);
+        aof_state.fd = -1;
+    }
+    for (int i = 0; aof_state.shards && i < server.nshards; i++)
+    {
+        _aof_buf_free(&aof_state.shards[i].pending);
+        _aof_buf_free(&aof_state.shards[i].diff);
+    }
+    free(aof_state.shards);
+    aof_state.shards = NULL;
+}
+
+/**
+ * @brief Appends the AOF part of INFO's persistence section.
+ * @return Bytes written.
+ */
+static inline size_t aof_info(char *buf, size_t cap)
+{
+    pthread_mutex_lock(&aof_state.write_lock);
+    long long size = aof_state.size;
+    int write_ok = aof_state.last_write_ok;
+    pthread_mutex_unlock(&aof_state.write_lock);
+
+    int rewriting = server.child_type == CHILD_AOF;
+    int n = snprintf(buf, cap,
+                     "aof_enabled:%d\r\n"
+                     "aof_rewrite_in_progress:%d\r\n"
+                     "aof_rewrite_scheduled:%d\r\n"
+                     "aof_last_rewrite_time_sec:%lld\r\n"
+                     "aof_current_rewrite_time_sec:%lld\r\n"
+                     "aof_last_bgrewrite_status:%s\r\n"
+                     "aof_last_write_status:%s\r\n"
+                     "aof_current_size:%lld\r\n"
+                     "aof_base_size:%lld\r\n",
+                     aof_state.fd >= 0, rewriting, aof_state.rewrite_scheduled,
+                     aof_state.last_rewrite_ms < 0 ? -1 : aof_state.last_rewrite_ms / 1000,
+                     rewriting ? (current_time_ms() - aof_state.rewrite_start_ms) / 1000 : -1,
+                     aof_state.last_rewrite_ok ? "ok" : "err", write_ok ? "ok" : "err", size, aof_state.base_size);
+    return n < 0 ? 0 : ((size_t)n < cap ? (size_t)n : cap - 1);
+}
+
+// --- Handlers ---
+
+static inline void handle_bgrewriteaof(redis_db_t *db, client_t *c, const resp_arg_t *argv, int argc)
+{
+    (void)db; (void)argv; (void)argc;
+    if (server.child_type == CHILD_AOF)
+    {
+        client_add_reply_str(c, "-ERR Background append only file rewriting already in progress\r\n");
+    }
+    else if (server.child_type != CHILD_NONE)
+    {
+        aof_state.rewrite_scheduled = 1;
+        client_add_reply_str(c, "+Background append only file rewriting scheduled\r\n");
+    }
+    else if (aof_rewrite_start() == 0)
+    {
+        client_add_reply_str(c, "+Background append only file rewriting started\r\n");
+    }
+    else
+    {
+        client_add_reply_str(c, "-ERR Can't start a background AOF rewrite, check the server log\r\n");
+    }
+}
+
+#endif // AOF_H
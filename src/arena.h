@@ -0,0 +1,93 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stdlib.h>
+#include <stddef.h>
+
+/**
+ * Bump allocator for data that lives no longer than one command.
+ * Allocations are carved out of chunks and never freed one by one;
+ * arena_reset() drops them all at once and keeps the first chunk, so a
+ * connection that runs the same commands over and over stops calling
+ * malloc() after its first one.
+ */
+
+#define ARENA_CHUNK_SIZE 4096
+#define ARENA_ALIGN 16
+
+// --- Data Structures ---
+
+typedef struct arena_chunk {
+    struct arena_chunk *next; // Older chunk
+    size_t size;              // Usable bytes after the header
+    size_t used;
+} arena_chunk_t;
+
+#define ARENA_HEADER ((sizeof(arena_chunk_t) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+typedef struct {
+    arena_chunk_t *head; // Newest chunk, the one being carved
+} arena_t;
+
+// --- Public API ---
+
+static inline void arena_init(arena_t *a) {
+    a->head = NULL;
+}
+
+/**
+ * @return 'size' bytes aligned to ARENA_ALIGN, valid until the next
+ * arena_reset(), or NULL if out of memory.
+ */
+static inline void *arena_alloc(arena_t *a, size_t size) {
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    arena_chunk_t *c = a->head;
+    if (c == NULL || c->size - c->used < size) {
+        size_t chunk = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+        c = (arena_chunk_t *)malloc(ARENA_HEADER + chunk);
+        if (c == NULL) return NULL;
+        c->next = a->head;
+        c->size = chunk;
+        c->used = 0;
+        a->head = c;
+    }
+    void *p = (char *)c + ARENA_HEADER + c->used;
+    c->used += size;
+    return p;
+}
+
+/**
+ * @brief Releases every allocation. The oldest chunk is kept for reuse if
+ * it has the default size; oversized ones go back to malloc.
+ */
+static inline void arena_reset(arena_t *a) {
+    arena_chunk_t *c = a->head;
+    if (c == NULL || (c->next == NULL && c->size == ARENA_CHUNK_SIZE)) {
+        if (c) c->used = 0;
+        return;
+    }
+    while (c->next) {
+        arena_chunk_t *next = c->next;
+        free(c);
+        c = next;
+    }
+    if (c->size == ARENA_CHUNK_SIZE) {
+        c->used = 0;
+        a->head = c;
+    } else {
+        free(c);
+        a->head = NULL;
+    }
+}
+
+static inline void arena_free(arena_t *a) {
+    arena_chunk_t *c = a->head;
+    while (c) {
+        arena_chunk_t *next = c->next;
+        free(c);
+        c = next;
+    }
+    a->head = NULL;
+}
+
+#endif // ARENA_H
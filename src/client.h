@@ -0,0 +1,679 @@
+#ifndef CLIENT_H
+#define CLIENT_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "parser.h"
+#include "arena.h"
+#include "log.h"
+
+#define CLIENT_IOBUF_LEN (16 * 1024)     // Minimum free space per recv()
+#define CLIENT_QUERYBUF_MAX (1024 * 1024 * 1024) // Hard cap on buffered input
+#define CLIENT_REPLY_CHUNK (16 * 1024)   // Size of one output buffer block
+#define CLIENT_WRITEV_IOVS 64            // Blocks handed to a single writev()
+
+// --- Client Flags ---
+#define CLIENT_PENDING_WRITE (1 << 0)     // Queued for the next flush
+#define CLIENT_WRITE_INTEREST (1 << 1)    // Registered for EVENT_WRITABLE
+#define CLIENT_CLOSE_AFTER_REPLY (1 << 2) // Close once output is flushed
+#define CLIENT_CLOSE_ASAP (1 << 3)        // Close at the next opportunity
+#define CLIENT_PENDING_READ (1 << 4)      // Queued for a (threaded) read
+#define CLIENT_PREPARSED (1 << 5)         // An I/O thread already parsed a command
+#define CLIENT_BLOCKED (1 << 6)           // Waiting for another shard's reply
+#define CLIENT_BLOCKED_POP (1 << 7)       // Parked in BLPOP/BRPOP
+#define CLIENT_BLOCKED_ANY (CLIENT_BLOCKED | CLIENT_BLOCKED_POP) // Input is not processed
+#define CLIENT_MASTER (1 << 8)            // Replica side: the link to our primary (repl.h)
+#define CLIENT_HANDOFF (1 << 9)           // Moving to shard 0 once its commands return
+#define CLIENT_ASKING (1 << 10)           // Its next command may use an importing slot (cluster.h)
+#define CLIENT_MULTI (1 << 11)            // Queueing commands between MULTI and EXEC
+#define CLIENT_DIRTY_EXEC (1 << 12)       // A queued command was refused: EXEC aborts
+#define CLIENT_IN_EXEC (1 << 13)          // Running an EXEC: blocking pops don't park
+#define CLIENT_ASYNC_IO (1 << 14)         // Read and written through the event loop (io_uring)
+#define CLIENT_SENDING (1 << 15)          // An event_send() of ours is in the kernel
+#define CLIENT_PREREAD (1 << 16)          // The event loop already filled querybuf: skip recv()
+#define CLIENT_CLOSED (1 << 17)           // Socket closed; freed once the send completes
+
+// --- Data Structures ---
+
+/**
+ * @brief One block of queued reply bytes.
+ */
+typedef struct reply_block
+{
+    struct reply_block *next;
+    size_t size; // Capacity of buf
+    size_t used; // Bytes appended so far
+    char buf[];
+} reply_block_t;
+
+/**
+ * @brief The send a CLIENT_ASYNC_IO client has in the kernel. Its blocks
+ * are detached from the reply chain until it completes.
+ */
+typedef struct client_send
+{
+    struct msghdr msg;
+    struct iovec iov[CLIENT_WRITEV_IOVS];
+    reply_block_t *head; // Blocks being sent
+    size_t off;          // Bytes of head written before
+    size_t bytes;        // Bytes being sent
+} client_send_t;
+
+/**
+ * @brief Per-connection state.
+ * Bytes from recv() accumulate in 'querybuf' until the parser has seen
+ * a complete command, so commands split across TCP segments and several
+ * pipelined commands in a single segment are both handled.
+ */
+struct shard;
+struct bpop_waiter;
+struct repl_replica;
+
+typedef struct client
+{
+    int fd;
+    unsigned long long id;  // Unique per shard; tells a reused fd apart
+    struct shard *shard;    // Event loop that owns the connection
+    int forwarded_to;       // Shard running our command, with CLIENT_BLOCKED
+    struct bpop_waiter *bpop; // With CLIENT_BLOCKED_POP
+    struct repl_replica *replica; // Primary side: this connection is a replica (repl.h)
+    char *querybuf;
+    size_t qb_len; // Bytes currently buffered
+    size_t qb_cap; // Allocated size of querybuf
+    resp_parser_t parser;
+
+    // Output buffer: replies are appended here and flushed with writev()
+    reply_block_t *reply_head;
+    reply_block_t *reply_tail;
+    reply_block_t *reply_spare; // A flushed CLIENT_REPLY_CHUNK block kept for the next reply
+    size_t reply_bytes;   // Unsent bytes across all blocks
+    size_t sent_off;      // Bytes of reply_head already written
+    size_t obuf_limit;    // Max reply_bytes before the client is dropped (0 = none)
+    client_send_t *send;  // With CLIENT_ASYNC_IO, allocated at the first send
+
+    int flags;
+    size_t pending_idx;   // Position in the pending-write list
+    arena_t arena;        // Scratch memory of the running command, reset after it
+
+    // MULTI: queued commands, kept as the RESP bytes they arrived in
+    char *multi_buf;
+    size_t multi_len;
+    size_t multi_cap;
+    int multi_count;
+    int multi_shard;      // Shard owning the queued keys (-2 = none yet)
+
+    // Results handed back from an I/O thread to the main thread
+    ssize_t io_result;    // client_read() / client_flush() return value
+    int io_errno;
+    resp_status io_parse_status; // Valid with CLIENT_PREPARSED
+} client_t;
+
+/**
+ * @brief fd-indexed table of live clients.
+ */
+typedef struct
+{
+    client_t **slots;
+    int cap;
+} client_table_t;
+
+// --- Client Lifecycle ---
+
+static inline client_t *client_create(int fd, size_t obuf_limit)
+{
+    client_t *c = (client_t *)malloc(sizeof(client_t));
+    if (c == NULL)
+        return NULL;
+    c->fd = fd;
+    c->id = 0;
+    c->shard = NULL;
+    c->forwarded_to = -1;
+    c->bpop = NULL;
+    c->replica = NULL;
+    c->querybuf = NULL;
+    c->qb_len = 0;
+    c->qb_cap = 0;
+    resp_parser_init(&c->parser);
+    c->reply_head = NULL;
+    c->reply_tail = NULL;
+    c->reply_spare = NULL;
+    c->reply_bytes = 0;
+    c->sent_off = 0;
+    c->obuf_limit = obuf_limit;
+    c->send = NULL;
+    c->flags = 0;
+    c->pending_idx = 0;
+    arena_init(&c->arena);
+    c->multi_buf = NULL;
+    c->multi_len = 0;
+    c->multi_cap = 0;
+    c->multi_count = 0;
+    c->multi_shard = -2;
+    c->io_result = 0;
+    c->io_errno = 0;
+    c->io_parse_status = RESP_PARSE_INCOMPLETE;
+    return c;
+}
+
+static inline void _client_free_replies(client_t *c)
+{
+    reply_block_t *b = c->reply_head;
+    while (b)
+    {
+        reply_block_t *next = b->next;
+        free(b);
+        b = next;
+    }
+    free(c->reply_spare);
+    c->reply_head = NULL;
+    c->reply_tail = NULL;
+    c->reply_spare = NULL;
+    c->reply_bytes = 0;
+    c->sent_off = 0;
+}
+
+static inline void client_free(client_t *c)
+{
+    if (c == NULL)
+        return;
+    _client_free_replies(c);
+    if (c->send)
+    {
+        for (reply_block_t *b = c->send->head, *next; b; b = next)
+        {
+            next = b->next;
+            free(b);
+        }
+        free(c->send);
+    }
+    resp_parser_free(&c->parser);
+    arena_free(&c->arena);
+    free(c->multi_buf);
+    free(c->querybuf);
+    free(c);
+}
+
+// --- Transaction Queue ---
+
+/**
+ * @brief Leaves MULTI, dropping whatever was queued.
+ */
+static inline void client_multi_reset(client_t *c)
+{
+    free(c->multi_buf);
+    c->multi_buf = NULL;
+    c->multi_len = 0;
+    c->multi_cap = 0;
+    c->multi_count = 0;
+    c->multi_shard = -2;
+    c->flags &= ~(CLIENT_MULTI | CLIENT_DIRTY_EXEC);
+}
+
+/**
+ * @brief Queues one command by copying its 'len' wire bytes; EXEC parses
+ * them again.
+ * @return 0 on success, -1 on allocation failure.
+ */
+static inline int client_multi_append(client_t *c, const char *cmd, size_t len)
+{
+    if (c->multi_cap - c->multi_len < len)
+    {
+        size_t cap = c->multi_cap ? c->multi_cap : 1024;
+        while (cap - c->multi_len < len)
+            cap *= 2;
+        char *buf = (char *)realloc(c->multi_buf, cap);
+        if (buf == NULL)
+            return -1;
+        c->multi_buf = buf;
+        c->multi_cap = cap;
+    }
+    memcpy(c->multi_buf + c->multi_len, cmd, len);
+    c->multi_len += len;
+    c->multi_count++;
+    return 0;
+}
+
+// --- Input Buffer ---
+
+/**
+ * @brief Makes sure at least 'need' bytes are free at the end of querybuf.
+ * @return 0 on success, -1 on allocation failure or if the cap is hit.
+ */
+static inline int _client_querybuf_reserve(client_t *c, size_t need)
+{
+    if (c->qb_cap - c->qb_len >= need)
+        return 0;
+    size_t cap = c->qb_cap ? c->qb_cap : CLIENT_IOBUF_LEN;
+    while (cap - c->qb_len < need)
+        cap *= 2;
+    if (cap > CLIENT_QUERYBUF_MAX)
+        return -1;
+    char *buf = (char *)realloc(c->querybuf, cap);
+    if (buf == NULL)
+        return -1;
+    c->querybuf = buf;
+    c->qb_cap = cap;
+    return 0;
+}
+
+/**
+ * @brief Reads whatever is available on the socket into querybuf.
+ * If the parser is in the middle of a large bulk string, the buffer is
+ * grown to fit it completely so it arrives without repeated reallocs.
+ * @return Bytes read, 0 on EOF, -1 on error (errno set).
+ */
+static inline ssize_t client_read(client_t *c)
+{
+    size_t need = resp_parser_pending_bulk(&c->parser, c->qb_len);
+    if (need < CLIENT_IOBUF_LEN)
+        need = CLIENT_IOBUF_LEN;
+    if (_client_querybuf_reserve(c, need) != 0)
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    ssize_t n = recv(c->fd, c->querybuf + c->qb_len, c->qb_cap - c->qb_len, 0);
+    if (n > 0)
+        c->qb_len += n;
+    return n;
+}
+
+/**
+ * @brief Appends bytes the event loop received for the client (io_uring)
+ * to querybuf, as client_read() would have.
+ * @return 0 on success, -1 on allocation failure or if the cap is hit.
+ */
+static inline int client_feed(client_t *c, const char *data, size_t len)
+{
+    if (_client_querybuf_reserve(c, len) != 0)
+        return -1;
+    memcpy(c->querybuf + c->qb_len, data, len);
+    c->qb_len += len;
+    return 0;
+}
+
+/**
+ * @brief Drops every fully-processed command from the front of querybuf,
+ * keeping only the (possibly partial) command the parser is still on.
+ */
+static inline void client_compact_querybuf(client_t *c)
+{
+    size_t consumed = c->parser.multibulk_len ? c->parser.cmd_start : c->parser.pos;
+    if (consumed == 0)
+        return;
+    memmove(c->querybuf, c->querybuf + consumed, c->qb_len - consumed);
+    c->qb_len -= consumed;
+    resp_parser_shift(&c->parser, consumed);
+}
+
+// --- Output Buffer ---
+
+static inline int client_has_pending_replies(const client_t *c)
+{
+    return c->reply_bytes > 0;
+}
+
+/**
+ * @brief Appends raw bytes to the client's output buffer.
+ * Nothing is written to the socket here; the event loop flushes all
+ * pending clients once per iteration. A client that exceeds its output
+ * limit is flagged CLIENT_CLOSE_ASAP and its queued output discarded.
+ */
+static inline int _client_over_obuf_limit(client_t *c)
+{
+    if (c->obuf_limit && c->reply_bytes > c->obuf_limit)
+    {
+        log_ratelimited(LOG_WARNING, 10, "Client (fd=%d) exceeded output buffer limit of %zu bytes, closing",
+                        c->fd, c->obuf_limit);
+        _client_free_replies(c);
+        c->flags |= CLIENT_CLOSE_ASAP;
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief (Internal) A block of at least 'size' bytes, the spare one when
+ * it fits. Out of memory drops the client.
+ */
+static inline reply_block_t *_client_new_block(client_t *c, size_t size)
+{
+    reply_block_t *b;
+    if (size == CLIENT_REPLY_CHUNK && c->reply_spare)
+    {
+        b = c->reply_spare;
+        c->reply_spare = NULL;
+    }
+    else if ((b = (reply_block_t *)malloc(sizeof(reply_block_t) + size)) == NULL)
+    {
+        _client_free_replies(c);
+        c->flags |= CLIENT_CLOSE_ASAP;
+        return NULL;
+    }
+    b->next = NULL;
+    b->size = size;
+    b->used = 0;
+    return b;
+}
+
+static inline void client_add_reply(client_t *c, const char *data, size_t len)
+{
+    if (c->flags & CLIENT_CLOSE_ASAP)
+        return;
+
+    c->reply_bytes += len;
+    if (_client_over_obuf_limit(c))
+        return;
+
+    reply_block_t *tail = c->reply_tail;
+    if (tail)
+    {
+        size_t avail = tail->size - tail->used;
+        size_t n = len < avail ? len : avail;
+        memcpy(tail->buf + tail->used, data, n);
+        tail->used += n;
+        data += n;
+        len -= n;
+    }
+    if (len == 0)
+        return;
+
+    reply_block_t *b = _client_new_block(c, len > CLIENT_REPLY_CHUNK ? len : CLIENT_REPLY_CHUNK);
+    if (b == NULL)
+        return;
+    b->used = len;
+    memcpy(b->buf, data, len);
+    if (tail)
+        tail->next = b;
+    else
+        c->reply_head = b;
+    c->reply_tail = b;
+}
+
+static inline void client_add_reply_str(client_t *c, const char *str)
+{
+    client_add_reply(c, str, strlen(str));
+}
+
+/**
+ * @brief Appends a chain of already-filled reply blocks without copying
+ * them (used for replies produced on another shard). Ownership of the
+ * blocks passes to the client.
+ */
+static inline void client_add_reply_blocks(client_t *c, reply_block_t *head, reply_block_t *tail, size_t bytes)
+{
+    if (head == NULL)
+        return;
+    if (c->flags & CLIENT_CLOSE_ASAP)
+    {
+        while (head)
+        {
+            reply_block_t *next = head->next;
+            free(head);
+            head = next;
+        }
+        return;
+    }
+    if (c->reply_tail)
+        c->reply_tail->next = head;
+    else
+        c->reply_head = head;
+    c->reply_tail = tail;
+    c->reply_bytes += bytes;
+    _client_over_obuf_limit(c);
+}
+
+/**
+ * @brief Returns room for at least 'n' contiguous bytes at the end of the
+ * output buffer, so encoders can write a reply in place. The bytes only
+ * count as output once client_reply_commit() is called.
+ * @return Pointer to write at, or NULL if the client is being dropped.
+ */
+static inline char *client_reply_reserve(client_t *c, size_t n)
+{
+    if (c->flags & CLIENT_CLOSE_ASAP)
+        return NULL;
+
+    reply_block_t *tail = c->reply_tail;
+    if (tail && tail->size - tail->used >= n)
+        return tail->buf + tail->used;
+
+    reply_block_t *b = _client_new_block(c, n > CLIENT_REPLY_CHUNK ? n : CLIENT_REPLY_CHUNK);
+    if (b == NULL)
+        return NULL;
+    if (tail)
+        tail->next = b;
+    else
+        c->reply_head = b;
+    c->reply_tail = b;
+    return b->buf;
+}
+
+static inline void client_reply_commit(client_t *c, size_t n)
+{
+    c->reply_tail->used += n;
+    c->reply_bytes += n;
+    _client_over_obuf_limit(c);
+}
+
+// --- Reply Helpers ---
+
+static inline void client_add_reply_integer(client_t *c, long long val)
+{
+    char *dst = client_reply_reserve(c, RESP_HEADER_MAX);
+    if (dst)
+        client_reply_commit(c, resp_encode_integer(dst, val));
+}
+
+static inline void client_add_reply_array_len(client_t *c, long long count)
+{
+    char *dst = client_reply_reserve(c, RESP_HEADER_MAX);
+    if (dst)
+        client_reply_commit(c, resp_encode_array_header(dst, count));
+}
+
+/**
+ * @brief Appends a bulk string. Values that fit in one block are encoded
+ * in place; larger ones get their header in place and the payload copied
+ * after it.
+ */
+static inline void client_add_reply_bulk(client_t *c, const char *str, size_t len)
+{
+    if (len <= CLIENT_REPLY_CHUNK - RESP_BULK_OVERHEAD_MAX)
+    {
+        char *dst = client_reply_reserve(c, RESP_BULK_OVERHEAD_MAX + len);
+        if (dst)
+            client_reply_commit(c, resp_encode_bulk(dst, str, len));
+        return;
+    }
+
+    char *dst = client_reply_reserve(c, RESP_HEADER_MAX);
+    if (dst == NULL)
+        return;
+    client_reply_commit(c, resp_encode_bulk_header(dst, len));
+    client_add_reply(c, str, len);
+    client_add_reply(c, "\r\n", 2);
+}
+
+/**
+ * @brief (Internal) Frees a written block, or keeps it as the spare: the
+ * next reply then needs no malloc().
+ */
+static inline void _client_release_block(client_t *c, reply_block_t *b)
+{
+    if (b->size == CLIENT_REPLY_CHUNK && c->reply_spare == NULL)
+        c->reply_spare = b;
+    else
+        free(b);
+}
+
+/**
+ * @brief Writes as much queued output as the socket accepts, coalescing
+ * up to CLIENT_WRITEV_IOVS blocks per writev() call.
+ * @return 1 if everything was flushed, 0 if the socket would block,
+ * -1 on a write error (errno set).
+ */
+static inline int client_flush(client_t *c)
+{
+    while (c->reply_head)
+    {
+        struct iovec iov[CLIENT_WRITEV_IOVS];
+        int iovcnt = 0;
+        size_t off = c->sent_off;
+        for (reply_block_t *b = c->reply_head; b && iovcnt < CLIENT_WRITEV_IOVS; b = b->next)
+        {
+            iov[iovcnt].iov_base = b->buf + off;
+            iov[iovcnt].iov_len = b->used - off;
+            iovcnt++;
+            off = 0;
+        }
+
+        ssize_t n = writev(c->fd, iov, iovcnt);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            return -1;
+        }
+
+        // Release fully written blocks
+        c->reply_bytes -= n;
+        while (n > 0)
+        {
+            reply_block_t *b = c->reply_head;
+            size_t left = b->used - c->sent_off;
+            if ((size_t)n < left)
+            {
+                c->sent_off += n;
+                break;
+            }
+            n -= left;
+            c->reply_head = b->next;
+            c->sent_off = 0;
+            _client_release_block(c, b);
+        }
+        if (c->reply_head == NULL)
+            c->reply_tail = NULL;
+    }
+    return 1;
+}
+
+/**
+ * @brief Detaches up to CLIENT_WRITEV_IOVS blocks of queued output for an
+ * asynchronous send. Replies added meanwhile go to new blocks, and
+ * dropping the output (_client_free_replies()) leaves these alone.
+ * @return The message to send, or NULL if there is no output or on
+ * allocation failure (the client is then flagged CLIENT_CLOSE_ASAP).
+ */
+static inline struct msghdr *client_send_begin(client_t *c)
+{
+    if (c->reply_head == NULL)
+        return NULL;
+    if (c->send == NULL && (c->send = (client_send_t *)calloc(1, sizeof(client_send_t))) == NULL)
+    {
+        _client_free_replies(c);
+        c->flags |= CLIENT_CLOSE_ASAP;
+        return NULL;
+    }
+
+    client_send_t *s = c->send;
+    reply_block_t *last = NULL;
+    size_t off = c->sent_off;
+    int iovcnt = 0;
+    s->bytes = 0;
+    for (reply_block_t *b = c->reply_head; b && iovcnt < CLIENT_WRITEV_IOVS; b = b->next)
+    {
+        s->iov[iovcnt].iov_base = b->buf + off;
+        s->iov[iovcnt].iov_len = b->used - off;
+        s->bytes += b->used - off;
+        iovcnt++;
+        off = 0;
+        last = b;
+    }
+    s->head = c->reply_head;
+    s->off = c->sent_off;
+    c->reply_head = last->next;
+    last->next = NULL;
+    if (c->reply_head == NULL)
+        c->reply_tail = NULL;
+    c->sent_off = 0;
+    c->reply_bytes -= s->bytes;
+
+    memset(&s->msg, 0, sizeof(s->msg));
+    s->msg.msg_iov = s->iov;
+    s->msg.msg_iovlen = (size_t)iovcnt;
+    return &s->msg;
+}
+
+/**
+ * @brief Completes a client_send_begin() of which 'n' bytes were written:
+ * those blocks are released and the rest goes back to the front of the
+ * output.
+ */
+static inline void client_send_end(client_t *c, size_t n)
+{
+    client_send_t *s = c->send;
+    reply_block_t *b = s->head;
+    size_t off = s->off;
+    s->head = NULL;
+    while (b && n >= b->used - off)
+    {
+        reply_block_t *next = b->next;
+        n -= b->used - off;
+        s->bytes -= b->used - off;
+        _client_release_block(c, b);
+        b = next;
+        off = 0;
+    }
+    if (b == NULL)
+        return;
+
+    reply_block_t *last = b;
+    while (last->next)
+        last = last->next;
+    last->next = c->reply_head;
+    if (c->reply_head == NULL)
+        c->reply_tail = last;
+    c->reply_head = b;
+    c->sent_off = off + n;
+    c->reply_bytes += s->bytes - n;
+}
+
+// --- Client Table ---
+
+static inline client_t *client_table_get(client_table_t *t, int fd)
+{
+    return (fd >= 0 && fd < t->cap) ? t->slots[fd] : NULL;
+}
+
+/**
+ * @return 0 on success, -1 on allocation failure.
+ */
+static inline int client_table_set(client_table_t *t, int fd, client_t *c)
+{
+    if (fd >= t->cap)
+    {
+        int cap = t->cap ? t->cap : 64;
+        while (cap <= fd)
+            cap *= 2;
+        client_t **slots = (client_t **)realloc(t->slots, cap * sizeof(client_t *));
+        if (slots == NULL)
+            return -1;
+        memset(slots + t->cap, 0, (cap - t->cap) * sizeof(client_t *));
+        t->slots = slots;
+        t->cap = cap;
+    }
+    t->slots[fd] = c;
+    return 0;
+}
+
+#endif // CLIENT_H
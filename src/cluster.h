@@ -0,0 +1,2040 @@
+#ifndef CLUSTER_H
+#define CLUSTER_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "utils.h"
+#include "parser.h"
+#include "client.h"
+#include "handler.h"
+#include "keyslot.h"
+#include "server.h"
+#include "shard.h"
+#include "rdb.h"
+#include "aof.h"
+#include "repl.h"
+#include "log.h"
+#include "time_utils.h"
+
+/**
+ * Cluster mode (--cluster-enabled yes, CLUSTER, ASKING, MIGRATE).
+ *
+ * The 16384 hash slots that spread keys over our shards (slot s lives on
+ * shard s % nshards) are also spread over the nodes of a cluster. A node
+ * serves the slots it owns and answers a command on any other slot with
+ * -MOVED <slot> <ip>:<port>, before the command runs, on the shard that
+ * would have run it.
+ *
+ * Nodes talk over the cluster bus, on our port + 10000: shard 0 PINGs
+ * every node once a second and gets a PONG back. Both carry the sender's
+ * slots, its config epoch and a few of the nodes it knows, so a node met
+ * once (CLUSTER MEET) is soon known to all and every change of ownership
+ * spreads. Two claims on a slot are settled by the config epoch: the
+ * greater one wins, and a node taking over a slot (SETSLOT NODE) first
+ * moves its own past every epoch it has seen.
+ *
+ * A slot moves like in Redis: the target marks it IMPORTING, the source
+ * MIGRATING; MIGRATE then moves its keys one batch at a time. Meanwhile
+ * the source answers for the keys it still has and sends the client to
+ * the target (-ASK) for the others; the target only serves the slot to a
+ * client that sent ASKING. SETSLOT NODE on both ends completes the move.
+ *
+ * The slot map is read by every shard without a lock: only shard 0
+ * changes it, and only with the other shards parked. There is no failover
+ * and there are no cluster replicas: a node that stops answering is only
+ * flagged (fail?), and its slots stay its own.
+ */
+
+#define CLUSTER_ID_LEN REPL_ID_LEN
+#define CLUSTER_NODES_MAX 256          // Known nodes, ourselves included
+#define CLUSTER_SLOT_BYTES (KEYSLOT_COUNT / 8)
+#define CLUSTER_CRON_MS 100            // Between runs of cluster_cron()
+#define CLUSTER_PING_MS 1000           // Between PINGs to a node, and connect attempts
+#define CLUSTER_HANDSHAKE_MIN_MS 1000  // Shortest time a handshake is given
+#define CLUSTER_GOSSIP_MAX 16          // Other nodes described per message
+#define CLUSTER_LINK_OBUF_MAX (4 * 1024 * 1024) // Unsent bus bytes before a link is dropped
+#define CLUSTER_MSG_ARGS 7             // Message fields before the gossip entries...
+#define CLUSTER_GOSSIP_ARGS 4          // ...and per gossip entry
+#define CLUSTER_MIGRATE_IDLE_MS 10000  // A cached MIGRATE connection unused for longer is reopened
+#define CLUSTER_MIGRATE_TIMEOUT_MS 1000 // MIGRATE with a timeout of 0
+#define CLUSTER_LINE_MAX 256           // Longest reply line kept from a MIGRATE target
+
+#define CLUSTER_CROSSSLOT_ERR "-CROSSSLOT Keys in request don't hash to the same slot\r\n"
+#define CLUSTER_DISABLED_ERR "-ERR This instance has cluster support disabled\r\n"
+#define CLUSTER_TRYAGAIN_ERR "-TRYAGAIN Multiple keys request during rehashing of slot\r\n"
+
+// --- Node Flags ---
+#define CLUSTER_NODE_MYSELF (1 << 0)
+#define CLUSTER_NODE_HANDSHAKE (1 << 1) // Only its address is known; its id is made up until it answers
+#define CLUSTER_NODE_MEET (1 << 2)      // Greet it with MEET, so it adds us (CLUSTER MEET)
+#define CLUSTER_NODE_PFAIL (1 << 3)     // A PING unanswered for --cluster-node-timeout
+
+// --- Data Structures ---
+
+struct cluster_node;
+
+/**
+ * @brief A cluster bus connection. Ours to a node (outbound) carries our
+ * PINGs and its PONGs; one it opened to us (inbound) the other way round.
+ */
+typedef struct cluster_link
+{
+    client_t *conn;            // Its buffers and parser; in no client table
+    struct cluster_node *node; // Outbound: the node it reaches, else NULL
+    int connecting;            // Non-blocking connect() in progress
+    int write_interest;        // Registered for EVENT_WRITABLE
+    int closed;                // fd closed; freed by _cluster_reap()
+    long long io_ms;           // Connect started or last message received
+    struct cluster_link *next_dead;
+} cluster_link_t;
+
+typedef struct cluster_node
+{
+    char id[CLUSTER_ID_LEN + 1];
+    char ip[INET6_ADDRSTRLEN];  // "" while unknown (ours, until a node talks to us)
+    int port;
+    int bus_port;
+    int flags;
+    uint64_t config_epoch;
+    long long ctime_ms;         // Added to the table
+    long long ping_sent_ms;     // Oldest unanswered PING, 0 if none
+    long long pong_recv_ms;
+    long long connect_ms;       // Last connect attempt
+    cluster_link_t *link;       // Outbound
+    unsigned char slots[CLUSTER_SLOT_BYTES]; // What it serves, as far as we know
+    int nslots;
+} cluster_node_t;
+
+/**
+ * @brief The node table and the slot map. Shard 0's, but for the slot map
+ * (and the addresses of the nodes in it), which every shard reads.
+ */
+typedef struct
+{
+    cluster_node_t *myself;
+    cluster_node_t *nodes[CLUSTER_NODES_MAX];
+    int nnodes;
+    uint64_t current_epoch;     // Greatest config epoch seen
+    int gossip_next;            // Where the next message's gossip starts
+
+    // Changed only with the other shards parked (_cluster_update())
+    cluster_node_t *slots[KEYSLOT_COUNT];     // Owner, NULL if unassigned
+    cluster_node_t *migrating[KEYSLOT_COUNT]; // Ours, moving to this node
+    cluster_node_t *importing[KEYSLOT_COUNT]; // Moving to us from this node
+
+    int bus_fd;                 // Cluster bus listener
+    cluster_link_t **links;     // By fd
+    int links_cap;
+    cluster_link_t *dead_links;
+    aof_buf_t msg;              // The message being built
+    int paused;                 // The other shards are parked
+    int save_pending;           // The config file is behind
+    long long cron_ms;
+    long long stat_sent;
+    long long stat_received;
+} cluster_state_t;
+
+/**
+ * @brief A shard's connection to the last MIGRATE target, kept for the
+ * next batch of the same slot.
+ */
+typedef struct
+{
+    int open;
+    int fd;
+    char host[REPL_HOST_MAX];
+    int port;
+    long long used_ms;
+    char rbuf[CLUSTER_LINE_MAX * 4]; // Replies read but not consumed yet
+    size_t rlen;
+} cluster_migrate_conn_t;
+
+static cluster_state_t cluster_state = {.bus_fd = -1};
+static cluster_migrate_conn_t cluster_migrate_conns[SHARDS_MAX]; // By shard
+
+static inline void _cluster_link_close(cluster_link_t *l);
+
+// --- Nodes ---
+
+static inline cluster_node_t *_cluster_node_lookup(const char *id, size_t len)
+{
+    if (len != CLUSTER_ID_LEN)
+        return NULL;
+    for (int i = 0; i < cluster_state.nnodes; i++)
+    {
+        if (memcmp(cluster_state.nodes[i]->id, id, CLUSTER_ID_LEN) == 0)
+            return cluster_state.nodes[i];
+    }
+    return NULL;
+}
+
+/**
+ * @return 1 if a handshake with ip:port is already under way.
+ */
+static inline int _cluster_handshaking(const char *ip, int port)
+{
+    for (int i = 0; i < cluster_state.nnodes; i++)
+    {
+        cluster_node_t *n = cluster_state.nodes[i];
+        if ((n->flags & CLUSTER_NODE_HANDSHAKE) && n->port == port && strcmp(n->ip, ip) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief (Internal) Adds a node to the table; a NULL 'id' is made up.
+ * @return The node, or NULL if the table is full or out of memory (logged).
+ */
+static inline cluster_node_t *_cluster_node_create(const char *id, const char *ip, int port, int bus_port, int flags)
+{
+    cluster_node_t *n = NULL;
+    if (cluster_state.nnodes < CLUSTER_NODES_MAX)
+        n = (cluster_node_t *)calloc(1, sizeof(cluster_node_t));
+    if (n == NULL)
+    {
+        log_warn("Can't add cluster node %s:%d: %s", ip, port,
+                 cluster_state.nnodes < CLUSTER_NODES_MAX ? "out of memory" : "too many nodes");
+        return NULL;
+    }
+    if (id)
+        memcpy(n->id, id, CLUSTER_ID_LEN);
+    else
+        repl_random_id(n->id);
+    n->id[CLUSTER_ID_LEN] = '\0';
+    snprintf(n->ip, sizeof(n->ip), "%s", ip);
+    n->port = port;
+    n->bus_port = bus_port;
+    n->flags = flags;
+    n->ctime_ms = cached_time_ms();
+    cluster_state.nodes[cluster_state.nnodes++] = n;
+    cluster_state.save_pending = 1;
+    return n;
+}
+
+/**
+ * @brief (Internal) Drops a node nothing refers to: a handshake that timed
+ * out or reached a node we already know.
+ */
+static inline void _cluster_node_free(cluster_node_t *n)
+{
+    if (n->link)
+        _cluster_link_close(n->link);
+    for (int i = 0; i < cluster_state.nnodes; i++)
+    {
+        if (cluster_state.nodes[i] == n)
+        {
+            cluster_state.nodes[i] = cluster_state.nodes[--cluster_state.nnodes];
+            break;
+        }
+    }
+    free(n);
+    cluster_state.save_pending = 1;
+}
+
+static inline int _cluster_node_has_slot(const cluster_node_t *n, int slot)
+{
+    return (n->slots[slot >> 3] >> (slot & 7)) & 1;
+}
+
+// --- Slot Map ---
+
+/**
+ * @brief (Internal) Parks the other shards, once per step of shard 0's
+ * cluster work, before the slot map or an address in it changes.
+ * _cluster_done() lets them go.
+ * @return 0, or -1 if shutdown was requested meanwhile.
+ */
+static inline int _cluster_update(void)
+{
+    if (cluster_state.paused)
+        return 0;
+    if (shard_pause_others(server.shards, server.nshards, &server.shutdown_asap) != 0)
+        return -1;
+    cluster_state.paused = 1;
+    return 0;
+}
+
+/**
+ * @brief (Internal) Hands 'slot' to 'n' (NULL: nobody), within _cluster_update().
+ */
+static inline void _cluster_assign(int slot, cluster_node_t *n)
+{
+    cluster_node_t *old = cluster_state.slots[slot];
+    if (old == n)
+        return;
+    if (old)
+    {
+        old->slots[slot >> 3] &= (unsigned char)~(1 << (slot & 7));
+        old->nslots--;
+    }
+    if (n)
+    {
+        n->slots[slot >> 3] |= (unsigned char)(1 << (slot & 7));
+        n->nslots++;
+    }
+    cluster_state.slots[slot] = n;
+    cluster_state.save_pending = 1;
+}
+
+/**
+ * @brief (Internal) Moves our config epoch past every one seen, so the
+ * slots we claim next win over any older claim.
+ */
+static inline void _cluster_bump_epoch(void)
+{
+    cluster_state.myself->config_epoch = ++cluster_state.current_epoch;
+    cluster_state.save_pending = 1;
+}
+
+/**
+ * @return Keys in 'slot', counted by the shard holding it. Called on that
+ * shard, or on shard 0 with the others parked.
+ */
+static inline uint32_t _cluster_slot_keys(int slot)
+{
+    return server.shards[slot % server.nshards].db.slot_keys[slot];
+}
+
+// --- Config File ---
+
+static inline int _cluster_buf_append(aof_buf_t *b, const char *s, size_t len)
+{
+    if (_aof_buf_reserve(b, len) != 0)
+        return -1;
+    memcpy(b->p + b->len, s, len);
+    b->len += len;
+    return 0;
+}
+
+/**
+ * @brief (Internal) Appends the CLUSTER NODES line of 'n', which is also
+ * how the config file describes it.
+ * @return 0, or -1 if out of memory.
+ */
+static inline int _cluster_describe_node(aof_buf_t *b, const cluster_node_t *n)
+{
+    char s[CLUSTER_LINE_MAX];
+    char flags[64];
+    int fl = snprintf(flags, sizeof(flags), "%s", (n->flags & CLUSTER_NODE_MYSELF) ? "myself,master" : "master");
+    if (n->flags & CLUSTER_NODE_HANDSHAKE)
+        fl = snprintf(flags, sizeof(flags), "handshake");
+    if (n->flags & CLUSTER_NODE_PFAIL)
+        fl += snprintf(flags + fl, sizeof(flags) - fl, ",fail?");
+    if (n->ip[0] == '\0' && !(n->flags & CLUSTER_NODE_MYSELF))
+        snprintf(flags + fl, sizeof(flags) - fl, ",noaddr");
+    int connected = (n->flags & CLUSTER_NODE_MYSELF) || (n->link && !n->link->connecting);
+
+    int len = snprintf(s, sizeof(s), "%s %s:%d@%d %s - %lld %lld %llu %s", n->id, n->ip, n->port, n->bus_port,
+                       flags, n->ping_sent_ms, n->pong_recv_ms, (unsigned long long)n->config_epoch,
+                       connected ? "connected" : "disconnected");
+    int rc = _cluster_buf_append(b, s, (size_t)len);
+
+    for (int start = 0; start < KEYSLOT_COUNT && rc == 0; start++)
+    {
+        if (!_cluster_node_has_slot(n, start))
+            continue;
+        int end = start;
+        while (end + 1 < KEYSLOT_COUNT && _cluster_node_has_slot(n, end + 1))
+            end++;
+        len = start == end ? snprintf(s, sizeof(s), " %d", start) : snprintf(s, sizeof(s), " %d-%d", start, end);
+        rc = _cluster_buf_append(b, s, (size_t)len);
+        start = end;
+    }
+    if (n->flags & CLUSTER_NODE_MYSELF)
+    {
+        for (int slot = 0; slot < KEYSLOT_COUNT && rc == 0; slot++)
+        {
+            if (cluster_state.migrating[slot])
+            {
+                len = snprintf(s, sizeof(s), " [%d->-%s]", slot, cluster_state.migrating[slot]->id);
+                rc = _cluster_buf_append(b, s, (size_t)len);
+            }
+            if (cluster_state.importing[slot] && rc == 0)
+            {
+                len = snprintf(s, sizeof(s), " [%d-<-%s]", slot, cluster_state.importing[slot]->id);
+                rc = _cluster_buf_append(b, s, (size_t)len);
+            }
+        }
+    }
+    return rc == 0 ? _cluster_buf_append(b, "\n", 1) : -1;
+}
+
+/**
+ * @brief (Internal) Rewrites the config file: every node but the ones in
+ * a handshake, then the epoch. A temporary file is renamed over it.
+ * @return 0 on success, -1 on failure (logged).
+ */
+static inline int _cluster_save_config(void)
+{
+    cluster_state.save_pending = 0;
+    aof_buf_t b = {0};
+    int rc = 0;
+    for (int i = 0; i < cluster_state.nnodes && rc == 0; i++)
+    {
+        if (!(cluster_state.nodes[i]->flags & CLUSTER_NODE_HANDSHAKE))
+            rc = _cluster_describe_node(&b, cluster_state.nodes[i]);
+    }
+    char vars[96];
+    int vlen = snprintf(vars, sizeof(vars), "vars currentEpoch %llu lastVoteEpoch 0\n",
+                        (unsigned long long)cluster_state.current_epoch);
+    if (rc == 0)
+        rc = _cluster_buf_append(&b, vars, (size_t)vlen);
+
+    const char *path = server.config.cluster_config_file;
+    char tmp[PATH_MAX];
+    snprintf(tmp, sizeof(tmp), "%s.tmp-%d", path, (int)getpid());
+    int fd = rc == 0 ? open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644) : -1;
+    if (fd < 0 || _aof_write_all(fd, b.p, b.len) != b.len || fsync(fd) != 0 || close(fd) != 0 ||
+        rename(tmp, path) != 0)
+    {
+        log_error("Can't save the cluster config to %s: %s", path, rc == 0 ? strerror(errno) : "out of memory");
+        if (fd >= 0)
+        {
+            close(fd);
+            unlink(tmp);
+        }
+        rc = -1;
+    }
+    free(b.p);
+    return rc;
+}
+
+/**
+ * @brief (Internal) Splits a config line on spaces, in place.
+ * @return Number of fields, or -1 if out of memory.
+ */
+static inline int _cluster_split(char *line, char ***fields, int *cap)
+{
+    int n = 0;
+    for (char *tok = strtok(line, " \r\n"); tok; tok = strtok(NULL, " \r\n"))
+    {
+        if (n == *cap)
+        {
+            int ncap = *cap ? *cap * 2 : 64;
+            char **f = (char **)realloc(*fields, (size_t)ncap * sizeof(char *));
+            if (f == NULL)
+                return -1;
+            *fields = f;
+            *cap = ncap;
+        }
+        (*fields)[n++] = tok;
+    }
+    return n;
+}
+
+static inline int _cluster_parse_int(const char *s, size_t len, long long max, long long *out)
+{
+    return string_to_ll(s, len, out) == 0 && *out >= 0 && *out <= max ? 0 : -1;
+}
+
+/**
+ * @brief (Internal) First pass over a config line: adds the node it
+ * describes (or reads the vars line).
+ * @return 0, or -1 if the line is malformed.
+ */
+static inline int _cluster_load_node(char **f, int n)
+{
+    long long v, port, bus_port;
+    if (n >= 2 && strcmp(f[0], "vars") == 0)
+    {
+        for (int i = 1; i + 1 < n; i += 2)
+        {
+            if (strcmp(f[i], "currentEpoch") == 0)
+            {
+                if (_cluster_parse_int(f[i + 1], strlen(f[i + 1]), LLONG_MAX, &v) != 0)
+                    return -1;
+                cluster_state.current_epoch = (uint64_t)v;
+            }
+        }
+        return 0;
+    }
+    if (n < 8 || strlen(f[0]) != CLUSTER_ID_LEN || _cluster_node_lookup(f[0], CLUSTER_ID_LEN))
+        return -1;
+
+    // <ip>:<port>@<bus port>
+    char *at = strchr(f[1], '@'), *colon = NULL;
+    for (char *p = f[1]; at && p < at; p++)
+    {
+        if (*p == ':')
+            colon = p; // The last one: an IPv6 address has more
+    }
+    if (colon == NULL || colon - f[1] >= INET6_ADDRSTRLEN ||
+        _cluster_parse_int(colon + 1, (size_t)(at - colon - 1), 65535, &port) != 0 ||
+        _cluster_parse_int(at + 1, strlen(at + 1), 65535, &bus_port) != 0 ||
+        _cluster_parse_int(f[6], strlen(f[6]), LLONG_MAX, &v) != 0)
+        return -1;
+    *colon = '\0';
+
+    int myself = strncmp(f[2], "myself", 6) == 0;
+    if (myself && cluster_state.myself)
+        return -1;
+    // Our own ports are the ones we run with now
+    cluster_node_t *node = _cluster_node_create(f[0], f[1], myself ? server.config.port : (int)port,
+                                                myself ? server.config.port + CLUSTER_PORT_INCR : (int)bus_port,
+                                                myself ? CLUSTER_NODE_MYSELF : 0);
+    if (node == NULL)
+        return -1;
+    node->config_epoch = (uint64_t)v;
+    if (myself)
+        cluster_state.myself = node;
+    return 0;
+}
+
+/**
+ * @brief (Internal) Second pass over a node's config line: its slots and,
+ * for ourselves, the slots being moved.
+ * @return 0, or -1 if the line is malformed.
+ */
+static inline int _cluster_load_slots(char **f, int n)
+{
+    if (strcmp(f[0], "vars") == 0)
+        return 0;
+    cluster_node_t *node = _cluster_node_lookup(f[0], CLUSTER_ID_LEN);
+    for (int i = 8; i < n; i++)
+    {
+        char *s = f[i];
+        long long start, end;
+        if (s[0] == '[')
+        {
+            // [<slot>->-<id>] migrating, [<slot>-<-<id>] importing
+            char *dash = strchr(s, '-');
+            size_t len = strlen(s);
+            if (dash == NULL || len < 2 || s[len - 1] != ']' ||
+                _cluster_parse_int(s + 1, (size_t)(dash - s - 1), KEYSLOT_COUNT - 1, &start) != 0 ||
+                (strncmp(dash, "->-", 3) != 0 && strncmp(dash, "-<-", 3) != 0))
+                return -1;
+            cluster_node_t *other = _cluster_node_lookup(dash + 3, (size_t)(s + len - 1 - (dash + 3)));
+            if (other == NULL)
+                return -1;
+            if (dash[1] == '>')
+                cluster_state.migrating[start] = other;
+            else
+                cluster_state.importing[start] = other;
+            continue;
+        }
+        char *dash = strchr(s, '-');
+        if (_cluster_parse_int(s, dash ? (size_t)(dash - s) : strlen(s), KEYSLOT_COUNT - 1, &start) != 0 ||
+            _cluster_parse_int(dash ? dash + 1 : s, strlen(dash ? dash + 1 : s), KEYSLOT_COUNT - 1, &end) != 0 ||
+            end < start)
+            return -1;
+        for (long long slot = start; slot <= end; slot++)
+            _cluster_assign((int)slot, node);
+    }
+    return 0;
+}
+
+/**
+ * @brief (Internal) Reads the node table back, before any shard runs. With
+ * no config file we are a new cluster of one, under a new id.
+ * @return 0 on success, -1 if the file is unreadable or malformed (logged).
+ */
+static inline int _cluster_load_config(const char *path)
+{
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL)
+    {
+        if (errno != ENOENT)
+        {
+            log_error("Can't open the cluster config %s: %s", path, strerror(errno));
+            return -1;
+        }
+        cluster_state.myself = _cluster_node_create(NULL, "", server.config.port,
+                                                    server.config.port + CLUSTER_PORT_INCR, CLUSTER_NODE_MYSELF);
+        if (cluster_state.myself == NULL)
+            return -1;
+        log_info("No cluster config found, I'm %s", cluster_state.myself->id);
+        return 0;
+    }
+
+    char *line = NULL, **fields = NULL;
+    size_t line_cap = 0;
+    int fields_cap = 0, lineno = 0, rc = 0;
+    // Nodes first: a slot being moved names the other node
+    for (int pass = 0; pass < 2 && rc == 0; pass++)
+    {
+        rewind(fp);
+        lineno = 0;
+        while (rc == 0 && getline(&line, &line_cap, fp) >= 0)
+        {
+            lineno++;
+            int n = _cluster_split(line, &fields, &fields_cap);
+            if (n == 0)
+                continue;
+            rc = n < 0 ? -1 : pass == 0 ? _cluster_load_node(fields, n) : _cluster_load_slots(fields, n);
+        }
+    }
+    if (rc == 0 && cluster_state.myself == NULL)
+    {
+        rc = -1;
+        lineno = 0;
+    }
+    if (rc != 0)
+        log_error("Bad cluster config %s, line %d", path, lineno);
+    free(line);
+    free(fields);
+    fclose(fp);
+    cluster_state.save_pending = 0;
+    return rc;
+}
+
+// --- Links ---
+
+static inline void _cluster_link_interest(cluster_link_t *l, int out)
+{
+    if (l->write_interest == out)
+        return;
+    if (event_mod(&server.shards[0].el, l->conn->fd, out ? EVENT_READABLE | EVENT_WRITABLE : EVENT_READABLE) == 0)
+        l->write_interest = out;
+}
+
+/**
+ * @brief (Internal) Wraps a bus connection and registers it with shard 0.
+ * @return The link, or NULL on failure ('fd' is then closed).
+ */
+static inline cluster_link_t *_cluster_link_create(int fd, cluster_node_t *node, int connecting)
+{
+    cluster_link_t *l = (cluster_link_t *)calloc(1, sizeof(cluster_link_t));
+    client_t *conn = l ? client_create(fd, CLUSTER_LINK_OBUF_MAX) : NULL;
+    if (conn && fd >= cluster_state.links_cap)
+    {
+        int cap = cluster_state.links_cap ? cluster_state.links_cap : 64;
+        while (cap <= fd)
+            cap *= 2;
+        cluster_link_t **links = (cluster_link_t **)realloc(cluster_state.links, (size_t)cap * sizeof(cluster_link_t *));
+        if (links)
+        {
+            memset(links + cluster_state.links_cap, 0, (size_t)(cap - cluster_state.links_cap) * sizeof(cluster_link_t *));
+            cluster_state.links = links;
+            cluster_state.links_cap = cap;
+        }
+    }
+    if (conn == NULL || fd >= cluster_state.links_cap ||
+        event_add(&server.shards[0].el, fd, connecting ? EVENT_WRITABLE : EVENT_READABLE) < 0)
+    {
+        log_error("Can't set up a cluster bus link: %s", conn ? strerror(errno) : "out of memory");
+        client_free(conn);
+        free(l);
+        close(fd);
+        return NULL;
+    }
+    conn->shard = &server.shards[0];
+    l->conn = conn;
+    l->node = node;
+    l->connecting = connecting;
+    l->write_interest = connecting;
+    l->io_ms = cached_time_ms();
+    cluster_state.links[fd] = l;
+    if (node)
+        node->link = l;
+    return l;
+}
+
+/**
+ * @brief (Internal) Closes a link now and frees it after the current
+ * step, as callers up the stack may still hold it.
+ */
+static inline void _cluster_link_close(cluster_link_t *l)
+{
+    if (l->closed)
+        return;
+    l->closed = 1;
+    event_del(&server.shards[0].el, l->conn->fd);
+    cluster_state.links[l->conn->fd] = NULL;
+    close(l->conn->fd);
+    if (l->node)
+    {
+        log_debug("Cluster bus link to %s:%d closed", l->node->ip, l->node->bus_port);
+        l->node->link = NULL;
+        l->node = NULL;
+    }
+    l->next_dead = cluster_state.dead_links;
+    cluster_state.dead_links = l;
+}
+
+static inline void _cluster_reap(void)
+{
+    while (cluster_state.dead_links)
+    {
+        cluster_link_t *l = cluster_state.dead_links;
+        cluster_state.dead_links = l->next_dead;
+        client_free(l->conn);
+        free(l);
+    }
+}
+
+/**
+ * @brief (Internal) Writes what the socket takes of the link's queued
+ * output. A link that can't keep up is closed.
+ */
+static inline void _cluster_link_flush(cluster_link_t *l)
+{
+    if (l->closed || l->connecting)
+        return;
+    int rc = (l->conn->flags & CLIENT_CLOSE_ASAP) ? -1 : client_flush(l->conn);
+    if (rc < 0)
+        _cluster_link_close(l);
+    else
+        _cluster_link_interest(l, rc == 0);
+}
+
+/**
+ * @brief (Internal) The address at the other end of 'fd' (or at ours, with
+ * 'local'), as text. Left empty if unknown.
+ */
+static inline void _cluster_sock_ip(int fd, int local, char *ip, size_t cap)
+{
+    struct sockaddr_storage sa;
+    socklen_t salen = sizeof(sa);
+    ip[0] = '\0';
+    if ((local ? getsockname(fd, (struct sockaddr *)&sa, &salen) : getpeername(fd, (struct sockaddr *)&sa, &salen)) != 0)
+        return;
+    if (sa.ss_family == AF_INET)
+        inet_ntop(AF_INET, &((struct sockaddr_in *)&sa)->sin_addr, ip, (socklen_t)cap);
+    else if (sa.ss_family == AF_INET6)
+        inet_ntop(AF_INET6, &((struct sockaddr_in6 *)&sa)->sin6_addr, ip, (socklen_t)cap);
+}
+
+// --- Messages ---
+// A bus message is a RESP array: <type> <sender id> <port> <bus port>
+// <current epoch> <config epoch> <slot bitmap>, then <id> <ip> <port>
+// <bus port> for each node gossiped about. The type is PING, MEET (a PING
+// asking to be added) or PONG.
+
+static inline int _cluster_encode(aof_buf_t *b, const resp_arg_t *argv, int argc)
+{
+    size_t need = RESP_HEADER_MAX;
+    for (int i = 0; i < argc; i++)
+        need += RESP_BULK_OVERHEAD_MAX + argv[i].len;
+    if (_aof_buf_reserve(b, need) != 0)
+        return -1;
+    b->len += resp_encode_array_header(b->p + b->len, argc);
+    for (int i = 0; i < argc; i++)
+        b->len += resp_encode_bulk(b->p + b->len, argv[i].ptr, argv[i].len);
+    return 0;
+}
+
+static inline resp_arg_t _cluster_num_arg(char *buf, long long v)
+{
+    return (resp_arg_t){buf, ll_to_str(buf, v)};
+}
+
+/**
+ * @brief (Internal) Queues a message on the link and sends it.
+ */
+static inline void _cluster_send_msg(cluster_link_t *l, const char *type)
+{
+    cluster_node_t *me = cluster_state.myself;
+    resp_arg_t argv[CLUSTER_MSG_ARGS + CLUSTER_GOSSIP_MAX * CLUSTER_GOSSIP_ARGS];
+    char nums[4 + CLUSTER_GOSSIP_MAX * 2][LL_STR_SIZE];
+    int argc = 0, k = 0;
+
+    argv[argc++] = (resp_arg_t){(char *)type, strlen(type)};
+    argv[argc++] = (resp_arg_t){me->id, CLUSTER_ID_LEN};
+    argv[argc++] = _cluster_num_arg(nums[k++], me->port);
+    argv[argc++] = _cluster_num_arg(nums[k++], me->bus_port);
+    argv[argc++] = _cluster_num_arg(nums[k++], (long long)cluster_state.current_epoch);
+    argv[argc++] = _cluster_num_arg(nums[k++], (long long)me->config_epoch);
+    argv[argc++] = (resp_arg_t){(char *)me->slots, CLUSTER_SLOT_BYTES};
+
+    // A different window of the table each time
+    int start = cluster_state.gossip_next++ % cluster_state.nnodes, gossiped = 0;
+    for (int i = 0; i < cluster_state.nnodes && gossiped < CLUSTER_GOSSIP_MAX; i++)
+    {
+        cluster_node_t *n = cluster_state.nodes[(start + i) % cluster_state.nnodes];
+        if (n == me || n == l->node || (n->flags & CLUSTER_NODE_HANDSHAKE) || n->ip[0] == '\0')
+            continue;
+        argv[argc++] = (resp_arg_t){n->id, CLUSTER_ID_LEN};
+        argv[argc++] = (resp_arg_t){n->ip, strlen(n->ip)};
+        argv[argc++] = _cluster_num_arg(nums[k++], n->port);
+        argv[argc++] = _cluster_num_arg(nums[k++], n->bus_port);
+        gossiped++;
+    }
+
+    cluster_state.msg.len = 0;
+    if (_cluster_encode(&cluster_state.msg, argv, argc) != 0)
+    {
+        log_ratelimited(LOG_WARNING, 10, "Cluster bus: out of memory, a message was not sent");
+        return;
+    }
+    client_add_reply(l->conn, cluster_state.msg.p, cluster_state.msg.len);
+    cluster_state.stat_sent++;
+    _cluster_link_flush(l);
+}
+
+static inline void _cluster_ping(cluster_node_t *n)
+{
+    if (n->ping_sent_ms == 0)
+        n->ping_sent_ms = cached_time_ms();
+    _cluster_send_msg(n->link, (n->flags & CLUSTER_NODE_MEET) ? "MEET" : "PING");
+}
+
+/**
+ * @brief (Internal) Applies the slots 'n' claims: a claim wins a slot
+ * nobody owns, or one whose owner has an older config epoch. A slot we
+ * are importing is left to SETSLOT NODE.
+ */
+static inline void _cluster_apply_claims(cluster_node_t *n, const unsigned char *claimed)
+{
+    int lost = 0;
+    for (int slot = 0; slot < KEYSLOT_COUNT; slot++)
+    {
+        if (claimed[slot >> 3] == 0)
+        {
+            slot |= 7;
+            continue;
+        }
+        if (!((claimed[slot >> 3] >> (slot & 7)) & 1))
+            continue;
+        cluster_node_t *owner = cluster_state.slots[slot];
+        if (owner == n || cluster_state.importing[slot] || (owner && owner->config_epoch >= n->config_epoch))
+            continue;
+        if (_cluster_update() != 0)
+            return;
+        lost += owner == cluster_state.myself;
+        _cluster_assign(slot, n);
+    }
+    if (lost)
+        log_warn("%d of our slots were taken over by node %s (%s:%d)", lost, n->id, n->ip, n->port);
+}
+
+/**
+ * @brief (Internal) Starts a handshake with each node gossiped about that
+ * we don't know yet.
+ */
+static inline void _cluster_apply_gossip(const resp_arg_t *g, int count)
+{
+    for (int i = 0; i < count; i++, g += CLUSTER_GOSSIP_ARGS)
+    {
+        long long port, bus_port;
+        char ip[INET6_ADDRSTRLEN];
+        if (g[0].len != CLUSTER_ID_LEN || g[1].len == 0 || g[1].len >= sizeof(ip) ||
+            _cluster_parse_int(g[2].ptr, g[2].len, 65535, &port) != 0 ||
+            _cluster_parse_int(g[3].ptr, g[3].len, 65535, &bus_port) != 0 ||
+            _cluster_node_lookup(g[0].ptr, g[0].len))
+            continue;
+        memcpy(ip, g[1].ptr, g[1].len);
+        ip[g[1].len] = '\0';
+        if (!_cluster_handshaking(ip, (int)port))
+            _cluster_node_create(NULL, ip, (int)port, (int)bus_port, CLUSTER_NODE_HANDSHAKE);
+    }
+}
+
+/**
+ * @brief (Internal) Takes in a message: a PING or MEET on an inbound link
+ * gets a PONG, a PONG on ours completes the handshake or clears the
+ * missed PING. Then the sender's slots, epochs and gossip are applied.
+ */
+static inline void _cluster_process(cluster_link_t *l, const resp_arg_t *argv, int argc)
+{
+    cluster_node_t *me = cluster_state.myself;
+    long long now = cached_time_ms(), port, bus_port, current_epoch, config_epoch;
+    int pong = argc > 0 && resp_arg_eq_nocase(&argv[0], "pong");
+    int meet = argc > 0 && resp_arg_eq_nocase(&argv[0], "meet");
+    if (argc < CLUSTER_MSG_ARGS || (argc - CLUSTER_MSG_ARGS) % CLUSTER_GOSSIP_ARGS != 0 ||
+        !(pong || meet || resp_arg_eq_nocase(&argv[0], "ping")) || argv[1].len != CLUSTER_ID_LEN ||
+        _cluster_parse_int(argv[2].ptr, argv[2].len, 65535, &port) != 0 ||
+        _cluster_parse_int(argv[3].ptr, argv[3].len, 65535, &bus_port) != 0 ||
+        _cluster_parse_int(argv[4].ptr, argv[4].len, LLONG_MAX, &current_epoch) != 0 ||
+        _cluster_parse_int(argv[5].ptr, argv[5].len, LLONG_MAX, &config_epoch) != 0 ||
+        argv[6].len != CLUSTER_SLOT_BYTES)
+    {
+        log_ratelimited(LOG_WARNING, 10, "Malformed cluster bus message, closing the link");
+        _cluster_link_close(l);
+        return;
+    }
+    cluster_state.stat_received++;
+    l->io_ms = now;
+    cluster_node_t *sender = _cluster_node_lookup(argv[1].ptr, argv[1].len);
+
+    if (l->node == NULL)
+    {
+        if (pong)
+            return;
+        if (me->ip[0] == '\0')
+            _cluster_sock_ip(l->conn->fd, 1, me->ip, sizeof(me->ip));
+        if (sender == NULL && meet)
+        {
+            char ip[INET6_ADDRSTRLEN];
+            _cluster_sock_ip(l->conn->fd, 0, ip, sizeof(ip));
+            sender = _cluster_node_create(argv[1].ptr, ip, (int)port, (int)bus_port, 0);
+            if (sender)
+                log_info("Met cluster node %s at %s:%d", sender->id, sender->ip, sender->port);
+        }
+        _cluster_send_msg(l, "PONG");
+        if (l->closed)
+            return;
+    }
+    else
+    {
+        cluster_node_t *n = l->node;
+        if (!pong)
+            return;
+        if (n->flags & CLUSTER_NODE_HANDSHAKE)
+        {
+            if (sender)
+            {
+                // A node we know (maybe ourselves) at another address
+                _cluster_node_free(n);
+                return;
+            }
+            memcpy(n->id, argv[1].ptr, CLUSTER_ID_LEN);
+            n->flags &= ~CLUSTER_NODE_HANDSHAKE;
+            cluster_state.save_pending = 1;
+            sender = n;
+            log_info("Handshake with %s:%d done: node %s", n->ip, n->port, n->id);
+        }
+        else if (sender != n)
+        {
+            log_warn("Cluster node %s at %s:%d answers as %.40s, closing the link", n->id, n->ip, n->port,
+                     argv[1].ptr);
+            _cluster_link_close(l);
+            return;
+        }
+        n->flags &= ~CLUSTER_NODE_MEET;
+        n->pong_recv_ms = now;
+        n->ping_sent_ms = 0;
+        if (n->flags & CLUSTER_NODE_PFAIL)
+        {
+            n->flags &= ~CLUSTER_NODE_PFAIL;
+            log_info("Cluster node %s (%s:%d) is reachable again", n->id, n->ip, n->port);
+        }
+    }
+    if (sender == NULL || sender == me)
+        return;
+
+    if (sender->port != port || sender->bus_port != bus_port)
+    {
+        if (_cluster_update() != 0)
+            return;
+        sender->port = (int)port;
+        sender->bus_port = (int)bus_port;
+        cluster_state.save_pending = 1;
+    }
+    if ((uint64_t)current_epoch > cluster_state.current_epoch)
+    {
+        cluster_state.current_epoch = (uint64_t)current_epoch;
+        cluster_state.save_pending = 1;
+    }
+    if ((uint64_t)config_epoch != sender->config_epoch)
+    {
+        sender->config_epoch = (uint64_t)config_epoch;
+        cluster_state.save_pending = 1;
+    }
+    _cluster_apply_claims(sender, (const unsigned char *)argv[6].ptr);
+
+    // Two nodes on the same config epoch could never settle a claim: the one with the smaller id moves on
+    if (sender->config_epoch == me->config_epoch && memcmp(me->id, sender->id, CLUSTER_ID_LEN) < 0)
+    {
+        _cluster_bump_epoch();
+        log_debug("Config epoch collision with node %s, moved to epoch %llu", sender->id,
+                  (unsigned long long)me->config_epoch);
+    }
+    _cluster_apply_gossip(&argv[CLUSTER_MSG_ARGS], (argc - CLUSTER_MSG_ARGS) / CLUSTER_GOSSIP_ARGS);
+}
+
+/**
+ * @brief (Internal) Reads and processes every complete message on the link.
+ */
+static inline void _cluster_link_read(cluster_link_t *l)
+{
+    client_t *conn = l->conn;
+    for (;;)
+    {
+        ssize_t n = client_read(conn);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if (n <= 0)
+        {
+            _cluster_link_close(l);
+            return;
+        }
+
+        resp_status st;
+        while ((st = resp_parse_command(&conn->parser, conn->querybuf, conn->qb_len)) == RESP_PARSE_OK)
+        {
+            if (conn->parser.argc > CLUSTER_MSG_ARGS + CLUSTER_NODES_MAX * CLUSTER_GOSSIP_ARGS)
+            {
+                st = RESP_PARSE_ERROR;
+                break;
+            }
+            resp_arg_t *argv = resp_parser_argv(&conn->parser, conn->querybuf);
+            _cluster_process(l, argv, conn->parser.argc);
+            if (l->closed)
+                return;
+        }
+        if (st == RESP_PARSE_ERROR)
+        {
+            log_ratelimited(LOG_WARNING, 10, "Protocol error on the cluster bus, closing the link");
+            _cluster_link_close(l);
+            return;
+        }
+        client_compact_querybuf(conn);
+    }
+}
+
+// --- Connecting ---
+
+static inline int _cluster_sockaddr(const char *ip, int port, struct sockaddr_storage *sa, socklen_t *salen)
+{
+    memset(sa, 0, sizeof(*sa));
+    struct sockaddr_in *in = (struct sockaddr_in *)sa;
+    struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)sa;
+    if (inet_pton(AF_INET, ip, &in->sin_addr) == 1)
+    {
+        in->sin_family = AF_INET;
+        in->sin_port = htons((uint16_t)port);
+        *salen = sizeof(*in);
+        return 0;
+    }
+    if (inet_pton(AF_INET6, ip, &in6->sin6_addr) == 1)
+    {
+        in6->sin6_family = AF_INET6;
+        in6->sin6_port = htons((uint16_t)port);
+        *salen = sizeof(*in6);
+        return 0;
+    }
+    return -1;
+}
+
+/**
+ * @brief (Internal) Starts a non-blocking connect to a node's bus port;
+ * the first PING (or MEET) goes out once it completes.
+ */
+static inline void _cluster_connect(cluster_node_t *n)
+{
+    struct sockaddr_storage sa;
+    socklen_t salen;
+    n->connect_ms = cached_time_ms();
+    if (_cluster_sockaddr(n->ip, n->bus_port, &sa, &salen) != 0)
+        return;
+    int fd = socket(sa.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0 || (connect(fd, (struct sockaddr *)&sa, salen) != 0 && errno != EINPROGRESS))
+    {
+        log_debug("Can't connect to cluster node %s:%d: %s", n->ip, n->bus_port, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    _cluster_link_create(fd, n, 1);
+}
+
+static inline void _cluster_connected(cluster_link_t *l)
+{
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(l->conn->fd, SOL_SOCKET, SO_ERROR, &err, &len) != 0 || err != 0)
+    {
+        log_debug("Can't connect to cluster node %s:%d: %s", l->node->ip, l->node->bus_port, strerror(err));
+        _cluster_link_close(l);
+        return;
+    }
+    l->connecting = 0;
+    l->io_ms = cached_time_ms();
+    _cluster_link_interest(l, 0);
+    _cluster_ping(l->node);
+}
+
+static inline void _cluster_accept(void)
+{
+    int fd = accept(cluster_state.bus_fd, NULL, NULL);
+    if (fd < 0)
+    {
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            log_ratelimited(LOG_WARNING, 10, "accept: cluster bus: %s", strerror(errno));
+        return;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK) != 0 || fcntl(fd, F_SETFD, FD_CLOEXEC) != 0)
+    {
+        close(fd);
+        return;
+    }
+    _cluster_link_create(fd, NULL, 0);
+}
+
+// --- Event Loop ---
+
+/**
+ * @brief (Internal) Ends a step of shard 0's cluster work: lets the parked
+ * shards go, saves the config file if it changed and frees closed links.
+ */
+static inline void _cluster_done(void)
+{
+    if (cluster_state.paused)
+    {
+        shard_resume_others(server.nshards);
+        cluster_state.paused = 0;
+    }
+    if (cluster_state.save_pending)
+        _cluster_save_config();
+    _cluster_reap();
+}
+
+/**
+ * @return 1 if 'fd' is the cluster bus listener or one of its links.
+ */
+static inline int cluster_owns_fd(int fd)
+{
+    return fd == cluster_state.bus_fd || (fd < cluster_state.links_cap && cluster_state.links[fd]);
+}
+
+/**
+ * @brief Shard 0: handles an event on an fd cluster_owns_fd() claimed.
+ */
+static inline void cluster_bus_event(int fd, uint32_t events)
+{
+    if (fd == cluster_state.bus_fd)
+    {
+        _cluster_accept();
+    }
+    else
+    {
+        cluster_link_t *l = cluster_state.links[fd];
+        if (l->connecting)
+        {
+            _cluster_connected(l);
+        }
+        else
+        {
+            if (events & EVENT_WRITABLE)
+                _cluster_link_flush(l);
+            if (!l->closed && (events & (EVENT_READABLE | EVENT_ERROR)))
+                _cluster_link_read(l);
+        }
+    }
+    _cluster_done();
+}
+
+/**
+ * @brief Runs on shard 0 every loop iteration, after repl_cron(), and gets
+ * to work every CLUSTER_CRON_MS: connects to and PINGs the other nodes,
+ * and flags the ones that stopped answering.
+ */
+static inline void cluster_cron(void)
+{
+    long long now = cached_time_ms();
+    if (!server.config.cluster_enabled || now - cluster_state.cron_ms < CLUSTER_CRON_MS)
+        return;
+    cluster_state.cron_ms = now;
+    long long timeout = server.config.cluster_node_timeout;
+    long long handshake_timeout = timeout > CLUSTER_HANDSHAKE_MIN_MS ? timeout : CLUSTER_HANDSHAKE_MIN_MS;
+
+    for (int i = 0; i < cluster_state.nnodes; i++)
+    {
+        cluster_node_t *n = cluster_state.nodes[i];
+        if (n->flags & CLUSTER_NODE_MYSELF)
+            continue;
+        if ((n->flags & CLUSTER_NODE_HANDSHAKE) && now - n->ctime_ms > handshake_timeout)
+        {
+            log_info("Handshake with %s:%d timed out", n->ip, n->port);
+            _cluster_node_free(n);
+            i--; // The last node took its place
+            continue;
+        }
+
+        cluster_link_t *l = n->link;
+        if (l == NULL)
+        {
+            // Unreachable counts as not answering, from the PING that would have gone out
+            if (n->ping_sent_ms == 0 && now - n->pong_recv_ms >= CLUSTER_PING_MS)
+                n->ping_sent_ms = now;
+            if (now - n->connect_ms >= CLUSTER_PING_MS)
+                _cluster_connect(n);
+        }
+        else if (l->connecting)
+        {
+            if (now - l->io_ms > timeout)
+                _cluster_link_close(l);
+        }
+        else if (n->ping_sent_ms && now - n->ping_sent_ms > timeout / 2 && now - l->io_ms > timeout / 2)
+        {
+            // Maybe only the link is broken: the next attempt opens a new one, the PING stays unanswered
+            _cluster_link_close(l);
+        }
+        else if (n->ping_sent_ms == 0 && now - n->pong_recv_ms >= CLUSTER_PING_MS)
+        {
+            _cluster_ping(n);
+        }
+
+        if (n->ping_sent_ms && now - n->ping_sent_ms > timeout && !(n->flags & CLUSTER_NODE_PFAIL))
+        {
+            n->flags |= CLUSTER_NODE_PFAIL;
+            log_warn("Cluster node %s (%s:%d) has not answered for %lld ms", n->id, n->ip, n->port,
+                     now - n->ping_sent_ms);
+        }
+    }
+
+    // The other end PINGs every second: a silent inbound link is dead
+    for (int fd = 0; fd < cluster_state.links_cap; fd++)
+    {
+        cluster_link_t *l = cluster_state.links[fd];
+        if (l && l->node == NULL && now - l->io_ms > timeout)
+            _cluster_link_close(l);
+    }
+    _cluster_done();
+}
+
+// --- Lifecycle ---
+
+/**
+ * @brief At startup, once the shards exist and before the dataset is
+ * loaded (so its keys are counted per slot): reads the node table, or
+ * starts a new one.
+ * @return 0 on success, -1 on failure (logged).
+ */
+static inline int cluster_init(void)
+{
+    if (!server.config.cluster_enabled)
+        return 0;
+    for (int i = 0; i < server.nshards; i++)
+    {
+        server.shards[i].db.slot_keys = (uint32_t *)calloc(KEYSLOT_COUNT, sizeof(uint32_t));
+        if (server.shards[i].db.slot_keys == NULL)
+        {
+            log_error("Out of memory for the cluster slot counters");
+            return -1;
+        }
+    }
+    if (_cluster_load_config(server.config.cluster_config_file) != 0)
+        return -1;
+    if (cluster_state.myself->config_epoch > cluster_state.current_epoch)
+        cluster_state.current_epoch = cluster_state.myself->config_epoch;
+    if (_cluster_save_config() != 0)
+        return -1; // Better now than at the first change
+    log_info("Cluster node %s, %d slots, %d known nodes", cluster_state.myself->id, cluster_state.myself->nslots,
+             cluster_state.nnodes);
+    return 0;
+}
+
+/**
+ * @brief At shutdown, once every shard has stopped.
+ */
+static inline void cluster_shutdown(void)
+{
+    if (!server.config.cluster_enabled)
+        return;
+    if (cluster_state.save_pending)
+        _cluster_save_config();
+    for (int fd = 0; fd < cluster_state.links_cap; fd++)
+    {
+        if (cluster_state.links[fd])
+            _cluster_link_close(cluster_state.links[fd]);
+    }
+    _cluster_reap();
+    free(cluster_state.links);
+    free(cluster_state.msg.p);
+    for (int i = 0; i < cluster_state.nnodes; i++)
+        free(cluster_state.nodes[i]);
+    cluster_state.nnodes = 0;
+    if (cluster_state.bus_fd >= 0)
+        close(cluster_state.bus_fd);
+    for (int i = 0; i < SHARDS_MAX; i++)
+    {
+        if (cluster_migrate_conns[i].open)
+            close(cluster_migrate_conns[i].fd);
+    }
+    for (int i = 0; i < server.nshards; i++)
+    {
+        free(server.shards[i].db.slot_keys);
+        server.shards[i].db.slot_keys = NULL;
+    }
+}
+
+// --- Redirects ---
+
+static inline int _cluster_keys_missing(redis_db_t *db, const resp_arg_t *keys, int nkeys, int step)
+{
+    int missing = 0;
+    for (int i = 0; i < nkeys; i++)
+    {
+        dict_node_t *n = dict_find(&db->entries, keys[i * step].ptr, keys[i * step].len);
+        missing += n == NULL || db_key_expired(DB_ENTRY_OF(n));
+    }
+    return missing;
+}
+
+static inline void _cluster_reply_redirect(client_t *c, const char *type, int slot, const cluster_node_t *n)
+{
+    char buf[32 + INET6_ADDRSTRLEN];
+    int len = snprintf(buf, sizeof(buf), "-%s %d %s:%d\r\n", type, slot, n->ip, n->port);
+    client_add_reply(c, buf, (size_t)len);
+}
+
+/**
+ * @brief Checks, before a command runs, that this node serves its keys:
+ * key i is keys[i * step]. A slot that is migrating away sends the client
+ * to the target (-ASK) for keys that already left, unless the command is
+ * the one moving them ('check_missing' == 0); one we are importing is
+ * served to a client that sent ASKING ('asking').
+ * @return 0 if the command may run, -1 if a redirect or error was replied.
+ */
+static inline int cluster_redirect(redis_db_t *db, client_t *c, const resp_arg_t *keys, int nkeys, int step,
+                                   int asking, int check_missing)
+{
+    int slot = (int)key_hash_slot(keys[0].ptr, keys[0].len);
+    for (int i = 1; i < nkeys; i++)
+    {
+        if ((int)key_hash_slot(keys[i * step].ptr, keys[i * step].len) != slot)
+        {
+            client_add_reply_str(c, CLUSTER_CROSSSLOT_ERR);
+            return -1;
+        }
+    }
+
+    cluster_node_t *owner = cluster_state.slots[slot];
+    if (owner == cluster_state.myself)
+    {
+        cluster_node_t *target = cluster_state.migrating[slot];
+        if (target == NULL || !check_missing)
+            return 0;
+        int missing = _cluster_keys_missing(db, keys, nkeys, step);
+        if (missing == 0)
+            return 0;
+        if (missing < nkeys)
+            client_add_reply_str(c, CLUSTER_TRYAGAIN_ERR);
+        else
+            _cluster_reply_redirect(c, "ASK", slot, target);
+        return -1;
+    }
+    if (asking && cluster_state.importing[slot])
+    {
+        // Keys still at the source can't be used together with the ones already here
+        if (nkeys > 1 && check_missing && _cluster_keys_missing(db, keys, nkeys, step) > 0)
+        {
+            client_add_reply_str(c, CLUSTER_TRYAGAIN_ERR);
+            return -1;
+        }
+        return 0;
+    }
+    if (owner == NULL)
+    {
+        char buf[64];
+        int len = snprintf(buf, sizeof(buf), "-CLUSTERDOWN Hash slot not served\r\n");
+        client_add_reply(c, buf, (size_t)len);
+    }
+    else
+    {
+        _cluster_reply_redirect(c, "MOVED", slot, owner);
+    }
+    return -1;
+}
+
+/**
+ * @brief Picks the shard that runs a CLUSTER command: COUNTKEYSINSLOT and
+ * GETKEYSINSLOT read the keyspace holding their slot, the rest shard 0.
+ */
+static inline int cluster_slot_shard(const resp_arg_t *argv, int argc, int nshards)
+{
+    long long slot;
+    if (argc >= 3 && (resp_arg_eq_nocase(&argv[1], "countkeysinslot") || resp_arg_eq_nocase(&argv[1], "getkeysinslot")) &&
+        _cluster_parse_int(argv[2].ptr, argv[2].len, KEYSLOT_COUNT - 1, &slot) == 0)
+        return (int)(slot % nshards);
+    return 0;
+}
+
+/**
+ * @brief Appends the cluster section of INFO.
+ * @return Bytes written.
+ */
+static inline size_t cluster_info(char *buf, size_t cap)
+{
+    int n = snprintf(buf, cap, "# Cluster\r\ncluster_enabled:%d\r\n", server.config.cluster_enabled);
+    return n < 0 ? 0 : ((size_t)n < cap ? (size_t)n : cap - 1);
+}
+
+// --- Handlers ---
+
+static inline void handle_asking(redis_db_t *db, client_t *c, const resp_arg_t *argv, int argc)
+{
+    (void)db; (void)argv; (void)argc;
+    if (!server.config.cluster_enabled)
+    {
+        client_add_reply_str(c, CLUSTER_DISABLED_ERR);
+        return;
+    }
+    c->flags |= CLIENT_ASKING;
+    client_add_reply_str(c, REDIS_OK);
+}
+
+/**
+ * @brief (Internal) Parses a slot argument, replying the error if invalid.
+ * @return The slot, or -1.
+ */
+static inline int _cluster_get_slot(client_t *c, const resp_arg_t *arg)
+{
+    long long slot;
+    if (_cluster_parse_int(arg->ptr, arg->len, KEYSLOT_COUNT - 1, &slot) != 0)
+    {
+        client_add_reply_str(c, "-ERR Invalid or out of range slot\r\n");
+        return -1;
+    }
+    return (int)slot;
+}
+
+/**
+ * @brief (Internal) Looks up a node argument, replying the error if unknown.
+ */
+static inline cluster_node_t *_cluster_get_node(client_t *c, const resp_arg_t *arg)
+{
+    cluster_node_t *n = _cluster_node_lookup(arg->ptr, arg->len);
+    if (n == NULL || (n->flags & CLUSTER_NODE_HANDSHAKE))
+    {
+        char err[96];
+        int len = snprintf(err, sizeof(err), "-ERR Unknown node %.*s\r\n",
+                           (int)(arg->len > CLUSTER_ID_LEN ? CLUSTER_ID_LEN : arg->len), arg->ptr);
+        client_add_reply(c, err, (size_t)len);
+        return NULL;
+    }
+    return n;
+}
+
+/**
+ * CLUSTER MEET ip port [bus-port]
+ */
+static inline void _cluster_meet(client_t *c, const resp_arg_t *argv, int argc)
+{
+    long long port, bus_port;
+    char host[INET6_ADDRSTRLEN];
+    struct sockaddr_storage sa;
+    socklen_t salen;
+    if (argc > 5 || argv[2].len >= sizeof(host) || _cluster_parse_int(argv[3].ptr, argv[3].len, 65535, &port) != 0 ||
+        (argc == 5 && _cluster_parse_int(argv[4].ptr, argv[4].len, 65535, &bus_port) != 0))
+    {
+        client_add_reply_str(c, "-ERR Invalid node address specified\r\n");
+        return;
+    }
+    if (argc < 5)
+        bus_port = port + CLUSTER_PORT_INCR;
+    memcpy(host, argv[2].ptr, argv[2].len);
+    host[argv[2].len] = '\0';
+    if (port == 0 || bus_port == 0 || _cluster_sockaddr(host, (int)bus_port, &sa, &salen) != 0)
+    {
+        char err[96 + INET6_ADDRSTRLEN];
+        int len = snprintf(err, sizeof(err), "-ERR Invalid node address specified: %s:%lld\r\n", host, port);
+        client_add_reply(c, err, (size_t)len);
+        return;
+    }
+    if (!_cluster_handshaking(host, (int)port))
+    {
+        cluster_node_t *n = _cluster_node_create(NULL, host, (int)port, (int)bus_port,
+                                                 CLUSTER_NODE_HANDSHAKE | CLUSTER_NODE_MEET);
+        if (n == NULL)
+        {
+            client_add_reply_str(c, "-ERR Can't add the node, check the server log\r\n");
+            return;
+        }
+        _cluster_connect(n);
+    }
+    client_add_reply_str(c, REDIS_OK);
+}
+
+/**
+ * CLUSTER ADDSLOTS slot [slot ...] | ADDSLOTSRANGE start end [start end ...]
+ * CLUSTER DELSLOTS slot [slot ...] | DELSLOTSRANGE start end [start end ...]
+ * Nothing changes unless every slot is valid, named once and (un)assigned.
+ * DELSLOTS only changes our own view.
+ */
+static inline void _cluster_change_slots(client_t *c, const resp_arg_t *argv, int argc, int add, int range)
+{
+    if (range && (argc - 2) % 2 != 0)
+    {
+        client_add_reply_str(c, REDIS_SYNTAX_ERR);
+        return;
+    }
+    unsigned char *named = (unsigned char *)arena_alloc(&c->arena, KEYSLOT_COUNT);
+    if (named == NULL)
+    {
+        client_add_reply_str(c, "-ERR out of memory\r\n");
+        return;
+    }
+    memset(named, 0, KEYSLOT_COUNT);
+    char err[96];
+    for (int i = 2; i < argc; i += range ? 2 : 1)
+    {
+        int start = _cluster_get_slot(c, &argv[i]);
+        int end = start < 0 || !range ? start : _cluster_get_slot(c, &argv[i + 1]);
+        if (start < 0 || end < 0)
+            return;
+        if (end < start)
+        {
+            int len = snprintf(err, sizeof(err), "-ERR start slot number %d is greater than end slot number %d\r\n",
+                               start, end);
+            client_add_reply(c, err, (size_t)len);
+            return;
+        }
+        for (int slot = start; slot <= end; slot++)
+        {
+            const char *problem = named[slot]                         ? "specified multiple times"
+                                  : add && cluster_state.slots[slot]  ? "is already busy"
+                                  : !add && !cluster_state.slots[slot] ? "is already unassigned"
+                                                                      : NULL;
+            if (problem)
+            {
+                int len = snprintf(err, sizeof(err), "-ERR Slot %d %s\r\n", slot, problem);
+                client_add_reply(c, err, (size_t)len);
+                return;
+            }
+            named[slot] = 1;
+        }
+    }
+    if (_cluster_update() != 0)
+    {
+        client_add_reply_str(c, "-ERR Server is shutting down\r\n");
+        return;
+    }
+    for (int slot = 0; slot < KEYSLOT_COUNT; slot++)
+    {
+        if (!named[slot])
+            continue;
+        _cluster_assign(slot, add ? cluster_state.myself : NULL);
+        cluster_state.importing[slot] = NULL;
+        cluster_state.migrating[slot] = NULL;
+    }
+    client_add_reply_str(c, REDIS_OK);
+}
+
+/**
+ * CLUSTER SETSLOT slot IMPORTING node | MIGRATING node | STABLE | NODE node
+ */
+static inline void _cluster_setslot(client_t *c, const resp_arg_t *argv, int argc)
+{
+    int slot = _cluster_get_slot(c, &argv[2]);
+    if (slot < 0)
+        return;
+    const resp_arg_t *what = &argv[3];
+    int stable = resp_arg_eq_nocase(what, "stable");
+    if (stable ? argc != 4 : argc != 5)
+    {
+        client_add_reply_str(c, REDIS_SYNTAX_ERR);
+        return;
+    }
+    cluster_node_t *me = cluster_state.myself;
+    cluster_node_t *n = stable ? NULL : _cluster_get_node(c, &argv[4]);
+    if (!stable && n == NULL)
+        return;
+    if (_cluster_update() != 0)
+    {
+        client_add_reply_str(c, "-ERR Server is shutting down\r\n");
+        return;
+    }
+    char err[160];
+    int len = 0;
+    if (resp_arg_eq_nocase(what, "migrating"))
+    {
+        if (cluster_state.slots[slot] != me)
+            len = snprintf(err, sizeof(err), "-ERR I'm not the owner of hash slot %d\r\n", slot);
+        else if (n == me)
+            len = snprintf(err, sizeof(err), "-ERR Can't migrate hash slot %d to myself\r\n", slot);
+        else
+            cluster_state.migrating[slot] = n;
+    }
+    else if (resp_arg_eq_nocase(what, "importing"))
+    {
+        if (cluster_state.slots[slot] == me)
+            len = snprintf(err, sizeof(err), "-ERR I'm already the owner of hash slot %d\r\n", slot);
+        else if (n == me)
+            len = snprintf(err, sizeof(err), "-ERR Can't import hash slot %d from myself\r\n", slot);
+        else
+            cluster_state.importing[slot] = n;
+    }
+    else if (stable)
+    {
+        cluster_state.importing[slot] = NULL;
+        cluster_state.migrating[slot] = NULL;
+    }
+    else if (resp_arg_eq_nocase(what, "node"))
+    {
+        if (cluster_state.slots[slot] == me && n != me && _cluster_slot_keys(slot) > 0)
+        {
+            len = snprintf(err, sizeof(err),
+                           "-ERR Can't assign hashslot %d to a different node while I still hold keys for this hash slot.\r\n",
+                           slot);
+        }
+        else
+        {
+            if (n == me && cluster_state.importing[slot])
+            {
+                // The import is done: our claim must beat the source's
+                cluster_state.importing[slot] = NULL;
+                _cluster_bump_epoch();
+                log_info("Slot %d imported, config epoch now %llu", slot, (unsigned long long)me->config_epoch);
+            }
+            if (n != me)
+                cluster_state.migrating[slot] = NULL;
+            _cluster_assign(slot, n);
+        }
+    }
+    else
+    {
+        len = snprintf(err, sizeof(err), "%s", REDIS_SYNTAX_ERR);
+    }
+    if (len > 0)
+    {
+        client_add_reply(c, err, (size_t)len);
+        return;
+    }
+    cluster_state.save_pending = 1;
+    client_add_reply_str(c, REDIS_OK);
+}
+
+/**
+ * CLUSTER SLOTS: one entry per run of slots with the same owner.
+ */
+static inline void _cluster_reply_slots(client_t *c)
+{
+    int ranges = 0;
+    for (int slot = 0; slot < KEYSLOT_COUNT; slot++)
+    {
+        if (cluster_state.slots[slot] && (slot == 0 || cluster_state.slots[slot - 1] != cluster_state.slots[slot]))
+            ranges++;
+    }
+    client_add_reply_array_len(c, ranges);
+    for (int start = 0; start < KEYSLOT_COUNT; start++)
+    {
+        cluster_node_t *n = cluster_state.slots[start];
+        if (n == NULL)
+            continue;
+        int end = start;
+        while (end + 1 < KEYSLOT_COUNT && cluster_state.slots[end + 1] == n)
+            end++;
+        client_add_reply_array_len(c, 3);
+        client_add_reply_integer(c, start);
+        client_add_reply_integer(c, end);
+        client_add_reply_array_len(c, 3);
+        client_add_reply_bulk(c, n->ip, strlen(n->ip));
+        client_add_reply_integer(c, n->port);
+        client_add_reply_bulk(c, n->id, CLUSTER_ID_LEN);
+        start = end;
+    }
+}
+
+static inline void _cluster_reply_info(client_t *c)
+{
+    int assigned = 0, pfail = 0, size = 0;
+    for (int slot = 0; slot < KEYSLOT_COUNT; slot++)
+    {
+        assigned += cluster_state.slots[slot] != NULL;
+        pfail += cluster_state.slots[slot] && (cluster_state.slots[slot]->flags & CLUSTER_NODE_PFAIL);
+    }
+    for (int i = 0; i < cluster_state.nnodes; i++)
+        size += cluster_state.nodes[i]->nslots > 0;
+    char buf[1024];
+    int len = snprintf(buf, sizeof(buf),
+                       "cluster_enabled:1\r\n"
+                       "cluster_state:%s\r\n"
+                       "cluster_slots_assigned:%d\r\n"
+                       "cluster_slots_ok:%d\r\n"
+                       "cluster_slots_pfail:%d\r\n"
+                       "cluster_slots_fail:0\r\n"
+                       "cluster_known_nodes:%d\r\n"
+                       "cluster_size:%d\r\n"
+                       "cluster_current_epoch:%llu\r\n"
+                       "cluster_my_epoch:%llu\r\n"
+                       "cluster_stats_messages_sent:%lld\r\n"
+                       "cluster_stats_messages_received:%lld\r\n",
+                       assigned == KEYSLOT_COUNT ? "ok" : "fail", assigned, assigned - pfail, pfail,
+                       cluster_state.nnodes, size, (unsigned long long)cluster_state.current_epoch,
+                       (unsigned long long)cluster_state.myself->config_epoch, cluster_state.stat_sent,
+                       cluster_state.stat_received);
+    client_add_reply_bulk(c, buf, (size_t)len);
+}
+
+typedef struct
+{
+    client_t *c;
+    int slot;
+    long long left;
+    long long sent;
+} _cluster_getkeys_t;
+
+static inline void _cluster_getkeys_collect(void *privdata, dict_node_t *node)
+{
+    _cluster_getkeys_t *g = (_cluster_getkeys_t *)privdata;
+    db_entry *e = DB_ENTRY_OF(node);
+    if (g->left > 0 && (int)key_hash_slot(e->key, e->key_len) == g->slot)
+    {
+        client_add_reply_bulk(g->c, e->key, e->key_len);
+        g->left--;
+        g->sent++;
+    }
+}
+
+/**
+ * CLUSTER GETKEYSINSLOT slot count: walks the keyspace of the slot's shard
+ * until 'count' keys are found, so it costs O(keys of the shard) at worst.
+ */
+static inline void _cluster_getkeysinslot(redis_db_t *db, client_t *c, const resp_arg_t *argv, int argc)
+{
+    long long count;
+    int slot = argc == 4 ? _cluster_get_slot(c, &argv[2]) : -1;
+    if (argc != 4)
+        client_add_reply_str(c, REDIS_SYNTAX_ERR);
+    if (slot < 0)
+        return;
+    if (string_to_ll(argv[3].ptr, argv[3].len, &count) != 0 || count < 0)
+    {
+        client_add_reply_str(c, "-ERR Invalid number of keys\r\n");
+        return;
+    }
+    long long total = db->slot_keys[slot];
+    _cluster_getkeys_t g = {c, slot, count < total ? count : total, 0};
+    client_add_reply_array_len(c, g.left);
+    uint64_t cursor = 0;
+    do
+    {
+        cursor = dict_scan(&db->entries, cursor, _cluster_getkeys_collect, &g);
+    } while (cursor != 0 && g.left > 0);
+}
+
+/**
+ * CLUSTER MEET | NODES | MYID | INFO | SLOTS | ADDSLOTS | ADDSLOTSRANGE |
+ * DELSLOTS | DELSLOTSRANGE | SETSLOT | KEYSLOT | COUNTKEYSINSLOT |
+ * GETKEYSINSLOT | SAVECONFIG
+ */
+static inline void handle_cluster(redis_db_t *db, client_t *c, const resp_arg_t *argv, int argc)
+{
+    if (!server.config.cluster_enabled)
+    {
+        client_add_reply_str(c, CLUSTER_DISABLED_ERR);
+        return;
+    }
+    const resp_arg_t *sub = &argv[1];
+    if (resp_arg_eq_nocase(sub, "keyslot") && argc == 3)
+    {
+        client_add_reply_integer(c, key_hash_slot(argv[2].ptr, argv[2].len));
+    }
+    else if (resp_arg_eq_nocase(sub, "countkeysinslot") && argc == 3)
+    {
+        int slot = _cluster_get_slot(c, &argv[2]);
+        if (slot >= 0)
+            client_add_reply_integer(c, db->slot_keys[slot]);
+    }
+    else if (resp_arg_eq_nocase(sub, "getkeysinslot"))
+    {
+        _cluster_getkeysinslot(db, c, argv, argc);
+    }
+    else if (db->shard_id != 0)
+    {
+        // cluster_slot_shard() sends everything else to shard 0
+        client_add_reply_str(c, REDIS_SYNTAX_ERR);
+    }
+    else if (resp_arg_eq_nocase(sub, "myid") && argc == 2)
+    {
+        client_add_reply_bulk(c, cluster_state.myself->id, CLUSTER_ID_LEN);
+    }
+    else if (resp_arg_eq_nocase(sub, "nodes") && argc == 2)
+    {
+        aof_buf_t b = {0};
+        int rc = 0;
+        for (int i = 0; i < cluster_state.nnodes && rc == 0; i++)
+            rc = _cluster_describe_node(&b, cluster_state.nodes[i]);
+        if (rc == 0)
+            client_add_reply_bulk(c, b.p, b.len);
+        else
+            client_add_reply_str(c, "-ERR out of memory\r\n");
+        free(b.p);
+    }
+    else if (resp_arg_eq_nocase(sub, "info") && argc == 2)
+    {
+        _cluster_reply_info(c);
+    }
+    else if (resp_arg_eq_nocase(sub, "slots") && argc == 2)
+    {
+        _cluster_reply_slots(c);
+    }
+    else if (resp_arg_eq_nocase(sub, "meet") && argc >= 4)
+    {
+        _cluster_meet(c, argv, argc);
+    }
+    else if ((resp_arg_eq_nocase(sub, "addslots") || resp_arg_eq_nocase(sub, "delslots")) && argc >= 3)
+    {
+        _cluster_change_slots(c, argv, argc, resp_arg_eq_nocase(sub, "addslots"), 0);
+    }
+    else if ((resp_arg_eq_nocase(sub, "addslotsrange") || resp_arg_eq_nocase(sub, "delslotsrange")) && argc >= 4)
+    {
+        _cluster_change_slots(c, argv, argc, resp_arg_eq_nocase(sub, "addslotsrange"), 1);
+    }
+    else if (resp_arg_eq_nocase(sub, "setslot") && argc >= 4)
+    {
+        _cluster_setslot(c, argv, argc);
+    }
+    else if (resp_arg_eq_nocase(sub, "saveconfig") && argc == 2)
+    {
+        if (_cluster_save_config() == 0)
+            client_add_reply_str(c, REDIS_OK);
+        else
+            client_add_reply_str(c, "-ERR Error saving the cluster node config, check the server log\r\n");
+    }
+    else
+    {
+        client_add_reply_str(c, REDIS_SYNTAX_ERR);
+    }
+    if (db->shard_id == 0)
+        _cluster_done();
+}
+
+// --- MIGRATE ---
+
+static inline void _cluster_migrate_close(cluster_migrate_conn_t *mc)
+{
+    if (mc->open)
+        close(mc->fd);
+    mc->open = 0;
+    mc->rlen = 0;
+}
+
+/**
+ * @brief (Internal) Opens a blocking connection to host:port, whose
+ * connect, reads and writes give up after 'timeout_ms'.
+ * @return 0 on success, -1 on failure (errno set).
+ */
+static inline int _cluster_migrate_connect(cluster_migrate_conn_t *mc, const char *host, int port, long long timeout_ms)
+{
+    char portstr[8];
+    snprintf(portstr, sizeof(portstr), "%d", port);
+    struct addrinfo hints = {0}, *res;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, portstr, &hints, &res) != 0)
+    {
+        errno = EHOSTUNREACH;
+        return -1;
+    }
+    int fd = socket(res->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    struct timeval tv = {(time_t)(timeout_ms / 1000), (suseconds_t)(timeout_ms % 1000) * 1000};
+    int one = 1;
+    if (fd < 0 || setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) != 0 ||
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) != 0 ||
+        connect(fd, res->ai_addr, res->ai_addrlen) != 0)
+    {
+        int err = errno;
+        if (fd >= 0)
+            close(fd);
+        freeaddrinfo(res);
+        errno = err;
+        return -1;
+    }
+    freeaddrinfo(res);
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    mc->open = 1;
+    mc->fd = fd;
+    mc->rlen = 0;
+    snprintf(mc->host, sizeof(mc->host), "%s", host);
+    mc->port = port;
+    return 0;
+}
+
+/**
+ * @brief (Internal) Reads the next reply line (without its CRLF) into
+ * 'line', cut to 'cap' - 1 bytes.
+ * @return 0 on success, -1 on EOF, error or timeout.
+ */
+static inline int _cluster_migrate_read_line(cluster_migrate_conn_t *mc, char *line, size_t cap)
+{
+    for (;;)
+    {
+        char *nl = (char *)memchr(mc->rbuf, '\n', mc->rlen);
+        if (nl || mc->rlen == sizeof(mc->rbuf))
+        {
+            size_t used = nl ? (size_t)(nl - mc->rbuf) + 1 : mc->rlen;
+            size_t len = nl ? used - 1 : used;
+            if (len > 0 && mc->rbuf[len - 1] == '\r')
+                len--;
+            if (len >= cap)
+                len = cap - 1;
+            memcpy(line, mc->rbuf, len);
+            line[len] = '\0';
+            memmove(mc->rbuf, mc->rbuf + used, mc->rlen - used);
+            mc->rlen -= used;
+            if (nl)
+                return 0;
+            continue; // Overlong: drop the rest of it
+        }
+        ssize_t n = recv(mc->fd, mc->rbuf + mc->rlen, sizeof(mc->rbuf) - mc->rlen, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        mc->rlen += (size_t)n;
+    }
+}
+
+/**
+ * @brief (Internal) Sends the pipeline and reads one reply line per
+ * command. 'lines' gets the RESTORE replies, one per key.
+ * @return 0 on success, -1 on an I/O error or timeout.
+ */
+static inline int _cluster_migrate_exchange(cluster_migrate_conn_t *mc, const aof_buf_t *out, int nkeys,
+                                            char (*lines)[CLUSTER_LINE_MAX])
+{
+    if (_aof_write_all(mc->fd, out->p, out->len) != out->len)
+        return -1;
+    char asking[CLUSTER_LINE_MAX];
+    for (int i = 0; i < nkeys; i++)
+    {
+        if (_cluster_migrate_read_line(mc, asking, sizeof(asking)) != 0 ||
+            _cluster_migrate_read_line(mc, lines[i], CLUSTER_LINE_MAX) != 0)
+            return -1;
+        if (asking[0] == '-')
+            memcpy(lines[i], asking, CLUSTER_LINE_MAX); // Its error is the one to report
+    }
+    mc->used_ms = cached_time_ms();
+    return 0;
+}
+
+/**
+ * MIGRATE host port key|"" destination-db timeout [COPY] [REPLACE] [KEYS key [key ...]]
+ * Moves the keys to another node with DUMP/RESTORE (each RESTORE after an
+ * ASKING, so a target importing the slot takes it), then deletes them
+ * here unless COPY. The shard waits for the target meanwhile, up to
+ * 'timeout' ms per operation; its connection is kept for the next call.
+ */
+static inline void handle_migrate(redis_db_t *db, client_t *c, const resp_arg_t *argv, int argc)
+{
+    long long port, dbid, timeout;
+    int copy = 0, replace = 0, first = 3, nargs = 1;
+    char host[REPL_HOST_MAX];
+    for (int i = 6; i < argc; i++)
+    {
+        if (resp_arg_eq_nocase(&argv[i], "copy"))
+            copy = 1;
+        else if (resp_arg_eq_nocase(&argv[i], "replace"))
+            replace = 1;
+        else if (resp_arg_eq_nocase(&argv[i], "keys") && argv[3].len == 0)
+        {
+            first = i + 1;
+            nargs = argc - first;
+            break;
+        }
+        else
+        {
+            client_add_reply_str(c, REDIS_SYNTAX_ERR);
+            return;
+        }
+    }
+    if (argv[1].len >= sizeof(host) || _cluster_parse_int(argv[2].ptr, argv[2].len, 65535, &port) != 0 || port == 0)
+    {
+        client_add_reply_str(c, "-ERR Invalid target address\r\n");
+        return;
+    }
+    if (string_to_ll(argv[4].ptr, argv[4].len, &dbid) != 0 || dbid != 0)
+    {
+        client_add_reply_str(c, "-ERR DB index is out of range\r\n");
+        return;
+    }
+    if (string_to_ll(argv[5].ptr, argv[5].len, &timeout) != 0)
+    {
+        client_add_reply_str(c, "-ERR timeout is not an integer or out of range\r\n");
+        return;
+    }
+    if (timeout <= 0)
+        timeout = CLUSTER_MIGRATE_TIMEOUT_MS;
+    memcpy(host, argv[1].ptr, argv[1].len);
+    host[argv[1].len] = '\0';
+
+    // The keys that exist, serialized with their remaining TTL
+    const resp_arg_t **keys = (const resp_arg_t **)arena_alloc(&c->arena, (size_t)nargs * sizeof(resp_arg_t *));
+    char (*lines)[CLUSTER_LINE_MAX] = (char (*)[CLUSTER_LINE_MAX])arena_alloc(&c->arena, (size_t)nargs * CLUSTER_LINE_MAX);
+    if (keys == NULL || lines == NULL)
+    {
+        client_add_reply_str(c, "-ERR out of memory\r\n");
+        return;
+    }
+    aof_buf_t out = {0};
+    int nkeys = 0, oom = 0;
+    long long now = cached_time_ms();
+    for (int i = 0; i < nargs && !oom; i++)
+    {
+        db_entry *e = db_find(db, &argv[first + i]);
+        if (e == NULL || db_key_expired(e))
+            continue;
+        size_t len = 0;
+        unsigned char *payload = rdb_dump_value(e, &len);
+        char ttl[LL_STR_SIZE];
+        resp_arg_t asking = {(char *)"ASKING", 6};
+        resp_arg_t restore[5] = {{(char *)"RESTORE", 7},
+                                 argv[first + i],
+                                 _cluster_num_arg(ttl, e->expiry_ms == -1 ? 0 : e->expiry_ms - now > 0 ? e->expiry_ms - now : 1),
+                                 {(char *)payload, len},
+                                 {(char *)"REPLACE", 7}};
+        oom = payload == NULL || _cluster_encode(&out, &asking, 1) != 0 ||
+              _cluster_encode(&out, restore, replace ? 5 : 4) != 0;
+        free(payload);
+        keys[nkeys++] = &argv[first + i];
+    }
+    if (oom || nkeys == 0)
+    {
+        client_add_reply_str(c, oom ? "-ERR out of memory\r\n" : "+NOKEY\r\n");
+        free(out.p);
+        return;
+    }
+
+    // A cached connection may have been dropped by the target: one more try on a new one
+    cluster_migrate_conn_t *mc = &cluster_migrate_conns[db->shard_id];
+    if (mc->open && (mc->port != port || strcmp(mc->host, host) != 0 || now - mc->used_ms > CLUSTER_MIGRATE_IDLE_MS))
+        _cluster_migrate_close(mc);
+    int reused = mc->open, rc = -1;
+    for (int attempt = 0; attempt < 2 && rc != 0; attempt++)
+    {
+        if (!mc->open && _cluster_migrate_connect(mc, host, (int)port, timeout) != 0)
+            break;
+        rc = _cluster_migrate_exchange(mc, &out, nkeys, lines);
+        int timed_out = rc != 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+        if (rc != 0)
+            _cluster_migrate_close(mc);
+        if (timed_out || !reused)
+            break;
+    }
+    free(out.p);
+    if (rc != 0)
+    {
+        char err[96 + REPL_HOST_MAX];
+        int len = snprintf(err, sizeof(err), "-IOERR error or timeout talking to target instance %s:%lld\r\n", host,
+                           port);
+        client_add_reply(c, err, (size_t)len);
+        return;
+    }
+
+    const char *error = NULL;
+    for (int i = 0; i < nkeys; i++)
+    {
+        if (lines[i][0] == '-')
+        {
+            if (error == NULL)
+                error = lines[i] + 1;
+            continue;
+        }
+        db_entry *e = copy ? NULL : db_find(db, keys[i]);
+        if (e)
+            db_delete_propagate(db, e);
+    }
+    if (error)
+    {
+        char err[64 + CLUSTER_LINE_MAX];
+        int len = snprintf(err, sizeof(err), "-ERR Target instance replied with error: %s\r\n", error);
+        client_add_reply(c, err, (size_t)len);
+        return;
+    }
+    client_add_reply_str(c, REDIS_OK);
+}
+
+#endif // CLUSTER_H
@@ -0,0 +1,714 @@
+#ifndef COMMAND_H
+#define COMMAND_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <assert.h>
+#include "parser.h"
+#include "client.h"
+#include "handler.h"
+#include "rdb.h"
+#include "aof.h"
+#include "repl.h"
+#include "cluster.h"
+#include "slowlog.h"
+#include "time_utils.h"
+
+// --- Command Flags ---
+#define CMD_WRITE (1 << 0)    // May modify the keyspace
+#define CMD_READONLY (1 << 1) // Only reads the keyspace
+#define CMD_ADMIN (1 << 2)    // Server introspection, touches no keys
+#define CMD_DENYOOM (1 << 3)  // May add memory: refused over maxmemory
+#define CMD_GLOBAL (1 << 4)   // Server-wide state: always runs on shard 0
+#define CMD_PROPAGATES (1 << 5) // A write that logs its own effects to the AOF (aof_feed())
+#define CMD_SHARD0_CONN (1 << 6) // Runs on shard 0 with the connection itself, which moves there
+
+#define COMMAND_NAME_MAX 32
+#define REDIS_OOM_ERR "-OOM command not allowed when used memory > 'maxmemory'.\r\n"
+#define COMMAND_HASH_SLOTS 256 // Power of two, kept at most half full
+
+// --- Data Structures ---
+
+typedef void (*command_proc)(redis_db_t *db, client_t *c, const resp_arg_t *argv, int argc);
+
+/**
+ * @brief One entry of the command table.
+ *
+ * 'arity' follows the Redis convention: N means exactly N arguments
+ * (including the command name), -N means at least N.
+ * Keys are argv[first_key], argv[first_key + key_step], ... up to
+ * argv[last_key] (-1 = the last argument). first_key == 0 means the
+ * command touches no keys.
+ */
+typedef struct redis_command
+{
+    const char *name;
+    command_proc proc;
+    int arity;
+    int flags;
+    int first_key;
+    int last_key;
+    int key_step;
+
+    // Stats
+    long long calls;
+    long long rejected_calls; // Arity errors
+    long long usec;           // Time spent in 'proc', summed over calls
+} redis_command_t;
+
+static inline void handle_command(redis_db_t *db, client_t *c, const resp_arg_t *argv, int argc);
+static inline void handle_info(redis_db_t *db, client_t *c, const resp_arg_t *argv, int argc);
+static inline void handle_multi(redis_db_t *db, client_t *c, const resp_arg_t *argv, int argc);
+static inline void handle_exec(redis_db_t *db, client_t *c, const resp_arg_t *argv, int argc);
+static inline void handle_discard(redis_db_t *db, client_t *c, const resp_arg_t *argv, int argc);
+
+static redis_command_t command_table[] = {
+    {"ping", handle_ping, -1, CMD_ADMIN, 0, 0, 0, 0, 0, 0},
+    {"echo", handle_echo, 2, CMD_ADMIN, 0, 0, 0, 0, 0, 0},
+    {"command", handle_command, -1, CMD_ADMIN, 0, 0, 0, 0, 0, 0},
+    {"info", handle_info, -1, CMD_ADMIN | CMD_GLOBAL, 0, 0, 0, 0, 0, 0},
+    {"slowlog", handle_slowlog, -2, CMD_ADMIN, 0, 0, 0, 0, 0, 0},
+    {"save", handle_save, 1, CMD_ADMIN | CMD_GLOBAL, 0, 0, 0, 0, 0, 0},
+    {"bgsave", handle_bgsave, 1, CMD_ADMIN | CMD_GLOBAL, 0, 0, 0, 0, 0, 0},
+    {"lastsave", handle_lastsave, 1, CMD_ADMIN | CMD_GLOBAL, 0, 0, 0, 0, 0, 0},
+    {"bgrewriteaof", handle_bgrewriteaof, 1, CMD_ADMIN | CMD_GLOBAL, 0, 0, 0, 0, 0, 0},
+    {"replicaof", handle_replicaof, 3, CMD_ADMIN | CMD_GLOBAL, 0, 0, 0, 0, 0, 0},
+    {"cluster", handle_cluster, -2, CMD_ADMIN | CMD_GLOBAL, 0, 0, 0, 0, 0, 0},
+    {"asking", handle_asking, 1, CMD_ADMIN, 0, 0, 0, 0, 0, 0},
+    {"psync", handle_psync, 3, CMD_ADMIN | CMD_SHARD0_CONN, 0, 0, 0, 0, 0, 0},
+    {"replconf", handle_replconf, -3, CMD_ADMIN | CMD_SHARD0_CONN, 0, 0, 0, 0, 0, 0},
+    {"multi", handle_multi, 1, CMD_ADMIN, 0, 0, 0, 0, 0, 0},
+    {"exec", handle_exec, 1, CMD_ADMIN, 0, 0, 0, 0, 0, 0},
+    {"discard", handle_discard, 1, CMD_ADMIN, 0, 0, 0, 0, 0, 0},
+    {"set", handle_set, -3, CMD_WRITE | CMD_DENYOOM | CMD_PROPAGATES, 1, 1, 1, 0, 0, 0},
+    {"get", handle_get, 2, CMD_READONLY, 1, 1, 1, 0, 0, 0},
+    {"mset", handle_mset, -3, CMD_WRITE | CMD_DENYOOM, 1, -1, 2, 0, 0, 0},
+    {"msetnx", handle_msetnx, -3, CMD_WRITE | CMD_DENYOOM | CMD_PROPAGATES, 1, -1, 2, 0, 0, 0},
+    {"mget", handle_mget, -2, CMD_READONLY, 1, -1, 1, 0, 0, 0},
+    {"del", handle_del, -2, CMD_WRITE, 1, -1, 1, 0, 0, 0},
+    {"unlink", handle_unlink, -2, CMD_WRITE, 1, -1, 1, 0, 0, 0},
+    {"dump", handle_dump, 2, CMD_READONLY, 1, 1, 1, 0, 0, 0},
+    {"restore", handle_restore, -4, CMD_WRITE | CMD_DENYOOM | CMD_PROPAGATES, 1, 1, 1, 0, 0, 0},
+    {"migrate", handle_migrate, -6, CMD_WRITE | CMD_PROPAGATES, 3, 3, 1, 0, 0, 0},
+    {"scan", handle_scan, -2, CMD_READONLY, 0, 0, 0, 0, 0, 0},
+    {"lpush", handle_lpush, -3, CMD_WRITE | CMD_DENYOOM | CMD_PROPAGATES, 1, 1, 1, 0, 0, 0},
+    {"rpush", handle_rpush, -3, CMD_WRITE | CMD_DENYOOM | CMD_PROPAGATES, 1, 1, 1, 0, 0, 0},
+    {"lpop", handle_lpop, -2, CMD_WRITE, 1, 1, 1, 0, 0, 0},
+    {"rpop", handle_rpop, -2, CMD_WRITE, 1, 1, 1, 0, 0, 0},
+    {"blpop", handle_blpop, -3, CMD_WRITE | CMD_PROPAGATES, 1, -2, 1, 0, 0, 0},
+    {"brpop", handle_brpop, -3, CMD_WRITE | CMD_PROPAGATES, 1, -2, 1, 0, 0, 0},
+    {"llen", handle_llen, 2, CMD_READONLY, 1, 1, 1, 0, 0, 0},
+    {"lindex", handle_lindex, 3, CMD_READONLY, 1, 1, 1, 0, 0, 0},
+    {"lrange", handle_lrange, 4, CMD_READONLY, 1, 1, 1, 0, 0, 0},
+    {"zadd", handle_zadd, -4, CMD_WRITE | CMD_DENYOOM | CMD_PROPAGATES, 1, 1, 1, 0, 0, 0},
+    {"zrange", handle_zrange, -4, CMD_READONLY, 1, 1, 1, 0, 0, 0},
+    {"zrevrange", handle_zrevrange, -4, CMD_READONLY, 1, 1, 1, 0, 0, 0},
+    {"zrangebyscore", handle_zrangebyscore, -4, CMD_READONLY, 1, 1, 1, 0, 0, 0},
+    {"zrank", handle_zrank, 3, CMD_READONLY, 1, 1, 1, 0, 0, 0},
+    {"zscore", handle_zscore, 3, CMD_READONLY, 1, 1, 1, 0, 0, 0},
+};
+
+#define COMMAND_COUNT ((int)(sizeof(command_table) / sizeof(command_table[0])))
+
+// Open-addressing index over command_table, filled by command_table_init()
+static redis_command_t *command_slots[COMMAND_HASH_SLOTS];
+
+// Time of every command_call() of this thread, summed: what a command's
+// handler spent in nested ones (EXEC's queue) is the growth over its call
+static _Thread_local long long command_nested_us = 0;
+
+// --- Lookup ---
+
+/**
+ * @brief Case-insensitive FNV-1a, so "GET", "get" and "Get" hash alike
+ * without lowercasing the argument in place.
+ */
+static inline uint32_t _command_hash(const char *name, size_t len)
+{
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++)
+    {
+        h ^= (uint32_t)(unsigned char)tolower((unsigned char)name[i]);
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static inline void command_table_init(void)
+{
+    static_assert(COMMAND_COUNT * 2 <= COMMAND_HASH_SLOTS, "command hash too full");
+    for (int i = 0; i < COMMAND_COUNT; i++)
+    {
+        redis_command_t *cmd = &command_table[i];
+        uint32_t slot = _command_hash(cmd->name, strlen(cmd->name)) & (COMMAND_HASH_SLOTS - 1);
+        while (command_slots[slot])
+            slot = (slot + 1) & (COMMAND_HASH_SLOTS - 1);
+        command_slots[slot] = cmd;
+    }
+}
+
+/**
+ * @return The command named by 'name', or NULL if there is none.
+ */
+static inline redis_command_t *command_lookup(const resp_arg_t *name)
+{
+    if (name->len == 0 || name->len > COMMAND_NAME_MAX)
+        return NULL;
+    uint32_t slot = _command_hash(name->ptr, name->len) & (COMMAND_HASH_SLOTS - 1);
+    redis_command_t *cmd;
+    while ((cmd = command_slots[slot]) != NULL)
+    {
+        if (resp_arg_eq_nocase(name, cmd->name))
+            return cmd;
+        slot = (slot + 1) & (COMMAND_HASH_SLOTS - 1);
+    }
+    return NULL;
+}
+
+static inline int command_arity_ok(const redis_command_t *cmd, int argc)
+{
+    return cmd->arity > 0 ? argc == cmd->arity : argc >= -cmd->arity;
+}
+
+/**
+ * @return Number of key arguments; key i is argv[first_key + i * key_step].
+ * argc must already satisfy the command's arity.
+ */
+static inline int command_key_count(const redis_command_t *cmd, int argc)
+{
+    if (cmd->first_key == 0)
+        return 0;
+    int last = cmd->last_key < 0 ? argc + cmd->last_key : cmd->last_key;
+    if (last >= argc)
+        last = argc - 1;
+    return last < cmd->first_key ? 0 : (last - cmd->first_key) / cmd->key_step + 1;
+}
+
+/**
+ * @return Number of key arguments, key i being argv[*first + i * key_step].
+ * Unlike command_key_count(), it finds the keys MIGRATE lists after KEYS
+ * when its key argument is empty. argc must satisfy the arity.
+ */
+static inline int command_keys(const redis_command_t *cmd, const resp_arg_t *argv, int argc, int *first)
+{
+    *first = cmd->first_key;
+    if (cmd->proc == handle_migrate && argv[3].len == 0)
+    {
+        for (int i = 6; i < argc; i++)
+        {
+            if (resp_arg_eq_nocase(&argv[i], "keys"))
+            {
+                *first = i + 1;
+                return argc - *first;
+            }
+        }
+        return 0;
+    }
+    return command_key_count(cmd, argc);
+}
+
+// --- Dispatch ---
+
+/**
+ * @brief Validates the arity of 'cmd' and runs it.
+ * Unknown commands (cmd == NULL) and arity errors are answered here, so
+ * handlers can index argv freely up to the declared arity. Stats are
+ * bumped atomically because every shard calls into the same table.
+ * Writes are logged to the AOF as received, unless CMD_PROPAGATES.
+ * The time spent in the handler is added to the command's stats, and a
+ * slow command is logged to the slowlog. In cluster mode a command on
+ * keys of another node's slot is redirected instead of run.
+ */
+static inline void command_call(redis_command_t *cmd, redis_db_t *db, client_t *c, const resp_arg_t *argv, int argc)
+{
+    char err[128];
+
+    if (cmd == NULL)
+    {
+        int n = snprintf(err, sizeof(err), "-ERR unknown command '%.*s'\r\n",
+                         (int)(argv[0].len > COMMAND_NAME_MAX ? COMMAND_NAME_MAX : argv[0].len), argv[0].ptr);
+        client_add_reply(c, err, n);
+        return;
+    }
+    if (!command_arity_ok(cmd, argc))
+    {
+        __atomic_fetch_add(&cmd->rejected_calls, 1, __ATOMIC_RELAXED);
+        int n = snprintf(err, sizeof(err), "-ERR wrong number of arguments for '%s' command\r\n", cmd->name);
+        client_add_reply(c, err, n);
+        return;
+    }
+
+    // ASKING covers the one command after it
+    int asking = c->flags & CLIENT_ASKING;
+    c->flags &= ~CLIENT_ASKING;
+    if (server.config.cluster_enabled && !db_replaying)
+    {
+        int first;
+        int nkeys = command_keys(cmd, argv, argc, &first);
+        if (nkeys > 0 && cluster_redirect(db, c, &argv[first], nkeys, cmd->key_step, asking,
+                                          cmd->proc != handle_migrate) != 0)
+            return;
+    }
+
+    if ((cmd->flags & CMD_DENYOOM) && db_evict_to_limit(db) != 0)
+    {
+        client_add_reply_str(c, REDIS_OOM_ERR);
+        return;
+    }
+
+    // vDSO clock reads: timing a command costs no syscall
+    long long nested = command_nested_us;
+    long long start = monotonic_us();
+    cmd->proc(db, c, argv, argc);
+    long long duration = monotonic_us() - start;
+    // EXEC's own time leaves out its queued commands, already counted
+    __atomic_fetch_add(&cmd->usec, duration - (command_nested_us - nested), __ATOMIC_RELAXED);
+    command_nested_us = nested + duration;
+    slowlog_maybe_add(argv, argc, duration);
+    arena_reset(&c->arena);
+    if ((cmd->flags & (CMD_WRITE | CMD_PROPAGATES)) == CMD_WRITE)
+        aof_feed(db, argv, argc);
+    if (cmd->flags & CMD_WRITE)
+        atomic_store_explicit(&db->dirty, atomic_load_explicit(&db->dirty, memory_order_relaxed) + 1,
+                              memory_order_relaxed);
+    __atomic_fetch_add(&cmd->calls, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Looks up argv[0] and runs it; see command_call().
+ */
+static inline void command_dispatch(redis_db_t *db, client_t *c, const resp_arg_t *argv, int argc)
+{
+    command_call(command_lookup(&argv[0]), db, c, argv, argc);
+}
+
+// --- Transactions ---
+// Between MULTI and EXEC the event loop queues commands instead of running
+// them (main.c). EXEC then runs the whole queue on the shard that owns its
+// keys, with nothing interleaved, and answers with one array.
+
+/**
+ * @brief Runs 'count' queued commands, the RESP bytes in buf[0..len), and
+ * adds one array holding their replies. Each goes through command_call(),
+ * so it is checked, logged to the AOF and counted like any other; what
+ * they log is wrapped in MULTI ... EXEC.
+ */
+static inline void multi_exec_queued(redis_db_t *db, client_t *c, char *buf, size_t len, int count)
+{
+    resp_parser_t p;
+    resp_parser_init(&p);
+    client_add_reply_array_len(c, count);
+    c->flags |= CLIENT_IN_EXEC;
+    aof_multi_begin(db);
+    for (int i = 0; i < count; i++)
+    {
+        if (resp_parse_command(&p, buf, len) != RESP_PARSE_OK)
+        {
+            client_add_reply_str(c, "-ERR out of memory\r\n"); // Queued bytes were well formed
+            continue;
+        }
+        resp_arg_t *argv = resp_parser_argv(&p, buf);
+        command_call(command_lookup(&argv[0]), db, c, argv, p.argc);
+    }
+    aof_multi_end(db);
+    c->flags &= ~CLIENT_IN_EXEC;
+    resp_parser_free(&p);
+}
+
+/**
+ * MULTI
+ */
+static inline void handle_multi(redis_db_t *db, client_t *c, const resp_arg_t *argv, int argc)
+{
+    (void)db;
+    (void)argv;
+    (void)argc;
+    if (c->flags & CLIENT_MULTI)
+    {
+        client_add_reply_str(c, "-ERR MULTI calls can not be nested\r\n");
+        return;
+    }
+    c->flags |= CLIENT_MULTI;
+    client_add_reply_str(c, REDIS_OK);
+}
+
+/**
+ * EXEC
+ * Runs the queue here; the event loop has already sent a queue whose keys
+ * live on another shard there. A queue with a refused command is dropped.
+ */
+static inline void handle_exec(redis_db_t *db, client_t *c, const resp_arg_t *argv, int argc)
+{
+    (void)argv;
+    (void)argc;
+    if (!(c->flags & CLIENT_MULTI))
+    {
+        client_add_reply_str(c, "-ERR EXEC without MULTI\r\n");
+        return;
+    }
+    if (c->flags & CLIENT_DIRTY_EXEC)
+    {
+        client_multi_reset(c);
+        client_add_reply_str(c, "-EXECABORT Transaction discarded because of previous errors.\r\n");
+        return;
+    }
+
+    // Out of MULTI before the first queued command runs
+    char *buf = c->multi_buf;
+    size_t len = c->multi_len;
+    int count = c->multi_count;
+    c->multi_buf = NULL;
+    client_multi_reset(c);
+
+    multi_exec_queued(db, c, buf, len, count);
+    free(buf);
+}
+
+/**
+ * DISCARD
+ */
+static inline void handle_discard(redis_db_t *db, client_t *c, const resp_arg_t *argv, int argc)
+{
+    (void)db;
+    (void)argv;
+    (void)argc;
+    if (!(c->flags & CLIENT_MULTI))
+    {
+        client_add_reply_str(c, "-ERR DISCARD without MULTI\r\n");
+        return;
+    }
+    client_multi_reset(c);
+    client_add_reply_str(c, REDIS_OK);
+}
+
+// --- Introspection ---
+
+static inline void _command_reply_info(client_t *c, const redis_command_t *cmd)
+{
+    client_add_reply_array_len(c, 6);
+    client_add_reply_bulk(c, cmd->name, strlen(cmd->name));
+    client_add_reply_integer(c, cmd->arity);
+
+    int nflags = !!(cmd->flags & CMD_WRITE) + !!(cmd->flags & CMD_READONLY) + !!(cmd->flags & CMD_ADMIN) +
+                 !!(cmd->flags & CMD_DENYOOM) + !!(cmd->flags & CMD_GLOBAL);
+    client_add_reply_array_len(c, nflags);
+    if (cmd->flags & CMD_WRITE)
+        client_add_reply_str(c, "+write\r\n");
+    if (cmd->flags & CMD_READONLY)
+        client_add_reply_str(c, "+readonly\r\n");
+    if (cmd->flags & CMD_ADMIN)
+        client_add_reply_str(c, "+admin\r\n");
+    if (cmd->flags & CMD_DENYOOM)
+        client_add_reply_str(c, "+denyoom\r\n");
+    if (cmd->flags & CMD_GLOBAL)
+        client_add_reply_str(c, "+global\r\n");
+
+    client_add_reply_integer(c, cmd->first_key);
+    client_add_reply_integer(c, cmd->last_key);
+    client_add_reply_integer(c, cmd->key_step);
+}
+
+/**
+ * COMMAND | COMMAND COUNT | COMMAND INFO name [name ...]
+ */
+static inline void handle_command(redis_db_t *db, client_t *c, const resp_arg_t *argv, int argc)
+{
+    (void)db;
+    if (argc == 1)
+    {
+        client_add_reply_array_len(c, COMMAND_COUNT);
+        for (int i = 0; i < COMMAND_COUNT; i++)
+            _command_reply_info(c, &command_table[i]);
+    }
+    else if (resp_arg_eq_nocase(&argv[1], "count") && argc == 2)
+    {
+        client_add_reply_integer(c, COMMAND_COUNT);
+    }
+    else if (resp_arg_eq_nocase(&argv[1], "info"))
+    {
+        client_add_reply_array_len(c, argc - 2);
+        for (int i = 2; i < argc; i++)
+        {
+            redis_command_t *cmd = command_lookup(&argv[i]);
+            if (cmd)
+                _command_reply_info(c, cmd);
+            else
+                client_add_reply_str(c, "*-1\r\n");
+        }
+    }
+    else
+    {
+        client_add_reply_str(c, REDIS_SYNTAX_ERR);
+    }
+}
+
+// --- INFO ---
+
+#define INFO_BUF_SIZE 16384
+#define OPS_SAMPLES 16      // instantaneous_ops_per_sec averages this many samples...
+#define OPS_SAMPLE_MS 100   // ...taken at least this far apart
+
+// Shard 0 only: recent command rates (command_stats_cron())
+static struct
+{
+    long long last_ms;
+    long long last_calls;
+    long long samples[OPS_SAMPLES];
+    int next;
+} ops_sampler;
+
+/**
+ * @return Commands run since startup, over every shard.
+ */
+static inline long long command_total_calls(void)
+{
+    long long total = 0;
+    for (int i = 0; i < COMMAND_COUNT; i++)
+        total += __atomic_load_n(&command_table[i].calls, __ATOMIC_RELAXED);
+    return total;
+}
+
+/**
+ * @brief Shard 0, once per loop iteration: samples the command rate.
+ */
+static inline void command_stats_cron(void)
+{
+    long long now = cached_time_ms();
+    if (now - ops_sampler.last_ms < OPS_SAMPLE_MS)
+        return;
+    long long calls = command_total_calls();
+    if (ops_sampler.last_ms != 0)
+    {
+        ops_sampler.samples[ops_sampler.next] = (calls - ops_sampler.last_calls) * 1000 / (now - ops_sampler.last_ms);
+        ops_sampler.next = (ops_sampler.next + 1) % OPS_SAMPLES;
+    }
+    ops_sampler.last_ms = now;
+    ops_sampler.last_calls = calls;
+}
+
+/**
+ * @return What snprintf() returned, clamped to what fits in 'cap'.
+ */
+static inline size_t _info_len(int n, size_t cap)
+{
+    return n < 0 ? 0 : ((size_t)n < cap ? (size_t)n : cap - 1);
+}
+
+/**
+ * @return Resident set size in bytes, or 0 if /proc is unavailable.
+ */
+static inline size_t _info_rss_bytes(void)
+{
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (f == NULL)
+        return 0;
+    unsigned long long size, resident;
+    int n = fscanf(f, "%llu %llu", &size, &resident);
+    fclose(f);
+    return n == 2 ? (size_t)(resident * (unsigned long long)sysconf(_SC_PAGESIZE)) : 0;
+}
+
+static inline size_t _info_server(char *buf, size_t cap)
+{
+    int n = snprintf(buf, cap,
+                     "# Server\r\n"
+                     "redis_mode:%s\r\n"
+                     "process_id:%d\r\n"
+                     "tcp_port:%d\r\n"
+                     "shards:%d\r\n"
+                     "io_threads:%d\r\n"
+                     "multiplexing_api:%s\r\n"
+                     "uptime_in_seconds:%lld\r\n",
+                     server.config.cluster_enabled ? "cluster" : "standalone", (int)getpid(), server.config.port,
+                     server.nshards, server.config.io_threads, event_backend_names[server.config.event_loop],
+                     (cached_time_ms() - server.start_time_ms) / 1000);
+    return _info_len(n, cap);
+}
+
+static inline size_t _info_clients(char *buf, size_t cap)
+{
+    int n = snprintf(buf, cap,
+                     "# Clients\r\n"
+                     "connected_clients:%lld\r\n",
+                     atomic_load_explicit(&server.stat_clients, memory_order_relaxed));
+    return _info_len(n, cap);
+}
+
+/**
+ * @brief Appends the memory section. The slab counters cover every shard;
+ * used_memory is what maxmemory is checked against.
+ * @return Bytes written.
+ */
+static inline size_t _info_memory(char *buf, size_t cap)
+{
+    slab_totals_t t;
+    slab_stats_total(&t);
+    long long pending = 0, freed = 0;
+    for (int i = 0; i < server.nshards; i++)
+    {
+        pending += atomic_load_explicit(&server.shards[i].stats.lazyfree_pending, memory_order_relaxed);
+        freed += atomic_load_explicit(&server.shards[i].stats.lazyfreed, memory_order_relaxed);
+    }
+    double frag = t.requested ? (double)t.reserved / (double)t.requested : 0;
+    int n = snprintf(buf, cap,
+                     "# Memory\r\n"
+                     "used_memory:%zu\r\n"
+                     "used_memory_rss:%zu\r\n"
+                     "maxmemory:%zu\r\n"
+                     "maxmemory_policy:%s\r\n"
+                     "evicted_keys:%lld\r\n"
+                     "lazyfree:%s\r\n"
+                     "lazyfree_pending_objects:%lld\r\n"
+                     "lazyfreed_objects:%lld\r\n"
+                     "slab_reserved_bytes:%zu\r\n"
+                     "slab_used_bytes:%zu\r\n"
+                     "slab_requested_bytes:%zu\r\n"
+                     "slab_objects:%zu\r\n"
+                     "slab_pages:%zu\r\n"
+                     "slab_fragmentation_ratio:%.2f\r\n",
+                     t.used + t.heap, _info_rss_bytes(), maxmemory, maxmemory_policy_names[maxmemory_policy],
+                     atomic_load_explicit(&evicted_keys, memory_order_relaxed), lazyfree_enabled ? "yes" : "no", pending, freed,
+                     t.reserved, t.used, t.requested, t.objects, t.pages, frag);
+    return _info_len(n, cap);
+}
+
+/**
+ * @brief Appends the stats section. Event loop times are per iteration,
+ * from its wakeup to its next event_wait(), over every shard.
+ */
+static inline size_t _info_stats(char *buf, size_t cap)
+{
+    long long cycles = 0, busy = 0, max = 0, ops = 0;
+    for (int i = 0; i < server.nshards; i++)
+    {
+        shard_stats_t *st = &server.shards[i].stats;
+        cycles += atomic_load_explicit(&st->loop_cycles, memory_order_relaxed);
+        busy += atomic_load_explicit(&st->loop_busy_us, memory_order_relaxed);
+        long long m = atomic_load_explicit(&st->loop_max_us, memory_order_relaxed);
+        if (m > max)
+            max = m;
+    }
+    for (int i = 0; i < OPS_SAMPLES; i++)
+        ops += ops_sampler.samples[i];
+
+    int n = snprintf(buf, cap,
+                     "# Stats\r\n"
+                     "total_connections_received:%lld\r\n"
+                     "total_commands_processed:%lld\r\n"
+                     "instantaneous_ops_per_sec:%lld\r\n"
+                     "eventloop_cycles:%lld\r\n"
+                     "eventloop_duration_sum_us:%lld\r\n"
+                     "eventloop_duration_avg_us:%lld\r\n"
+                     "eventloop_duration_max_us:%lld\r\n"
+                     "slowlog_len:%zu\r\n",
+                     atomic_load_explicit(&server.stat_connections, memory_order_relaxed), command_total_calls(),
+                     ops / OPS_SAMPLES, cycles, busy, cycles ? busy / cycles : 0, max, slowlog_len());
+    return _info_len(n, cap);
+}
+
+static inline size_t _info_persistence(char *buf, size_t cap)
+{
+    size_t len = rdb_info(buf, cap);
+    return len + aof_info(buf + len, cap - len);
+}
+
+/**
+ * @brief Appends the keyspace section. 'expires' is the size of the
+ * expiry heaps: entries are indexed, so there is exactly one per key with
+ * a TTL and never a stale one.
+ */
+static inline size_t _info_keyspace(char *buf, size_t cap)
+{
+    long long keys = 0, expires = 0;
+    for (int i = 0; i < server.nshards; i++)
+    {
+        keys += atomic_load_explicit(&server.shards[i].stats.keys, memory_order_relaxed);
+        expires += atomic_load_explicit(&server.shards[i].stats.expires, memory_order_relaxed);
+    }
+    int n = keys ? snprintf(buf, cap, "# Keyspace\r\ndb0:keys=%lld,expires=%lld\r\n", keys, expires)
+                 : snprintf(buf, cap, "# Keyspace\r\n");
+    return _info_len(n, cap);
+}
+
+/**
+ * @brief Appends a line per command that has been called.
+ */
+static inline size_t _info_commandstats(char *buf, size_t cap)
+{
+    size_t len = _info_len(snprintf(buf, cap, "# Commandstats\r\n"), cap);
+    for (int i = 0; i < COMMAND_COUNT; i++)
+    {
+        redis_command_t *cmd = &command_table[i];
+        long long calls = __atomic_load_n(&cmd->calls, __ATOMIC_RELAXED);
+        long long rejected = __atomic_load_n(&cmd->rejected_calls, __ATOMIC_RELAXED);
+        if (calls == 0 && rejected == 0)
+            continue;
+        long long usec = __atomic_load_n(&cmd->usec, __ATOMIC_RELAXED);
+        len += _info_len(snprintf(buf + len, cap - len, "cmdstat_%s:calls=%lld,usec=%lld,usec_per_call=%.2f,rejected_calls=%lld\r\n",
+                                  cmd->name, calls, usec, calls ? (double)usec / (double)calls : 0, rejected),
+                         cap - len);
+    }
+    return len;
+}
+
+typedef size_t (*info_section_fn)(char *buf, size_t cap);
+
+static const struct
+{
+    const char *name;
+    info_section_fn fn;
+    int in_default; // Part of a bare INFO
+} info_sections[] = {
+    {"server", _info_server, 1},
+    {"clients", _info_clients, 1},
+    {"memory", _info_memory, 1},
+    {"persistence", _info_persistence, 1},
+    {"stats", _info_stats, 1},
+    {"replication", repl_info, 1},
+    {"cluster", cluster_info, 1},
+    {"keyspace", _info_keyspace, 1},
+    {"commandstats", _info_commandstats, 0},
+};
+
+/**
+ * INFO [section]
+ * Sections: server, clients, memory, persistence, stats, replication,
+ * cluster, keyspace and commandstats. No argument or "default" selects
+ * all but commandstats, "all" and "everything" select them all; an
+ * unknown section gives an empty reply.
+ */
+static inline void handle_info(redis_db_t *db, client_t *c, const resp_arg_t *argv, int argc)
+{
+    (void)db;
+    if (argc > 2)
+    {
+        client_add_reply_str(c, REDIS_SYNTAX_ERR);
+        return;
+    }
+    int all = argc == 2 && (resp_arg_eq_nocase(&argv[1], "all") || resp_arg_eq_nocase(&argv[1], "everything"));
+    int dflt = argc == 1 || resp_arg_eq_nocase(&argv[1], "default");
+
+    char *buf = (char *)arena_alloc(&c->arena, INFO_BUF_SIZE);
+    if (buf == NULL)
+    {
+        client_add_reply_str(c, "-ERR out of memory\r\n");
+        return;
+    }
+    size_t len = 0;
+    for (size_t i = 0; i < sizeof(info_sections) / sizeof(info_sections[0]); i++)
+    {
+        if (!all && !(dflt && info_sections[i].in_default) &&
+            !(argc == 2 && resp_arg_eq_nocase(&argv[1], info_sections[i].name)))
+            continue;
+        if (len > 0)
+            len += _info_len(snprintf(buf + len, INFO_BUF_SIZE - len, "\r\n"), INFO_BUF_SIZE - len); // Sections are separated by a blank line
+        len += info_sections[i].fn(buf + len, INFO_BUF_SIZE - len);
+    }
+    client_add_reply_bulk(c, buf, len);
+}
+
+#endif // COMMAND_H
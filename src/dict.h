@@ -0,0 +1,432 @@
+#ifndef DICT_H
+#define DICT_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include "slab.h" // For slab_note_alloc()
+
+/**
+ * Chained hash table that grows and shrinks without stalling.
+ *
+ * Nodes are intrusive: a dict_node_t lives inside each stored item and
+ * carries the item's full 64-bit hash, so chains are walked comparing
+ * hashes and the key itself is only looked at on a hash match.
+ *
+ * A resize allocates a second table and then moves a few buckets over on
+ * every lookup, insert and delete (and from dict_rehash_us() when the
+ * caller is idle), so no single operation pays for the whole table.
+ * While both tables are live, buckets below 'rehash_idx' in ht[0] have
+ * been moved to ht[1].
+ *
+ * Bucket arrays are accounted to the current slab pool, so a dict must be
+ * resized and released on the thread that owns its pool.
+ */
+
+#define DICT_MIN_SIZE 4             // Smallest table; a power of two
+#define DICT_REHASH_EMPTY_VISITS 10 // Empty buckets skipped per moved bucket
+
+// --- Data Structures ---
+
+typedef struct dict_node {
+    struct dict_node *next;
+    uint64_t hash;
+} dict_node_t;
+
+/**
+ * @return Non-zero if the item holding 'node' has the key 'key'.
+ */
+typedef int (*dict_key_eq_func)(const dict_node_t *node, const void *key, size_t len);
+
+typedef struct {
+    dict_node_t **buckets;
+    size_t size; // Power of two, or 0 when unallocated
+    size_t used;
+} dict_table_t;
+
+typedef struct {
+    dict_table_t ht[2];
+    long long rehash_idx; // -1 when not rehashing
+    dict_key_eq_func key_eq;
+} dict_t;
+
+/**
+ * @brief Called by dict_scan() for every node visited.
+ */
+typedef void (*dict_scan_func)(void *privdata, dict_node_t *node);
+
+// --- Hashing ---
+
+static uint64_t dict_hash_seed = 0x9e3779b97f4a7c15ULL; // Randomized at startup
+
+/**
+ * @brief MurmurHash64A of 'len' bytes, keyed by dict_hash_seed.
+ */
+static inline uint64_t dict_hash(const void *key, size_t len) {
+    const uint64_t m = 0xc6a4a7935bd1e995ULL;
+    const int r = 47;
+    uint64_t h = dict_hash_seed ^ (len * m);
+    const unsigned char *p = (const unsigned char *)key;
+    const unsigned char *end = p + (len & ~(size_t)7);
+
+    for (; p != end; p += 8) {
+        uint64_t k;
+        memcpy(&k, p, sizeof(k));
+        k *= m;
+        k ^= k >> r;
+        k *= m;
+        h ^= k;
+        h *= m;
+    }
+
+    switch (len & 7) {
+    case 7: h ^= (uint64_t)p[6] << 48; // fallthrough
+    case 6: h ^= (uint64_t)p[5] << 40; // fallthrough
+    case 5: h ^= (uint64_t)p[4] << 32; // fallthrough
+    case 4: h ^= (uint64_t)p[3] << 24; // fallthrough
+    case 3: h ^= (uint64_t)p[2] << 16; // fallthrough
+    case 2: h ^= (uint64_t)p[1] << 8;  // fallthrough
+    case 1: h ^= (uint64_t)p[0];
+            h *= m;
+    }
+
+    h ^= h >> r;
+    h *= m;
+    h ^= h >> r;
+    return h;
+}
+
+// --- Internal ---
+
+static inline dict_node_t **_dict_buckets_new(size_t size) {
+    dict_node_t **buckets = (dict_node_t **)calloc(size, sizeof(dict_node_t *));
+    if (buckets) slab_note_alloc(size * sizeof(dict_node_t *));
+    return buckets;
+}
+
+static inline void _dict_buckets_free(dict_table_t *ht) {
+    if (ht->buckets == NULL) return;
+    slab_note_free(ht->size * sizeof(dict_node_t *));
+    free(ht->buckets);
+}
+
+static inline int dict_is_rehashing(const dict_t *d) {
+    return d->rehash_idx != -1;
+}
+
+/**
+ * @brief (Internal) Moves up to 'n' non-empty buckets from ht[0] to ht[1],
+ * visiting at most n * DICT_REHASH_EMPTY_VISITS empty ones.
+ * @return 1 if there is more to move, 0 once the rehash is complete.
+ */
+static inline int _dict_rehash(dict_t *d, int n) {
+    if (!dict_is_rehashing(d)) return 0;
+    dict_table_t *from = &d->ht[0], *to = &d->ht[1];
+    int empty_visits = n * DICT_REHASH_EMPTY_VISITS;
+
+    while (n-- > 0 && from->used > 0) {
+        while (from->buckets[d->rehash_idx] == NULL) {
+            d->rehash_idx++;
+            if (--empty_visits == 0) return 1;
+        }
+        dict_node_t *node = from->buckets[d->rehash_idx];
+        while (node) {
+            dict_node_t *next = node->next;
+            size_t idx = node->hash & (to->size - 1);
+            node->next = to->buckets[idx];
+            to->buckets[idx] = node;
+            from->used--;
+            to->used++;
+            node = next;
+        }
+        from->buckets[d->rehash_idx++] = NULL;
+    }
+
+    if (from->used > 0) return 1;
+
+    // Done: the new table becomes ht[0]
+    _dict_buckets_free(from);
+    *from = *to;
+    memset(to, 0, sizeof(*to));
+    d->rehash_idx = -1;
+    return 0;
+}
+
+/**
+ * @brief (Internal) Starts moving to a table of at least 'min_size' slots.
+ * Out of memory just means no resize: chains get longer, nothing fails.
+ */
+static inline void _dict_resize(dict_t *d, size_t min_size) {
+    if (dict_is_rehashing(d)) return;
+    size_t size = DICT_MIN_SIZE;
+    while (size < min_size) size <<= 1;
+    if (size == d->ht[0].size) return;
+
+    dict_node_t **buckets = _dict_buckets_new(size);
+    if (buckets == NULL) return;
+
+    if (d->ht[0].buckets == NULL) {
+        // First allocation: nothing to move
+        d->ht[0].buckets = buckets;
+        d->ht[0].size = size;
+        return;
+    }
+    d->ht[1].buckets = buckets;
+    d->ht[1].size = size;
+    d->ht[1].used = 0;
+    d->rehash_idx = 0;
+}
+
+/**
+ * @brief (Internal) Which table holds (or would hold) 'hash': ht[1] for
+ * buckets the rehash has already moved, ht[0] otherwise.
+ */
+static inline dict_table_t *_dict_table_for(dict_t *d, uint64_t hash) {
+    size_t idx = hash & (d->ht[0].size - 1);
+    if (dict_is_rehashing(d) && (long long)idx < d->rehash_idx) return &d->ht[1];
+    return &d->ht[0];
+}
+
+// --- Public API ---
+
+static inline void dict_init(dict_t *d, dict_key_eq_func key_eq) {
+    memset(d->ht, 0, sizeof(d->ht));
+    d->rehash_idx = -1;
+    d->key_eq = key_eq;
+}
+
+/**
+ * @brief Empties the dict and frees its bucket arrays, handing every node
+ * to 'free_node' first (if not NULL): the nodes belong to the caller.
+ */
+static inline void dict_release(dict_t *d, void (*free_node)(dict_node_t *node)) {
+    for (int t = 0; t <= 1 && free_node; t++) {
+        for (size_t i = 0; i < d->ht[t].size; i++) {
+            dict_node_t *n = d->ht[t].buckets[i];
+            while (n) {
+                dict_node_t *next = n->next;
+                free_node(n);
+                n = next;
+            }
+        }
+    }
+    _dict_buckets_free(&d->ht[0]);
+    _dict_buckets_free(&d->ht[1]);
+    dict_init(d, d->key_eq);
+}
+
+static inline size_t dict_size(const dict_t *d) {
+    return d->ht[0].used + d->ht[1].used;
+}
+
+/**
+ * @brief Sizes an empty dict for 'n' keys up front, so filling it never
+ * rehashes. A dict that already holds keys is left alone.
+ */
+static inline void dict_reserve(dict_t *d, size_t n) {
+    if (dict_size(d) > 0 || dict_is_rehashing(d) || n <= d->ht[0].size) return;
+    _dict_buckets_free(&d->ht[0]);
+    memset(&d->ht[0], 0, sizeof(d->ht[0]));
+    _dict_resize(d, n);
+}
+
+/**
+ * @brief dict_find() for a key already hashed with dict_hash(). Takes no
+ * rehash step, so a batch of lookups sees one stable table layout.
+ * @return The node for 'key', or NULL.
+ */
+static inline dict_node_t *dict_find_hash(dict_t *d, uint64_t hash, const void *key, size_t len) {
+    if (dict_size(d) == 0) return NULL;
+    dict_table_t *ht = _dict_table_for(d, hash);
+    for (dict_node_t *n = ht->buckets[hash & (ht->size - 1)]; n; n = n->next) {
+        if (n->hash == hash && d->key_eq(n, key, len)) return n;
+    }
+    return NULL;
+}
+
+/**
+ * @return The node for 'key', or NULL.
+ */
+static inline dict_node_t *dict_find(dict_t *d, const void *key, size_t len) {
+    if (dict_size(d) == 0) return NULL;
+    _dict_rehash(d, 1);
+    return dict_find_hash(d, dict_hash(key, len), key, len);
+}
+
+/**
+ * @brief The incremental rehash step every lookup takes, for callers
+ * probing with dict_find_hash().
+ */
+static inline void dict_rehash_step(dict_t *d) {
+    if (dict_size(d) > 0) _dict_rehash(d, 1);
+}
+
+/**
+ * @brief Starts loading the bucket slot 'hash' maps to, so a batch of
+ * lookups can overlap their cache misses (see dict_prefetch_chain()).
+ */
+static inline void dict_prefetch_bucket(dict_t *d, uint64_t hash) {
+    if (dict_size(d) == 0) return;
+    dict_table_t *ht = _dict_table_for(d, hash);
+    __builtin_prefetch(&ht->buckets[hash & (ht->size - 1)]);
+}
+
+/**
+ * @brief Starts loading the first node chained at 'hash'. Call it once the
+ * bucket slot itself has had time to arrive.
+ */
+static inline void dict_prefetch_chain(dict_t *d, uint64_t hash) {
+    if (dict_size(d) == 0) return;
+    dict_table_t *ht = _dict_table_for(d, hash);
+    dict_node_t *n = ht->buckets[hash & (ht->size - 1)];
+    if (n) __builtin_prefetch(n);
+}
+
+/**
+ * @brief Links 'node' under 'key', which must not be present yet.
+ * A table that can't grow just gets longer chains, so only a dict with no
+ * bucket array at all can fail; one that holds or held a node never does.
+ * @return 0 on success, -1 if the first bucket array can't be allocated.
+ */
+static inline int dict_add(dict_t *d, dict_node_t *node, const void *key, size_t len) {
+    _dict_rehash(d, 1);
+    if (d->ht[0].buckets == NULL) {
+        _dict_resize(d, DICT_MIN_SIZE);
+        if (d->ht[0].buckets == NULL) return -1;
+    } else if (d->ht[0].used >= d->ht[0].size) {
+        _dict_resize(d, d->ht[0].used * 2); // Load factor 1
+    }
+
+    node->hash = dict_hash(key, len);
+    dict_table_t *ht = _dict_table_for(d, node->hash);
+    dict_node_t **bucket = &ht->buckets[node->hash & (ht->size - 1)];
+    node->next = *bucket;
+    *bucket = node;
+    ht->used++;
+    return 0;
+}
+
+/**
+ * @brief Unlinks 'node', which must be in 'd'.
+ */
+static inline void dict_delete(dict_t *d, dict_node_t *node) {
+    _dict_rehash(d, 1);
+    for (int t = 0; t <= 1; t++) {
+        dict_table_t *ht = &d->ht[t];
+        if (ht->size == 0) continue;
+        dict_node_t **pp = &ht->buckets[node->hash & (ht->size - 1)];
+        while (*pp && *pp != node) pp = &(*pp)->next;
+        if (*pp) {
+            *pp = node->next;
+            ht->used--;
+            break;
+        }
+    }
+
+    // Give memory back once the table is at most 1/8 full
+    if (!dict_is_rehashing(d) && d->ht[0].size > DICT_MIN_SIZE && d->ht[0].used * 8 < d->ht[0].size)
+        _dict_resize(d, d->ht[0].used);
+}
+
+/**
+ * @brief Rehashes in batches of 100 buckets for about 'us' microseconds.
+ * For idle ticks, so a resize finishes even without traffic.
+ * @return 1 if the rehash is still incomplete.
+ */
+static inline int dict_rehash_us(dict_t *d, long long us, long long (*now_us)(void)) {
+    long long start = now_us();
+    while (_dict_rehash(d, 100)) {
+        if (now_us() - start > us) return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Collects up to 'count' nodes from consecutive buckets, starting
+ * at the bucket picked by 'rnd' and giving up after count * 10 buckets.
+ * Much cheaper than 'count' independent random picks, at the price of a
+ * less uniform sample: good enough for choosing eviction candidates.
+ * @return Nodes stored in 'out'.
+ */
+static inline size_t dict_sample(dict_t *d, uint64_t rnd, dict_node_t **out, size_t count) {
+    if (dict_size(d) == 0) return 0;
+    _dict_rehash(d, 1);
+
+    int tables = dict_is_rehashing(d) ? 2 : 1;
+    size_t mask = d->ht[0].size - 1;
+    if (tables == 2 && d->ht[1].size - 1 > mask) mask = d->ht[1].size - 1;
+    size_t i = rnd & mask, stored = 0;
+    for (size_t steps = count * 10; stored < count && steps > 0; steps--) {
+        for (int t = 0; t < tables; t++) {
+            dict_table_t *ht = &d->ht[t];
+            if (i >= ht->size) continue;
+            if (t == 0 && tables == 2 && (long long)i < d->rehash_idx) continue; // Moved to ht[1]
+            for (dict_node_t *n = ht->buckets[i]; n && stored < count; n = n->next) out[stored++] = n;
+        }
+        i = (i + 1) & mask;
+    }
+    return stored;
+}
+
+/**
+ * @brief Reverses the bits of a cursor, so it can be incremented from
+ * its high end.
+ */
+static inline uint64_t _dict_rev(uint64_t v) {
+    uint64_t r = 0;
+    for (int i = 0; i < 64; i++) {
+        r = (r << 1) | (v & 1);
+        v >>= 1;
+    }
+    return r;
+}
+
+static inline void _dict_scan_bucket(dict_node_t *n, dict_scan_func fn, void *privdata) {
+    while (n) {
+        dict_node_t *next = n->next;
+        fn(privdata, n);
+        n = next;
+    }
+}
+
+/**
+ * @brief Visits one bucket (and, mid-rehash, the buckets of the larger
+ * table that it expands into) and returns the next cursor; 0 when done.
+ *
+ * The cursor is incremented in reversed bit order, so a bucket of a
+ * smaller table maps onto a contiguous run of cursors in a larger table
+ * and vice versa. Every key present for the whole scan is therefore
+ * reported at least once, across any number of resizes; some may be
+ * reported more than once.
+ */
+static inline uint64_t dict_scan(dict_t *d, uint64_t cursor, dict_scan_func fn, void *privdata) {
+    if (dict_size(d) == 0) return 0;
+
+    if (!dict_is_rehashing(d)) {
+        uint64_t mask = d->ht[0].size - 1;
+        _dict_scan_bucket(d->ht[0].buckets[cursor & mask], fn, privdata);
+        cursor |= ~mask;
+        cursor = _dict_rev(_dict_rev(cursor) + 1);
+        return cursor;
+    }
+
+    dict_table_t *small = &d->ht[0], *large = &d->ht[1];
+    if (small->size > large->size) {
+        dict_table_t *t = small;
+        small = large;
+        large = t;
+    }
+    uint64_t m0 = small->size - 1, m1 = large->size - 1;
+
+    _dict_scan_bucket(small->buckets[cursor & m0], fn, privdata);
+    // Then every large-table bucket that folds into that small bucket
+    do {
+        _dict_scan_bucket(large->buckets[cursor & m1], fn, privdata);
+        cursor |= ~m1;
+        cursor = _dict_rev(_dict_rev(cursor) + 1);
+    } while (cursor & (m0 ^ m1));
+    return cursor;
+}
+
+#endif // DICT_H
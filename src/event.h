@@ -0,0 +1,773 @@
+#ifndef EVENT_H
+#define EVENT_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/utsname.h>
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+#endif
+
+/**
+ * The event loop of a shard, behind one small interface with two
+ * backends:
+ *
+ * - epoll: readiness only. The caller does its own accept(), recv() and
+ *   writev() once told a socket is ready.
+ * - io_uring: a listener gets a multishot accept that hands over every
+ *   new connection, a client socket (EVENT_STREAM) a multishot recv into
+ *   a ring of kernel-provided buffers, so the bytes arrive with the
+ *   event, and replies go out as sendmsg requests, all submitted by the
+ *   one io_uring_enter() that also waits. Other fds (wakeups, cluster
+ *   bus, replication) get a one-shot poll re-armed at every wait, which
+ *   behaves like level-triggered epoll.
+ *
+ * A loop belongs to one thread. io_uring needs Linux 6.0 or newer; on
+ * anything older, or when the ring can't be created, the caller falls
+ * back to epoll.
+ */
+
+#if defined(IORING_RECV_MULTISHOT) && defined(__NR_io_uring_setup)
+#define EVENT_HAVE_IO_URING 1
+#endif
+
+#define EVENT_BATCH_MAX 1024       // Events returned by one event_wait()
+#define EVENT_URING_ENTRIES 1024   // Submission queue size...
+#define EVENT_URING_CQ_ENTRIES 8192 // ...and completion queue size
+#define EVENT_URING_BUFS 256       // Provided receive buffers per loop (a power of two)...
+#define EVENT_URING_BUF_LEN (16 * 1024) // ...and the size of each
+
+// Interest (event_add()/event_mod()) and fired event bits
+#define EVENT_READABLE (1u << 0)
+#define EVENT_WRITABLE (1u << 1)
+#define EVENT_ERROR (1u << 2)    // Fired: hangup or socket error
+#define EVENT_STREAM (1u << 3)   // Interest: deliver received bytes as EVENT_DATA (io_uring)
+#define EVENT_ACCEPTED (1u << 4) // Fired: 'res' is a new connection on a listener
+#define EVENT_DATA (1u << 5)     // Fired: 'res' bytes at 'data', 0 on EOF, -errno on error
+#define EVENT_SENT (1u << 6)     // Fired: the event_send() of 'ctx' completed with 'res'
+#define _EVENT_LISTEN (1u << 7)  // (Internal) Registered by event_listen()
+
+// --- Data Structures ---
+
+typedef enum
+{
+    EVENT_BACKEND_EPOLL,
+    EVENT_BACKEND_IO_URING
+} event_backend;
+
+static const char *const event_backend_names[] = {"epoll", "io_uring"};
+
+/**
+ * @brief One event returned by event_wait(). 'data' stays valid until
+ * the next event_wait().
+ */
+typedef struct
+{
+    int fd; // -1 with EVENT_SENT
+    uint32_t mask;
+    int res;
+    const char *data;
+    void *ctx;
+} event_fired_t;
+
+struct event_uring;
+
+typedef struct
+{
+    event_backend backend;
+    int epfd;
+    struct epoll_event *ep_events; // EVENT_BATCH_MAX
+    struct event_uring *uring;
+} event_loop_t;
+
+#ifdef EVENT_HAVE_IO_URING
+
+// --- io_uring Backend ---
+
+// user_data of a request: its kind, fd and sequence number, so the
+// completion of a request that was since cancelled is recognized. A
+// send carries its (8-byte aligned) context pointer instead.
+#define _EVENT_OP_POLL 0
+#define _EVENT_OP_RECV 1
+#define _EVENT_OP_ACCEPT 2
+#define _EVENT_OP_CANCEL 3 // Completions are ignored
+#define _EVENT_OP_SEND 4
+#define _EVENT_SEQ_MASK ((1u << 29) - 1)
+#define _EVENT_UD(op, fd, seq) \
+    ((uint64_t)(op) | ((uint64_t)(uint32_t)(fd) << 3) | ((uint64_t)((seq) & _EVENT_SEQ_MASK) << 35))
+
+/**
+ * @brief (Internal) What is registered for one fd, and which of its
+ * requests are in the kernel. Indexed by _EVENT_OP_POLL/RECV/ACCEPT.
+ */
+typedef struct
+{
+    uint32_t mask;
+    uint32_t seq[3];
+    uint8_t armed[3]; // Poll: the POLLIN/POLLOUT mask it waits for
+    uint8_t dirty;    // Listed in 'dirty' to be re-armed
+} _event_fd_t;
+
+typedef struct event_uring
+{
+    int fd;
+    void *sq_map;
+    size_t sq_map_len;
+    void *cq_map;
+    size_t cq_map_len;
+    struct io_uring_sqe *sqes;
+    size_t sqes_len;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned sq_local_tail; // Prepared, published at the next submit
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+
+    // Provided buffers multishot recvs fill
+    struct io_uring_buf_ring *br;
+    size_t br_len;
+    char *bufs;
+    uint16_t br_tail;
+    uint16_t held[EVENT_URING_BUFS]; // Handed out by the last event_wait()
+    unsigned held_count;
+
+    _event_fd_t *fds;
+    int fds_cap;
+    int *dirty; // fds whose requests don't match their interest
+    int dirty_count;
+    int dirty_cap;
+} event_uring_t;
+
+static inline int _event_kernel_at_least(int major, int minor)
+{
+    struct utsname u;
+    int ma = 0, mi = 0;
+    if (uname(&u) != 0 || sscanf(u.release, "%d.%d", &ma, &mi) != 2)
+        return 0;
+    return ma > major || (ma == major && mi >= minor);
+}
+
+/**
+ * @brief (Internal) Publishes the prepared requests and enters the
+ * kernel, waiting for 'min_complete' completions (up to 'timeout_ms' if
+ * it is positive).
+ */
+static inline int _event_uring_enter(event_uring_t *u, unsigned min_complete, int timeout_ms)
+{
+    __atomic_store_n(u->sq_tail, u->sq_local_tail, __ATOMIC_RELEASE);
+    unsigned to_submit = u->sq_local_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+    unsigned flags = IORING_ENTER_GETEVENTS;
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+    void *argp = NULL;
+    size_t argsz = 0;
+    if (min_complete && timeout_ms > 0)
+    {
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (long long)(timeout_ms % 1000) * 1000000LL;
+        memset(&arg, 0, sizeof(arg));
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+        argp = &arg;
+        argsz = sizeof(arg);
+        flags |= IORING_ENTER_EXT_ARG;
+    }
+    int rc = (int)syscall(__NR_io_uring_enter, u->fd, to_submit, min_complete, flags, argp, argsz);
+    if (rc < 0 && errno != ETIME && errno != EBUSY)
+        return -1;
+    return 0;
+}
+
+/**
+ * @brief (Internal) A zeroed submission queue entry, submitting what is
+ * prepared first if the queue is full.
+ * @return The entry, or NULL if the kernel takes no more.
+ */
+static inline struct io_uring_sqe *_event_uring_sqe(event_uring_t *u, uint8_t opcode, int fd, uint64_t user_data)
+{
+    if (u->sq_local_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >= u->sq_entries)
+    {
+        _event_uring_enter(u, 0, 0);
+        if (u->sq_local_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >= u->sq_entries)
+            return NULL;
+    }
+    struct io_uring_sqe *sqe = &u->sqes[u->sq_local_tail & u->sq_mask];
+    u->sq_local_tail++;
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->user_data = user_data;
+    return sqe;
+}
+
+static inline void _event_uring_cancel(event_uring_t *u, uint64_t target)
+{
+    struct io_uring_sqe *sqe = _event_uring_sqe(u, IORING_OP_ASYNC_CANCEL, -1, _EVENT_OP_CANCEL);
+    if (sqe)
+        sqe->addr = target;
+}
+
+static inline _event_fd_t *_event_uring_fd(event_uring_t *u, int fd)
+{
+    if (fd < 0)
+        return NULL;
+    if (fd >= u->fds_cap)
+    {
+        int cap = u->fds_cap ? u->fds_cap : 1024;
+        while (cap <= fd)
+            cap *= 2;
+        _event_fd_t *fds = (_event_fd_t *)realloc(u->fds, (size_t)cap * sizeof(_event_fd_t));
+        if (fds == NULL)
+            return NULL;
+        memset(fds + u->fds_cap, 0, (size_t)(cap - u->fds_cap) * sizeof(_event_fd_t));
+        u->fds = fds;
+        u->fds_cap = cap;
+    }
+    return &u->fds[fd];
+}
+
+/**
+ * @brief (Internal) Lists 'fd' to have its requests brought in line with
+ * its interest at the next event_wait().
+ */
+static inline int _event_uring_mark(event_uring_t *u, int fd)
+{
+    _event_fd_t *st = &u->fds[fd];
+    if (st->dirty)
+        return 0;
+    if (u->dirty_count == u->dirty_cap)
+    {
+        int cap = u->dirty_cap ? u->dirty_cap * 2 : 256;
+        int *dirty = (int *)realloc(u->dirty, (size_t)cap * sizeof(int));
+        if (dirty == NULL)
+            return -1;
+        u->dirty = dirty;
+        u->dirty_cap = cap;
+    }
+    u->dirty[u->dirty_count++] = fd;
+    st->dirty = 1;
+    return 0;
+}
+
+/**
+ * @brief (Internal) Submits the requests 'fd' lacks and cancels those it
+ * no longer wants. A one-shot poll that fired is armed again here, so
+ * a socket still ready is reported again, as level-triggered epoll does.
+ */
+static inline void _event_uring_arm(event_uring_t *u, int fd)
+{
+    _event_fd_t *st = &u->fds[fd];
+    uint32_t m = st->mask;
+    st->dirty = 0;
+    if (m == 0)
+        return;
+
+    int want_accept = (m & _EVENT_LISTEN) != 0;
+    int want_recv = !want_accept && (m & (EVENT_READABLE | EVENT_STREAM)) == (EVENT_READABLE | EVENT_STREAM);
+    uint8_t want_poll = (uint8_t)(((m & EVENT_READABLE) && !want_accept && !want_recv ? POLLIN : 0) |
+                                  ((m & EVENT_WRITABLE) ? POLLOUT : 0));
+    struct io_uring_sqe *sqe;
+
+    if (want_accept && !st->armed[_EVENT_OP_ACCEPT])
+    {
+        sqe = _event_uring_sqe(u, IORING_OP_ACCEPT, fd, _EVENT_UD(_EVENT_OP_ACCEPT, fd, st->seq[_EVENT_OP_ACCEPT]));
+        if (sqe)
+        {
+            sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+            sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+            st->armed[_EVENT_OP_ACCEPT] = 1;
+        }
+    }
+
+    if (want_recv && !st->armed[_EVENT_OP_RECV])
+    {
+        sqe = _event_uring_sqe(u, IORING_OP_RECV, fd, _EVENT_UD(_EVENT_OP_RECV, fd, st->seq[_EVENT_OP_RECV]));
+        if (sqe)
+        {
+            sqe->ioprio = IORING_RECV_MULTISHOT;
+            sqe->flags = IOSQE_BUFFER_SELECT;
+            sqe->buf_group = 0;
+            st->armed[_EVENT_OP_RECV] = 1;
+        }
+    }
+    else if (!want_recv && st->armed[_EVENT_OP_RECV])
+    {
+        _event_uring_cancel(u, _EVENT_UD(_EVENT_OP_RECV, fd, st->seq[_EVENT_OP_RECV]));
+        st->seq[_EVENT_OP_RECV]++;
+        st->armed[_EVENT_OP_RECV] = 0;
+    }
+
+    if (st->armed[_EVENT_OP_POLL] != want_poll)
+    {
+        if (st->armed[_EVENT_OP_POLL])
+            _event_uring_cancel(u, _EVENT_UD(_EVENT_OP_POLL, fd, st->seq[_EVENT_OP_POLL]));
+        st->seq[_EVENT_OP_POLL]++;
+        st->armed[_EVENT_OP_POLL] = 0;
+        if (want_poll)
+        {
+            sqe = _event_uring_sqe(u, IORING_OP_POLL_ADD, fd, _EVENT_UD(_EVENT_OP_POLL, fd, st->seq[_EVENT_OP_POLL]));
+            if (sqe)
+            {
+                sqe->poll32_events = want_poll;
+                st->armed[_EVENT_OP_POLL] = want_poll;
+            }
+        }
+    }
+}
+
+/**
+ * @brief (Internal) Hands the buffers of the last batch back to the
+ * kernel: the caller has consumed their bytes by now.
+ */
+static inline void _event_uring_recycle(event_uring_t *u)
+{
+    if (u->held_count == 0)
+        return;
+    for (unsigned i = 0; i < u->held_count; i++)
+    {
+        uint16_t bid = u->held[i];
+        struct io_uring_buf *b = &u->br->bufs[(uint16_t)(u->br_tail + i) & (EVENT_URING_BUFS - 1)];
+        b->addr = (uint64_t)(uintptr_t)(u->bufs + (size_t)bid * EVENT_URING_BUF_LEN);
+        b->len = EVENT_URING_BUF_LEN;
+        b->bid = bid;
+    }
+    u->br_tail = (uint16_t)(u->br_tail + u->held_count);
+    __atomic_store_n(&u->br->tail, u->br_tail, __ATOMIC_RELEASE);
+    u->held_count = 0;
+}
+
+static inline void _event_uring_free(event_uring_t *u)
+{
+    if (u == NULL)
+        return;
+    if (u->br && u->br != MAP_FAILED)
+        munmap(u->br, u->br_len);
+    free(u->bufs);
+    if (u->sqes && (void *)u->sqes != MAP_FAILED)
+        munmap(u->sqes, u->sqes_len);
+    if (u->cq_map && u->cq_map != MAP_FAILED && u->cq_map != u->sq_map)
+        munmap(u->cq_map, u->cq_map_len);
+    if (u->sq_map && u->sq_map != MAP_FAILED)
+        munmap(u->sq_map, u->sq_map_len);
+    if (u->fd >= 0)
+        close(u->fd);
+    free(u->fds);
+    free(u->dirty);
+    free(u);
+}
+
+/**
+ * @brief (Internal) Creates the ring, maps its queues and registers the
+ * provided buffer ring (group 0).
+ * @return The ring, or NULL (errno set).
+ */
+static inline event_uring_t *_event_uring_create(void)
+{
+    if (!_event_kernel_at_least(6, 0))
+    {
+        errno = ENOSYS; // Multishot recv and buffer rings came with 6.0
+        return NULL;
+    }
+    event_uring_t *u = (event_uring_t *)calloc(1, sizeof(event_uring_t));
+    if (u == NULL)
+        return NULL;
+
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN;
+    p.cq_entries = EVENT_URING_CQ_ENTRIES;
+    u->fd = (int)syscall(__NR_io_uring_setup, EVENT_URING_ENTRIES, &p);
+    if (u->fd < 0 || !(p.features & IORING_FEAT_EXT_ARG) || !(p.features & IORING_FEAT_NODROP))
+    {
+        int err = u->fd < 0 ? errno : ENOSYS;
+        _event_uring_free(u);
+        errno = err;
+        return NULL;
+    }
+
+    u->sq_map_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_map_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (u->cq_map_len > u->sq_map_len)
+            u->sq_map_len = u->cq_map_len;
+        u->cq_map_len = u->sq_map_len;
+    }
+    u->sq_map = mmap(NULL, u->sq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    u->cq_map = (p.features & IORING_FEAT_SINGLE_MMAP)
+                    ? u->sq_map
+                    : mmap(NULL, u->cq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd,
+                           IORING_OFF_CQ_RING);
+    u->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = (struct io_uring_sqe *)mmap(NULL, u->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                          u->fd, IORING_OFF_SQES);
+
+    // The buffer ring must be page aligned
+    u->br_len = EVENT_URING_BUFS * sizeof(struct io_uring_buf);
+    u->br = (struct io_uring_buf_ring *)mmap(NULL, u->br_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                                             -1, 0);
+    u->bufs = (char *)malloc((size_t)EVENT_URING_BUFS * EVENT_URING_BUF_LEN);
+    if (u->sq_map == MAP_FAILED || u->cq_map == MAP_FAILED || (void *)u->sqes == MAP_FAILED ||
+        (void *)u->br == MAP_FAILED || u->bufs == NULL)
+    {
+        int err = u->bufs ? errno : ENOMEM;
+        _event_uring_free(u);
+        errno = err;
+        return NULL;
+    }
+
+    char *sq = (char *)u->sq_map, *cq = (char *)u->cq_map;
+    u->sq_head = (unsigned *)(sq + p.sq_off.head);
+    u->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    u->sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+    u->sq_entries = p.sq_entries;
+    u->sq_local_tail = *u->sq_tail;
+    unsigned *sq_array = (unsigned *)(sq + p.sq_off.array);
+    for (unsigned i = 0; i < p.sq_entries; i++)
+        sq_array[i] = i; // Entry i always goes into slot i
+    u->cq_head = (unsigned *)(cq + p.cq_off.head);
+    u->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    u->cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)u->br;
+    reg.ring_entries = EVENT_URING_BUFS;
+    reg.bgid = 0;
+    if (syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+    {
+        int err = errno;
+        _event_uring_free(u);
+        errno = err;
+        return NULL;
+    }
+    for (unsigned i = 0; i < EVENT_URING_BUFS; i++)
+        u->held[u->held_count++] = (uint16_t)i;
+    _event_uring_recycle(u);
+    return u;
+}
+
+/**
+ * @brief (Internal) Turns one completion into at most one event.
+ * @return 1 if 'fe' was filled in, 0 if the completion is dropped.
+ */
+static inline int _event_uring_complete(event_uring_t *u, const struct io_uring_cqe *cqe, event_fired_t *fe)
+{
+    unsigned op = (unsigned)(cqe->user_data & 7);
+    if (op == _EVENT_OP_SEND)
+    {
+        fe->fd = -1;
+        fe->mask = EVENT_SENT;
+        fe->res = cqe->res;
+        fe->data = NULL;
+        fe->ctx = (void *)(uintptr_t)(cqe->user_data & ~(uint64_t)7);
+        return 1;
+    }
+    if (op == _EVENT_OP_CANCEL)
+        return 0;
+
+    int fd = (int)(uint32_t)(cqe->user_data >> 3);
+    uint32_t seq = (uint32_t)(cqe->user_data >> 35);
+    const char *data = NULL;
+    if (cqe->flags & IORING_CQE_F_BUFFER)
+    {
+        uint16_t bid = (uint16_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+        u->held[u->held_count++] = bid;
+        data = u->bufs + (size_t)bid * EVENT_URING_BUF_LEN;
+    }
+    if (fd >= u->fds_cap)
+        return 0;
+    _event_fd_t *st = &u->fds[fd];
+    if (seq != (st->seq[op] & _EVENT_SEQ_MASK))
+        return 0; // Cancelled, or the fd was deregistered meanwhile
+    if (!(cqe->flags & IORING_CQE_F_MORE))
+    {
+        st->armed[op] = 0;
+        _event_uring_mark(u, fd);
+    }
+
+    fe->fd = fd;
+    fe->res = cqe->res;
+    fe->data = data;
+    fe->ctx = NULL;
+    if (op == _EVENT_OP_POLL)
+    {
+        if (cqe->res < 0)
+            fe->mask = EVENT_READABLE | EVENT_ERROR;
+        else
+            fe->mask = ((cqe->res & POLLIN) ? EVENT_READABLE : 0) | ((cqe->res & POLLOUT) ? EVENT_WRITABLE : 0) |
+                       ((cqe->res & (POLLERR | POLLHUP)) ? EVENT_ERROR : 0);
+        return 1;
+    }
+    if (cqe->res == -ECANCELED || cqe->res == -ENOBUFS)
+        return 0; // ENOBUFS: out of buffers, the recv is re-armed once they return
+    fe->mask = op == _EVENT_OP_RECV ? EVENT_DATA : EVENT_ACCEPTED;
+    return 1;
+}
+
+static inline int _event_uring_wait(event_loop_t *el, event_fired_t *fired, int max, int timeout_ms)
+{
+    event_uring_t *u = el->uring;
+    _event_uring_recycle(u);
+    for (int i = 0; i < u->dirty_count; i++)
+        _event_uring_arm(u, u->dirty[i]);
+    u->dirty_count = 0;
+
+    unsigned head = *u->cq_head;
+    int ready = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE) != head;
+    if (_event_uring_enter(u, ready || timeout_ms == 0 ? 0 : 1, timeout_ms) < 0)
+        return -1;
+
+    int n = 0;
+    unsigned tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail && n < max)
+    {
+        n += _event_uring_complete(u, &u->cqes[head & u->cq_mask], &fired[n]);
+        head++;
+    }
+    __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+    return n;
+}
+
+#endif // EVENT_HAVE_IO_URING
+
+// --- Lifecycle ---
+
+/**
+ * @brief Sets up a loop on 'backend'.
+ * @return 0 on success, -1 on failure (errno set): io_uring is not
+ * compiled in, too old, or not permitted here.
+ */
+static inline int event_loop_init(event_loop_t *el, event_backend backend)
+{
+    memset(el, 0, sizeof(*el));
+    el->backend = backend;
+    el->epfd = -1;
+    if (backend == EVENT_BACKEND_IO_URING)
+    {
+#ifdef EVENT_HAVE_IO_URING
+        el->uring = _event_uring_create();
+        return el->uring ? 0 : -1;
+#else
+        errno = ENOSYS;
+        return -1;
+#endif
+    }
+    el->ep_events = (struct epoll_event *)malloc(EVENT_BATCH_MAX * sizeof(struct epoll_event));
+    el->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (el->ep_events == NULL || el->epfd < 0)
+    {
+        int err = el->ep_events ? errno : ENOMEM;
+        free(el->ep_events);
+        el->ep_events = NULL;
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+static inline void event_loop_free(event_loop_t *el)
+{
+#ifdef EVENT_HAVE_IO_URING
+    _event_uring_free(el->uring);
+    el->uring = NULL;
+#endif
+    if (el->epfd >= 0)
+        close(el->epfd);
+    el->epfd = -1;
+    free(el->ep_events);
+    el->ep_events = NULL;
+}
+
+/**
+ * @brief 1 if client sockets registered with EVENT_STREAM are read and
+ * written through the loop (EVENT_DATA, event_send()).
+ */
+static inline int event_async_io(const event_loop_t *el)
+{
+    return el->backend == EVENT_BACKEND_IO_URING;
+}
+
+static inline const char *event_backend_name(const event_loop_t *el)
+{
+    return event_backend_names[el->backend];
+}
+
+// --- Registration ---
+
+static inline int _event_epoll_ctl(event_loop_t *el, int op, int fd, uint32_t mask)
+{
+    struct epoll_event ev = {0};
+    ev.events = ((mask & EVENT_READABLE) ? EPOLLIN : 0) | ((mask & EVENT_WRITABLE) ? EPOLLOUT : 0);
+    ev.data.fd = fd;
+    return epoll_ctl(el->epfd, op, fd, &ev);
+}
+
+/**
+ * @brief Changes the interest of a registered fd. Takes effect at the
+ * next event_wait().
+ * @return 0 on success, -1 on failure (errno set).
+ */
+static inline int event_mod(event_loop_t *el, int fd, uint32_t mask)
+{
+#ifdef EVENT_HAVE_IO_URING
+    if (el->uring)
+    {
+        _event_fd_t *st = _event_uring_fd(el->uring, fd);
+        if (st == NULL || _event_uring_mark(el->uring, fd) != 0)
+        {
+            errno = ENOMEM;
+            return -1;
+        }
+        st->mask = (st->mask & _EVENT_LISTEN) | mask;
+        return 0;
+    }
+#endif
+    return _event_epoll_ctl(el, EPOLL_CTL_MOD, fd, mask);
+}
+
+/**
+ * @brief Registers 'fd' for EVENT_READABLE and/or EVENT_WRITABLE. With
+ * EVENT_STREAM (and EVENT_READABLE), io_uring receives the bytes itself
+ * and reports them as EVENT_DATA; epoll reports readiness either way.
+ * @return 0 on success, -1 on failure (errno set).
+ */
+static inline int event_add(event_loop_t *el, int fd, uint32_t mask)
+{
+#ifdef EVENT_HAVE_IO_URING
+    if (el->uring)
+        return event_mod(el, fd, mask);
+#endif
+    return _event_epoll_ctl(el, EPOLL_CTL_ADD, fd, mask);
+}
+
+/**
+ * @brief Registers a listening socket. io_uring accepts connections
+ * itself and reports each as EVENT_ACCEPTED; epoll reports it readable.
+ */
+static inline int event_listen(event_loop_t *el, int fd)
+{
+#ifdef EVENT_HAVE_IO_URING
+    if (el->uring)
+        return event_mod(el, fd, EVENT_READABLE | _EVENT_LISTEN);
+#endif
+    return _event_epoll_ctl(el, EPOLL_CTL_ADD, fd, EVENT_READABLE);
+}
+
+/**
+ * @brief Deregisters 'fd' before it is closed or handed to another loop.
+ * Its io_uring requests are cancelled at once; completions still queued
+ * for them are dropped.
+ */
+static inline void event_del(event_loop_t *el, int fd)
+{
+#ifdef EVENT_HAVE_IO_URING
+    event_uring_t *u = el->uring;
+    if (u)
+    {
+        if (fd < 0 || fd >= u->fds_cap)
+            return;
+        _event_fd_t *st = &u->fds[fd];
+        int cancelled = 0;
+        for (int op = _EVENT_OP_POLL; op <= _EVENT_OP_ACCEPT; op++)
+        {
+            if (st->armed[op])
+            {
+                _event_uring_cancel(u, _EVENT_UD(op, fd, st->seq[op]));
+                cancelled = 1;
+            }
+            st->seq[op]++;
+            st->armed[op] = 0;
+        }
+        st->mask = 0;
+        if (cancelled)
+            _event_uring_enter(u, 0, 0);
+        return;
+    }
+#endif
+    epoll_ctl(el->epfd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+// --- I/O ---
+
+/**
+ * @brief io_uring only: queues a sendmsg of 'msg' on 'fd', submitted with
+ * the next event_wait(), which reports EVENT_SENT with 'ctx' once it
+ * completes. 'msg' and the memory it points at must stay untouched
+ * until then; 'ctx' must be 8-byte aligned.
+ * @return 0 on success, -1 if the request can't be queued.
+ */
+static inline int event_send(event_loop_t *el, int fd, const struct msghdr *msg, void *ctx)
+{
+#ifdef EVENT_HAVE_IO_URING
+    if (el->uring)
+    {
+        struct io_uring_sqe *sqe = _event_uring_sqe(el->uring, IORING_OP_SENDMSG, fd,
+                                                    (uint64_t)(uintptr_t)ctx | _EVENT_OP_SEND);
+        if (sqe == NULL)
+            return -1;
+        sqe->addr = (uint64_t)(uintptr_t)msg;
+        sqe->len = 1;
+        sqe->msg_flags = MSG_NOSIGNAL;
+        return 0;
+    }
+#endif
+    (void)el, (void)fd, (void)msg, (void)ctx;
+    errno = ENOSYS;
+    return -1;
+}
+
+/**
+ * @brief Cancels the event_send() of 'ctx'. EVENT_SENT still comes, with
+ * -ECANCELED unless it had completed.
+ */
+static inline void event_cancel_send(event_loop_t *el, void *ctx)
+{
+#ifdef EVENT_HAVE_IO_URING
+    if (el->uring)
+        _event_uring_cancel(el->uring, (uint64_t)(uintptr_t)ctx | _EVENT_OP_SEND);
+#endif
+    (void)el, (void)ctx;
+}
+
+/**
+ * @brief Waits up to 'timeout_ms' (-1 = forever) for events, after
+ * submitting everything queued since the last call.
+ * @return The number of events in 'fired', or -1 on error (errno set).
+ */
+static inline int event_wait(event_loop_t *el, event_fired_t *fired, int max, int timeout_ms)
+{
+#ifdef EVENT_HAVE_IO_URING
+    if (el->uring)
+        return _event_uring_wait(el, fired, max, timeout_ms);
+#endif
+    int n = epoll_wait(el->epfd, el->ep_events, max < EVENT_BATCH_MAX ? max : EVENT_BATCH_MAX, timeout_ms);
+    for (int i = 0; i < n; i++)
+    {
+        uint32_t ev = el->ep_events[i].events;
+        fired[i].fd = el->ep_events[i].data.fd;
+        fired[i].mask = ((ev & EPOLLIN) ? EVENT_READABLE : 0) | ((ev & EPOLLOUT) ? EVENT_WRITABLE : 0) |
+                        ((ev & (EPOLLHUP | EPOLLERR)) ? EVENT_ERROR : 0);
+        fired[i].res = 0;
+        fired[i].data = NULL;
+        fired[i].ctx = NULL;
+    }
+    return n;
+}
+
+#endif // EVENT_H
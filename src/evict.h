@@ -0,0 +1,215 @@
+#ifndef EVICT_H
+#define EVICT_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Approximated LRU/LFU for maxmemory eviction.
+ *
+ * Every key carries a 24-bit access word, updated on each lookup:
+ *   - LRU: the access clock, in EVICT_LRU_RESOLUTION_MS ticks (wraps after
+ *     about 194 days);
+ *   - LFU: 16 bits of access time in minutes, then an 8-bit logarithmic
+ *     access counter that decays by one per idle minute.
+ *
+ * There is no global recency list. Eviction samples a few keys at a time
+ * and keeps the best candidates seen so far in a small pool that survives
+ * between evictions, which gets close to true LRU/LFU at a fraction of
+ * the bookkeeping.
+ */
+
+#define EVICT_CLOCK_MAX ((1u << 24) - 1)
+#define EVICT_LRU_RESOLUTION_MS 1000
+#define EVICT_LFU_INIT 5        // Counter of a new key, so it is not evicted first
+#define EVICT_LFU_LOG_FACTOR 10 // Higher: the counter saturates after more hits
+#define EVICT_LFU_DECAY_MIN 1   // Minutes of idleness per counter decrement
+
+#define EVICT_POOL_SIZE 16
+#define EVICT_POOL_CACHED_KEY 48 // Longer keys are copied to the heap
+#define EVICT_DEFAULT_SAMPLES 5
+#define EVICT_MAX_SAMPLES 64
+
+typedef enum {
+    MAXMEMORY_NOEVICTION,
+    MAXMEMORY_ALLKEYS_LRU,
+    MAXMEMORY_ALLKEYS_LFU,
+    MAXMEMORY_VOLATILE_TTL
+} maxmemory_policy_t;
+
+// Set from --maxmemory, --maxmemory-policy and --maxmemory-samples
+static size_t maxmemory = 0; // 0 = no limit
+static maxmemory_policy_t maxmemory_policy = MAXMEMORY_NOEVICTION;
+static int maxmemory_samples = EVICT_DEFAULT_SAMPLES;
+
+static const char *const maxmemory_policy_names[] = {"noeviction", "allkeys-lru", "allkeys-lfu", "volatile-ttl"};
+
+// --- Data Structures ---
+
+/**
+ * @brief One eviction candidate. Only the key is kept: the entry may be
+ * gone (or replaced) by the time the candidate is used.
+ */
+typedef struct {
+    unsigned long long score; // Idle time (LRU) or 255 - counter (LFU): higher goes first
+    size_t key_len;
+    char *heap_key; // Copy of a long key, NULL when it fits 'cached'
+    char cached[EVICT_POOL_CACHED_KEY];
+} evict_candidate_t;
+
+/**
+ * @brief The best candidates seen so far, by ascending score.
+ */
+typedef struct {
+    evict_candidate_t c[EVICT_POOL_SIZE];
+    int n;
+} evict_pool_t;
+
+// --- Internal ---
+
+static _Thread_local uint64_t _evict_rand_state = 0;
+
+/**
+ * @brief (Internal) xorshift64*, seeded per thread on first use.
+ */
+static inline uint64_t evict_rand(void) {
+    uint64_t x = _evict_rand_state;
+    if (x == 0) x = (uint64_t)(uintptr_t)&_evict_rand_state ^ 0x9e3779b97f4a7c15ULL;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    _evict_rand_state = x;
+    return x * 0x2545f4914f6cdd1dULL;
+}
+
+static inline uint32_t _evict_lru_clock(long long now_ms) {
+    return (uint32_t)(now_ms / EVICT_LRU_RESOLUTION_MS) & EVICT_CLOCK_MAX;
+}
+
+static inline unsigned long long _evict_lru_idle_ms(uint32_t lru, long long now_ms) {
+    uint32_t clock = _evict_lru_clock(now_ms);
+    uint32_t ticks = clock >= lru ? clock - lru : EVICT_CLOCK_MAX - lru + clock;
+    return (unsigned long long)ticks * EVICT_LRU_RESOLUTION_MS;
+}
+
+static inline uint32_t _evict_lfu_minutes(long long now_ms) {
+    return (uint32_t)(now_ms / 60000) & 0xFFFF;
+}
+
+/**
+ * @brief (Internal) The counter of 'lfu' after its idle minutes' decay.
+ */
+static inline uint32_t _evict_lfu_decayed(uint32_t lfu, long long now_ms) {
+    uint32_t then = lfu >> 8, now = _evict_lfu_minutes(now_ms);
+    uint32_t idle = now >= then ? now - then : 0xFFFF - then + now;
+    uint32_t periods = idle / EVICT_LFU_DECAY_MIN;
+    uint32_t counter = lfu & 0xFF;
+    return periods > counter ? 0 : counter - periods;
+}
+
+/**
+ * @brief (Internal) Bumps 'counter' with probability 1 / ((counter -
+ * EVICT_LFU_INIT) * EVICT_LFU_LOG_FACTOR + 1), so 8 bits cover millions
+ * of hits.
+ */
+static inline uint32_t _evict_lfu_incr(uint32_t counter) {
+    if (counter == 255) return counter;
+    uint32_t base = counter > EVICT_LFU_INIT ? counter - EVICT_LFU_INIT : 0;
+    double r = (double)(evict_rand() >> 11) / (double)(1ULL << 53);
+    if (r < 1.0 / ((double)base * EVICT_LFU_LOG_FACTOR + 1)) counter++;
+    return counter;
+}
+
+// --- Public API ---
+
+/**
+ * @return The access word of a key created at 'now_ms'.
+ */
+static inline uint32_t evict_access_new(long long now_ms) {
+    if (maxmemory_policy == MAXMEMORY_ALLKEYS_LFU) return (_evict_lfu_minutes(now_ms) << 8) | EVICT_LFU_INIT;
+    return _evict_lru_clock(now_ms);
+}
+
+/**
+ * @return 'word' updated for an access at 'now_ms'.
+ */
+static inline uint32_t evict_access_touch(uint32_t word, long long now_ms) {
+    if (maxmemory_policy == MAXMEMORY_ALLKEYS_LFU)
+        return (_evict_lfu_minutes(now_ms) << 8) | _evict_lfu_incr(_evict_lfu_decayed(word, now_ms));
+    return _evict_lru_clock(now_ms);
+}
+
+/**
+ * @return How good an eviction candidate a key with 'word' is; higher
+ * scores are evicted first.
+ */
+static inline unsigned long long evict_score(uint32_t word, long long now_ms) {
+    if (maxmemory_policy == MAXMEMORY_ALLKEYS_LFU) return 255 - _evict_lfu_decayed(word, now_ms);
+    return _evict_lru_idle_ms(word, now_ms);
+}
+
+static inline const char *evict_candidate_key(const evict_candidate_t *cand) {
+    return cand->heap_key ? cand->heap_key : cand->cached;
+}
+
+static inline void _evict_candidate_clear(evict_candidate_t *cand) {
+    free(cand->heap_key);
+    cand->heap_key = NULL;
+}
+
+/**
+ * @brief Offers a sampled key to the pool. It goes in at its place by
+ * score if the pool has room or it beats the worst candidate, which then
+ * drops out. A key that cannot be copied is just not offered.
+ */
+static inline void evict_pool_offer(evict_pool_t *pool, unsigned long long score, const char *key, size_t key_len) {
+    int k = 0;
+    while (k < pool->n && pool->c[k].score < score) k++;
+    for (int i = k; i < pool->n && pool->c[i].score == score; i++) {
+        if (pool->c[i].key_len == key_len && memcmp(evict_candidate_key(&pool->c[i]), key, key_len) == 0) return; // Sampled twice
+    }
+
+    char *copy = NULL;
+    if (key_len > EVICT_POOL_CACHED_KEY && (copy = (char *)malloc(key_len)) == NULL) return;
+
+    if (pool->n < EVICT_POOL_SIZE) {
+        memmove(&pool->c[k + 1], &pool->c[k], (size_t)(pool->n - k) * sizeof(evict_candidate_t));
+        pool->n++;
+    } else if (k == 0) {
+        free(copy); // Worse than everything already in a full pool
+        return;
+    } else {
+        _evict_candidate_clear(&pool->c[0]);
+        memmove(&pool->c[0], &pool->c[1], (size_t)(k - 1) * sizeof(evict_candidate_t));
+        k--;
+    }
+
+    evict_candidate_t *cand = &pool->c[k];
+    cand->score = score;
+    cand->key_len = key_len;
+    cand->heap_key = copy;
+    memcpy(copy ? copy : cand->cached, key, key_len);
+}
+
+/**
+ * @return The best candidate, valid until the next offer or pop, or NULL
+ * if the pool is empty.
+ */
+static inline evict_candidate_t *evict_pool_best(evict_pool_t *pool) {
+    return pool->n ? &pool->c[pool->n - 1] : NULL;
+}
+
+/**
+ * @brief Drops the best candidate.
+ */
+static inline void evict_pool_pop(evict_pool_t *pool) {
+    if (pool->n == 0) return;
+    _evict_candidate_clear(&pool->c[--pool->n]);
+}
+
+static inline void evict_pool_clear(evict_pool_t *pool) {
+    while (pool->n) evict_pool_pop(pool);
+}
+
+#endif // EVICT_H
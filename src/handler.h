@@ -4,20 +4,38 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/socket.h>
+#include <stdatomic.h>
+#include <assert.h>
+#include <limits.h>
+#include "slab.h"
+// uthash tables (sorted set members, blocked keys) come from the shard's
+// pool too, so they count against maxmemory like everything else
+#define uthash_malloc(sz) slab_alloc(sz)
+#define uthash_free(ptr, sz) slab_free(ptr, sz)
 #include "uthash.h"
 #include "utils.h"      // Assumed to exist
 #include "time_utils.h" // Assumed to exist
 #include "parser.h"     // Include our parser functions
+#include "client.h"     // Replies go to the client output buffer
 #include "minheap.h"    // Include our heap library
 #include "zset.h"
+#include "listpack.h"
+#include "quicklist.h"
+#include "lazyfree.h"
+#include "dict.h"
+#include "evict.h"
+#include "keyslot.h"
+#include "log.h"
 
 // --- Defines ---
 #define REDIS_OK "+OK\r\n"
 #define NULL_BULK_STRING "$-1\r\n"
 #define REDIS_WRONGTYPE "-WRONGTYPE Operation against a key holding the wrong kind of value\r\n"
 #define REDIS_EMPTY_ARRAY "*0\r\n"
-#define dbg 1
+#define REDIS_PONG "+PONG\r\n"
+#define REDIS_SYNTAX_ERR "-ERR syntax error\r\n"
+#define REDIS_NOT_INTEGER "-ERR value is not an integer or out of range\r\n"
+#define REDIS_NOT_FLOAT "-ERR value is not a valid float\r\n"
 
 // --- Data Structures ---
 
@@ -28,406 +46,2103 @@ typedef enum
     VAL_TYPE_ZSET
 } val_type;
 
-typedef struct ListNode
+/**
+ * @brief How a value is laid out in memory. Small lists and sorted sets
+ * start out packed and are converted once they outgrow the thresholds.
+ */
+typedef enum
 {
-    char *value;
-    struct ListNode *next;
-} ListNode;
+    VAL_ENC_RAW,        // RedisString
+    VAL_ENC_EMBSTR,     // RedisString inside the db_entry allocation
+    VAL_ENC_INT,        // Integer string, held in the value pointer itself
+    VAL_ENC_QUICKLIST,  // quicklist_t (quicklist.h)
+    VAL_ENC_TREE,       // RedisZSet
+    VAL_ENC_LISTPACK    // Small list or sorted set in one buffer (listpack.h)
+} val_encoding;
+
+// Largest collections kept packed (--list-max-listpack-*, --zset-max-listpack-*)
+static size_t list_max_listpack_entries = 128;
+static size_t list_max_listpack_value = 64;
+static size_t zset_max_listpack_entries = 128;
+static size_t zset_max_listpack_value = 64;
 
+// Set while a log of writes is replayed: the AOF at startup, or the
+// primary's stream on a replica (repl.h). No key expires or is evicted by
+// itself then, as the log holds a DEL for every key that did
+static int db_replaying = 0;
+
+/**
+ * @brief A binary-safe string value.
+ * 'data' is NUL-terminated for printing, but 'len' is authoritative.
+ */
 typedef struct
 {
-    ListNode *head;
-    ListNode *tail;
     size_t len;
-} RedisList;
+    char data[];
+} RedisString;
+
+#define DB_EMBSTR_MAX_LEN 64 // Longest string value stored inside its db_entry
 
+/**
+ * @brief One key. The key itself follows the struct in the same
+ * allocation, then (for VAL_ENC_EMBSTR) an embedded RedisString.
+ */
 typedef struct db_entry
 {
-    char *key;
-    void *value; // Points to a char* (string) or RedisList* (list)
-    val_type type;
+    dict_node_t node; // Link in the keyspace dict
+    void *value;      // RedisString*, quicklist_t*, RedisZSet*, a listpack or an integer, per 'encoding'
     long long expiry_ms;
-    UT_hash_handle hh;
+    size_t heap_index;     // Position in expiry_heap, HEAP_INDEX_NONE without a TTL
+    uint32_t key_len;      // Bounded by RESP_MAX_BULK_LEN
+    uint32_t lru : 24;     // Access clock or LFU counter, see evict.h
+    uint32_t type : 4;     // val_type
+    uint32_t encoding : 4; // val_encoding
+    uint16_t embed_room;   // Bytes reserved after the key for an embedded value
+    char key[];            // NUL-terminated; key_len is authoritative
 } db_entry;
 
+#define DB_ENTRY_OF(n) ((db_entry *)((char *)(n) - offsetof(db_entry, node)))
+
 
-// --- Struct for the HEAP ---
-// This is stored in the heap, completely separate from db_entry
-typedef struct expiry_entry
+struct bpop_waiter;
+
+/**
+ * @brief A waiter's place in the FIFO of one of the keys it waits on.
+ */
+typedef struct bpop_link
 {
-    long long expiry_ms;
-    char *key; // A *copy* of the key
-} expiry_entry_t;
+    struct bpop_waiter *w;
+    struct blocked_key *bk;
+    struct bpop_link *prev;
+    struct bpop_link *next;
+} bpop_link_t;
+
+/**
+ * @brief A list name that clients are parked on, oldest waiter first.
+ */
+typedef struct blocked_key
+{
+    char *key;
+    size_t key_len;
+    bpop_link_t *head;
+    bpop_link_t *tail;
+    int ready; // Queued in ready_keys; freed by whoever serves it
+    UT_hash_handle hh;
+} blocked_key_t;
+
+/**
+ * @brief A parked BLPOP/BRPOP, waiting on 'nkeys' lists at once.
+ */
+typedef struct bpop_waiter
+{
+    client_t *c;           // Parked client, or NULL for a forwarded command
+    void *forward;         // The shard message to answer instead
+    int where;             // QUICKLIST_HEAD or QUICKLIST_TAIL
+    long long deadline_ms; // -1 = wait forever
+    size_t heap_index;     // Position in bpop_heap, HEAP_INDEX_NONE without a deadline
+    struct bpop_waiter *prev; // All waiters of the db
+    struct bpop_waiter *next;
+    int nkeys;
+    bpop_link_t links[];
+} bpop_waiter_t;
+
+/**
+ * @brief The keyspace plus its expiry index and parked blocking pops.
+ */
+typedef struct
+{
+    dict_t entries; // Keyspace, key -> db_entry
+    slab_pool_t mem; // Where this keyspace's small objects come from (slab_use())
+    heap_t *expiry_heap;
+    int shard_id; // This keyspace's place among 'nshards', for SCAN cursors
+    int nshards;
+    evict_pool_t evict_pool; // Eviction candidates kept between evictions
+    _Atomic long long dirty; // Write commands run, for --save points (written by the owner only)
+    uint32_t *slot_keys;     // Cluster mode: keys per hash slot (cluster.h), else NULL
+    lazyfree_queue_t lazyfree; // Detached values still to be freed
+
+    blocked_key_t *blocking_keys; // uthash head: list name -> waiters
+    bpop_waiter_t *waiters;       // Every parked pop
+    heap_t *bpop_heap;            // Waiters with a timeout, by deadline
+    blocked_key_t **ready_keys;   // Pushed to while a waiter is parked on them
+    size_t ready_count;
+    size_t ready_cap;
+} redis_db_t;
+
+static inline void aof_feed(redis_db_t *db, const resp_arg_t *argv, int argc); // aof.h
+
+// --- Expiry Heap ---
+// The heap holds the db_entry pointers themselves, ordered by expiry_ms,
+// and each entry remembers its slot so a TTL can be changed or dropped
+// in O(log n) without leaving stale copies behind.
+
+static inline int compare_entry_expiry(const void *a, const void *b)
+{
+    const db_entry *e1 = (const db_entry *)a;
+    const db_entry *e2 = (const db_entry *)b;
+    if (e1->expiry_ms < e2->expiry_ms) return -1;
+    if (e1->expiry_ms > e2->expiry_ms) return 1;
+    return 0;
+}
+
+static inline void set_entry_heap_index(void *item, size_t index)
+{
+    ((db_entry *)item)->heap_index = index;
+}
+
+static inline heap_t *expiry_heap_create(void)
+{
+    return heap_create_indexed(compare_entry_expiry, set_entry_heap_index);
+}
+
+// Blocking pop timeouts use the same indexed heap, over waiters
+
+static inline int compare_waiter_deadline(const void *a, const void *b)
+{
+    const bpop_waiter_t *w1 = (const bpop_waiter_t *)a;
+    const bpop_waiter_t *w2 = (const bpop_waiter_t *)b;
+    if (w1->deadline_ms < w2->deadline_ms) return -1;
+    if (w1->deadline_ms > w2->deadline_ms) return 1;
+    return 0;
+}
+
+static inline void set_waiter_heap_index(void *item, size_t index)
+{
+    ((bpop_waiter_t *)item)->heap_index = index;
+}
+
+static inline heap_t *bpop_heap_create(void)
+{
+    return heap_create_indexed(compare_waiter_deadline, set_waiter_heap_index);
+}
+
+
+// --- Static Helper Functions ---
+
+static inline RedisString *redis_string_new(const char *data, size_t len)
+{
+    RedisString *s = (RedisString *)slab_alloc(sizeof(RedisString) + len + 1);
+    if (s == NULL)
+        return NULL;
+    s->len = len;
+    memcpy(s->data, data, len);
+    s->data[len] = '\0';
+    return s;
+}
+
+static inline void redis_string_free(RedisString *s)
+{
+    slab_free(s, sizeof(RedisString) + s->len + 1);
+}
+
+static inline int db_key_eq(const dict_node_t *node, const void *key, size_t len)
+{
+    const db_entry *e = DB_ENTRY_OF(node);
+    return e->key_len == len && memcmp(e->key, key, len) == 0;
+}
+
+static inline void db_init(redis_db_t *db)
+{
+    memset(db, 0, sizeof(*db));
+    dict_init(&db->entries, db_key_eq);
+    slab_pool_init(&db->mem);
+    db->nshards = 1;
+}
+
+/**
+ * @brief (Internal) Offset of the embedded value from e->key: past the
+ * key's NUL, rounded up so the RedisString there is aligned.
+ */
+static inline size_t _db_embed_offset(size_t key_len)
+{
+    size_t end = offsetof(db_entry, key) + key_len + 1;
+    return ((end + 7) & ~(size_t)7) - offsetof(db_entry, key);
+}
+
+static inline size_t _db_entry_size(size_t key_len, size_t room)
+{
+    if (room == 0)
+        return offsetof(db_entry, key) + key_len + 1;
+    return offsetof(db_entry, key) + _db_embed_offset(key_len) + room;
+}
+
+/**
+ * @brief (Internal) Value room for an entry of 'key_len' that asks for
+ * 'room': whatever its size class leaves over goes to the value too.
+ */
+static inline size_t _db_embed_room(size_t key_len, size_t room)
+{
+    if (room == 0)
+        return 0;
+    room = slab_usable_size(_db_entry_size(key_len, room)) - offsetof(db_entry, key) - _db_embed_offset(key_len);
+    return room > UINT16_MAX ? UINT16_MAX : room;
+}
+
+static inline RedisString *_db_embedded(db_entry *e)
+{
+    return (RedisString *)(e->key + _db_embed_offset(e->key_len));
+}
+
+/**
+ * @brief Looks up 'key' and counts the lookup as an access for eviction.
+ */
+static inline db_entry *db_find(redis_db_t *db, const resp_arg_t *key)
+{
+    dict_node_t *n = dict_find(&db->entries, key->ptr, key->len);
+    if (n == NULL)
+        return NULL;
+    db_entry *e = DB_ENTRY_OF(n);
+    e->lru = evict_access_touch(e->lru, cached_time_ms());
+    return e;
+}
+
+#define DB_FIND_BATCH 16 // Lookups in flight per db_find_batch() call
+
+/**
+ * @brief db_find() for up to DB_FIND_BATCH keys: keys[0], keys[step], ...
+ * Every bucket, then every chain head, is prefetched before the first
+ * probe, so the cache misses of the whole batch overlap instead of
+ * being paid one key at a time.
+ */
+static inline void db_find_batch(redis_db_t *db, const resp_arg_t *keys, int step, int n, db_entry **out)
+{
+    uint64_t hash[DB_FIND_BATCH];
+    assert(n <= DB_FIND_BATCH);
+
+    dict_rehash_step(&db->entries);
+    for (int i = 0; i < n; i++)
+    {
+        hash[i] = dict_hash(keys[i * step].ptr, keys[i * step].len);
+        dict_prefetch_bucket(&db->entries, hash[i]);
+    }
+    for (int i = 0; i < n; i++)
+        dict_prefetch_chain(&db->entries, hash[i]);
+
+    long long now = cached_time_ms();
+    for (int i = 0; i < n; i++)
+    {
+        const resp_arg_t *key = &keys[i * step];
+        dict_node_t *node = dict_find_hash(&db->entries, hash[i], key->ptr, key->len);
+        out[i] = node ? DB_ENTRY_OF(node) : NULL;
+        if (out[i])
+            out[i]->lru = evict_access_touch(out[i]->lru, now);
+    }
+}
+
+/**
+ * @brief Clears the copies of 'e' in out[from..n) of a db_find_batch()
+ * once it has been deleted: a key repeated in the batch was found as the
+ * same entry each time.
+ */
+static inline void db_batch_forget(db_entry **out, int from, int n, const db_entry *e)
+{
+    for (int k = from; k < n; k++)
+        if (out[k] == e)
+            out[k] = NULL;
+}
+
+/**
+ * @brief (Internal) Creates an entry for 'key', with 'room' bytes for an
+ * embedded value, and adds it to the keyspace.
+ * This is the only place a key is copied.
+ * @return The entry, or NULL if out of memory.
+ */
+static inline db_entry *_db_add(redis_db_t *db, const resp_arg_t *key, size_t room)
+{
+    room = _db_embed_room(key->len, room);
+    db_entry *e = (db_entry *)slab_alloc(_db_entry_size(key->len, room));
+    if (e == NULL)
+        return NULL;
+    memcpy(e->key, key->ptr, key->len);
+    e->key[key->len] = '\0';
+    e->key_len = (uint32_t)key->len;
+    e->embed_room = (uint16_t)room;
+    e->value = NULL;
+    e->expiry_ms = -1;
+    e->heap_index = HEAP_INDEX_NONE;
+    e->lru = evict_access_new(cached_time_ms());
+    if (dict_add(&db->entries, &e->node, e->key, e->key_len) != 0)
+    {
+        slab_free(e, _db_entry_size(key->len, room));
+        return NULL;
+    }
+    if (db->slot_keys)
+        db->slot_keys[key_hash_slot(e->key, e->key_len)]++;
+    return e;
+}
+
+static inline void _db_entry_free(db_entry *e)
+{
+    slab_free(e, _db_entry_size(e->key_len, e->embed_room));
+}
+
+static inline db_entry *db_add(redis_db_t *db, const resp_arg_t *key)
+{
+    return _db_add(db, key, 0);
+}
+
+/**
+ * @brief (Internal) Reallocates 'e' with 'room' bytes for an embedded
+ * value, fixing up the links that hold its address.
+ * @return The entry, or NULL if out of memory ('e' is then unchanged).
+ */
+static inline db_entry *_db_entry_resize(redis_db_t *db, db_entry *e, size_t room)
+{
+    room = _db_embed_room(e->key_len, room);
+    // Chains link entries by address, so step out of the dict for the move;
+    // the table stays allocated, so adding it back can't fail
+    dict_delete(&db->entries, &e->node);
+    db_entry *n = (db_entry *)slab_realloc(e, _db_entry_size(e->key_len, e->embed_room), _db_entry_size(e->key_len, room));
+    if (n == NULL)
+    {
+        dict_add(&db->entries, &e->node, e->key, e->key_len);
+        return NULL;
+    }
+    n->embed_room = (uint16_t)room;
+    if (n->encoding == VAL_ENC_EMBSTR)
+        n->value = _db_embedded(n);
+    if (n->heap_index != HEAP_INDEX_NONE)
+        heap_set(db->expiry_heap, n->heap_index, n);
+    dict_add(&db->entries, &n->node, n->key, n->key_len);
+    return n;
+}
+
+static inline void free_db_value(db_entry *e)
+{
+    if (e == NULL || e->value == NULL)
+        return;
+
+    if (e->encoding == VAL_ENC_EMBSTR || e->encoding == VAL_ENC_INT)
+    {
+        // Nothing of its own: the value lives in the entry
+    }
+    else if (e->type == VAL_TYPE_STRING)
+    {
+        redis_string_free((RedisString *)e->value);
+    }
+    else if (e->encoding == VAL_ENC_LISTPACK)
+    {
+        lp_free((unsigned char *)e->value); // One buffer, whatever the type
+    }
+    else if (e->type == VAL_TYPE_LIST)
+    {
+        quicklist_free((quicklist_t *)e->value);
+    }
+    else if (e->type == VAL_TYPE_ZSET) // 3. Add free logic
+    {
+        zset_free((RedisZSet*)e->value); // Calls the new lib's free func
+    }
+    
+    e->value = NULL;
+}
+
+/**
+ * @brief (Internal) Moves the value of 'e' to the lazy-free queue if it
+ * is a list or sorted set large enough to be worth it.
+ * @return 1 if queued ('e' is then left without a value), 0 if not.
+ */
+static inline int _db_value_defer(redis_db_t *db, db_entry *e)
+{
+    lazyfree_kind kind;
+    if (e->value == NULL || e->encoding == VAL_ENC_LISTPACK)
+        return 0; // One buffer: as cheap to free now as later
+    if (e->type == VAL_TYPE_LIST && quicklist_count((quicklist_t *)e->value) > LAZYFREE_THRESHOLD)
+        kind = LAZYFREE_LIST;
+    else if (e->type == VAL_TYPE_ZSET && zset_length((RedisZSet *)e->value) > LAZYFREE_THRESHOLD)
+        kind = LAZYFREE_ZSET;
+    else
+        return 0;
+    if (!lazyfree_push(&db->lazyfree, kind, e->value))
+        return 0;
+    e->value = NULL;
+    return 1;
+}
+
+/**
+ * @brief Frees the value of 'e' before it is replaced, lazily under
+ * --lazyfree.
+ */
+static inline void db_free_value(redis_db_t *db, db_entry *e)
+{
+    if (!lazyfree_enabled || !_db_value_defer(db, e))
+        free_db_value(e);
+}
+
+/**
+ * @brief Converts a packed list to a quicklist. The listpack becomes its
+ * first node, so nothing is copied.
+ * @return 0 on success, -1 if out of memory (the list stays packed).
+ */
+static inline int list_convert_listpack(db_entry *e)
+{
+    quicklist_t *ql = quicklist_create_from_listpack((unsigned char *)e->value);
+    if (ql == NULL)
+        return -1;
+    e->value = ql;
+    e->encoding = VAL_ENC_QUICKLIST;
+    return 0;
+}
+
+/**
+ * @brief Converts a packed sorted set to a RedisZSet.
+ * @return 0 on success, -1 if out of memory (the set stays packed).
+ */
+static inline int zset_convert_listpack(db_entry *e)
+{
+    unsigned char *lp = (unsigned char *)e->value;
+    RedisZSet *zset = zset_create();
+    if (zset == NULL)
+        return -1;
+    for (unsigned char *p = lp_first(lp); p; p = lp_next(lp, lp_next(lp, p)))
+    {
+        size_t len;
+        const char *member = lp_get(p, &len);
+        if (zset_add(zset, zlp_score_at(lp, p), member, len) < 0)
+        {
+            zset_free(zset);
+            return -1;
+        }
+    }
+    lp_free(lp);
+    e->value = zset;
+    e->encoding = VAL_ENC_TREE;
+    return 0;
+}
+
+/**
+ * @brief Sets (or with -1, clears) the absolute expiry of 'e', keeping
+ * its single heap slot in sync.
+ * @return 0 on success, -1 if the heap could not grow (no TTL is set).
+ */
+static inline int db_set_expiry(redis_db_t *db, db_entry *e, long long expiry_ms)
+{
+    if (expiry_ms == -1)
+    {
+        if (e->heap_index != HEAP_INDEX_NONE)
+            heap_remove(db->expiry_heap, e->heap_index);
+        e->expiry_ms = -1;
+        return 0;
+    }
+
+    e->expiry_ms = expiry_ms;
+    if (e->heap_index != HEAP_INDEX_NONE)
+    {
+        heap_update(db->expiry_heap, e->heap_index);
+        return 0;
+    }
+    if (heap_push(db->expiry_heap, e) != 0)
+    {
+        log_error("heap_push: out of memory");
+        e->expiry_ms = -1;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief (Internal) Unlinks 'e' from the keyspace and the expiry heap
+ * and frees it; with 'lazy', a large value goes to the lazy-free queue.
+ */
+static inline void _db_delete(redis_db_t *db, db_entry *e, int lazy)
+{
+    if (e->heap_index != HEAP_INDEX_NONE)
+        heap_remove(db->expiry_heap, e->heap_index);
+    if (!lazy || !_db_value_defer(db, e))
+        free_db_value(e);
+    dict_delete(&db->entries, &e->node);
+    if (db->slot_keys)
+        db->slot_keys[key_hash_slot(e->key, e->key_len)]--;
+    _db_entry_free(e);
+}
+
+/**
+ * @brief Deletes 'e', lazily under --lazyfree.
+ */
+static inline void db_delete(redis_db_t *db, db_entry *e)
+{
+    _db_delete(db, e, lazyfree_enabled);
+}
+
+/**
+ * @brief Deletes 'e' at once, leaving a large value to the lazy-free queue.
+ */
+static inline void db_unlink(redis_db_t *db, db_entry *e)
+{
+    _db_delete(db, e, 1);
+}
+
+/**
+ * @return 1 if the TTL of 'e' has passed (never while a log is replayed).
+ */
+static inline int db_key_expired(const db_entry *e)
+{
+    return e->expiry_ms != -1 && e->expiry_ms < cached_time_ms() && !db_replaying;
+}
+
+/**
+ * @brief Deletes a key that went without a command naming it (expired or
+ * evicted), logging the DEL that repeats this in the AOF.
+ */
+static inline void db_delete_propagate(redis_db_t *db, db_entry *e)
+{
+    resp_arg_t argv[2] = {{(char *)"DEL", 3}, {e->key, e->key_len}};
+    aof_feed(db, argv, 2);
+    db_delete(db, e);
+}
+
+static inline void _db_free_entry(dict_node_t *node)
+{
+    db_entry *e = DB_ENTRY_OF(node);
+    free_db_value(e);
+    _db_entry_free(e);
+}
+
+/**
+ * @brief Frees every key. The expiry heap is left holding stale pointers
+ * and must be destroyed or cleared next.
+ */
+static inline void db_release(redis_db_t *db)
+{
+    dict_release(&db->entries, _db_free_entry);
+    evict_pool_clear(&db->evict_pool);
+    if (db->slot_keys)
+        memset(db->slot_keys, 0, KEYSLOT_COUNT * sizeof(uint32_t));
+}
+
+/**
+ * @brief Deletes every key, leaving an empty keyspace ready for use. The
+ * caller selects the keyspace's slab pool.
+ */
+static inline void db_empty(redis_db_t *db)
+{
+    db_release(db);
+    heap_clear(db->expiry_heap);
+}
+
+// --- Strings ---
+// A string is kept in the cheapest of three forms: an integer in its
+// canonical spelling lives in the value pointer itself, a short string is
+// embedded after the key in the entry's allocation, and anything longer
+// gets a RedisString of its own.
+
+/**
+ * @brief (Internal) Parses 's' as an integer that prints back to exactly
+ * the same bytes ("12", not "012" or "+12") and fits in a pointer.
+ * @return 1 with the integer in '*out', 0 otherwise.
+ */
+static inline int _string_int_value(const char *s, size_t len, long long *out)
+{
+    char buf[LL_STR_SIZE];
+    long long v;
+    if (len >= LL_STR_SIZE || string_to_ll(s, len, &v) != 0)
+        return 0;
+    if (v < INTPTR_MIN || v > INTPTR_MAX)
+        return 0;
+    if (ll_to_str(buf, v) != len || memcmp(buf, s, len) != 0)
+        return 0;
+    *out = v;
+    return 1;
+}
+
+/**
+ * @brief Stores a string under 'key'; 'e' is its current entry, or NULL
+ * if the key does not exist yet. The TTL is left to the caller.
+ * @return The entry, which may have moved, or NULL if out of memory (an
+ * existing key then keeps its old value).
+ */
+static inline db_entry *db_set_string(redis_db_t *db, db_entry *e, const resp_arg_t *key, const char *s, size_t len)
+{
+    long long v;
+    if (_string_int_value(s, len, &v))
+    {
+        if (e == NULL && (e = db_add(db, key)) == NULL)
+            return NULL;
+        db_free_value(db, e);
+        e->value = (void *)(intptr_t)v;
+        e->encoding = VAL_ENC_INT;
+    }
+    else if (len <= DB_EMBSTR_MAX_LEN)
+    {
+        size_t room = sizeof(RedisString) + len + 1;
+        if (e == NULL)
+            e = _db_add(db, key, room);
+        else if (e->embed_room < room)
+            e = _db_entry_resize(db, e, room);
+        if (e == NULL)
+            return NULL;
+        db_free_value(db, e);
+        RedisString *str = _db_embedded(e);
+        str->len = len;
+        memcpy(str->data, s, len);
+        str->data[len] = '\0';
+        e->value = str;
+        e->encoding = VAL_ENC_EMBSTR;
+    }
+    else
+    {
+        RedisString *str = redis_string_new(s, len);
+        if (str == NULL)
+            return NULL;
+        if (e == NULL && (e = db_add(db, key)) == NULL)
+        {
+            redis_string_free(str);
+            return NULL;
+        }
+        db_free_value(db, e);
+        e->value = str;
+        e->encoding = VAL_ENC_RAW;
+    }
+    e->type = VAL_TYPE_STRING;
+    return e;
+}
+
+/**
+ * @brief The bytes of a string value. An integer is printed into 'buf',
+ * which needs room for LL_STR_SIZE bytes.
+ */
+static inline const char *db_string_get(const db_entry *e, char *buf, size_t *len)
+{
+    if (e->encoding == VAL_ENC_INT)
+    {
+        *len = ll_to_str(buf, (long long)(intptr_t)e->value);
+        return buf;
+    }
+    const RedisString *str = (const RedisString *)e->value;
+    *len = str->len;
+    return str->data;
+}
+
+/**
+ * @brief Called after a push to 'key': queues it for serving if a pop
+ * is parked on it.
+ */
+static inline void db_signal_ready(redis_db_t *db, const resp_arg_t *key)
+{
+    if (db->blocking_keys == NULL)
+        return;
+    blocked_key_t *bk;
+    HASH_FIND(hh, db->blocking_keys, key->ptr, key->len, bk);
+    if (bk == NULL || bk->ready)
+        return;
+    if (db->ready_count == db->ready_cap)
+    {
+        size_t cap = db->ready_cap ? db->ready_cap * 2 : 16;
+        blocked_key_t **keys = (blocked_key_t **)realloc(db->ready_keys, cap * sizeof(blocked_key_t *));
+        if (keys == NULL)
+        {
+            log_error("db_signal_ready: out of memory");
+            return; // The waiters are served by the next push instead
+        }
+        db->ready_keys = keys;
+        db->ready_cap = cap;
+    }
+    bk->ready = 1;
+    db->ready_keys[db->ready_count++] = bk;
+}
+
+// --- Eviction ---
+// Memory is what the shard's slab pool has handed out: every keyspace
+// allocation goes through slab.h or is noted there, so the count is kept
+// up to date by the data structures themselves, with no walk over values.
+// With several shards the limit is split evenly between them.
+
+static _Atomic long long evicted_keys = 0; // Over every shard, for INFO
+
+static inline size_t db_used_memory(redis_db_t *db)
+{
+    return slab_pool_used_bytes(&db->mem);
+}
+
+/**
+ * @brief (Internal) Samples a few keys into the eviction pool.
+ */
+static inline void _db_evict_sample(redis_db_t *db)
+{
+    dict_node_t *sample[EVICT_MAX_SAMPLES];
+    size_t n = dict_sample(&db->entries, evict_rand(), sample, (size_t)maxmemory_samples);
+    long long now = cached_time_ms();
+    for (size_t i = 0; i < n; i++)
+    {
+        db_entry *e = DB_ENTRY_OF(sample[i]);
+        evict_pool_offer(&db->evict_pool, evict_score(e->lru, now), e->key, e->key_len);
+    }
+}
+
+/**
+ * @brief (Internal) Deletes the best key to evict under the policy.
+ * volatile-ttl needs no sampling: the expiry heap already knows the key
+ * closest to expiring.
+ * @return 0 if a key went, -1 if there is nothing to evict.
+ */
+static inline int _db_evict_one(redis_db_t *db)
+{
+    if (maxmemory_policy == MAXMEMORY_VOLATILE_TTL)
+    {
+        db_entry *e = (db_entry *)heap_peek(db->expiry_heap);
+        if (e == NULL)
+            return -1;
+        db_delete_propagate(db, e);
+        return 0;
+    }
+
+    while (dict_size(&db->entries) > 0)
+    {
+        _db_evict_sample(db);
+        evict_candidate_t *cand;
+        while ((cand = evict_pool_best(&db->evict_pool)) != NULL)
+        {
+            // The key may have been deleted since it was sampled
+            dict_node_t *n = dict_find(&db->entries, evict_candidate_key(cand), cand->key_len);
+            evict_pool_pop(&db->evict_pool);
+            if (n)
+            {
+                db_delete_propagate(db, DB_ENTRY_OF(n));
+                return 0;
+            }
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief Evicts keys until the shard is back under its share of
+ * maxmemory. Called before every command that may add memory.
+ * @return 0 if the command may run, -1 if memory is over the limit and
+ * the policy leaves nothing to evict.
+ */
+static inline int db_evict_to_limit(redis_db_t *db)
+{
+    if (maxmemory == 0 || db_replaying)
+        return 0;
+    size_t limit = maxmemory / (size_t)db->nshards;
+    while (db_used_memory(db) > limit)
+    {
+        // Detached values still count until reclaimed: reclaim them a slice
+        // at a time before evicting more, stopping once back under the limit
+        if (db->lazyfree.count > 0)
+        {
+            lazyfree_slice(&db->lazyfree);
+            continue;
+        }
+        if (maxmemory_policy == MAXMEMORY_NOEVICTION || _db_evict_one(db) != 0)
+            return -1;
+        atomic_fetch_add_explicit(&evicted_keys, 1, memory_order_relaxed);
+    }
+    return 0;
+}
+
+// --- Public Handler Functions ---
+
+static inline void handle_echo(redis_db_t *db, client_t *c, const resp_arg_t *argv, int argc)
+{
+    (void)db; (void)argc;
+    client_add_reply_bulk(c, argv[1].ptr, argv[1].len);
+}
+
+static inline void handle_ping(redis_db_t *db, client_t *c, const resp_arg_t *argv, int argc)
+{
+    (void)db;
+    if (argc > 2)
+    {
+        client_add_reply_str(c, "-ERR wrong number of arguments for 'ping' command\r\n");
+        return;
+    }
+    if (argc == 2)
+        client_add_reply_bulk(c, argv[1].ptr, argv[1].len);
+    else
+        client_add_reply_str(c, REDIS_PONG);
+}
+
+/**
+ * SET key value [PX milliseconds | EX seconds | PXAT unix-ms | EXAT unix-seconds]
+ * Logged to the AOF with PXAT, so a replay sets the same deadline.
+ */
+static inline void handle_set(redis_db_t *db, client_t *c, const resp_arg_t *argv, int argc)
+{
+    const resp_arg_t *key = &argv[1];
+    const resp_arg_t *value = &argv[2];
+    long long expiry = -1;
+
+    for (int i = 3; i < argc; i++)
+    {
+        int px = resp_arg_eq_nocase(&argv[i], "px"), ex = resp_arg_eq_nocase(&argv[i], "ex");
+        int pxat = resp_arg_eq_nocase(&argv[i], "pxat"), exat = resp_arg_eq_nocase(&argv[i], "exat");
+        if ((px || ex || pxat || exat) && i + 1 < argc)
+        {
+            long long t;
+            if (string_to_ll(argv[i + 1].ptr, argv[i + 1].len, &t) != 0 || t <= 0)
+            {
+                client_add_reply_str(c, "-ERR invalid expire time in 'set' command\r\n");
+                return;
+            }
+            expiry = px ? cached_time_ms() + t : ex ? cached_time_ms() + t * 1000 : pxat ? t : t * 1000;
+            i++;
+        }
+        else
+        {
+            client_add_reply_str(c, REDIS_SYNTAX_ERR);
+            return;
+        }
+    }
+
+    log_trace("handle_set-> params recvd: %.*s %.*s %lld %d", (int)key->len, key->ptr, (int)value->len, value->ptr, expiry, c->fd);
+    
+    db_entry *e = db_set_string(db, db_find(db, key), key, value->ptr, value->len);
+    if (e == NULL)
+    {
+        client_add_reply_str(c, "-ERR out of memory\r\n");
+        return;
+    }
+    // Moves the entry's existing heap slot, or drops it for a plain SET
+    db_set_expiry(db, e, expiry);
+
+    if (e->expiry_ms == -1)
+    {
+        resp_arg_t plain[3] = {argv[0], *key, *value};
+        aof_feed(db, plain, 3);
+    }
+    else
+    {
+        char at[LL_STR_SIZE];
+        resp_arg_t timed[5] = {argv[0], *key, *value, {(char *)"PXAT", 4}, {at, ll_to_str(at, e->expiry_ms)}};
+        aof_feed(db, timed, 5);
+    }
+
+    client_add_reply_str(c, REDIS_OK);
+}
+
+static inline void _handle_del(redis_db_t *db, client_t *c, const resp_arg_t *argv, int argc, int lazy)
+{
+    long long deleted = 0;
+    for (int i = 1; i < argc; i++)
+    {
+        db_entry *e = db_find(db, &argv[i]);
+        if (e == NULL)
+            continue;
+        if (!db_key_expired(e))
+            deleted++;
+        _db_delete(db, e, lazy);
+    }
+    client_add_reply_integer(c, deleted);
+}
+
+/**
+ * DEL key [key ...]
+ */
+static inline void handle_del(redis_db_t *db, client_t *c, const resp_arg_t *argv, int argc)
+{
+    _handle_del(db, c, argv, argc, lazyfree_enabled);
+}
+
+/**
+ * UNLINK key [key ...]
+ * DEL that removes the keys in O(1) each and leaves freeing large values
+ * to the lazy-free queue.
+ */
+static inline void handle_unlink(redis_db_t *db, client_t *c, const resp_arg_t *argv, int argc)
+{
+    _handle_del(db, c, argv, argc, 1);
+}
+
+static inline void handle_get(redis_db_t *db, client_t *c, const resp_arg_t *argv, int argc)
+{
+    (void)argc;
+    const resp_arg_t *key = &argv[1];
+    db_entry *e = db_find(db, key);
+
+    if (e == NULL)
+    {
+        client_add_reply_str(c, NULL_BULK_STRING);
+        return;
+    }
+
+    // Passive eviction check
+    if (db_key_expired(e))
+    {
+        log_trace("Passive evict (GET): %s", e->key);
+        db_delete_propagate(db, e);
+        client_add_reply_str(c, NULL_BULK_STRING);
+        return;
+    }
+
+    if (e->type != VAL_TYPE_STRING)
+    {
+        client_add_reply_str(c, REDIS_WRONGTYPE);
+        return;
+    }
+
+    char buf[LL_STR_SIZE];
+    size_t len;
+    const char *data = db_string_get(e, buf, &len);
+    client_add_reply_bulk(c, data, len);
+}
+
+/**
+ * MGET key [key ...]
+ * Missing keys and keys of another type are nil.
+ */
+static inline void handle_mget(redis_db_t *db, client_t *c, const resp_arg_t *argv, int argc)
+{
+    db_entry *found[DB_FIND_BATCH];
+    client_add_reply_array_len(c, argc - 1);
+    for (int i = 1; i < argc; i += DB_FIND_BATCH)
+    {
+        int n = argc - i < DB_FIND_BATCH ? argc - i : DB_FIND_BATCH;
+        db_find_batch(db, &argv[i], 1, n, found);
+        for (int j = 0; j < n; j++)
+        {
+            db_entry *e = found[j];
+            if (e != NULL && db_key_expired(e))
+            {
+                db_batch_forget(found, j + 1, n, e);
+                db_delete_propagate(db, e);
+                e = NULL;
+            }
+            if (e == NULL || e->type != VAL_TYPE_STRING)
+            {
+                client_add_reply_str(c, NULL_BULK_STRING);
+                continue;
+            }
+            char buf[LL_STR_SIZE];
+            size_t len;
+            const char *data = db_string_get(e, buf, &len);
+            client_add_reply_bulk(c, data, len);
+        }
+    }
+}
+
+/**
+ * @brief (Internal) Sets every key/value pair of an MSET, dropping any TTL.
+ * @return 0, or -1 if out of memory (the pairs before stay set).
+ */
+static inline int _db_mset(redis_db_t *db, const resp_arg_t *argv, int argc)
+{
+    db_entry *found[DB_FIND_BATCH];
+    for (int i = 1; i < argc; i += 2 * DB_FIND_BATCH)
+    {
+        int n = (argc - i) / 2 < DB_FIND_BATCH ? (argc - i) / 2 : DB_FIND_BATCH;
+        db_find_batch(db, &argv[i], 2, n, found);
+        for (int j = 0; j < n; j++)
+        {
+            const resp_arg_t *key = &argv[i + 2 * j], *value = key + 1;
+            // An earlier pair of this batch may have added or moved the entry
+            db_entry *e = found[j];
+            for (int k = 0; k < j; k++)
+                if (resp_arg_eq(&argv[i + 2 * k], key))
+                    e = db_find(db, key);
+            if ((e = db_set_string(db, e, key, value->ptr, value->len)) == NULL)
+                return -1;
+            db_set_expiry(db, e, -1);
+        }
+    }
+    return 0;
+}
+
+/**
+ * MSET key value [key value ...]
+ */
+static inline void handle_mset(redis_db_t *db, client_t *c, const resp_arg_t *argv, int argc)
+{
+    if (argc % 2 == 0)
+    {
+        client_add_reply_str(c, "-ERR wrong number of arguments for 'mset' command\r\n");
+        return;
+    }
+    if (_db_mset(db, argv, argc) != 0)
+    {
+        client_add_reply_str(c, "-ERR out of memory\r\n");
+        return;
+    }
+    client_add_reply_str(c, REDIS_OK);
+}
+
+/**
+ * MSETNX key value [key value ...]
+ * Sets all the pairs only if none of the keys exists. Logged to the AOF
+ * as an MSET, and only when it did set them.
+ */
+static inline void handle_msetnx(redis_db_t *db, client_t *c, const resp_arg_t *argv, int argc)
+{
+    if (argc % 2 == 0)
+    {
+        client_add_reply_str(c, "-ERR wrong number of arguments for 'msetnx' command\r\n");
+        return;
+    }
+
+    db_entry *found[DB_FIND_BATCH];
+    int exists = 0;
+    for (int i = 1; i < argc && !exists; i += 2 * DB_FIND_BATCH)
+    {
+        int n = (argc - i) / 2 < DB_FIND_BATCH ? (argc - i) / 2 : DB_FIND_BATCH;
+        db_find_batch(db, &argv[i], 2, n, found);
+        for (int j = 0; j < n; j++)
+        {
+            if (found[j] == NULL)
+                continue;
+            if (!db_key_expired(found[j]))
+            {
+                exists = 1;
+            }
+            else
+            {
+                db_batch_forget(found, j + 1, n, found[j]);
+                db_delete_propagate(db, found[j]);
+            }
+        }
+    }
+    if (exists)
+    {
+        client_add_reply_integer(c, 0);
+        return;
+    }
+
+    if (_db_mset(db, argv, argc) != 0)
+    {
+        client_add_reply_str(c, "-ERR out of memory\r\n");
+        return;
+    }
+    resp_arg_t *logged = arena_alloc(&c->arena, sizeof(resp_arg_t) * argc);
+    if (logged != NULL)
+    {
+        memcpy(logged, argv, sizeof(resp_arg_t) * argc);
+        logged[0] = (resp_arg_t){(char *)"MSET", 4};
+        aof_feed(db, logged, argc);
+    }
+    client_add_reply_integer(c, 1);
+}
+
+// --- Keyspace Iteration ---
+// A SCAN cursor names a bucket of the keyspace dict (see dict_scan()).
+// With several shards the cursor also carries the shard it is walking:
+// cursor = local_cursor * nshards + shard_id.
+
+#define SCAN_DEFAULT_COUNT 10
+
+/**
+ * @brief Parses a SCAN cursor.
+ * @return 0 on success, -1 if it is not a non-negative integer.
+ */
+static inline int scan_parse_cursor(const resp_arg_t *arg, long long *cursor)
+{
+    return string_to_ll(arg->ptr, arg->len, cursor) == 0 && *cursor >= 0 ? 0 : -1;
+}
+
+/**
+ * @return The shard a SCAN cursor belongs to, or -1 if it is malformed.
+ */
+static inline int scan_cursor_shard(const resp_arg_t *arg, int nshards)
+{
+    long long cursor;
+    if (scan_parse_cursor(arg, &cursor) != 0)
+        return -1;
+    return (int)(cursor % nshards);
+}
+
+typedef struct
+{
+    arena_t *arena; // The client's: the batch is gone after the command
+    db_entry **keys;
+    size_t count;
+    size_t cap;
+    int oom;
+} _scan_batch_t;
+
+static inline void _scan_collect(void *privdata, dict_node_t *node)
+{
+    _scan_batch_t *b = (_scan_batch_t *)privdata;
+    if (b->count == b->cap)
+    {
+        size_t cap = b->cap ? b->cap * 2 : 64;
+        db_entry **keys = (db_entry **)arena_alloc(b->arena, cap * sizeof(db_entry *));
+        if (keys == NULL)
+        {
+            b->oom = 1;
+            return;
+        }
+        if (b->count)
+            memcpy(keys, b->keys, b->count * sizeof(db_entry *));
+        b->keys = keys;
+        b->cap = cap;
+    }
+    b->keys[b->count++] = DB_ENTRY_OF(node);
+}
+
+static inline const char *_type_name(val_type type)
+{
+    switch (type)
+    {
+    case VAL_TYPE_STRING: return "string";
+    case VAL_TYPE_LIST:   return "list";
+    case VAL_TYPE_ZSET:   return "zset";
+    }
+    return "none";
+}
+
+/**
+ * SCAN cursor [MATCH pattern] [COUNT count] [TYPE type]
+ * Walks about COUNT keys per call; a key present for the whole iteration
+ * is returned at least once, however the keyspace is resized meanwhile.
+ */
+static inline void handle_scan(redis_db_t *db, client_t *c, const resp_arg_t *argv, int argc)
+{
+    long long cursor;
+    if (scan_parse_cursor(&argv[1], &cursor) != 0)
+    {
+        client_add_reply_str(c, "-ERR invalid cursor\r\n");
+        return;
+    }
+
+    const resp_arg_t *pattern = NULL, *type = NULL;
+    long long count = SCAN_DEFAULT_COUNT;
+    for (int i = 2; i < argc; i++)
+    {
+        if (i + 1 >= argc)
+        {
+            client_add_reply_str(c, REDIS_SYNTAX_ERR);
+            return;
+        }
+        if (resp_arg_eq_nocase(&argv[i], "match"))
+        {
+            pattern = &argv[++i];
+        }
+        else if (resp_arg_eq_nocase(&argv[i], "type"))
+        {
+            type = &argv[++i];
+        }
+        else if (resp_arg_eq_nocase(&argv[i], "count"))
+        {
+            i++;
+            if (string_to_ll(argv[i].ptr, argv[i].len, &count) != 0)
+            {
+                client_add_reply_str(c, REDIS_NOT_INTEGER);
+                return;
+            }
+            if (count < 1)
+            {
+                client_add_reply_str(c, REDIS_SYNTAX_ERR);
+                return;
+            }
+        }
+        else
+        {
+            client_add_reply_str(c, REDIS_SYNTAX_ERR);
+            return;
+        }
+    }
+
+    uint64_t local = (uint64_t)(cursor / db->nshards);
+    _scan_batch_t batch = {.arena = &c->arena};
+    // Empty buckets cost a step too, so bound the walk of a sparse table
+    long long steps = count * 10;
+    do
+    {
+        local = dict_scan(&db->entries, local, _scan_collect, &batch);
+    } while (local != 0 && batch.count < (size_t)count && --steps > 0 && !batch.oom);
+
+    if (batch.oom)
+    {
+        client_add_reply_str(c, "-ERR out of memory\r\n");
+        return;
+    }
+
+    // Filter now that the walk is over: deleting an expired key mid-walk could shrink the table under it
+    size_t kept = 0;
+    for (size_t i = 0; i < batch.count; i++)
+    {
+        db_entry *e = batch.keys[i];
+        if (db_key_expired(e))
+        {
+            db_delete_propagate(db, e);
+            continue;
+        }
+        if (pattern && !string_match_len(pattern->ptr, pattern->len, e->key, e->key_len))
+            continue;
+        if (type && !resp_arg_eq_nocase(type, _type_name(e->type)))
+            continue;
+        batch.keys[kept++] = e;
+    }
+
+    // This shard is done: carry on with the next one, or finish
+    if (local != 0)
+        cursor = (long long)local * db->nshards + db->shard_id;
+    else
+        cursor = db->shard_id + 1 < db->nshards ? db->shard_id + 1 : 0;
+
+    char buf[LL_STR_SIZE];
+    client_add_reply_array_len(c, 2);
+    client_add_reply_bulk(c, buf, ll_to_str(buf, cursor));
+    client_add_reply_array_len(c, (long long)kept);
+    for (size_t i = 0; i < kept; i++)
+        client_add_reply_bulk(c, batch.keys[i]->key, batch.keys[i]->key_len);
+}
+
+// --- Lists ---
+// Small lists are one listpack; past the thresholds they become a
+// quicklist. Every list operation below is O(1) at either end.
+
+/**
+ * @brief (Internal) Adds one element at 'where' (QUICKLIST_HEAD/TAIL),
+ * converting a packed list first when the element would take it past the
+ * listpack thresholds.
+ * @return 0 on success, -1 if out of memory.
+ */
+static inline int _list_push(db_entry *e, int where, const char *value, size_t len)
+{
+    if (e->encoding == VAL_ENC_LISTPACK)
+    {
+        unsigned char *lp = (unsigned char *)e->value;
+        if (lp_count(lp) < list_max_listpack_entries && len <= list_max_listpack_value)
+        {
+            unsigned char *n = lp_insert(lp, where == QUICKLIST_HEAD ? lp_first(lp) : NULL, value, len);
+            if (n == NULL)
+                return -1;
+            e->value = n;
+            return 0;
+        }
+        if (list_convert_listpack(e) != 0)
+            return -1;
+    }
+    return quicklist_push((quicklist_t *)e->value, where, value, len);
+}
 
-// --- Compare function for the HEAP ---
-static inline int compare_expiry_entry(const void *a, const void *b)
+static inline size_t _list_length(const db_entry *e)
 {
-    expiry_entry_t *e1 = (expiry_entry_t *)a;
-    expiry_entry_t *e2 = (expiry_entry_t *)b;
-    if (e1->expiry_ms < e2->expiry_ms) return -1;
-    if (e1->expiry_ms > e2->expiry_ms) return 1;
-    return 0;
+    if (e->encoding == VAL_ENC_LISTPACK)
+        return lp_count((const unsigned char *)e->value);
+    return quicklist_count((const quicklist_t *)e->value);
 }
 
+/**
+ * @brief Looks up a list, applying passive expiry. Replies with 'missing'
+ * (or WRONGTYPE) itself when there is nothing to operate on.
+ * @return The entry, or NULL if a reply was already sent.
+ */
+static inline db_entry *_list_lookup(redis_db_t *db, client_t *c, const resp_arg_t *key, const char *missing)
+{
+    db_entry *e = db_find(db, key);
+    if (e == NULL)
+    {
+        client_add_reply_str(c, missing);
+        return NULL;
+    }
 
-// --- Static Helper Functions ---
+    // Passive eviction check
+    if (db_key_expired(e))
+    {
+        log_trace("Passive evict (list): %s", e->key);
+        db_delete_propagate(db, e);
+        client_add_reply_str(c, missing);
+        return NULL;
+    }
 
-static inline void free_db_value(db_entry *e)
+    if (e->type != VAL_TYPE_LIST)
+    {
+        client_add_reply_str(c, REDIS_WRONGTYPE);
+        return NULL;
+    }
+    return e;
+}
+
+/**
+ * LPUSH key element [element ...]
+ * RPUSH key element [element ...]
+ * Out of memory midway, the elements pushed so far stay, and only they
+ * are logged to the AOF, so replicas end up with the same list.
+ */
+static inline void _list_push_command(redis_db_t *db, client_t *c, const resp_arg_t *argv, int argc, int where)
 {
-    if (e == NULL || e->value == NULL)
-        return;
+    const resp_arg_t *key = &argv[1];
+    db_entry *e = db_find(db, key);
 
-    if (e->type == VAL_TYPE_STRING)
+    // Passive eviction check: an expired key, whatever its type, is absent
+    if (e != NULL && db_key_expired(e))
     {
-        free(e->value); // 'value' is a char*
+        log_trace("Passive evict (push): %s", e->key);
+        db_delete_propagate(db, e);
+        e = NULL;
     }
-    else if (e->type == VAL_TYPE_LIST)
+
+    if (e == NULL)
     {
-        RedisList *list = (RedisList *)e->value;
-        ListNode *current = list->head;
-        while (current)
+        unsigned char *lp = lp_new();
+        if (lp == NULL)
+        {
+            client_add_reply_str(c, "-ERR out of memory\r\n");
+            return;
+        }
+        e = db_add(db, key);
+        if (e == NULL)
         {
-            ListNode *next = current->next;
-            free(current->value); // Free the string in the node
-            free(current);        // Free the node itself
-            current = next;
+            lp_free(lp);
+            client_add_reply_str(c, "-ERR out of memory\r\n");
+            return;
         }
-        free(list); // Free the main list struct
+        e->type = VAL_TYPE_LIST;
+        e->encoding = VAL_ENC_LISTPACK;
+        e->value = lp;
     }
-    else if (e->type == VAL_TYPE_ZSET) // 3. Add free logic
+    else if (e->type != VAL_TYPE_LIST)
     {
-        zset_free((RedisZSet*)e->value); // Calls the new lib's free func
+        client_add_reply_str(c, REDIS_WRONGTYPE);
+        return;
     }
-    
-    e->value = NULL;
-}
 
-// --- Public Handler Functions ---
+    int i = 2;
+    while (i < argc && _list_push(e, where, argv[i].ptr, argv[i].len) == 0)
+        i++;
+    if (i > 2)
+    {
+        aof_feed(db, argv, i);
+        db_signal_ready(db, key);
+    }
+    if (i < argc)
+    {
+        log_error("%s: out of memory", where == QUICKLIST_HEAD ? "LPUSH" : "RPUSH");
+        if (_list_length(e) == 0)
+            db_delete(db, e); // A list never exists empty
+        client_add_reply_str(c, "-ERR out of memory\r\n");
+        return;
+    }
+    client_add_reply_integer(c, _list_length(e));
+}
 
-static inline void handle_echo(const char *str, int fd)
+static inline void handle_lpush(redis_db_t *db, client_t *c, const resp_arg_t *argv, int argc)
 {
-    if (dbg)
-        printf("Handling echo command\n");
-    char *encoded_str = encode_bulk_str(str);
-    if (encoded_str) {
-        send(fd, encoded_str, strlen(encoded_str), 0);
-        free(encoded_str);
-    }
+    _list_push_command(db, c, argv, argc, QUICKLIST_HEAD);
 }
 
-static inline void handle_set(db_entry **db_head, heap_t *expiry_heap, char *key, char *value, long long expiry, int fd)
+static inline void handle_rpush(redis_db_t *db, client_t *c, const resp_arg_t *argv, int argc)
 {
-    if (dbg)
-        printf("handle_set-> params recvd: %s %s %lld %d\n", key, value, expiry, fd);
-    
-    db_entry *e;
-    HASH_FIND_STR(*db_head, key, e);
+    _list_push_command(db, c, argv, argc, QUICKLIST_TAIL);
+}
 
-    if (e == NULL)
+/**
+ * @brief Pops one element of a non-empty list straight into c's reply.
+ * The key is deleted once its last element is gone, like Redis.
+ */
+static inline void list_pop_reply(redis_db_t *db, db_entry *e, int where, client_t *c)
+{
+    const char *value;
+    size_t vlen;
+    if (e->encoding == VAL_ENC_LISTPACK)
     {
-        e = (db_entry *)malloc(sizeof(db_entry));
-        e->key = strdup(key);
-        e->value = NULL;
-        HASH_ADD_STR(*db_head, key, e);
+        unsigned char *lp = (unsigned char *)e->value;
+        unsigned char *p = where == QUICKLIST_HEAD ? lp_first(lp) : lp_last(lp);
+        value = lp_get(p, &vlen);
+        client_add_reply_bulk(c, value, vlen);
+        e->value = lp_delete(lp, p, 1);
     }
     else
     {
-        free_db_value(e);
-        // Note: The *old* expiry_entry_t is still in the heap.
-        // This is OK. Our new eviction loop will safely handle it.
-    }
-
-    e->value = strdup(value);
-    e->type = VAL_TYPE_STRING;
-    e->expiry_ms = expiry; // The hash table entry gets the expiry time
-
-    // If the key has an expiry, push a NEW expiry_entry to the heap
-    if (expiry != -1) {
-        expiry_entry_t *heap_entry = (expiry_entry_t *)malloc(sizeof(expiry_entry_t));
-        if (heap_entry) {
-            heap_entry->expiry_ms = expiry;
-            heap_entry->key = strdup(key); // Store a *copy* of the key
-            if (heap_push(expiry_heap, heap_entry) != 0) {
-                perror("heap_push");
-                free(heap_entry->key);
-                free(heap_entry);
-            }
-        }
+        quicklist_t *ql = (quicklist_t *)e->value;
+        quicklist_peek(ql, where, &value, &vlen);
+        client_add_reply_bulk(c, value, vlen);
+        quicklist_del(ql, where);
     }
 
-    send(fd, REDIS_OK, strlen(REDIS_OK), 0);
+    if (_list_length(e) == 0)
+        db_delete(db, e);
 }
 
-static inline void handle_get(db_entry **db_head, char *key, int fd)
+/**
+ * @brief Logs a pop served to BLPOP/BRPOP as the LPOP/RPOP it amounted to:
+ * a replay has no client waiting.
+ */
+static inline void list_pop_propagate(redis_db_t *db, const resp_arg_t *key, int where)
 {
-    db_entry *e;
-    HASH_FIND_STR(*db_head, key, e);
+    resp_arg_t argv[2] = {{(char *)(where == QUICKLIST_HEAD ? "LPOP" : "RPOP"), 4}, *key};
+    aof_feed(db, argv, 2);
+}
 
-    if (e == NULL)
+/**
+ * LPOP key [count]
+ * RPOP key [count]
+ */
+static inline void _list_pop_command(redis_db_t *db, client_t *c, const resp_arg_t *argv, int argc, int where)
+{
+    long long count = 1;
+    if (argc == 3 && (string_to_ll(argv[2].ptr, argv[2].len, &count) != 0 || count < 0))
     {
-        send(fd, NULL_BULK_STRING, strlen(NULL_BULK_STRING), 0);
+        client_add_reply_str(c, "-ERR value is out of range, must be positive\r\n");
         return;
     }
-
-    // Passive eviction check
-    if (e->expiry_ms != -1 && e->expiry_ms < current_time_ms())
+    if (argc > 3)
     {
-        if (dbg)
-            printf("Passive evict (GET): %s\n", e->key);
-        free_db_value(e);
-        HASH_DEL(*db_head, e);
-        free(e->key);
-        free(e);
-        send(fd, NULL_BULK_STRING, strlen(NULL_BULK_STRING), 0);
+        client_add_reply_str(c, REDIS_SYNTAX_ERR);
         return;
     }
 
-    if (e->type != VAL_TYPE_STRING)
-    {
-        send(fd, REDIS_WRONGTYPE, strlen(REDIS_WRONGTYPE), 0);
+    db_entry *e = _list_lookup(db, c, &argv[1], argc == 3 ? "*-1\r\n" : NULL_BULK_STRING);
+    if (e == NULL)
         return;
-    }
 
-    char *value_str = (char *)e->value;
-    char *response = encode_bulk_str(value_str);
-    if (response)
-    {
-        send(fd, response, strlen(response), 0);
-        free(response);
-    }
+    size_t len = _list_length(e);
+    size_t n = (size_t)count < len ? (size_t)count : len;
+    if (argc == 3)
+        client_add_reply_array_len(c, n);
+
+    for (size_t i = 0; i < n; i++)
+        list_pop_reply(db, e, where, c);
 }
 
-static inline void handle_rpush(db_entry **db_head, char **cmnds, int cmnd_list_size, int fd)
+static inline void handle_lpop(redis_db_t *db, client_t *c, const resp_arg_t *argv, int argc)
 {
-    if (cmnd_list_size < 3) return;
+    _list_pop_command(db, c, argv, argc, QUICKLIST_HEAD);
+}
 
-    char *key = cmnds[1];
-    db_entry *e;
-    HASH_FIND_STR(*db_head, key, e);
+static inline void handle_rpop(redis_db_t *db, client_t *c, const resp_arg_t *argv, int argc)
+{
+    _list_pop_command(db, c, argv, argc, QUICKLIST_TAIL);
+}
 
-    RedisList *list;
+/**
+ * LLEN key
+ */
+static inline void handle_llen(redis_db_t *db, client_t *c, const resp_arg_t *argv, int argc)
+{
+    (void)argc;
+    db_entry *e = _list_lookup(db, c, &argv[1], ":0\r\n");
+    if (e == NULL)
+        return;
+    client_add_reply_integer(c, (long long)_list_length(e));
+}
 
+/**
+ * LINDEX key index
+ */
+static inline void handle_lindex(redis_db_t *db, client_t *c, const resp_arg_t *argv, int argc)
+{
+    (void)argc;
+    long long index;
+    if (string_to_ll(argv[2].ptr, argv[2].len, &index) != 0)
+    {
+        client_add_reply_str(c, REDIS_NOT_INTEGER);
+        return;
+    }
+    db_entry *e = _list_lookup(db, c, &argv[1], NULL_BULK_STRING);
     if (e == NULL)
+        return;
+
+    const char *value;
+    size_t vlen;
+    if (e->encoding == VAL_ENC_LISTPACK)
     {
-        e = (db_entry *)malloc(sizeof(db_entry));
-        e->key = strdup(key);
-        e->expiry_ms = -1;
-        e->type = VAL_TYPE_LIST;
-        list = (RedisList *)malloc(sizeof(RedisList));
-        list->head = NULL;
-        list->tail = NULL;
-        list->len = 0;
-        e->value = list;
-        HASH_ADD_STR(*db_head, key, e);
+        unsigned char *p = lp_seek((unsigned char *)e->value, index);
+        if (p == NULL)
+        {
+            client_add_reply_str(c, NULL_BULK_STRING);
+            return;
+        }
+        value = lp_get(p, &vlen);
     }
     else
     {
-        if (e->type != VAL_TYPE_LIST)
+        quicklist_iter_t it;
+        if (!quicklist_seek((quicklist_t *)e->value, index, &it))
         {
-            send(fd, REDIS_WRONGTYPE, strlen(REDIS_WRONGTYPE), 0);
+            client_add_reply_str(c, NULL_BULK_STRING);
             return;
         }
+        quicklist_next(&it, &value, &vlen);
+    }
+    client_add_reply_bulk(c, value, vlen);
+}
 
-        // Passive eviction check
-        if (e->expiry_ms != -1 && e->expiry_ms < current_time_ms())
-        {
-            if (dbg) printf("Passive evict (RPUSH): %s\n", e->key);
-            free_db_value(e); // Free the old list
-            // Re-initialize the list
-            list = (RedisList *)malloc(sizeof(RedisList));
-            list->head = NULL; list->tail = NULL; list->len = 0;
-            e->value = list;
-            e->expiry_ms = -1;
-        }
-        else
+/**
+ * LRANGE key start stop
+ * Negative indices count from the tail. The start element is located from
+ * the nearer end, then the range is walked once.
+ */
+static inline void handle_lrange(redis_db_t *db, client_t *c, const resp_arg_t *argv, int argc)
+{
+    (void)argc;
+    long long start, stop;
+    if (string_to_ll(argv[2].ptr, argv[2].len, &start) != 0 ||
+        string_to_ll(argv[3].ptr, argv[3].len, &stop) != 0)
+    {
+        client_add_reply_str(c, REDIS_NOT_INTEGER);
+        return;
+    }
+
+    db_entry *e = _list_lookup(db, c, &argv[1], REDIS_EMPTY_ARRAY);
+    if (e == NULL)
+        return;
+
+    long long len = _list_length(e);
+    if (start < 0) start = len + start;
+    if (stop < 0) stop = len + stop;
+    if (start < 0) start = 0;
+    if (stop >= len) stop = len - 1;
+    if (start >= len || start > stop) {
+        client_add_reply_str(c, REDIS_EMPTY_ARRAY);
+        return;
+    }
+
+    long long count = (stop - start) + 1;
+    client_add_reply_array_len(c, count);
+
+    if (e->encoding == VAL_ENC_LISTPACK)
+    {
+        unsigned char *lp = (unsigned char *)e->value;
+        unsigned char *p = lp_seek(lp, start);
+        for (long long i = 0; i < count; i++)
         {
-            list = (RedisList *)e->value;
+            size_t vlen;
+            const char *value = lp_get(p, &vlen);
+            client_add_reply_bulk(c, value, vlen);
+            p = lp_next(lp, p);
         }
+        return;
     }
 
-    for (int i = 2; i < cmnd_list_size; i++)
+    quicklist_iter_t it;
+    quicklist_seek((quicklist_t *)e->value, start, &it);
+    for (long long i = 0; i < count; i++)
     {
-        ListNode *new_node = (ListNode *)malloc(sizeof(ListNode));
-        new_node->value = strdup(cmnds[i]);
-        new_node->next = NULL;
-
-        if (list->tail == NULL) {
-            list->head = new_node;
-            list->tail = new_node;
-        } else {
-            list->tail->next = new_node;
-            list->tail = new_node;
-        }
-        list->len++;
+        const char *value;
+        size_t vlen;
+        quicklist_next(&it, &value, &vlen);
+        client_add_reply_bulk(c, value, vlen);
     }
+}
+
+// --- Blocking Pops ---
+// A BLPOP/BRPOP that finds no element parks a bpop_waiter on every key it
+// names. Pushes only mark a key ready; the event loop then serves its
+// waiters in arrival order once the pushing command has returned, and
+// times out the rest off bpop_heap. See serve_ready_keys() in main.c.
 
-    char *response = encode_integer(list->len);
-    if (response)
+/**
+ * @brief Unlinks 'w' from its keys, the deadline heap and the db, and
+ * frees it. The parked client itself is left to the caller.
+ */
+static inline void bpop_unpark(redis_db_t *db, bpop_waiter_t *w)
+{
+    for (int i = 0; i < w->nkeys; i++)
     {
-        send(fd, response, strlen(response), 0);
-        free(response);
+        bpop_link_t *l = &w->links[i];
+        blocked_key_t *bk = l->bk;
+        if (bk == NULL)
+            continue; // Parking failed before this key
+        if (l->prev) l->prev->next = l->next;
+        else bk->head = l->next;
+        if (l->next) l->next->prev = l->prev;
+        else bk->tail = l->prev;
+
+        if (bk->head == NULL && !bk->ready)
+        {
+            HASH_DEL(db->blocking_keys, bk);
+            free(bk->key);
+            free(bk);
+        }
     }
+    if (w->heap_index != HEAP_INDEX_NONE)
+        heap_remove(db->bpop_heap, w->heap_index);
+    if (w->prev) w->prev->next = w->next;
+    else db->waiters = w->next;
+    if (w->next) w->next->prev = w->prev;
+    free(w);
 }
 
-static inline void handle_lrange(db_entry **db_head, char **cmnds, int cmnd_list_size, int fd)
+/**
+ * @brief Parks a pop on 'keys' until 'deadline_ms' (-1 = forever).
+ * @return The waiter, or NULL if out of memory.
+ */
+static inline bpop_waiter_t *bpop_park(redis_db_t *db, const resp_arg_t *keys, int nkeys, int where, long long deadline_ms)
 {
-    if (cmnd_list_size != 4) return;
+    bpop_waiter_t *w = (bpop_waiter_t *)calloc(1, sizeof(bpop_waiter_t) + nkeys * sizeof(bpop_link_t));
+    if (w == NULL)
+        return NULL;
+    w->where = where;
+    w->deadline_ms = deadline_ms;
+    w->heap_index = HEAP_INDEX_NONE;
+    w->nkeys = nkeys;
+    w->next = db->waiters;
+    if (db->waiters) db->waiters->prev = w;
+    db->waiters = w;
 
-    char *key = cmnds[1];
-    int start = strtol(cmnds[2], NULL, 10);
-    int stop = strtol(cmnds[3], NULL, 10);
+    for (int i = 0; i < nkeys; i++)
+    {
+        blocked_key_t *bk;
+        HASH_FIND(hh, db->blocking_keys, keys[i].ptr, keys[i].len, bk);
+        if (bk == NULL)
+        {
+            bk = (blocked_key_t *)calloc(1, sizeof(blocked_key_t));
+            if (bk == NULL || (bk->key = memdup_cstr(keys[i].ptr, keys[i].len)) == NULL)
+            {
+                free(bk);
+                bpop_unpark(db, w);
+                return NULL;
+            }
+            bk->key_len = keys[i].len;
+            HASH_ADD_KEYPTR(hh, db->blocking_keys, bk->key, bk->key_len, bk);
+        }
 
-    db_entry *e;
-    HASH_FIND_STR(*db_head, key, e);
+        bpop_link_t *l = &w->links[i];
+        l->w = w;
+        l->bk = bk;
+        l->prev = bk->tail;
+        if (bk->tail) bk->tail->next = l;
+        else bk->head = l;
+        bk->tail = l;
+    }
 
-    if (e == NULL)
+    if (deadline_ms != -1 && heap_push(db->bpop_heap, w) != 0)
     {
-        send(fd, REDIS_EMPTY_ARRAY, strlen(REDIS_EMPTY_ARRAY), 0);
-        return;
+        bpop_unpark(db, w);
+        return NULL;
     }
+    return w;
+}
 
-    // Passive eviction check
-    if (e->expiry_ms != -1 && e->expiry_ms < current_time_ms())
+/**
+ * BLPOP key [key ...] timeout
+ * BRPOP key [key ...] timeout
+ * Pops from the first non-empty list; with none, the client is parked
+ * (CLIENT_BLOCKED_POP) until a push serves it or 'timeout' seconds pass.
+ * A timeout of 0 waits forever. Inside EXEC it never parks.
+ */
+static inline void _list_bpop_command(redis_db_t *db, client_t *c, const resp_arg_t *argv, int argc, int where)
+{
+    double timeout;
+    if (string_to_double(argv[argc - 1].ptr, argv[argc - 1].len, &timeout) != 0 || isinf(timeout))
     {
-        if (dbg) printf("Passive evict (LRANGE): %s\n", e->key);
-        free_db_value(e);
-        HASH_DEL(*db_head, e);
-        free(e->key);
-        free(e);
-        send(fd, REDIS_EMPTY_ARRAY, strlen(REDIS_EMPTY_ARRAY), 0);
+        client_add_reply_str(c, "-ERR timeout is not a float or out of range\r\n");
         return;
     }
-
-    if (e->type != VAL_TYPE_LIST)
+    if (timeout < 0)
     {
-        send(fd, REDIS_WRONGTYPE, strlen(REDIS_WRONGTYPE), 0);
+        client_add_reply_str(c, "-ERR timeout is negative\r\n");
         return;
     }
-
-    RedisList *list = (RedisList *)e->value;
-    int len = list->len;
-
-    if (stop >= len) stop = len - 1;
-    if (start >= len || start > stop) {
-        send(fd, REDIS_EMPTY_ARRAY, strlen(REDIS_EMPTY_ARRAY), 0);
+    // Past this the deadline in ms would not fit in a long long
+    if (timeout * 1000 >= (double)(LLONG_MAX / 2))
+    {
+        client_add_reply_str(c, "-ERR timeout is out of range\r\n");
         return;
     }
 
-    int count = (stop - start) + 1;
-    char header[32];
-    sprintf(header, "*%d\r\n", count);
-    send(fd, header, strlen(header), 0);
+    for (int i = 1; i < argc - 1; i++)
+    {
+        db_entry *e = db_find(db, &argv[i]);
+        if (e == NULL)
+            continue;
+        if (db_key_expired(e))
+        {
+            log_trace("Passive evict (bpop): %s", e->key);
+            db_delete_propagate(db, e);
+            continue;
+        }
+        if (e->type != VAL_TYPE_LIST)
+        {
+            client_add_reply_str(c, REDIS_WRONGTYPE);
+            return;
+        }
+        client_add_reply_array_len(c, 2);
+        client_add_reply_bulk(c, argv[i].ptr, argv[i].len);
+        list_pop_reply(db, e, where, c);
+        list_pop_propagate(db, &argv[i], where);
+        return;
+    }
 
-    ListNode *current = list->head;
-    for (int i = 0; i < start; i++)
+    // Inside EXEC nothing can push meanwhile, so don't wait at all
+    if (c->flags & CLIENT_IN_EXEC)
     {
-        current = current->next;
+        client_add_reply_str(c, "*-1\r\n");
+        return;
     }
 
-    for (int i = 0; i < count; i++)
+    long long deadline = timeout > 0 ? cached_time_ms() + (long long)(timeout * 1000) : -1;
+    bpop_waiter_t *w = bpop_park(db, &argv[1], argc - 2, where, deadline);
+    if (w == NULL)
     {
-        char *response_item = encode_bulk_str(current->value);
-        if (response_item)
-        {
-            send(fd, response_item, strlen(response_item), 0);
-            free(response_item);
+        client_add_reply_str(c, "-ERR out of memory\r\n");
+        return;
+    }
+    w->c = c;
+    c->bpop = w;
+    c->flags |= CLIENT_BLOCKED_POP;
+}
+
+static inline void handle_blpop(redis_db_t *db, client_t *c, const resp_arg_t *argv, int argc)
+{
+    _list_bpop_command(db, c, argv, argc, QUICKLIST_HEAD);
+}
+
+static inline void handle_brpop(redis_db_t *db, client_t *c, const resp_arg_t *argv, int argc)
+{
+    _list_bpop_command(db, c, argv, argc, QUICKLIST_TAIL);
+}
+
+/**
+ * @brief (Internal) Adds or updates one member, converting a packed set
+ * first when a new member would take it past the listpack thresholds.
+ * @return Same as zset_add(): 1 added, 0 updated, -1 out of memory.
+ */
+static inline int _zset_add(db_entry *e, double score, const char *member, size_t member_len)
+{
+    if (e->encoding == VAL_ENC_LISTPACK) {
+        unsigned char *lp = (unsigned char *)e->value;
+        unsigned char *p = zlp_find(lp, member, member_len);
+        if (p) {
+            if (zlp_score_at(lp, p) != score)
+                zlp_update(lp, p, score);
+            return 0;
         }
-        current = current->next;
+        if (zlp_length(lp) < zset_max_listpack_entries && member_len <= zset_max_listpack_value) {
+            unsigned char *n = zlp_insert(lp, score, member, member_len);
+            if (n == NULL)
+                return -1;
+            e->value = n;
+            return 1;
+        }
+        if (zset_convert_listpack(e) != 0)
+            return -1;
     }
+    return zset_add((RedisZSet *)e->value, score, member, member_len);
 }
-static inline void handle_zadd(db_entry **db_head, char **cmnds, int cmnd_list_size, int fd)
+
+/**
+ * ZADD key score member [score member ...]
+ * Out of memory midway, the pairs added so far stay, and only they are
+ * logged to the AOF.
+ */
+static inline void handle_zadd(redis_db_t *db, client_t *c, const resp_arg_t *argv, int argc)
 {
-    if (cmnd_list_size < 4 || (cmnd_list_size - 2) % 2 != 0) {
-        return; // Wrong args
+    if ((argc - 2) % 2 != 0) {
+        client_add_reply_str(c, REDIS_SYNTAX_ERR);
+        return;
+    }
+
+    // Validate every score up front so a bad one leaves the set untouched
+    for (int i = 2; i < argc; i += 2) {
+        double score;
+        if (string_to_double(argv[i].ptr, argv[i].len, &score) != 0) {
+            client_add_reply_str(c, REDIS_NOT_FLOAT);
+            return;
+        }
     }
 
-    char *key = cmnds[1];
-    db_entry *e;
-    HASH_FIND_STR(*db_head, key, e);
-    RedisZSet *zset;
+    const resp_arg_t *key = &argv[1];
+    db_entry *e = db_find(db, key);
+
+    // Passive eviction check: an expired key, whatever its type, is absent
+    if (e != NULL && db_key_expired(e)) {
+        log_trace("Passive evict (zadd): %s", e->key);
+        db_delete_propagate(db, e);
+        e = NULL;
+    }
+    int created = e == NULL;
 
     if (e == NULL) {
-        // Create new ZSET
-        e = (db_entry *)malloc(sizeof(db_entry));
-        e->key = strdup(key);
-        e->expiry_ms = -1;
+        // New sets start packed
+        unsigned char *lp = lp_new();
+        if (lp == NULL) {
+            client_add_reply_str(c, "-ERR out of memory\r\n");
+            return;
+        }
+        e = db_add(db, key);
+        if (e == NULL) {
+            lp_free(lp);
+            client_add_reply_str(c, "-ERR out of memory\r\n");
+            return;
+        }
         e->type = VAL_TYPE_ZSET;
-        zset = zset_create(); // From new lib
-        e->value = zset;
-        HASH_ADD_STR(*db_head, key, e);
+        e->encoding = VAL_ENC_LISTPACK;
+        e->value = lp;
     } else {
         if (e->type != VAL_TYPE_ZSET) {
-            send(fd, REDIS_WRONGTYPE, strlen(REDIS_WRONGTYPE), 0);
+            client_add_reply_str(c, REDIS_WRONGTYPE);
             return;
         }
-        zset = (RedisZSet *)e->value;
     }
 
     int elements_added = 0;
-    for (int i = 2; i < cmnd_list_size; i += 2) {
-        double score = strtod(cmnds[i], NULL);
-        char *member = cmnds[i+1];
-        elements_added += zset_add(zset, score, member); // From new lib
+    int i = 2;
+    for (; i < argc; i += 2) {
+        double score;
+        string_to_double(argv[i].ptr, argv[i].len, &score);
+        int added = _zset_add(e, score, argv[i+1].ptr, argv[i+1].len);
+        if (added < 0)
+            break;
+        elements_added += added;
     }
-    
-    char *response = encode_integer(elements_added);
-    if (response) {
-        send(fd, response, strlen(response), 0);
-        free(response);
+    if (i > 2)
+        aof_feed(db, argv, i);
+
+    if (i < argc) {
+        log_error("ZADD: out of memory");
+        if (created && elements_added == 0)
+            db_delete(db, e); // A sorted set never exists empty
+        client_add_reply_str(c, "-ERR out of memory\r\n");
+        return;
+    }
+    client_add_reply_integer(c, elements_added);
+}
+
+/**
+ * @brief Looks up a sorted set for a read-only command, applying passive
+ * expiry. Replies with 'missing' (or WRONGTYPE) itself when there is
+ * nothing to read.
+ * @return The entry, or NULL if a reply was already sent.
+ */
+static inline db_entry *_zset_lookup_read(redis_db_t *db, client_t *c, const resp_arg_t *key, const char *missing)
+{
+    db_entry *e = db_find(db, key);
+    if (e == NULL) {
+        client_add_reply_str(c, missing);
+        return NULL;
     }
+
+    // Passive eviction check
+    if (db_key_expired(e)) {
+        log_trace("Passive evict (zset): %s", e->key);
+        db_delete_propagate(db, e);
+        client_add_reply_str(c, missing);
+        return NULL;
+    }
+
+    if (e->type != VAL_TYPE_ZSET) {
+        client_add_reply_str(c, REDIS_WRONGTYPE);
+        return NULL;
+    }
+    return e;
 }
 
-static inline void handle_zrange(db_entry **db_head, char **cmnds, int cmnd_list_size, int fd)
+// Encoding-independent reads; same contracts as the zset_* functions
+
+static inline size_t _zset_length(const db_entry *e)
 {
-    if (cmnd_list_size != 4) { /* send error */ return; }
+    if (e->encoding == VAL_ENC_LISTPACK)
+        return zlp_length((const unsigned char *)e->value);
+    return zset_length((const RedisZSet *)e->value);
+}
 
-    char *key = cmnds[1];
-    long start = strtol(cmnds[2], NULL, 10);
-    long stop = strtol(cmnds[3], NULL, 10);
+static inline size_t _zset_count_below(const db_entry *e, double score, int inclusive)
+{
+    if (e->encoding == VAL_ENC_LISTPACK)
+        return zlp_count_below((unsigned char *)e->value, score, inclusive);
+    return zset_count_below((RedisZSet *)e->value, score, inclusive);
+}
 
-    db_entry *e;
-    HASH_FIND_STR(*db_head, key, e);
+static inline int _zset_rank(const db_entry *e, const resp_arg_t *member, size_t *rank)
+{
+    if (e->encoding == VAL_ENC_LISTPACK)
+        return zlp_rank((unsigned char *)e->value, member->ptr, member->len, rank);
+    return zset_rank((RedisZSet *)e->value, member->ptr, member->len, rank);
+}
 
-    if (e == NULL) {
-        send(fd, REDIS_EMPTY_ARRAY, strlen(REDIS_EMPTY_ARRAY), 0);
+static inline int _zset_score(const db_entry *e, const resp_arg_t *member, double *score)
+{
+    if (e->encoding == VAL_ENC_LISTPACK) {
+        unsigned char *lp = (unsigned char *)e->value;
+        unsigned char *p = zlp_find(lp, member->ptr, member->len);
+        if (p == NULL)
+            return 0;
+        *score = zlp_score_at(lp, p);
+        return 1;
+    }
+    return zset_score((RedisZSet *)e->value, member->ptr, member->len, score);
+}
+
+static inline void _zset_reply_elem(client_t *c, const char *member, size_t member_len, double score, int withscores)
+{
+    client_add_reply_bulk(c, member, member_len);
+    if (withscores) {
+        char buf[DOUBLE_STR_SIZE];
+        size_t len = double_to_str(buf, score);
+        client_add_reply_bulk(c, buf, len);
+    }
+}
+
+/**
+ * @brief Replies with 'count' members starting 'start' steps into the
+ * walk, using one cursor seek rather than a descent per element.
+ */
+static inline void _zset_reply_range(client_t *c, const db_entry *e, size_t start, size_t count,
+                                     int reverse, int withscores)
+{
+    client_add_reply_array_len(c, withscores ? count * 2 : count);
+
+    if (e->encoding == VAL_ENC_LISTPACK) {
+        unsigned char *lp = (unsigned char *)e->value;
+        size_t rank = reverse ? zlp_length(lp) - 1 - start : start;
+        unsigned char *p = lp_seek(lp, 2 * (long long)rank);
+        for (size_t i = 0; i < count && p; i++) {
+            size_t len;
+            const char *member = lp_get(p, &len);
+            _zset_reply_elem(c, member, len, zlp_score_at(lp, p), withscores);
+            // Pairs are two entries: hop over a score to the neighbouring member
+            if (reverse) {
+                p = lp_prev(lp, p);
+                if (p)
+                    p = lp_prev(lp, p);
+            } else {
+                p = lp_next(lp, lp_next(lp, p));
+            }
+        }
         return;
     }
-    if (e->type != VAL_TYPE_ZSET) {
-        send(fd, REDIS_WRONGTYPE, strlen(REDIS_WRONGTYPE), 0);
+
+    zset_iter_t it;
+    zset_elem_t el;
+    zset_iter_seek_rank(&it, (RedisZSet *)e->value, start, reverse);
+    for (size_t i = 0; i < count && zset_iter_next(&it, &el); i++)
+        _zset_reply_elem(c, el.member, el.member_len, el.score, withscores);
+}
+
+/**
+ * ZRANGE key start stop [WITHSCORES]
+ * ZREVRANGE key start stop [WITHSCORES]
+ */
+static inline void _zset_range_by_rank(redis_db_t *db, client_t *c, const resp_arg_t *argv, int argc, int reverse)
+{
+    long long start, stop;
+    if (string_to_ll(argv[2].ptr, argv[2].len, &start) != 0 ||
+        string_to_ll(argv[3].ptr, argv[3].len, &stop) != 0)
+    {
+        client_add_reply_str(c, REDIS_NOT_INTEGER);
         return;
     }
-    
-    RedisZSet *zset = (RedisZSet *)e->value;
-    size_t total_elements = _zset_avl_count(zset->avl_root); // Get total size
+    int withscores = 0;
+    if (argc == 5 && resp_arg_eq_nocase(&argv[4], "withscores")) {
+        withscores = 1;
+    } else if (argc != 4) {
+        client_add_reply_str(c, REDIS_SYNTAX_ERR);
+        return;
+    }
+
+    db_entry *e = _zset_lookup_read(db, c, &argv[1], REDIS_EMPTY_ARRAY);
+    if (e == NULL)
+        return;
+    long long total_elements = _zset_length(e);
 
     // Handle negative indices
     if (start < 0) start = total_elements + start;
     if (stop < 0) stop = total_elements + stop;
     if (start < 0) start = 0;
     if (start > stop || start >= total_elements) {
-        send(fd, REDIS_EMPTY_ARRAY, strlen(REDIS_EMPTY_ARRAY), 0);
+        client_add_reply_str(c, REDIS_EMPTY_ARRAY);
         return;
     }
     if (stop >= total_elements) stop = total_elements - 1;
-    
-    size_t count = (stop - start) + 1;
-    
-    char header[32];
-    sprintf(header, "*%zu\r\n", count);
-    send(fd, header, strlen(header), 0);
-    
-    // Iterate by rank
-    for (size_t i = 0; i < count; i++) {
-        ZSetNode *node = zset_get_by_rank(zset, start + i); // From new lib
-        if (node) {
-            char *response_item = encode_bulk_str(node->member);
-            if (response_item) {
-                send(fd, response_item, strlen(response_item), 0);
-                free(response_item);
+
+    _zset_reply_range(c, e, start, stop - start + 1, reverse, withscores);
+}
+
+static inline void handle_zrange(redis_db_t *db, client_t *c, const resp_arg_t *argv, int argc)
+{
+    _zset_range_by_rank(db, c, argv, argc, 0);
+}
+
+static inline void handle_zrevrange(redis_db_t *db, client_t *c, const resp_arg_t *argv, int argc)
+{
+    _zset_range_by_rank(db, c, argv, argc, 1);
+}
+
+/**
+ * @brief Parses a score bound: a float, "-inf"/"+inf", or "(" + float
+ * for an exclusive bound.
+ * @return 0 on success, -1 if malformed.
+ */
+static inline int _zset_parse_bound(const resp_arg_t *arg, double *score, int *exclusive)
+{
+    const char *p = arg->ptr;
+    size_t len = arg->len;
+    *exclusive = 0;
+    if (len > 0 && p[0] == '(') {
+        *exclusive = 1;
+        p++;
+        len--;
+    }
+    return string_to_double(p, len, score);
+}
+
+/**
+ * ZRANGEBYSCORE key min max [WITHSCORES] [LIMIT offset count]
+ */
+static inline void handle_zrangebyscore(redis_db_t *db, client_t *c, const resp_arg_t *argv, int argc)
+{
+    double min, max;
+    int minex, maxex;
+    if (_zset_parse_bound(&argv[2], &min, &minex) != 0 ||
+        _zset_parse_bound(&argv[3], &max, &maxex) != 0)
+    {
+        client_add_reply_str(c, "-ERR min or max is not a float\r\n");
+        return;
+    }
+
+    int withscores = 0;
+    long long offset = 0, limit = -1;
+    for (int i = 4; i < argc; i++) {
+        if (resp_arg_eq_nocase(&argv[i], "withscores")) {
+            withscores = 1;
+        } else if (resp_arg_eq_nocase(&argv[i], "limit") && i + 2 < argc) {
+            if (string_to_ll(argv[i + 1].ptr, argv[i + 1].len, &offset) != 0 ||
+                string_to_ll(argv[i + 2].ptr, argv[i + 2].len, &limit) != 0)
+            {
+                client_add_reply_str(c, REDIS_NOT_INTEGER);
+                return;
             }
+            i += 2;
+        } else {
+            client_add_reply_str(c, REDIS_SYNTAX_ERR);
+            return;
         }
     }
+
+    db_entry *e = _zset_lookup_read(db, c, &argv[1], REDIS_EMPTY_ARRAY);
+    if (e == NULL)
+        return;
+
+    // The matching members are exactly the ranks [lo, hi)
+    size_t lo = _zset_count_below(e, min, minex);
+    size_t hi = _zset_count_below(e, max, !maxex);
+    if (offset < 0 || hi <= lo || (size_t)offset >= hi - lo) {
+        client_add_reply_str(c, REDIS_EMPTY_ARRAY);
+        return;
+    }
+    size_t count = hi - lo - (size_t)offset;
+    if (limit >= 0 && (size_t)limit < count)
+        count = (size_t)limit;
+
+    _zset_reply_range(c, e, lo + (size_t)offset, count, 0, withscores);
+}
+
+/**
+ * ZRANK key member
+ */
+static inline void handle_zrank(redis_db_t *db, client_t *c, const resp_arg_t *argv, int argc)
+{
+    (void)argc;
+    db_entry *e = _zset_lookup_read(db, c, &argv[1], NULL_BULK_STRING);
+    if (e == NULL)
+        return;
+    size_t rank;
+    if (_zset_rank(e, &argv[2], &rank))
+        client_add_reply_integer(c, (long long)rank);
+    else
+        client_add_reply_str(c, NULL_BULK_STRING);
 }
 
+/**
+ * ZSCORE key member
+ */
+static inline void handle_zscore(redis_db_t *db, client_t *c, const resp_arg_t *argv, int argc)
+{
+    (void)argc;
+    db_entry *e = _zset_lookup_read(db, c, &argv[1], NULL_BULK_STRING);
+    if (e == NULL)
+        return;
+
+    double score;
+    if (!_zset_score(e, &argv[2], &score)) {
+        client_add_reply_str(c, NULL_BULK_STRING);
+        return;
+    }
+    char buf[DOUBLE_STR_SIZE];
+    size_t len = double_to_str(buf, score);
+    client_add_reply_bulk(c, buf, len);
+}
 
-#endif // HANDLER_H
\ No newline at end of file
+#endif // HANDLER_H
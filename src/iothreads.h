@@ -0,0 +1,204 @@
+#ifndef IOTHREADS_H
+#define IOTHREADS_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sched.h>
+#include "client.h"
+#include "log.h"
+
+#define IO_THREADS_MAX 64
+#define IO_THREAD_SPIN_LOOPS 100000 // Busy-polls before sleeping on the condvar
+#define IO_THREADS_MIN_CLIENTS 2    // Per thread; smaller batches stay on main
+
+// --- Data Structures ---
+
+typedef void (*io_job_fn)(client_t *c);
+
+/**
+ * @brief One I/O worker.
+ * The main thread fills 'jobs' and then publishes 'pending'; the worker
+ * runs io_job_fn over its jobs and resets 'pending' to 0 when done. The
+ * main thread never touches those clients until 'pending' drops to 0.
+ */
+typedef struct
+{
+    pthread_t tid;
+    int id;
+    client_t **jobs;
+    size_t njobs;
+    size_t cap;
+    _Atomic size_t pending;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} io_thread_t;
+
+/**
+ * @brief Redis-6-style threaded I/O.
+ * Only socket reads (plus parsing of the first buffered command) and
+ * output flushes run on workers. Command execution, the keyspace and the
+ * expiry heap stay on the main thread.
+ */
+typedef struct
+{
+    int count;          // Total threads, including main as thread 0
+    io_thread_t threads[IO_THREADS_MAX];
+    io_job_fn job;      // Work for the current batch
+    _Atomic int stop;
+} io_threads_t;
+
+static io_threads_t io_threads = {.count = 1};
+
+// --- Workers ---
+
+static inline void _io_thread_run_jobs(io_thread_t *t)
+{
+    for (size_t i = 0; i < t->njobs; i++)
+        io_threads.job(t->jobs[i]);
+    t->njobs = 0;
+}
+
+static inline void *_io_thread_main(void *arg)
+{
+    io_thread_t *t = (io_thread_t *)arg;
+    while (1)
+    {
+        // Spin briefly: batches usually arrive back to back under load
+        for (int i = 0; i < IO_THREAD_SPIN_LOOPS; i++)
+        {
+            if (atomic_load_explicit(&t->pending, memory_order_acquire) != 0)
+                break;
+        }
+
+        if (atomic_load_explicit(&t->pending, memory_order_acquire) == 0)
+        {
+            pthread_mutex_lock(&t->lock);
+            while (atomic_load_explicit(&t->pending, memory_order_acquire) == 0 &&
+                   !atomic_load(&io_threads.stop))
+                pthread_cond_wait(&t->cond, &t->lock);
+            pthread_mutex_unlock(&t->lock);
+        }
+        if (atomic_load(&io_threads.stop))
+            break;
+
+        _io_thread_run_jobs(t);
+        atomic_store_explicit(&t->pending, 0, memory_order_release);
+    }
+    return NULL;
+}
+
+static inline int _io_thread_add_job(io_thread_t *t, client_t *c)
+{
+    if (t->njobs == t->cap)
+    {
+        size_t cap = t->cap ? t->cap * 2 : 64;
+        client_t **jobs = (client_t **)realloc(t->jobs, cap * sizeof(client_t *));
+        if (jobs == NULL)
+            return -1;
+        t->jobs = jobs;
+        t->cap = cap;
+    }
+    t->jobs[t->njobs++] = c;
+    return 0;
+}
+
+// --- Public API ---
+
+/**
+ * @brief Starts 'count' - 1 workers (the main thread is thread 0).
+ * count == 1 keeps all I/O on the main thread.
+ * @return 0 on success, -1 if a thread could not be created.
+ */
+static inline int io_threads_init(int count)
+{
+    if (count < 1)
+        count = 1;
+    if (count > IO_THREADS_MAX)
+        count = IO_THREADS_MAX;
+    io_threads.count = 1;
+    for (int i = 0; i < count; i++)
+    {
+        io_thread_t *t = &io_threads.threads[i];
+        t->id = i;
+        atomic_init(&t->pending, 0);
+        pthread_mutex_init(&t->lock, NULL);
+        pthread_cond_init(&t->cond, NULL);
+        if (i == 0)
+            continue;
+        if (pthread_create(&t->tid, NULL, _io_thread_main, t) != 0)
+        {
+            log_error("Can't create I/O thread %d", i);
+            return -1;
+        }
+        io_threads.count++;
+    }
+    if (io_threads.count > 1)
+        log_info("Threaded I/O enabled with %d threads", io_threads.count);
+    return 0;
+}
+
+static inline void io_threads_shutdown(void)
+{
+    atomic_store(&io_threads.stop, 1);
+    for (int i = 1; i < io_threads.count; i++)
+    {
+        io_thread_t *t = &io_threads.threads[i];
+        pthread_mutex_lock(&t->lock);
+        pthread_cond_signal(&t->cond);
+        pthread_mutex_unlock(&t->lock);
+        pthread_join(t->tid, NULL);
+    }
+    for (int i = 0; i < io_threads.count; i++)
+        free(io_threads.threads[i].jobs);
+    io_threads.count = 1;
+}
+
+/**
+ * @brief Runs 'fn' on every client, spreading them round-robin over the
+ * I/O threads. The main thread takes its share and then waits for the
+ * workers, so on return every job has completed. Small batches are run
+ * inline, where the handoff would cost more than it saves.
+ */
+static inline void io_threads_run(client_t **clients, size_t n, io_job_fn fn)
+{
+    int count = io_threads.count;
+    if (count == 1 || n < (size_t)count * IO_THREADS_MIN_CLIENTS)
+    {
+        for (size_t i = 0; i < n; i++)
+            fn(clients[i]);
+        return;
+    }
+
+    io_threads.job = fn;
+    for (size_t i = 0; i < n; i++)
+    {
+        io_thread_t *t = &io_threads.threads[i % count];
+        if (_io_thread_add_job(t, clients[i]) != 0)
+            fn(clients[i]); // Out of memory: do it inline
+    }
+
+    // Publish the batches; the release store makes 'jobs' and 'job' visible
+    for (int i = 1; i < count; i++)
+    {
+        io_thread_t *t = &io_threads.threads[i];
+        if (t->njobs == 0)
+            continue;
+        atomic_store_explicit(&t->pending, t->njobs, memory_order_release);
+        pthread_mutex_lock(&t->lock);
+        pthread_cond_signal(&t->cond);
+        pthread_mutex_unlock(&t->lock);
+    }
+
+    _io_thread_run_jobs(&io_threads.threads[0]);
+
+    for (int i = 1; i < count; i++)
+    {
+        while (atomic_load_explicit(&io_threads.threads[i].pending, memory_order_acquire) != 0)
+            sched_yield();
+    }
+}
+
+#endif // IOTHREADS_H
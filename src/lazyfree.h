@@ -0,0 +1,120 @@
+#ifndef LAZYFREE_H
+#define LAZYFREE_H
+
+#include <stddef.h>
+#include "quicklist.h"
+#include "zset.h"
+
+/**
+ * Lazy freeing: a large list or sorted set is detached from its key in
+ * O(1) and queued, and its memory is reclaimed afterwards a slice at a
+ * time, so deleting a million-element key does not stall every other
+ * client of the shard.
+ *
+ * Slab objects may only be freed by the thread that owns their pool
+ * (slab.h), so the reclaiming is done by the shard's own event loop,
+ * between events and under a time budget, like rehashing. The queue is
+ * bounded: while it is full, values are freed on the spot as before.
+ */
+
+#define LAZYFREE_THRESHOLD 64   // Elements a value needs before it is worth queueing
+#define LAZYFREE_QUEUE_MAX 1024 // Values waiting per shard
+#define LAZYFREE_STEP 64        // Elements freed between clock checks
+
+// --lazyfree: DEL, overwrites, expiry and eviction free large values
+// lazily too, not just UNLINK
+static int lazyfree_enabled = 0;
+
+// --- Data Structures ---
+
+typedef enum
+{
+    LAZYFREE_LIST, // quicklist_t
+    LAZYFREE_ZSET  // RedisZSet
+} lazyfree_kind;
+
+typedef struct
+{
+    lazyfree_kind kind;
+    void *value;
+} lazyfree_job_t;
+
+/**
+ * @brief Detached values of one keyspace, oldest first. Only the owning
+ * shard touches it.
+ */
+typedef struct
+{
+    lazyfree_job_t jobs[LAZYFREE_QUEUE_MAX]; // Ring starting at 'head'
+    size_t head;
+    size_t count;
+    long long freed; // Values reclaimed since startup
+} lazyfree_queue_t;
+
+// --- Queue ---
+
+/**
+ * @brief Queues 'value' to be freed later.
+ * @return 1 if queued, 0 if the queue is full (the caller frees it now).
+ */
+static inline int lazyfree_push(lazyfree_queue_t *q, lazyfree_kind kind, void *value)
+{
+    if (q->count == LAZYFREE_QUEUE_MAX)
+        return 0;
+    lazyfree_job_t *job = &q->jobs[(q->head + q->count) % LAZYFREE_QUEUE_MAX];
+    job->kind = kind;
+    job->value = value;
+    q->count++;
+    return 1;
+}
+
+/**
+ * @brief (Internal) Frees about '*budget' elements of the oldest value.
+ * @return 1 once that value is gone and has left the queue.
+ */
+static inline int _lazyfree_step(lazyfree_queue_t *q, size_t *budget)
+{
+    lazyfree_job_t *job = &q->jobs[q->head];
+    int done = job->kind == LAZYFREE_LIST ? quicklist_free_step((quicklist_t *)job->value, budget)
+                                          : zset_free_step((RedisZSet *)job->value, budget);
+    if (!done)
+        return 0;
+    q->head = (q->head + 1) % LAZYFREE_QUEUE_MAX;
+    q->count--;
+    q->freed++;
+    return 1;
+}
+
+/**
+ * @brief Reclaims queued values for about 'us' microseconds.
+ * @return 1 if values are still queued.
+ */
+static inline int lazyfree_cycle(lazyfree_queue_t *q, long long us, long long (*now_us)(void))
+{
+    long long start = now_us();
+    while (q->count > 0)
+    {
+        size_t budget = LAZYFREE_STEP;
+        _lazyfree_step(q, &budget);
+        if (now_us() - start > us)
+            break;
+    }
+    return q->count > 0;
+}
+
+/**
+ * @brief Reclaims about LAZYFREE_STEP elements of the oldest queued value,
+ * for callers that need memory back a little at a time.
+ * @return 1 if values are still queued.
+ */
+static inline int lazyfree_slice(lazyfree_queue_t *q)
+{
+    if (q->count > 0)
+    {
+        size_t budget = LAZYFREE_STEP;
+        _lazyfree_step(q, &budget);
+    }
+    return q->count > 0;
+}
+
+#endif // LAZYFREE_H
@@ -0,0 +1,445 @@
+#ifndef LISTPACK_H
+#define LISTPACK_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "utils.h" // For memcmp_len()
+#include "slab.h"  // For slab_note_alloc()
+
+/**
+ * Compact encoding for small collections: one contiguous allocation of
+ * length-prefixed entries.
+ *
+ *   <total bytes:u32> <count:u32> <entry> <entry> ...
+ *   entry = <len:varint> <data> <backlen>
+ *
+ * 'len' is LEB128 (1 byte for values under 128). 'backlen' is the size of
+ * len + data, written so it can be decoded from its last byte backwards,
+ * which makes the list walkable in both directions.
+ * Every mutating call may move the buffer and returns the new pointer, or
+ * NULL when out of memory (the old buffer is then left untouched).
+ * Buffers are accounted to the current slab pool by their header size, so
+ * they must be released with lp_free().
+ */
+
+#define LP_HEADER_SIZE 8
+
+// --- Encoding ---
+
+static inline uint32_t _lp_get_u32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline void _lp_set_u32(unsigned char *p, uint32_t v) {
+    memcpy(p, &v, sizeof(v));
+}
+
+static inline size_t _lp_varint_size(size_t v) {
+    size_t n = 1;
+    while (v >= 128) {
+        v >>= 7;
+        n++;
+    }
+    return n;
+}
+
+static inline size_t _lp_encode_varint(unsigned char *p, size_t v) {
+    size_t n = 0;
+    while (v >= 128) {
+        p[n++] = (unsigned char)(v & 127) | 128;
+        v >>= 7;
+    }
+    p[n++] = (unsigned char)v;
+    return n;
+}
+
+static inline size_t _lp_decode_varint(const unsigned char *p, size_t *v) {
+    size_t n = 0, shift = 0, out = 0;
+    do {
+        out |= (size_t)(p[n] & 127) << shift;
+        shift += 7;
+    } while (p[n++] & 128);
+    *v = out;
+    return n;
+}
+
+/**
+ * @brief (Internal) Writes 'v' so the low 7 bits sit in the last byte and
+ * each byte with the high bit set continues towards lower addresses.
+ */
+static inline void _lp_encode_backlen(unsigned char *p, size_t v) {
+    size_t n = _lp_varint_size(v);
+    for (size_t j = 0; j < n; j++) {
+        p[n - 1 - j] = (unsigned char)((v >> (7 * j)) & 127) | (j + 1 < n ? 128 : 0);
+    }
+}
+
+/**
+ * @brief (Internal) Decodes the backlen that ends just before 'end'.
+ */
+static inline size_t _lp_decode_backlen(const unsigned char *end) {
+    size_t v = 0, shift = 0;
+    const unsigned char *p = end - 1;
+    while (1) {
+        v |= (size_t)(*p & 127) << shift;
+        if (!(*p & 128)) break;
+        shift += 7;
+        p--;
+    }
+    return v;
+}
+
+static inline size_t _lp_entry_size(size_t len) {
+    size_t body = _lp_varint_size(len) + len;
+    return body + _lp_varint_size(body);
+}
+
+// --- Public API ---
+
+static inline unsigned char *lp_new(void) {
+    unsigned char *lp = (unsigned char *)malloc(LP_HEADER_SIZE);
+    if (lp) {
+        _lp_set_u32(lp, LP_HEADER_SIZE);
+        _lp_set_u32(lp + 4, 0);
+        slab_note_alloc(LP_HEADER_SIZE);
+    }
+    return lp;
+}
+
+static inline size_t lp_bytes(const unsigned char *lp) {
+    return _lp_get_u32(lp);
+}
+
+static inline void lp_free(unsigned char *lp) {
+    if (lp == NULL) return;
+    slab_note_free(lp_bytes(lp));
+    free(lp);
+}
+
+static inline size_t lp_count(const unsigned char *lp) {
+    return _lp_get_u32(lp + 4);
+}
+
+/**
+ * @brief Checks that the 'bytes' at 'p' form a well-formed listpack: the
+ * header matches, and every entry's lengths stay in bounds and agree
+ * with its backlen. For buffers read from outside, before any other lp_*
+ * call trusts them.
+ * @return 1 if valid, 0 otherwise.
+ */
+static inline int lp_validate(const unsigned char *p, size_t bytes) {
+    if (bytes < LP_HEADER_SIZE || _lp_get_u32(p) != bytes) return 0;
+    const unsigned char *end = p + bytes, *e = p + LP_HEADER_SIZE;
+    size_t count = 0;
+    while (e < end) {
+        // The varint itself must end inside the buffer (and fit 32 bits)
+        size_t n = 0, len = 0, shift = 0;
+        do {
+            if (e + n >= end || n == 5) return 0;
+            len |= (size_t)(e[n] & 127) << shift;
+            shift += 7;
+        } while (e[n++] & 128);
+        size_t body = n + len, tail = _lp_varint_size(body);
+        if (len > bytes || body + tail > (size_t)(end - e)) return 0;
+        unsigned char backlen[10];
+        _lp_encode_backlen(backlen, body);
+        if (memcmp(e + body, backlen, tail) != 0) return 0;
+        e += body + tail;
+        count++;
+    }
+    return count == lp_count(p);
+}
+
+/**
+ * @brief Copies a listpack of 'bytes' from 'src', which must be valid
+ * (see lp_validate()).
+ * @return The new buffer, or NULL if out of memory.
+ */
+static inline unsigned char *lp_load(const unsigned char *src, size_t bytes) {
+    unsigned char *lp = (unsigned char *)malloc(bytes);
+    if (lp == NULL) return NULL;
+    memcpy(lp, src, bytes);
+    slab_note_alloc(bytes);
+    return lp;
+}
+
+static inline unsigned char *lp_first(unsigned char *lp) {
+    return lp_count(lp) ? lp + LP_HEADER_SIZE : NULL;
+}
+
+static inline unsigned char *lp_last(unsigned char *lp) {
+    if (lp_count(lp) == 0) return NULL;
+    unsigned char *end = lp + lp_bytes(lp);
+    size_t body = _lp_decode_backlen(end);
+    return end - _lp_varint_size(body) - body;
+}
+
+/**
+ * @return The entry after 'p', or NULL if 'p' is the last one.
+ */
+static inline unsigned char *lp_next(unsigned char *lp, unsigned char *p) {
+    size_t len;
+    size_t n = _lp_decode_varint(p, &len);
+    p += n + len;
+    p += _lp_varint_size(n + len);
+    return p < lp + lp_bytes(lp) ? p : NULL;
+}
+
+/**
+ * @return The entry before 'p', or NULL if 'p' is the first one.
+ */
+static inline unsigned char *lp_prev(unsigned char *lp, unsigned char *p) {
+    if (p == lp + LP_HEADER_SIZE) return NULL;
+    size_t body = _lp_decode_backlen(p);
+    return p - _lp_varint_size(body) - body;
+}
+
+/**
+ * @brief Reads the entry at 'p'. The data is not NUL-terminated.
+ */
+static inline const char *lp_get(const unsigned char *p, size_t *len) {
+    size_t n = _lp_decode_varint(p, len);
+    return (const char *)p + n;
+}
+
+/**
+ * @brief Finds the entry at 'index'; negative indices count from the end.
+ * @return The entry, or NULL if out of range.
+ */
+static inline unsigned char *lp_seek(unsigned char *lp, long long index) {
+    long long count = (long long)lp_count(lp);
+    if (index < 0) index += count;
+    if (index < 0 || index >= count) return NULL;
+
+    unsigned char *p;
+    if (index < count / 2) {
+        p = lp_first(lp);
+        while (index-- > 0) p = lp_next(lp, p);
+    } else {
+        p = lp_last(lp);
+        for (long long i = count - 1; i > index; i--) p = lp_prev(lp, p);
+    }
+    return p;
+}
+
+/**
+ * @brief (Internal) Opens a 'size' byte gap at 'offset' and accounts for
+ * 'entries' new entries in the header.
+ * @return The new buffer, or NULL if out of memory.
+ */
+static inline unsigned char *_lp_make_room(unsigned char *lp, size_t offset, size_t size, size_t entries) {
+    size_t bytes = lp_bytes(lp);
+    if (bytes + size > UINT32_MAX) return NULL;
+
+    unsigned char *n = (unsigned char *)realloc(lp, bytes + size);
+    if (n == NULL) return NULL;
+    slab_note_alloc(size);
+    memmove(n + offset + size, n + offset, bytes - offset);
+    _lp_set_u32(n, (uint32_t)(bytes + size));
+    _lp_set_u32(n + 4, (uint32_t)(lp_count(n) + entries));
+    return n;
+}
+
+/**
+ * @brief (Internal) Encodes one entry at 'p'.
+ * @return Bytes written, always _lp_entry_size(len).
+ */
+static inline size_t _lp_write_entry(unsigned char *p, const char *s, size_t len) {
+    size_t h = _lp_encode_varint(p, len);
+    memcpy(p + h, s, len);
+    _lp_encode_backlen(p + h + len, h + len);
+    return h + len + _lp_varint_size(h + len);
+}
+
+/**
+ * @brief Inserts 'len' bytes of 's' before the entry 'before' (at the end
+ * if NULL).
+ * @return The new buffer, or NULL if out of memory.
+ */
+static inline unsigned char *lp_insert(unsigned char *lp, unsigned char *before, const char *s, size_t len) {
+    size_t offset = before ? (size_t)(before - lp) : lp_bytes(lp);
+    unsigned char *n = _lp_make_room(lp, offset, _lp_entry_size(len), 1);
+    if (n == NULL) return NULL;
+    _lp_write_entry(n + offset, s, len);
+    return n;
+}
+
+static inline unsigned char *lp_append(unsigned char *lp, const char *s, size_t len) {
+    return lp_insert(lp, NULL, s, len);
+}
+
+/**
+ * @brief Removes 'count' entries starting at 'p'. Never fails: if the
+ * buffer cannot be shrunk it keeps its old capacity.
+ * @return The new buffer.
+ */
+static inline unsigned char *lp_delete(unsigned char *lp, unsigned char *p, size_t count) {
+    size_t bytes = lp_bytes(lp);
+    unsigned char *end = p;
+    size_t removed = 0;
+    while (removed < count && end) {
+        end = lp_next(lp, end);
+        removed++;
+    }
+    if (end == NULL) end = lp + bytes;
+
+    size_t gap = (size_t)(end - p);
+    memmove(p, end, bytes - (size_t)(end - lp));
+    _lp_set_u32(lp, (uint32_t)(bytes - gap));
+    _lp_set_u32(lp + 4, (uint32_t)(lp_count(lp) - removed));
+    slab_note_free(gap);
+
+    unsigned char *n = (unsigned char *)realloc(lp, bytes - gap);
+    return n ? n : lp;
+}
+
+// --- Sorted Set View ---
+// A small sorted set is a listpack of (member, score) pairs in score
+// order; each score is the 8 raw bytes of a double.
+
+static inline double zlp_score_at(unsigned char *lp, unsigned char *member) {
+    size_t len;
+    const char *s = lp_get(lp_next(lp, member), &len);
+    double score;
+    memcpy(&score, s, sizeof(score));
+    return score;
+}
+
+/**
+ * @return The member entry, or NULL if 'member' is not in the set.
+ */
+static inline unsigned char *zlp_find(unsigned char *lp, const char *member, size_t member_len) {
+    unsigned char *p = lp_first(lp);
+    while (p) {
+        size_t len;
+        const char *s = lp_get(p, &len);
+        if (len == member_len && memcmp(s, member, len) == 0) return p;
+        p = lp_next(lp, lp_next(lp, p)); // Skip the score
+    }
+    return NULL;
+}
+
+/**
+ * @brief Inserts a member that is not in the set yet at its position.
+ * @return The new buffer, or NULL if out of memory.
+ */
+static inline unsigned char *zlp_insert(unsigned char *lp, double score, const char *member, size_t member_len) {
+    unsigned char *p = lp_first(lp);
+    while (p) {
+        double s = zlp_score_at(lp, p);
+        size_t len;
+        const char *m = lp_get(p, &len);
+        if (s > score || (s == score && memcmp_len(m, len, member, member_len) > 0)) break;
+        p = lp_next(lp, lp_next(lp, p));
+    }
+
+    // Both entries go in with one reallocation, so failure leaves no half pair
+    size_t offset = p ? (size_t)(p - lp) : lp_bytes(lp);
+    size_t msize = _lp_entry_size(member_len);
+    unsigned char *n = _lp_make_room(lp, offset, msize + _lp_entry_size(sizeof(score)), 2);
+    if (n == NULL) return NULL;
+    _lp_write_entry(n + offset, member, member_len);
+    _lp_write_entry(n + offset + msize, (const char *)&score, sizeof(score));
+    return n;
+}
+
+static inline void _lp_reverse(unsigned char *a, unsigned char *b) {
+    while (a < --b) {
+        unsigned char t = *a;
+        *a++ = *b;
+        *b = t;
+    }
+}
+
+/**
+ * @brief (Internal) Rotates [a, b) so that 'mid' moves to 'a'.
+ */
+static inline void _lp_rotate(unsigned char *a, unsigned char *mid, unsigned char *b) {
+    _lp_reverse(a, mid);
+    _lp_reverse(mid, b);
+    _lp_reverse(a, b);
+}
+
+/**
+ * @brief Gives the pair at 'p' a new score and moves it to its new
+ * position. The pair keeps its size, so this works in place and never
+ * fails.
+ */
+static inline void zlp_update(unsigned char *lp, unsigned char *p, double score) {
+    unsigned char *score_at = lp_next(lp, p);
+    unsigned char *pair_end = lp_next(lp, score_at);
+    if (pair_end == NULL) pair_end = lp + lp_bytes(lp);
+    size_t len;
+    memcpy((unsigned char *)lp_get(score_at, &len), &score, sizeof(score));
+
+    // The first other pair that sorts after the updated one
+    size_t member_len;
+    const char *member = lp_get(p, &member_len);
+    unsigned char *q = lp_first(lp);
+    while (q) {
+        if (q != p) {
+            double s = zlp_score_at(lp, q);
+            size_t qlen;
+            const char *m = lp_get(q, &qlen);
+            if (s > score || (s == score && memcmp_len(m, qlen, member, member_len) > 0)) break;
+        }
+        q = lp_next(lp, lp_next(lp, q));
+    }
+    if (q == NULL) q = lp + lp_bytes(lp);
+
+    if (q < p) {
+        _lp_rotate(q, p, pair_end); // Move the pair back to 'q'
+    } else if (q > pair_end) {
+        _lp_rotate(p, pair_end, q); // Move the pairs in between ahead of it
+    }
+}
+
+/**
+ * @brief Removes the pair whose member entry is 'p'.
+ */
+static inline unsigned char *zlp_delete(unsigned char *lp, unsigned char *p) {
+    return lp_delete(lp, p, 2);
+}
+
+static inline size_t zlp_length(const unsigned char *lp) {
+    return lp_count(lp) / 2;
+}
+
+/**
+ * @brief Same contract as zset_rank().
+ */
+static inline int zlp_rank(unsigned char *lp, const char *member, size_t member_len, size_t *rank) {
+    size_t r = 0;
+    unsigned char *p = lp_first(lp);
+    while (p) {
+        size_t len;
+        const char *s = lp_get(p, &len);
+        if (len == member_len && memcmp(s, member, len) == 0) {
+            *rank = r;
+            return 1;
+        }
+        p = lp_next(lp, lp_next(lp, p));
+        r++;
+    }
+    return 0;
+}
+
+/**
+ * @brief Same contract as zset_count_below().
+ */
+static inline size_t zlp_count_below(unsigned char *lp, double score, int inclusive) {
+    size_t n = 0;
+    unsigned char *p = lp_first(lp);
+    while (p) {
+        double s = zlp_score_at(lp, p);
+        if (!(s < score || (inclusive && s == score))) break;
+        p = lp_next(lp, lp_next(lp, p));
+        n++;
+    }
+    return n;
+}
+
+#endif // LISTPACK_H
@@ -0,0 +1,329 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdarg.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+// --- Levels ---
+
+typedef enum
+{
+    LOG_TRACE,   // Per-command detail; compiled out unless LOG_ENABLE_TRACE
+    LOG_DEBUG,
+    LOG_INFO,
+    LOG_WARNING,
+    LOG_ERROR
+} log_level;
+
+// Set -DLOG_ENABLE_TRACE=1 (cmake -DREDIS_LOG_TRACE=ON) to keep trace calls
+#ifndef LOG_ENABLE_TRACE
+#define LOG_ENABLE_TRACE 0
+#endif
+
+#define LOG_LINE_MAX 1024
+#define LOG_BUFFER_SIZE (256 * 1024) // Bytes buffered before lines are dropped
+#define LOG_FLUSH_INTERVAL_MS 100
+
+// --- Data Structures ---
+
+/**
+ * @brief Process-wide logger.
+ * Callers format a line on their own stack and append it to 'buf' under
+ * the lock; a writer thread swaps buffers and write()s them out, so the
+ * event loop never blocks on the log file.
+ */
+typedef struct
+{
+    log_level level; // Runtime threshold
+    int fd;
+    int async;       // Writer thread running
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+    int stop;
+
+    char *buf;       // Lines waiting for the writer
+    size_t len;
+    char *spare;     // Swapped in while the writer drains 'buf'
+    unsigned long long dropped;
+} logger_t;
+
+static logger_t logger = {
+    .level = LOG_INFO,
+    .fd = STDOUT_FILENO,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+};
+
+/**
+ * @brief State for one rate-limited call site.
+ */
+typedef struct
+{
+    time_t window;   // Second the current count belongs to
+    unsigned count;  // Lines emitted in this window
+    unsigned long long suppressed;
+} log_ratelimit_t;
+
+// --- Config ---
+
+static inline const char *log_level_name(log_level level)
+{
+    static const char *names[] = {"trace", "debug", "info", "warning", "error"};
+    return names[level];
+}
+
+/**
+ * @return 0 on success, -1 if 'name' is not a level.
+ */
+static inline int log_parse_level(const char *name, log_level *out)
+{
+    for (int l = LOG_TRACE; l <= LOG_ERROR; l++)
+    {
+        if (!strcasecmp(name, log_level_name((log_level)l)))
+        {
+            *out = (log_level)l;
+            return 0;
+        }
+    }
+    if (!strcasecmp(name, "notice") || !strcasecmp(name, "verbose"))
+    {
+        *out = LOG_INFO; // Accept the Redis spellings
+        return 0;
+    }
+    return -1;
+}
+
+static inline int log_enabled(log_level level)
+{
+    return level >= logger.level;
+}
+
+// --- Writer ---
+
+static inline void _log_write_all(int fd, const char *buf, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = write(fd, buf, len);
+        if (n <= 0)
+            return; // Nowhere left to report a failing log
+        buf += n;
+        len -= n;
+    }
+}
+
+static inline void *_log_writer_main(void *arg)
+{
+    (void)arg;
+    pthread_mutex_lock(&logger.lock);
+    while (1)
+    {
+        if (logger.len == 0 && !logger.stop)
+        {
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_nsec += LOG_FLUSH_INTERVAL_MS * 1000000L;
+            if (ts.tv_nsec >= 1000000000L)
+            {
+                ts.tv_sec++;
+                ts.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&logger.cond, &logger.lock, &ts);
+        }
+        if (logger.len == 0)
+        {
+            if (logger.stop)
+                break;
+            continue;
+        }
+
+        // Swap buffers and write without holding the lock
+        char *out = logger.buf;
+        size_t len = logger.len;
+        logger.buf = logger.spare;
+        logger.len = 0;
+        logger.spare = out;
+        pthread_mutex_unlock(&logger.lock);
+        _log_write_all(logger.fd, out, len);
+        pthread_mutex_lock(&logger.lock);
+    }
+    pthread_mutex_unlock(&logger.lock);
+    return NULL;
+}
+
+/**
+ * @brief Opens the log target and starts the writer thread.
+ * @param path File to append to, or NULL for stdout.
+ * @return 0 on success, -1 if the file cannot be opened.
+ */
+static inline int log_init(log_level level, const char *path)
+{
+    logger.level = level;
+    if (path && *path)
+    {
+        int fd = open(path, O_WRONLY | O_APPEND | O_CREAT, 0644);
+        if (fd < 0)
+            return -1;
+        logger.fd = fd;
+    }
+
+    logger.buf = (char *)malloc(LOG_BUFFER_SIZE);
+    logger.spare = (char *)malloc(LOG_BUFFER_SIZE);
+    if (logger.buf == NULL || logger.spare == NULL ||
+        pthread_create(&logger.thread, NULL, _log_writer_main, NULL) != 0)
+    {
+        // Fall back to synchronous writes
+        free(logger.buf);
+        free(logger.spare);
+        logger.buf = logger.spare = NULL;
+        return 0;
+    }
+    logger.async = 1;
+    return 0;
+}
+
+/**
+ * @brief Drains buffered lines and stops the writer thread.
+ */
+static inline void log_shutdown(void)
+{
+    if (!logger.async)
+        return;
+    pthread_mutex_lock(&logger.lock);
+    logger.stop = 1;
+    pthread_cond_signal(&logger.cond);
+    pthread_mutex_unlock(&logger.lock);
+    pthread_join(logger.thread, NULL);
+    logger.async = 0;
+    if (logger.dropped)
+    {
+        char line[128];
+        int n = snprintf(line, sizeof(line), "Logger dropped %llu lines (buffer full)\n", logger.dropped);
+        _log_write_all(logger.fd, line, n);
+    }
+    free(logger.buf);
+    free(logger.spare);
+    logger.buf = logger.spare = NULL;
+}
+
+// --- Emitting ---
+
+/**
+ * @brief Formats one line as "pid:M 14 Oct 2026 10:00:00.123 <mark> msg".
+ * Prefer the log_* macros, which skip formatting for disabled levels.
+ */
+__attribute__((format(printf, 2, 3)))
+static inline void log_write(log_level level, const char *fmt, ...)
+{
+    static const char marks[] = {'.', '-', '*', '#', '!'};
+    char line[LOG_LINE_MAX];
+    struct timeval tv;
+    struct tm tm;
+
+    gettimeofday(&tv, NULL);
+    localtime_r(&tv.tv_sec, &tm);
+    int n = snprintf(line, sizeof(line), "%d:M ", (int)getpid());
+    n += strftime(line + n, sizeof(line) - n, "%d %b %Y %H:%M:%S", &tm);
+    n += snprintf(line + n, sizeof(line) - n, ".%03d %c ", (int)(tv.tv_usec / 1000), marks[level]);
+
+    va_list ap;
+    va_start(ap, fmt);
+    int m = vsnprintf(line + n, sizeof(line) - n, fmt, ap);
+    va_end(ap);
+    n = (m < 0 || (size_t)(n + m) >= sizeof(line) - 1) ? (int)sizeof(line) - 2 : n + m;
+    line[n++] = '\n';
+
+    if (!logger.async)
+    {
+        _log_write_all(logger.fd, line, n);
+        return;
+    }
+
+    pthread_mutex_lock(&logger.lock);
+    if (logger.len + n <= LOG_BUFFER_SIZE)
+    {
+        memcpy(logger.buf + logger.len, line, n);
+        logger.len += n;
+        // Wake the writer early for problems or a filling buffer
+        if (level >= LOG_WARNING || logger.len > LOG_BUFFER_SIZE / 2)
+            pthread_cond_signal(&logger.cond);
+    }
+    else
+    {
+        logger.dropped++;
+    }
+    pthread_mutex_unlock(&logger.lock);
+}
+
+/**
+ * @brief Allows at most 'per_sec' lines per second from one call site.
+ * @return 1 if the line may be emitted. '*suppressed' is set to the number
+ * of lines swallowed in previous windows, to be reported once.
+ */
+static inline int log_ratelimit_allow(log_ratelimit_t *rl, unsigned per_sec, unsigned long long *suppressed)
+{
+    time_t now = time(NULL);
+    *suppressed = 0;
+    if (now != rl->window)
+    {
+        *suppressed = rl->suppressed;
+        rl->window = now;
+        rl->count = 0;
+        rl->suppressed = 0;
+    }
+    if (rl->count >= per_sec)
+    {
+        rl->suppressed++;
+        return 0;
+    }
+    rl->count++;
+    return 1;
+}
+
+#define log_msg(level, ...)                \
+    do                                     \
+    {                                      \
+        if (log_enabled(level))            \
+            log_write(level, __VA_ARGS__); \
+    } while (0)
+
+#define log_debug(...) log_msg(LOG_DEBUG, __VA_ARGS__)
+#define log_info(...) log_msg(LOG_INFO, __VA_ARGS__)
+#define log_warn(...) log_msg(LOG_WARNING, __VA_ARGS__)
+#define log_error(...) log_msg(LOG_ERROR, __VA_ARGS__)
+
+#if LOG_ENABLE_TRACE
+#define log_trace(...) log_msg(LOG_TRACE, __VA_ARGS__)
+#else
+#define log_trace(...) ((void)0)
+#endif
+
+/**
+ * @brief Like log_msg, but at most 'per_sec' lines per second from this
+ * call site (per thread, so shards don't share counters); the number of
+ * swallowed lines is reported when the next window opens.
+ */
+#define log_ratelimited(level, per_sec, ...)                                        \
+    do                                                                              \
+    {                                                                               \
+        static _Thread_local log_ratelimit_t _log_rl;                               \
+        unsigned long long _log_supp;                                               \
+        if (log_enabled(level) && log_ratelimit_allow(&_log_rl, per_sec, &_log_supp)) \
+        {                                                                           \
+            if (_log_supp)                                                          \
+                log_write(level, "(%llu similar messages suppressed)", _log_supp);  \
+            log_write(level, __VA_ARGS__);                                          \
+        }                                                                           \
+    } while (0)
+
+#endif // LOG_H
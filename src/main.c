@@ -1,26 +1,38 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/socket.h>
-#include <sys/epoll.h>
 #include <netinet/in.h>
 #include <netinet/ip.h>
+#include <netinet/tcp.h>
 #include <string.h>
 #include <errno.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <ctype.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/random.h>
 
 #include "utils.h"      // Assumed to exist
 #include "time_utils.h" // Assumed to exist
 
 // Include all parser and handler logic
 #include "parser.h"
+#include "client.h"
+#include "server.h"
+#include "log.h"
+#include "iothreads.h"
 #include "handler.h" // This now includes minheap.h and data structs
+#include "command.h"
+#include "shard.h"
 
-#define PORT 6379
 #define MAX_EVENTS 1000
-#define REDIS_PONG "+PONG\r\n"
-#define dbg 1
+#define ACCEPT_MAX_PER_WAKEUP 1000     // Connections taken off the backlog per listener event
+#define EVENT_LOOP_MAX_WAIT_MS 1000    // Longest event_wait() with nothing scheduled
+#define ACTIVE_EXPIRE_CYCLE_KEYS 20000 // Max keys deleted per loop iteration...
+#define ACTIVE_EXPIRE_CYCLE_US 1000    // ...and max time spent doing so
+#define ACTIVE_REHASH_US 1000          // Keyspace rehashing per idle loop iteration
+#define LAZYFREE_CYCLE_US 1000         // Reclaiming of unlinked values per loop iteration
 
 /**
  * Sets a socket file descriptor to non-blocking mode.
@@ -30,314 +42,1597 @@ int set_nonblocking(int fd)
     int flags = fcntl(fd, F_GETFL, 0);
     if (flags == -1)
     {
-        perror("fcntl(F_GETFL)");
+        log_error("fcntl(F_GETFL): %s", strerror(errno));
         return -1;
     }
 
     if (fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
     {
-        perror("fcntl(F_SETFL)");
+        log_error("fcntl(F_SETFL): %s", strerror(errno));
         return -1;
     }
     return 0;
 }
 
-int main()
+/**
+ * SIGINT/SIGTERM: leave the event loop so buffered state is flushed.
+ */
+static void handle_shutdown_signal(int sig)
+{
+    (void)sig;
+    server.shutdown_asap = 1;
+}
+
+/**
+ * Picks the shard that must run a command: the one owning its keys.
+ * Commands without keys, unknown commands and arity errors run locally
+ * (the latter two only to produce their error reply); CMD_GLOBAL ones on
+ * shard 0.
+ * @return A shard index, or -1 if the keys live on different shards.
+ */
+static int route_command(const redis_command_t *cmd, const resp_arg_t *argv, int argc, int local)
+{
+    if (server.nshards == 1 || cmd == NULL || !command_arity_ok(cmd, argc))
+        return local;
+    // CLUSTER COUNTKEYSINSLOT and GETKEYSINSLOT read the keyspace holding their slot
+    if (cmd->proc == handle_cluster)
+        return cluster_slot_shard(argv, argc, server.nshards);
+    if (cmd->flags & CMD_GLOBAL)
+        return 0;
+    // SCAN touches no key, but its cursor says which shard it is walking
+    if (cmd->proc == handle_scan)
+    {
+        int owner = scan_cursor_shard(&argv[1], server.nshards);
+        return owner < 0 ? local : owner;
+    }
+    int first;
+    int nkeys = command_keys(cmd, argv, argc, &first);
+    if (nkeys == 0)
+        return local;
+
+    int owner = shard_for_key(&argv[first], server.nshards);
+    for (int i = 1; i < nkeys; i++)
+    {
+        if (shard_for_key(&argv[first + i * cmd->key_step], server.nshards) != owner)
+            return -1;
+    }
+    return owner;
+}
+
+static void serve_ready_keys(shard_t *sh);
+
+/**
+ * Replica side: runs a command of the primary's stream on shard 'owner',
+ * dropping its reply. Another shard gets it as an APPLY message; nothing
+ * waits for it, and the next command to that shard queues up behind it.
+ */
+static void apply_on_shard(shard_t *sh, int owner, const resp_arg_t *argv, int argc)
+{
+    if (owner == sh->id)
+    {
+        command_dispatch(&sh->db, sh->exec_client, argv, argc);
+        _client_free_replies(sh->exec_client);
+        if (sh->db.ready_count)
+            serve_ready_keys(sh);
+        return;
+    }
+    shard_msg_t *m = shard_msg_command(sh->exec_client, argv, argc);
+    if (m == NULL)
+    {
+        log_error("Out of memory: a command from the primary was not applied");
+        return;
+    }
+    m->type = SHARD_MSG_APPLY;
+    m->client_id = repl_state.apply_epoch;
+    shard_send(&server.shards[owner], m);
+}
+
+/**
+ * Replica side: applies a command of the primary's stream. The primary
+ * may run fewer shards, so a command whose trailing key arguments span
+ * several of ours (DEL a b) is split into one command per owning shard.
+ */
+static void apply_replicated(shard_t *sh, redis_command_t *cmd, const resp_arg_t *argv, int argc)
+{
+    int owner = route_command(cmd, argv, argc, sh->id);
+    if (owner >= 0)
+    {
+        apply_on_shard(sh, owner, argv, argc);
+        return;
+    }
+    if (cmd->last_key != -1)
+    {
+        log_error("Can't apply '%s' from the primary: its keys span shards", cmd->name);
+        return;
+    }
+
+    int nkeys = command_key_count(cmd, argc);
+    resp_arg_t *part = (resp_arg_t *)malloc(argc * sizeof(resp_arg_t));
+    if (part == NULL)
+    {
+        log_error("Out of memory: a command from the primary was not applied");
+        return;
+    }
+    memcpy(part, argv, cmd->first_key * sizeof(resp_arg_t));
+    for (int s = 0; s < server.nshards; s++)
+    {
+        int n = cmd->first_key;
+        for (int i = 0; i < nkeys; i++)
+        {
+            const resp_arg_t *key = &argv[cmd->first_key + i * cmd->key_step];
+            if (shard_for_key(key, server.nshards) != s)
+                continue;
+            memcpy(&part[n], key, cmd->key_step * sizeof(resp_arg_t));
+            n += cmd->key_step;
+        }
+        if (n > cmd->first_key)
+            apply_on_shard(sh, s, part, n);
+    }
+    free(part);
+}
+
+/**
+ * Replica side: applies the queued MULTI block of the master client 'c'
+ * (the MULTI itself first in multi_buf) and moves the offset past it.
+ */
+static void apply_master_multi(client_t *c)
+{
+    resp_parser_t p;
+    resp_parser_init(&p);
+    resp_parse_command(&p, c->multi_buf, c->multi_len); // The MULTI
+    for (int i = 1; i < c->multi_count; i++)
+    {
+        if (resp_parse_command(&p, c->multi_buf, c->multi_len) != RESP_PARSE_OK)
+        {
+            log_error("Out of memory: a command from the primary was not applied");
+            continue;
+        }
+        resp_arg_t *argv = resp_parser_argv(&p, c->multi_buf);
+        apply_replicated(c->shard, command_lookup(&argv[0]), argv, p.argc);
+    }
+    resp_parser_free(&p);
+    repl_state.master_repl_offset += (long long)c->multi_len;
+    client_multi_reset(c);
+}
+
+/**
+ * Replica side: one command of the primary's stream, parsed by c->parser.
+ * A MULTI ... EXEC block is queued whole and applied at its EXEC, so a link
+ * lost halfway applies none of it; the offset only moves past it then, so
+ * a partial resync sends it again.
+ */
+static void apply_master_command(client_t *c, redis_command_t *cmd, const resp_arg_t *argv, int argc)
+{
+    resp_parser_t *p = &c->parser;
+    size_t len = p->pos - p->cmd_start;
+    int multi = cmd && cmd->proc == handle_multi && argc == 1;
+    if (multi || (c->flags & CLIENT_MULTI))
+    {
+        if (!multi && cmd && cmd->proc == handle_exec && argc == 1)
+        {
+            apply_master_multi(c);
+            repl_state.master_repl_offset += (long long)len;
+            return;
+        }
+        if (client_multi_append(c, c->querybuf + p->cmd_start, len) == 0)
+        {
+            c->flags |= CLIENT_MULTI;
+            return;
+        }
+        // Applied as it comes instead; the EXEC then finds no MULTI, harmlessly
+        log_error("Out of memory: a transaction from the primary is applied without waiting for its EXEC");
+        if (multi)
+        {
+            repl_state.master_repl_offset += (long long)len;
+            return;
+        }
+        apply_master_multi(c);
+    }
+    apply_replicated(c->shard, cmd, argv, argc);
+    repl_state.master_repl_offset += (long long)len;
+}
+
+/**
+ * Between MULTI and EXEC: queues the command just parsed instead of
+ * running it. A command that could never run (unknown, wrong arity, a
+ * write on a replica, keys on another shard than the rest of the queue)
+ * is refused at once and makes EXEC abort.
+ */
+static void queue_multi_command(client_t *c, redis_command_t *cmd, const resp_arg_t *argv, int argc)
+{
+    const char *err = NULL;
+    int owner = -2;
+
+    if (cmd == NULL || !command_arity_ok(cmd, argc))
+    {
+        command_call(cmd, &c->shard->db, c, argv, argc); // Just for its error reply
+        c->flags |= CLIENT_DIRTY_EXEC;
+        return;
+    }
+    if (cmd->flags & CMD_SHARD0_CONN)
+        err = "-ERR Command not allowed inside a transaction\r\n";
+    else if ((cmd->flags & CMD_WRITE) && repl_state.master_port != 0)
+        err = "-READONLY You can't write against a read only replica.\r\n";
+    else if ((owner = route_command(cmd, argv, argc, -2)) == -1 ||
+             (owner != -2 && c->multi_shard != -2 && owner != c->multi_shard))
+        err = server.config.cluster_enabled ? CLUSTER_CROSSSLOT_ERR : SHARD_CROSSSLOT_ERR;
+    else if (client_multi_append(c, c->querybuf + c->parser.cmd_start, c->parser.pos - c->parser.cmd_start) != 0)
+        err = "-ERR out of memory\r\n";
+
+    if (err != NULL)
+    {
+        client_add_reply_str(c, err);
+        c->flags |= CLIENT_DIRTY_EXEC;
+        return;
+    }
+    if (owner != -2)
+        c->multi_shard = owner;
+    client_add_reply_str(c, "+QUEUED\r\n");
+}
+
+/**
+ * Sends the client's MULTI queue to shard 'owner' to run as one EXEC.
+ * The queue leaves with the message, so the client is out of MULTI.
+ * @return The message, or NULL on allocation failure.
+ */
+static shard_msg_t *forward_multi_queue(client_t *c)
+{
+    char count[LL_STR_SIZE];
+    resp_arg_t argv[3] = {
+        {(char *)"EXEC", 4},
+        {c->multi_buf, c->multi_len},
+        {count, ll_to_str(count, c->multi_count)},
+    };
+    shard_msg_t *m = shard_msg_command(c, argv, 3);
+    if (m == NULL)
+        return NULL;
+    m->type = SHARD_MSG_EXEC;
+    client_multi_reset(c);
+    return m;
+}
+
+/**
+ * Runs every complete command sitting in the client's input buffer.
+ * A trailing partial command stays buffered until more bytes arrive.
+ * A command owned by another shard is forwarded there and the client
+ * blocks; the rest of its pipeline resumes once the reply is back, which
+ * keeps replies in order. A blocking pop that parks the client stops the
+ * pipeline the same way until it is served or times out. The replication
+ * commands stop it for good: the connection moves to shard 0.
+ * @return 0 on success, -1 on a protocol error (the client is then
+ * flagged to close once the error reply has been flushed).
+ */
+static int process_input_buffer(client_t *c)
+{
+    shard_t *sh = c->shard;
+    resp_parser_t *p = &c->parser;
+    resp_status st;
+
+    if (c->flags & CLIENT_BLOCKED_ANY)
+        return 0;
+
+    // An I/O thread may already have parsed the first command
+    if (c->flags & CLIENT_PREPARSED)
+    {
+        st = c->io_parse_status;
+        c->flags &= ~CLIENT_PREPARSED;
+    }
+    else
+    {
+        st = resp_parse_command(p, c->querybuf, c->qb_len);
+    }
+
+    for (; st == RESP_PARSE_OK; st = resp_parse_command(p, c->querybuf, c->qb_len))
+    {
+        // Args are views into querybuf, valid until it is compacted below
+        resp_arg_t *argv = resp_parser_argv(p, c->querybuf);
+        log_trace("fd=%d cmd=%.*s argc=%d", c->fd, (int)argv[0].len, argv[0].ptr, p->argc);
+
+        redis_command_t *cmd = command_lookup(&argv[0]);
+        if (c->flags & CLIENT_MASTER)
+        {
+            if (c->flags & CLIENT_CLOSE_ASAP)
+                break; // Being replaced: the rest of its stream is void
+            apply_master_command(c, cmd, argv, p->argc);
+            continue;
+        }
+        if (cmd && (cmd->flags & CMD_SHARD0_CONN) && sh->id != 0)
+        {
+            // Parsed again on shard 0, once the connection moved there
+            resp_parser_rewind(p);
+            c->flags |= CLIENT_HANDOFF;
+            break;
+        }
+        if ((c->flags & CLIENT_MULTI) &&
+            !(cmd && (cmd->proc == handle_exec || cmd->proc == handle_discard || cmd->proc == handle_multi)))
+        {
+            queue_multi_command(c, cmd, argv, p->argc);
+            continue;
+        }
+        if (cmd && (cmd->flags & CMD_WRITE) && repl_state.master_port != 0)
+        {
+            client_add_reply_str(c, "-READONLY You can't write against a read only replica.\r\n");
+            continue;
+        }
+
+        int owner = route_command(cmd, argv, p->argc, sh->id);
+        // EXEC goes where the queued keys live
+        int exec_remote = cmd && cmd->proc == handle_exec && p->argc == 1 &&
+                          (c->flags & (CLIENT_MULTI | CLIENT_DIRTY_EXEC)) == CLIENT_MULTI &&
+                          c->multi_shard >= 0 && c->multi_shard != sh->id;
+        if (exec_remote)
+            owner = c->multi_shard;
+        if (owner == sh->id)
+        {
+            command_call(cmd, &sh->db, c, argv, p->argc);
+            if (sh->db.ready_count)
+                serve_ready_keys(sh);
+            if (c->flags & CLIENT_BLOCKED_POP)
+                break;
+            continue;
+        }
+        if (owner < 0)
+        {
+            client_add_reply_str(c, server.config.cluster_enabled ? CLUSTER_CROSSSLOT_ERR : SHARD_CROSSSLOT_ERR);
+            c->flags &= ~CLIENT_ASKING;
+            continue;
+        }
+
+        shard_msg_t *m = exec_remote ? forward_multi_queue(c) : shard_msg_command(c, argv, p->argc);
+        if (m == NULL)
+        {
+            client_add_reply_str(c, "-ERR out of memory\r\n");
+            continue;
+        }
+        shard_send(&server.shards[owner], m);
+        c->flags &= ~CLIENT_ASKING; // Went along with the command
+        c->flags |= CLIENT_BLOCKED;
+        c->forwarded_to = owner;
+        break;
+    }
+
+    if (st == RESP_PARSE_ERROR)
+    {
+        char err[128];
+        int len = snprintf(err, sizeof(err), "-ERR %s\r\n", p->err);
+        client_add_reply(c, err, len);
+        c->flags |= CLIENT_CLOSE_AFTER_REPLY;
+        return -1;
+    }
+
+    client_compact_querybuf(c);
+    return 0;
+}
+
+/**
+ * Queues a client for the end-of-iteration flush (once per iteration).
+ */
+static void queue_pending_write(client_t *c)
+{
+    shard_t *sh = c->shard;
+    if (c->flags & CLIENT_PENDING_WRITE)
+        return;
+    if (sh->pending_count == sh->pending_cap)
+    {
+        size_t cap = sh->pending_cap ? sh->pending_cap * 2 : 64;
+        client_t **list = (client_t **)realloc(sh->pending_writes, cap * sizeof(client_t *));
+        if (list == NULL)
+        {
+            c->flags |= CLIENT_CLOSE_ASAP;
+            return;
+        }
+        sh->pending_writes = list;
+        sh->pending_cap = cap;
+    }
+    c->pending_idx = sh->pending_count;
+    sh->pending_writes[sh->pending_count++] = c;
+    c->flags |= CLIENT_PENDING_WRITE;
+}
+
+static void unqueue_pending_write(client_t *c)
+{
+    shard_t *sh = c->shard;
+    if (!(c->flags & CLIENT_PENDING_WRITE))
+        return;
+    client_t *last = sh->pending_writes[--sh->pending_count];
+    sh->pending_writes[c->pending_idx] = last;
+    last->pending_idx = c->pending_idx;
+    c->flags &= ~CLIENT_PENDING_WRITE;
+}
+
+/**
+ * Interest a client is registered with while it is not waiting to write.
+ */
+static uint32_t client_read_interest(const client_t *c)
+{
+    return (c->flags & CLIENT_ASYNC_IO) ? EVENT_READABLE | EVENT_STREAM : EVENT_READABLE;
+}
+
+/**
+ * Switches write interest on or off for a client.
+ * It is only registered while the socket refuses more output.
+ */
+static int set_write_interest(client_t *c, int on)
+{
+    if (!!(c->flags & CLIENT_WRITE_INTEREST) == on)
+        return 0;
+    uint32_t mask = client_read_interest(c) | (on ? EVENT_WRITABLE : 0);
+    if (on && (c->flags & CLIENT_CLOSE_AFTER_REPLY))
+        mask = EVENT_WRITABLE; // Nothing more will be read from it
+    if (event_mod(&c->shard->el, c->fd, mask) < 0)
+    {
+        log_error("event_mod: %s", strerror(errno));
+        return -1;
+    }
+    if (on)
+        c->flags |= CLIENT_WRITE_INTEREST;
+    else
+        c->flags &= ~CLIENT_WRITE_INTEREST;
+    return 0;
+}
+
+/**
+ * Unregisters a client from the event loop, closes its socket and frees
+ * it. A reply still in flight from another shard is dropped on arrival,
+ * because the client id no longer matches; a pop parked there is
+ * cancelled so it cannot swallow an element. A client whose send is
+ * still in the kernel is only freed once it completes (finish_send()).
+ */
+static void close_client(client_t *c)
+{
+    shard_t *sh = c->shard;
+    if (c->flags & CLIENT_BLOCKED_POP)
+        bpop_unpark(&sh->db, c->bpop);
+    if (c->flags & CLIENT_BLOCKED)
+    {
+        shard_msg_t *m = shard_msg_command(c, NULL, 0);
+        if (m)
+        {
+            m->type = SHARD_MSG_CANCEL;
+            shard_send(&server.shards[c->forwarded_to], m);
+        }
+    }
+    if (c->replica)
+        repl_replica_free(c);
+    if (c->flags & CLIENT_MASTER)
+        repl_master_lost(c); // Never counted in stat_clients
+    else
+        atomic_fetch_sub_explicit(&server.stat_clients, 1, memory_order_relaxed);
+    unqueue_pending_write(c);
+    if (c->flags & CLIENT_SENDING)
+        event_cancel_send(&sh->el, c);
+    event_del(&sh->el, c->fd);
+    close(c->fd);
+    client_table_set(&sh->clients, c->fd, NULL);
+    if (c->flags & CLIENT_SENDING)
+        c->flags |= CLIENT_CLOSED;
+    else
+        client_free(c);
+}
+
+/**
+ * Moves a connection to shard 0, with its unsent replies and the bytes it
+ * has not run yet: replicas are served from there.
+ */
+static void hand_off_client(client_t *c)
+{
+    shard_t *sh = c->shard;
+    if (c->flags & CLIENT_SENDING)
+        return; // finish_send() calls us again
+    shard_msg_t *m = shard_msg_command(c, NULL, 0);
+    if (m == NULL)
+    {
+        c->flags |= CLIENT_CLOSE_ASAP;
+        queue_pending_write(c);
+        return;
+    }
+    unqueue_pending_write(c);
+    event_del(&sh->el, c->fd);
+    client_table_set(&sh->clients, c->fd, NULL);
+    c->flags &= ~(CLIENT_HANDOFF | CLIENT_WRITE_INTEREST);
+    m->type = SHARD_MSG_HANDOFF;
+    m->client = c;
+    shard_send(&server.shards[0], m);
+}
+
+/**
+ * Queues the output of the commands that just ran, if there is any, or
+ * sends the connection on to shard 0.
+ */
+static void after_commands(client_t *c)
+{
+    if ((c->flags & (CLIENT_HANDOFF | CLIENT_CLOSE_ASAP)) == CLIENT_HANDOFF)
+        hand_off_client(c);
+    else if (client_has_pending_replies(c) || (c->flags & CLIENT_CLOSE_ASAP))
+        queue_pending_write(c);
+}
+
+// --- Reads ---
+
+static void queue_pending_read(client_t *c)
+{
+    shard_t *sh = c->shard;
+    if (c->flags & CLIENT_PENDING_READ)
+        return;
+    if (sh->pending_reads_count == sh->pending_reads_cap)
+    {
+        size_t cap = sh->pending_reads_cap ? sh->pending_reads_cap * 2 : 64;
+        client_t **list = (client_t **)realloc(sh->pending_reads, cap * sizeof(client_t *));
+        if (list == NULL)
+            return; // Level-triggered: the event loop reports it again next time
+        sh->pending_reads = list;
+        sh->pending_reads_cap = cap;
+    }
+    sh->pending_reads[sh->pending_reads_count++] = c;
+    c->flags |= CLIENT_PENDING_READ;
+}
+
+/**
+ * I/O-thread half of a read: recv() and parse the first buffered command.
+ * Touches nothing but the client itself. Bytes the event loop received
+ * (CLIENT_PREREAD) are already in querybuf.
+ */
+static void read_job(client_t *c)
+{
+    if (!(c->flags & CLIENT_PREREAD))
+    {
+        c->io_result = client_read(c);
+        c->io_errno = errno;
+    }
+    if (c->io_result > 0 && !(c->flags & CLIENT_BLOCKED_ANY))
+    {
+        c->io_parse_status = resp_parse_command(&c->parser, c->querybuf, c->qb_len);
+        c->flags |= CLIENT_PREPARSED;
+    }
+}
+
+/**
+ * Main-thread half of a read: handle EOF/errors and run the commands.
+ */
+static void finish_read(client_t *c)
+{
+    if (c->io_result == 0)
+    {
+        // Client disconnected
+        log_ratelimited(LOG_INFO, 10, "Client (fd=%d) disconnected.", c->fd);
+        close_client(c);
+        return;
+    }
+    if (c->io_result < 0)
+    {
+        // Read error
+        if (c->io_errno == EAGAIN || c->io_errno == EWOULDBLOCK)
+            return;
+        log_ratelimited(LOG_WARNING, 10, "recv (fd=%d): %s", c->fd, strerror(c->io_errno));
+        close_client(c);
+        return;
+    }
+
+    // Data received: run every complete command in the buffer.
+    // On a protocol error the -ERR reply is flushed before closing.
+    process_input_buffer(c);
+    after_commands(c);
+}
+
+/**
+ * Reads every client that became readable in this event batch, on the
+ * I/O threads when enabled, then executes their commands on this thread.
+ */
+static void handle_pending_reads(shard_t *sh)
+{
+    size_t n = sh->pending_reads_count;
+    if (n == 0)
+        return;
+    io_threads_run(sh->pending_reads, n, read_job);
+    sh->pending_reads_count = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        client_t *c = sh->pending_reads[i];
+        c->flags &= ~(CLIENT_PENDING_READ | CLIENT_PREREAD);
+        finish_read(c);
+    }
+}
+
+// --- Writes ---
+
+/**
+ * I/O-thread half of a write: flush as much output as the socket takes.
+ */
+static void write_job(client_t *c)
+{
+    if (c->flags & CLIENT_CLOSE_ASAP)
+        return;
+    c->io_result = c->replica ? repl_replica_write(c) : client_flush(c);
+    c->io_errno = errno;
+}
+
+/**
+ * Main-thread half of a write: close or (un)register write interest.
+ * @return 0 if the client is still alive, -1 if it was closed.
+ */
+static int finish_write(client_t *c)
+{
+    if (c->flags & CLIENT_CLOSE_ASAP)
+    {
+        close_client(c);
+        return -1;
+    }
+
+    int rc = (int)c->io_result;
+    if (rc < 0)
+    {
+        if (c->io_errno != EPIPE && c->io_errno != ECONNRESET)
+            log_ratelimited(LOG_WARNING, 10, "writev (fd=%d): %s", c->fd, strerror(c->io_errno));
+        close_client(c);
+        return -1;
+    }
+    if (rc == 1 && (c->flags & CLIENT_CLOSE_AFTER_REPLY))
+    {
+        close_client(c);
+        return -1;
+    }
+    // Ask the event loop to tell us when the socket drains, only if it's full
+    if (set_write_interest(c, rc == 0) < 0)
+    {
+        close_client(c);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * CLIENT_ASYNC_IO: hands the client's output to the kernel as one
+ * sendmsg, submitted by the next event_wait(). Replies produced while it
+ * is in flight wait for finish_send().
+ */
+static void start_send(client_t *c)
+{
+    if (c->flags & CLIENT_SENDING)
+        return;
+    struct msghdr *msg = (c->flags & CLIENT_CLOSE_ASAP) ? NULL : client_send_begin(c);
+    if (msg == NULL)
+    {
+        // Nothing left to send, or out of memory
+        if (c->flags & (CLIENT_CLOSE_ASAP | CLIENT_CLOSE_AFTER_REPLY))
+            close_client(c);
+        return;
+    }
+    if (event_send(&c->shard->el, c->fd, msg, c) != 0)
+    {
+        log_error("event_send (fd=%d): submission queue full", c->fd);
+        client_send_end(c, 0);
+        close_client(c);
+        return;
+    }
+    c->flags |= CLIENT_SENDING;
+}
+
+/**
+ * The sendmsg of start_send() completed with 'res' (bytes or -errno).
+ */
+static void finish_send(client_t *c, int res)
+{
+    c->flags &= ~CLIENT_SENDING;
+    client_send_end(c, res > 0 ? (size_t)res : 0);
+    if (c->flags & CLIENT_CLOSED)
+    {
+        client_free(c);
+        return;
+    }
+    if (res < 0)
+    {
+        if (res != -EPIPE && res != -ECONNRESET)
+            log_ratelimited(LOG_WARNING, 10, "sendmsg (fd=%d): %s", c->fd, strerror(-res));
+        close_client(c);
+        return;
+    }
+    // A short write sends the rest at once; the kernel waits for room itself
+    if ((c->flags & (CLIENT_HANDOFF | CLIENT_CLOSE_ASAP)) == CLIENT_HANDOFF)
+        hand_off_client(c);
+    else if (client_has_pending_replies(c) || (c->flags & (CLIENT_CLOSE_ASAP | CLIENT_CLOSE_AFTER_REPLY)))
+        queue_pending_write(c);
+}
+
+/**
+ * Flushes every client that produced output during this iteration,
+ * on the I/O threads when enabled. Clients whose socket is full stay
+ * registered for write interest. CLIENT_ASYNC_IO clients get a send
+ * submitted instead, apart from replicas, which stream their snapshot
+ * with sendfile().
+ */
+static void flush_pending_writes(shard_t *sh)
+{
+    size_t n = sh->pending_count;
+    if (n == 0)
+        return;
+
+    // Writes done here first, sends at the end of the list
+    size_t nsync = n;
+    for (size_t i = 0; i < nsync;)
+    {
+        client_t *c = sh->pending_writes[i];
+        if ((c->flags & CLIENT_ASYNC_IO) && c->replica == NULL)
+        {
+            sh->pending_writes[i] = sh->pending_writes[--nsync];
+            sh->pending_writes[nsync] = c;
+        }
+        else
+        {
+            i++;
+        }
+    }
+
+    io_threads_run(sh->pending_writes, nsync, write_job);
+    sh->pending_count = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        client_t *c = sh->pending_writes[i];
+        c->flags &= ~CLIENT_PENDING_WRITE;
+        if (i < nsync)
+            finish_write(c);
+        else
+            start_send(c);
+    }
+}
+
+// --- Cross-Shard Messages ---
+
+/**
+ * Owner side: sends the exec client's captured reply back in 'm'.
+ */
+static void reply_forwarded(shard_t *sh, shard_msg_t *m)
+{
+    client_t *ec = sh->exec_client;
+
+    // The reply leaves at once, not at the top of the next iteration
+    if (server.config.appendfsync == AOF_FSYNC_ALWAYS)
+        aof_flush(sh->id);
+
+    // Hand the reply blocks over as they are; the origin splices them in
+    m->reply_head = ec->reply_head;
+    m->reply_tail = ec->reply_tail;
+    m->reply_bytes = ec->reply_bytes;
+    ec->reply_head = ec->reply_tail = NULL;
+    ec->reply_bytes = 0;
+    ec->flags = 0;
+
+    m->type = SHARD_MSG_REPLY;
+    shard_send(m->origin, m);
+}
+
+/**
+ * Owner side: runs a forwarded command and sends the reply back in the
+ * same message. A pop that parks keeps the message and answers it later.
+ */
+static void run_forwarded_command(shard_t *sh, shard_msg_t *m)
+{
+    client_t *ec = sh->exec_client;
+    ec->flags |= m->client_flags;
+    command_dispatch(&sh->db, ec, m->argv, m->argc);
+
+    if (ec->flags & CLIENT_BLOCKED_POP)
+    {
+        bpop_waiter_t *w = ec->bpop;
+        w->c = NULL;
+        w->forward = m; // Its argv (and so the keys) stay alive with it
+        ec->bpop = NULL;
+        ec->flags = 0;
+    }
+    else
+    {
+        reply_forwarded(sh, m);
+    }
+    if (sh->db.ready_count)
+        serve_ready_keys(sh);
+}
+
+/**
+ * Owner side: runs a MULTI queue forwarded by EXEC and sends back the
+ * array of replies.
+ */
+static void run_forwarded_exec(shard_t *sh, shard_msg_t *m)
+{
+    client_t *ec = sh->exec_client;
+    long long count = 0;
+    string_to_ll(m->argv[2].ptr, m->argv[2].len, &count); // Written by forward_multi_queue()
+    ec->flags |= m->client_flags;
+    multi_exec_queued(&sh->db, ec, m->argv[1].ptr, m->argv[1].len, (int)count);
+    reply_forwarded(sh, m);
+    if (sh->db.ready_count)
+        serve_ready_keys(sh);
+}
+
+/**
+ * Owner side: the origin's client disconnected while its pop was parked.
+ */
+static void cancel_forwarded_pop(shard_t *sh, shard_msg_t *cancel)
+{
+    for (bpop_waiter_t *w = sh->db.waiters; w; w = w->next)
+    {
+        shard_msg_t *m = (shard_msg_t *)w->forward;
+        if (m && m->origin == cancel->origin && m->fd == cancel->fd && m->client_id == cancel->client_id)
+        {
+            bpop_unpark(&sh->db, w);
+            shard_msg_free(m);
+            break;
+        }
+    }
+    shard_msg_free(cancel);
+}
+
+/**
+ * Origin side: delivers a reply and resumes the client's pipeline.
+ */
+static void deliver_forwarded_reply(shard_t *sh, shard_msg_t *m)
 {
-    setbuf(stdout, NULL);
-    setbuf(stderr, NULL);
+    client_t *c = client_table_get(&sh->clients, m->fd);
+    if (c == NULL || c->id != m->client_id)
+    {
+        shard_msg_free(m); // Client went away meanwhile
+        return;
+    }
 
-    printf("Logs from your program will appear here!\n");
+    client_add_reply_blocks(c, m->reply_head, m->reply_tail, m->reply_bytes);
+    m->reply_head = NULL;
+    shard_msg_free(m);
 
-    // 1. Initialize DB and Heap
-    db_entry *db = NULL;
-    heap_t *expiry_heap = heap_create(compare_expiry_entry); // Use new func
-    if (expiry_heap == NULL)
+    c->flags &= ~CLIENT_BLOCKED;
+    process_input_buffer(c);
+    after_commands(c);
+}
+
+/**
+ * Owner side, on a replica: runs a command of the primary's stream.
+ * One sent before the dataset was last replaced is dropped.
+ */
+static void apply_forwarded(shard_t *sh, shard_msg_t *m)
+{
+    if (m->client_id == repl_state.apply_epoch)
     {
-        printf("Failed to create expiry heap.\n");
-        return 1;
+        command_dispatch(&sh->db, sh->exec_client, m->argv, m->argc);
+        _client_free_replies(sh->exec_client);
+        if (sh->db.ready_count)
+            serve_ready_keys(sh);
+    }
+    shard_msg_free(m);
+}
+
+/**
+ * Shard 0: takes over a connection handed off by another shard and runs
+ * the commands it left unparsed.
+ */
+static void adopt_client(shard_t *sh, shard_msg_t *m)
+{
+    client_t *c = m->client;
+    shard_msg_free(m);
+    c->shard = sh;
+    c->id = ++sh->next_client_id;
+
+    if (client_table_set(&sh->clients, c->fd, c) != 0 || event_add(&sh->el, c->fd, client_read_interest(c)) < 0)
+    {
+        log_error("Can't take over connection fd=%d: %s", c->fd, strerror(errno));
+        client_table_set(&sh->clients, c->fd, NULL);
+        close(c->fd);
+        client_free(c);
+        atomic_fetch_sub_explicit(&server.stat_clients, 1, memory_order_relaxed);
+        return;
+    }
+    process_input_buffer(c);
+    after_commands(c);
+}
+
+static void drain_inbox(shard_t *sh)
+{
+    shard_msg_t *m;
+    while ((m = shard_inbox_pop(sh)) != NULL)
+    {
+        if (m->type == SHARD_MSG_COMMAND)
+            run_forwarded_command(sh, m);
+        else if (m->type == SHARD_MSG_REPLY)
+            deliver_forwarded_reply(sh, m);
+        else if (m->type == SHARD_MSG_APPLY)
+            apply_forwarded(sh, m);
+        else if (m->type == SHARD_MSG_HANDOFF)
+            adopt_client(sh, m);
+        else if (m->type == SHARD_MSG_EXEC)
+            run_forwarded_exec(sh, m);
+        else
+            cancel_forwarded_pop(sh, m);
+    }
+}
+
+// --- Blocking Pops ---
+
+/**
+ * Completes a waiter whose reply has been written. A local client is
+ * queued to resume its pipeline; a forwarded pop is answered.
+ */
+static void finish_bpop(shard_t *sh, bpop_waiter_t *w)
+{
+    client_t *c = w->c;
+    shard_msg_t *m = (shard_msg_t *)w->forward;
+    bpop_unpark(&sh->db, w);
+
+    if (c == NULL)
+    {
+        reply_forwarded(sh, m);
+        return;
+    }
+    c->flags &= ~CLIENT_BLOCKED_POP;
+    c->bpop = NULL;
+    after_commands(c);
+
+    if (sh->unblocked_count == sh->unblocked_cap)
+    {
+        size_t cap = sh->unblocked_cap ? sh->unblocked_cap * 2 : 16;
+        client_ref_t *list = (client_ref_t *)realloc(sh->unblocked, cap * sizeof(client_ref_t));
+        if (list == NULL)
+            return; // Its pipeline resumes with its next read instead
+        sh->unblocked = list;
+        sh->unblocked_cap = cap;
+    }
+    sh->unblocked[sh->unblocked_count++] = (client_ref_t){c->fd, c->id};
+}
+
+/**
+ * Where a waiter's reply goes: the parked client, or for a forwarded pop
+ * the exec client, whose blocks finish_bpop() then ships back.
+ */
+static client_t *bpop_reply_client(shard_t *sh, bpop_waiter_t *w)
+{
+    return w->c ? w->c : sh->exec_client;
+}
+
+/**
+ * Serves the waiters of every key pushed to since the last call, oldest
+ * first, for as long as their lists have elements.
+ */
+static void serve_ready_keys(shard_t *sh)
+{
+    redis_db_t *db = &sh->db;
+    for (size_t i = 0; i < db->ready_count; i++)
+    {
+        blocked_key_t *bk = db->ready_keys[i];
+        resp_arg_t key = {bk->key, bk->key_len};
+        while (bk->head)
+        {
+            db_entry *e = db_find(db, &key);
+            if (e == NULL || e->type != VAL_TYPE_LIST)
+                break; // Emptied (lists never stay empty) or replaced
+            if (db_key_expired(e))
+            {
+                db_delete_propagate(db, e);
+                break;
+            }
+
+            bpop_waiter_t *w = bk->head->w;
+            client_t *rc = bpop_reply_client(sh, w);
+            client_add_reply_array_len(rc, 2);
+            client_add_reply_bulk(rc, bk->key, bk->key_len);
+            list_pop_reply(db, e, w->where, rc);
+            list_pop_propagate(db, &key, w->where);
+            finish_bpop(sh, w);
+        }
+
+        bk->ready = 0;
+        if (bk->head == NULL)
+        {
+            HASH_DEL(db->blocking_keys, bk);
+            free(bk->key);
+            free(bk);
+        }
+    }
+    db->ready_count = 0;
+}
+
+/**
+ * Answers with a null array every pop whose timeout has passed.
+ */
+static void bpop_timeout_cycle(shard_t *sh)
+{
+    long long now = cached_time_ms();
+    bpop_waiter_t *w;
+    while ((w = (bpop_waiter_t *)heap_peek(sh->db.bpop_heap)) != NULL && w->deadline_ms <= now)
+    {
+        client_add_reply_str(bpop_reply_client(sh, w), "*-1\r\n");
+        finish_bpop(sh, w);
+    }
+}
+
+/**
+ * Runs the commands that piled up behind the pops served this iteration.
+ * Those may serve and unblock further clients, which are handled too.
+ */
+static void handle_unblocked_clients(shard_t *sh)
+{
+    for (size_t i = 0; i < sh->unblocked_count; i++)
+    {
+        client_ref_t ref = sh->unblocked[i];
+        client_t *c = client_table_get(&sh->clients, ref.fd);
+        if (c == NULL || c->id != ref.id || (c->flags & CLIENT_BLOCKED_ANY))
+            continue;
+        process_input_buffer(c);
+        after_commands(c);
+    }
+    sh->unblocked_count = 0;
+}
+
+// --- Expiry ---
+
+/**
+ * Deletes keys whose TTL has passed, oldest first, until none are left or
+ * the cycle's key or time budget runs out. The heap holds the entries
+ * themselves and every entry sits in it at most once, so the top is
+ * always a live key with its current TTL. A replica leaves it to the
+ * primary's DELs.
+ * @return 1 if expired keys remain (the next cycle should run at once).
+ */
+static int active_expire_cycle(redis_db_t *db)
+{
+    if (db_replaying)
+        return 0;
+    long long now = cached_time_ms();
+    long long start_us = monotonic_us();
+    db_entry *e;
+    int evicted = 0;
+
+    while ((e = (db_entry *)heap_peek(db->expiry_heap)) != NULL && e->expiry_ms <= now)
+    {
+        if (evicted == ACTIVE_EXPIRE_CYCLE_KEYS)
+            return 1;
+        // Reading the clock is cheap but not free: check it every few keys
+        if ((evicted & 31) == 31 && monotonic_us() - start_us > ACTIVE_EXPIRE_CYCLE_US)
+            return 1;
+        log_debug("Active evict: %s", e->key);
+        db_delete_propagate(db, e);
+        evicted++;
+    }
+    return 0;
+}
+
+/**
+ * How long event_wait() may sleep: until the next key expires or blocking
+ * pop times out, capped so an idle shard still wakes up now and then. A
+ * keyspace resize in progress, or unlinked values still to be freed, are
+ * finished off between events instead.
+ */
+static int poll_timeout_ms(shard_t *sh, int expire_pending)
+{
+    if (expire_pending || dict_is_rehashing(&sh->db.entries) || sh->db.lazyfree.count > 0)
+        return 0;
+    int max_wait = sh->id == 0 && server.child_type != CHILD_NONE ? CHILD_POLL_MS : EVENT_LOOP_MAX_WAIT_MS;
+    if (sh->id == 0 && server.config.cluster_enabled && max_wait > CLUSTER_CRON_MS)
+        max_wait = CLUSTER_CRON_MS;
+    db_entry *next = db_replaying ? NULL : (db_entry *)heap_peek(sh->db.expiry_heap);
+    bpop_waiter_t *w = (bpop_waiter_t *)heap_peek(sh->db.bpop_heap);
+    if (next == NULL && w == NULL)
+        return max_wait;
+    long long deadline = next ? next->expiry_ms : w->deadline_ms;
+    if (w && w->deadline_ms < deadline)
+        deadline = w->deadline_ms;
+    long long wait = deadline - current_time_ms();
+    if (wait <= 0)
+        return 0;
+    return wait < max_wait ? (int)wait : max_wait;
+}
+
+// --- Replication ---
+
+/**
+ * Shard 0: hands every replica what was streamed since the last
+ * iteration; on a replica, queues the periodic ACK to the primary.
+ */
+static void replication_tick(shard_t *sh)
+{
+    for (size_t i = 0; i < repl_state.nreplicas; i++)
+    {
+        if (repl_replica_feed(repl_state.replicas[i]))
+            queue_pending_write(repl_state.replicas[i]->c);
     }
+    client_t *m = repl_master_client(sh);
+    if (m && (repl_send_ack(m) || (m->flags & CLIENT_CLOSE_ASAP)))
+        queue_pending_write(m);
+}
 
-    int server_fd;
+// --- Event Loop ---
 
+/**
+ * Creates a non-blocking listening socket on 'port'.
+ * With 'reuseport' several shards bind the same port and the kernel
+ * spreads incoming connections over them.
+ * @return The socket, or -1 on failure.
+ */
+static int create_listener(int port, int reuseport)
+{
     /** STEP 1: Create a TCP socket **/
-    server_fd = socket(AF_INET, SOCK_STREAM, 0);
+    int server_fd = socket(AF_INET, SOCK_STREAM, 0);
     if (server_fd == -1)
     {
-        printf("Socket creation failed: %s...\n", strerror(errno));
-        return 1;
+        log_error("Socket creation failed: %s...", strerror(errno));
+        return -1;
     }
 
     /** STEP 2: Enable address reuse **/
     int reuse = 1;
-    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) < 0)
+    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) < 0 ||
+        (reuseport && setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) < 0))
     {
-        printf("Setsockopt failed: %s \n", strerror(errno));
-        return 1;
+        log_error("Setsockopt failed: %s", strerror(errno));
+        close(server_fd);
+        return -1;
     }
 
     /** STEP 3: Bind socket to a port **/
     struct sockaddr_in serv_addr = {
         .sin_family = AF_INET,
-        .sin_port = htons(PORT),
+        .sin_port = htons(port),
         .sin_addr = {htonl(INADDR_ANY)},
     };
     if (bind(server_fd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) != 0)
     {
-        printf("Bind failed: %s \n", strerror(errno));
-        return 1;
+        log_error("Bind failed: %s", strerror(errno));
+        close(server_fd);
+        return -1;
     }
 
     /** STEP 4: Start listening **/
-    if (listen(server_fd, 5) != 0)
+    if (listen(server_fd, server.config.tcp_backlog) != 0)
     {
-        printf("Listen failed: %s \n", strerror(errno));
-        return 1;
+        log_error("Listen failed: %s", strerror(errno));
+        close(server_fd);
+        return -1;
     }
 
     /** STEP 5: Make listening socket non-blocking **/
     if (set_nonblocking(server_fd) == -1)
     {
-        printf("set_nonblocking failed: %s\n", strerror(errno));
-        return 1;
+        log_error("set_nonblocking failed: %s", strerror(errno));
+        close(server_fd);
+        return -1;
     }
+    return server_fd;
+}
 
-    printf("Waiting for a client to connect...\n");
+/**
+ * Socket options of every accepted connection, whichever backend
+ * accepted it.
+ */
+static int setup_client_socket(int client_fd)
+{
+    if (set_nonblocking(client_fd) < 0)
+        return -1;
+    // Replies may go out in several writes (e.g. once per shard a pipeline
+    // touched): without this, Nagle holds each one back until the client's
+    // delayed ACK
+    int one = 1;
+    setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return 0;
+}
+
+/**
+ * Sets up a client for a new connection, accepted by either backend.
+ * Under io_uring it is read and written through the ring (CLIENT_ASYNC_IO).
+ */
+static void add_client(shard_t *sh, int client_fd)
+{
+    log_ratelimited(LOG_INFO, 10, "New client connected (fd=%d, shard=%d)", client_fd, sh->id);
+    if (setup_client_socket(client_fd) < 0)
+    {
+        close(client_fd);
+        return;
+    }
+    client_t *c = client_create(client_fd, server.config.client_obuf_limit);
+    if (c == NULL || client_table_set(&sh->clients, client_fd, c) != 0)
+    {
+        client_free(c);
+        close(client_fd);
+        return;
+    }
+    c->id = ++sh->next_client_id;
+    c->shard = sh;
+    if (event_async_io(&sh->el))
+        c->flags |= CLIENT_ASYNC_IO;
 
-    // https://man7.org/linux/man-pages/man7/epoll.7.html
-    /** STEP 6: Create an epoll instance **/
-    int epfd = epoll_create1(0);
-    if (epfd < 0)
+    if (event_add(&sh->el, client_fd, client_read_interest(c)) < 0)
     {
-        perror("epoll_create1");
-        return 1;
+        log_error("event_add: client_fd: %s", strerror(errno));
+        client_table_set(&sh->clients, client_fd, NULL);
+        client_free(c);
+        close(client_fd);
+        return;
+    }
+    atomic_fetch_add_explicit(&server.stat_clients, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&server.stat_connections, 1, memory_order_relaxed);
+}
+
+/**
+ * The listener is readable (epoll): takes the waiting connections off
+ * the backlog, up to ACCEPT_MAX_PER_WAKEUP so a connection storm can't
+ * starve the clients already connected.
+ */
+static void accept_clients(shard_t *sh)
+{
+    for (int i = 0; i < ACCEPT_MAX_PER_WAKEUP; i++)
+    {
+        int client_fd = accept(sh->listen_fd, NULL, NULL);
+        if (client_fd < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                log_ratelimited(LOG_WARNING, 10, "accept: %s", strerror(errno));
+            return;
+        }
+        add_client(sh, client_fd);
     }
+}
 
-    /** STEP 7: Register the listening socket with epoll **/
-    struct epoll_event ev, events[MAX_EVENTS];
-    ev.events = EPOLLIN;
-    ev.data.fd = server_fd;
-    if (epoll_ctl(epfd, EPOLL_CTL_ADD, server_fd, &ev) < 0)
+/**
+ * The ring received bytes for a CLIENT_ASYNC_IO client ('res' of them,
+ * 0 on EOF, -errno on error): they go into querybuf, and the client is
+ * queued for the read batch as if recv() had returned them.
+ */
+static void feed_client(client_t *c, const event_fired_t *fe)
+{
+    if (c->flags & (CLIENT_CLOSE_AFTER_REPLY | CLIENT_CLOSE_ASAP))
+    {
+        // Input is ignored from now on; stop the recv that keeps reporting EOF
+        if (fe->res <= 0)
+            event_mod(&c->shard->el, c->fd, (c->flags & CLIENT_WRITE_INTEREST) ? EVENT_WRITABLE : 0);
+        return;
+    }
+    if (!(c->flags & CLIENT_PREREAD))
     {
-        perror("epoll_ctl: listen_fd");
-        exit(EXIT_FAILURE);
+        c->flags |= CLIENT_PREREAD;
+        c->io_result = fe->res < 0 ? -1 : 0;
+        c->io_errno = fe->res < 0 ? -fe->res : 0;
     }
+    else if (c->io_result <= 0 || fe->res <= 0)
+    {
+        // EOF or an error behind data: the re-armed recv reports it again
+        return;
+    }
+    if (fe->res > 0)
+    {
+        if (client_feed(c, fe->data, (size_t)fe->res) != 0)
+        {
+            c->io_result = -1;
+            c->io_errno = ENOMEM;
+        }
+        else
+        {
+            c->io_result += fe->res;
+        }
+    }
+    queue_pending_read(c);
+}
+
+/**
+ * Runs one shard until shutdown is requested.
+ */
+static void run_event_loop(shard_t *sh)
+{
+    event_fired_t events[MAX_EVENTS];
+    int expire_pending = 0; // The last expiry cycle ran out of budget
 
-    printf("Event loop started\n");
+    slab_use(&sh->db.mem); // Keyspace objects come from this shard's pool
 
-    /** STEP 8: Main event loop **/
-    while (1)
+    while (!server.shutdown_asap)
     {
-        // Set epoll_wait timeout to 100ms so the eviction loop runs
-        int n = epoll_wait(epfd, events, MAX_EVENTS, 100);
+        // Shard 0 runs snapshots, AOF rewrites and replication; the others hold still while it forks
+        if (sh->id == 0)
+        {
+            rdb_cron();
+            aof_cron();
+            repl_cron();
+            cluster_cron();
+            command_stats_cron();
+        }
+        else
+        {
+            shard_pause_point();
+        }
+
+        // Log the previous iteration's writes before any of their replies go out
+        aof_flush(sh->id);
+        if (sh->id == 0)
+            replication_tick(sh);
+
+        // Send everything the previous iteration produced, one writev per client
+        flush_pending_writes(sh);
+
+        // Sleep until the next key expires (or not at all if a cycle was cut short)
+        int n = event_wait(&sh->el, events, MAX_EVENTS, poll_timeout_ms(sh, expire_pending));
         if (n == -1)
         {
             if (errno == EINTR)
-                continue;
-            perror("epoll_wait");
+                continue; // Re-checks shutdown_asap
+            log_error("event_wait: %s", strerror(errno));
             break;
         }
+        update_cached_time();
 
-        /** STEP 9: Handle all triggered events **/
+        /** Handle all triggered events **/
+        int woken = 0;
         for (int i = 0; i < n; i++)
         {
-            int fd = events[i].data.fd;
+            const event_fired_t *fe = &events[i];
+            int fd = fe->fd;
 
-            if (fd == server_fd)
+            if (fe->mask & EVENT_SENT)
             {
-                // Accept new connection
-                struct sockaddr_in client_addr;
-                socklen_t client_len = sizeof(client_addr);
-                int client_fd = accept(server_fd, (struct sockaddr *)&client_addr, &client_len);
-                if (client_fd < 0)
-                {
-                    perror("accept");
-                    continue;
-                }
-                printf("New client connected\n");
-                if (set_nonblocking(client_fd) < 0)
-                {
-                    close(client_fd);
-                    continue;
-                }
-                ev.events = EPOLLIN;
-                ev.data.fd = client_fd;
-                if (epoll_ctl(epfd, EPOLL_CTL_ADD, client_fd, &ev) < 0)
-                {
-                    perror("epoll_ctl: client_fd");
-                    close(client_fd);
-                    continue;
-                }
+                finish_send((client_t *)fe->ctx, fe->res);
+                continue;
             }
-            else if (events[i].events & EPOLLIN)
+            if (fd == sh->listen_fd)
             {
-                // Data from a client
-                char buf[1024];
-                int bytes_read = recv(fd, buf, sizeof(buf) - 1, 0);
-                buf[bytes_read] = '\0';
-
-                if (bytes_read == 0) /***************** */
-                {
-                    // Client disconnected
-                    printf("Client (fd=%d) disconnected.\n", fd);
-                    close(fd);
-                    epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
-                }
-                else if (bytes_read < 0)
-                {
-                    // Read error
-                    if (errno != EAGAIN && errno != EWOULDBLOCK)
-                    {
-                        perror("recv");
-                        close(fd);
-                        epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
-                    }
-                }
+                // io_uring accepted one connection; epoll says there are some
+                if (!(fe->mask & EVENT_ACCEPTED))
+                    accept_clients(sh);
+                else if (fe->res >= 0)
+                    add_client(sh, fe->res);
                 else
-                {
-                    // Data received
-                    int ind = 0;
-                    if (dbg)
-                        printf("buf: %s\n", buf);
-                    if (buf[ind] == '*')
-                    {
-                        //
-                        // --- Parsing logic (from parser.h) ---
-                        //
-                        ind++;
-                        int cmnd_list_size = extract_number(&ind, buf);
-                        char *cmnds[cmnd_list_size];
-                        ind += 2;
-                        for (int j = 0; j < cmnd_list_size; j++)
-                        {
-                            cmnds[j] = extract_bulk_string(&ind, buf);
-                            if (cmnds[j] == NULL) { // Malloc failure
-                                cmnd_list_size = j; // only free the ones we allocated
-                                break;
-                            }
-                            ind += 2;
-                        }
-                        to_lowercase(cmnds[0]);
-                        if (dbg)
-                        {
-                            for (int j = 0; j < cmnd_list_size; j++)
-                                printf("%s ", cmnds[j]);
-                            printf("\n");
-                        }
-
-                        //
-                        // --- Command dispatch (calls functions from handler.h) ---
-                        //
-                        if (!strcmp(cmnds[0], "echo"))
-                        {
-                            if (cmnd_list_size > 1) handle_echo(cmnds[1], fd);
-                        }
-                        else if (!strcmp(cmnds[0], "ping"))
-                        {
-                            send(fd, REDIS_PONG, strlen(REDIS_PONG), 0);
-                        }
-                        else if (!strcmp(cmnds[0], "set"))
-                        {
-                            if (cmnd_list_size < 3) continue; // Not enough args
-                            long long expiry = -1;
-                            if (cmnd_list_size > 3)
-                            {
-                                to_lowercase(cmnds[3]);
-                                if (!strcmp(cmnds[3], "px") && cmnd_list_size > 4)
-                                {
-                                    expiry = current_time_ms() + atoi(cmnds[4]);
-                                }
-                            }
-                            handle_set(&db, expiry_heap, cmnds[1], cmnds[2], expiry, fd);
-                        }
-                        else if (!strcmp(cmnds[0], "get"))
-                        {
-                            if (cmnd_list_size > 1) handle_get(&db, cmnds[1], fd);
-                        }
-                        else if (!strcmp(cmnds[0], "rpush"))
-                        {
-                            handle_rpush(&db, cmnds, cmnd_list_size, fd);
-                        }
-                        else if (!strcmp(cmnds[0], "lrange"))
-                        {
-                            handle_lrange(&db, cmnds, cmnd_list_size, fd);
-                        }
-                        else if (!strcmp(cmnds[0], "zadd"))
-                        {
-                            handle_zadd(&db, cmnds, cmnd_list_size, fd);
-                        }
-                        else if (!strcmp(cmnds[0], "zrange"))
-                        {
-                            handle_zrange(&db, cmnds, cmnd_list_size, fd);
-                        }   
-                        
-
-                        // Free parsed commands
-                        for (int j = 0; j < cmnd_list_size; j++)
-                        {
-                            free(cmnds[j]);
-                        }
-                    }
-                }
+                    log_ratelimited(LOG_WARNING, 10, "accept: %s", strerror(-fe->res));
+                continue;
+            }
+            if (fd == sh->wake_fd)
+            {
+                // Other shards queued commands or replies for us
+                shard_ack_wake(sh);
+                woken = 1;
+                continue;
+            }
+            if (sh->id == 0 && fd == repl_state.link_fd)
+            {
+                // Handshake with our primary, or its snapshot
+                repl_link_event(sh);
+                continue;
+            }
+            if (sh->id == 0 && cluster_owns_fd(fd))
+            {
+                // Another node, or the bus listener
+                cluster_bus_event(fd, fe->mask);
+                continue;
             }
-        } // End of epoll event loop
 
-        // --- 4. Active Eviction Logic (NEW AND CORRECT) ---
-        while (1)
-        {
-            // 1. Peek at the HEAP'S entry (this is now safe)
-            expiry_entry_t *e_heap = (expiry_entry_t *)heap_peek(expiry_heap);
+            client_t *c = client_table_get(&sh->clients, fd);
+            if (c == NULL)
+                continue;
 
-            // 2. Stop if heap is empty or top item is not expired
-            if (e_heap == NULL || e_heap->expiry_ms > current_time_ms()) {
-                break;
+            if (fe->mask & EVENT_DATA)
+            {
+                // Bytes the ring already received
+                feed_client(c, fe);
+                continue;
             }
 
-            // 3. Item is expired. Pop it.
-            e_heap = (expiry_entry_t *)heap_pop(expiry_heap);
-
-            // 4. --- The Stale Pointer Check ---
-            //    Find the *real* entry in the hash table
-            db_entry *e_hash;
-            HASH_FIND_STR(db, e_heap->key, e_hash);
+            if (fe->mask & EVENT_WRITABLE)
+            {
+                // Socket drained: resume the flush that previously blocked
+                queue_pending_write(c);
+            }
 
-            // 5. Check if it's stale
-            //    Case A: Key was deleted (e_hash is NULL)
-            //    Case B: Key was overwritten with a *different* expiry
-            //            (e_hash->expiry_ms != e_heap->expiry_ms)
-            if (e_hash == NULL || e_hash->expiry_ms != e_heap->expiry_ms)
+            if ((fe->mask & (EVENT_READABLE | EVENT_ERROR)) &&
+                !(c->flags & (CLIENT_CLOSE_AFTER_REPLY | CLIENT_CLOSE_ASAP)))
             {
-                if (dbg) printf("Stale heap entry found for key: %s\n", e_heap->key);
-                // This heap entry is garbage. Free it and check the next one.
-                free(e_heap->key);
-                free(e_heap);
-                continue;
+                // Data from a client: read in one batch after this loop
+                queue_pending_read(c);
             }
+        } // End of event loop
+
+        // Read (possibly on I/O threads) and run the commands of every readable client
+        handle_pending_reads(sh);
+
+        if (woken)
+            drain_inbox(sh);
+
+        bpop_timeout_cycle(sh);
+        handle_unblocked_clients(sh);
+
+        expire_pending = active_expire_cycle(&sh->db);
+
+        // Traffic moves the rehash along a bucket per operation; idle time does the rest
+        if (n == 0 && dict_is_rehashing(&sh->db.entries))
+            dict_rehash_us(&sh->db.entries, ACTIVE_REHASH_US, monotonic_us);
+
+        // Values unlinked by this or earlier iterations, a slice at a time
+        if (sh->db.lazyfree.count > 0)
+            lazyfree_cycle(&sh->db.lazyfree, LAZYFREE_CYCLE_US, monotonic_us);
+
+        shard_stats_publish(sh, monotonic_us() - cached_monotonic_us());
+    }
+}
+
+/**
+ * Runs one command read back from the AOF on the shard owning its keys,
+ * at startup, before any shard thread exists. Replies are dropped.
+ * @return 0, or -1 if it names an unknown command or keys of several shards.
+ */
+static int replay_command(const resp_arg_t *argv, int argc)
+{
+    redis_command_t *cmd = command_lookup(&argv[0]);
+    int owner = route_command(cmd, argv, argc, 0);
+    if (cmd == NULL || owner < 0)
+        return -1;
+    shard_t *sh = &server.shards[owner];
+    slab_use(&sh->db.mem);
+    command_call(cmd, &sh->db, sh->exec_client, argv, argc);
+    _client_free_replies(sh->exec_client);
+    return 0;
+}
+
+static void *shard_thread_main(void *arg)
+{
+    run_event_loop((shard_t *)arg);
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    config_set_defaults(&server.config);
+    if (config_parse_args(&server.config, argc, argv) != 0)
+        return 1;
+
+    if (log_init(server.config.log_level, server.config.log_file) != 0)
+    {
+        fprintf(stderr, "Can't open log file %s: %s\n", server.config.log_file, strerror(errno));
+        return 1;
+    }
+
+    // Peers that hang up mid-reply must not kill the process
+    signal(SIGPIPE, SIG_IGN);
+
+    struct sigaction sa = {0};
+    sa.sa_handler = handle_shutdown_signal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    log_info("Logs from your program will appear here!");
+
+    command_table_init();
+    // A per-process hash seed keeps clients from choosing colliding keys
+    if (getrandom(&dict_hash_seed, sizeof(dict_hash_seed), 0) != sizeof(dict_hash_seed))
+        dict_hash_seed ^= (uint64_t)monotonic_us() ^ ((uint64_t)getpid() << 32);
+    zset_default_engine = server.config.zset_impl;
+    list_max_listpack_entries = server.config.list_max_listpack_entries;
+    list_max_listpack_value = server.config.list_max_listpack_value;
+    zset_max_listpack_entries = server.config.zset_max_listpack_entries;
+    zset_max_listpack_value = server.config.zset_max_listpack_value;
+    maxmemory = server.config.maxmemory;
+    maxmemory_policy = server.config.maxmemory_policy;
+    maxmemory_samples = server.config.maxmemory_samples;
+    lazyfree_enabled = server.config.lazyfree;
+
+    if (io_threads_init(server.config.io_threads) != 0)
+        return 1;
+
+    // io_uring can be compiled out, too old or forbidden (seccomp, sysctl)
+    if (server.config.event_loop == EVENT_BACKEND_IO_URING)
+    {
+        event_loop_t probe;
+        if (event_loop_init(&probe, EVENT_BACKEND_IO_URING) != 0)
+        {
+            log_warn("io_uring is not available (%s), using epoll", strerror(errno));
+            server.config.event_loop = EVENT_BACKEND_EPOLL;
+        }
+        else
+        {
+            event_loop_free(&probe);
+        }
+    }
 
-            // 6. If we're here, it's a valid, expired entry.
-            //    e_hash points to the real db_entry.
-            //    e_heap points to the heap's bookkeeping entry.
-            if (dbg) printf("Active evict: %s\n", e_hash->key);
-            
-            // Delete from hash table
-            free_db_value(e_hash);
-            HASH_DEL(db, e_hash);
-            free(e_hash->key);
-            free(e_hash);
-
-            // Delete the heap entry
-            free(e_heap->key);
-            free(e_heap);
+    // 1. One keyspace, expiry heap, event loop and listener per shard
+    server.nshards = server.config.shards;
+    server.shards = (shard_t *)calloc(server.nshards, sizeof(shard_t));
+    if (server.shards == NULL)
+    {
+        log_error("Failed to allocate shards.");
+        return 1;
+    }
+    for (int i = 0; i < server.nshards; i++)
+    {
+        shard_t *sh = &server.shards[i];
+        if (shard_init(sh, i, server.config.event_loop) != 0)
+            return 1;
+        sh->db.nshards = server.nshards;
+        sh->listen_fd = create_listener(server.config.port, server.nshards > 1);
+        if (sh->listen_fd < 0)
+            return 1;
+
+        if (event_listen(&sh->el, sh->listen_fd) < 0)
+        {
+            log_error("event_listen: listen_fd: %s", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (aof_init() != 0)
+        return 1;
+
+    // DUMP and RESTORE checksum their payloads on every shard
+    rdb_crc_init();
+
+    // The node table, and the cluster bus on port + CLUSTER_PORT_INCR
+    if (cluster_init() != 0)
+        return 1;
+    if (server.config.cluster_enabled)
+    {
+        cluster_state.bus_fd = create_listener(server.config.port + CLUSTER_PORT_INCR, 0);
+        if (cluster_state.bus_fd < 0)
+            return 1;
+        if (event_add(&server.shards[0].el, cluster_state.bus_fd, EVENT_READABLE) < 0)
+        {
+            log_error("event_add: cluster bus: %s", strerror(errno));
+            return 1;
+        }
+    }
+
+    // 2. The dataset, before the first command runs: replayed from the AOF
+    // if there is one, else loaded from the last snapshot
+    update_cached_time();
+    server.start_time_ms = cached_time_ms();
+    int from_aof = server.config.appendonly && access(server.config.appendfilename, F_OK) == 0;
+    int loaded = from_aof ? aof_load(server.config.appendfilename, replay_command)
+                          : rdb_load(server.config.dbfilename, server.shards, server.nshards);
+    if (loaded != 0 || (server.config.appendonly && aof_start() != 0))
+    {
+        log_shutdown(); // Flush the reason
+        return 1;
+    }
+    rdb_state.dirty_saved = rdb_dirty(); // Replayed writes are not changes
+    rdb_state.last_save_ms = current_time_ms();
+    repl_init();
+
+    log_info("Waiting for a client to connect on port %d...", server.config.port);
+
+    // Shard threads leave SIGINT/SIGTERM to the main thread
+    sigset_t block, old;
+    sigemptyset(&block);
+    sigaddset(&block, SIGINT);
+    sigaddset(&block, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &block, &old);
+    for (int i = 1; i < server.nshards; i++)
+    {
+        if (pthread_create(&server.shards[i].thread, NULL, shard_thread_main, &server.shards[i]) != 0)
+        {
+            log_error("Can't create thread for shard %d", i);
+            return 1;
         }
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
 
-    } // End of main while(1)
+    if (server.nshards > 1)
+        log_info("Event loop started with %d shards (%s)", server.nshards, event_backend_names[server.config.event_loop]);
+    else
+        log_info("Event loop started (%s)", event_backend_names[server.config.event_loop]);
+
+    run_event_loop(&server.shards[0]);
 
     /** Cleanup **/
-    // On a real shutdown, you would iterate and free all entries
-    // in both 'db' and 'expiry_heap' before destroying them.
-    heap_destroy(expiry_heap);
-    close(epfd);
-    close(server_fd);
+    log_info("Shutting down");
+    server.shutdown_asap = 1;
+    for (int i = 1; i < server.nshards; i++)
+    {
+        shard_wake(&server.shards[i]);
+        pthread_join(server.shards[i].thread, NULL);
+    }
+    io_threads_shutdown();
+    aof_shutdown();
+    rdb_shutdown();
+    repl_shutdown();
+    cluster_shutdown();
+    for (int i = 0; i < server.nshards; i++)
+    {
+        shard_t *sh = &server.shards[i];
+        db_release(&sh->db);
+        heap_destroy(sh->db.expiry_heap);
+        heap_destroy(sh->db.bpop_heap);
+        event_loop_free(&sh->el);
+        close(sh->listen_fd);
+        close(sh->wake_fd);
+    }
 
+    log_shutdown();
     return 0;
-}
\ No newline at end of file
+}
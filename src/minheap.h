@@ -15,6 +15,15 @@
  */
 typedef int (*heap_compare_func)(const void *a, const void *b);
 
+/**
+ * @brief Optional callback told an item's new position whenever it moves
+ * (HEAP_INDEX_NONE once it leaves the heap). Items that store this index
+ * can later be updated or removed in O(log n) without a search.
+ */
+typedef void (*heap_index_func)(void *item, size_t index);
+
+#define HEAP_INDEX_NONE ((size_t)-1)
+
 /**
  * @brief The heap structure.
  */
@@ -23,17 +32,26 @@ typedef struct {
     size_t size;             // Current number of items in the heap
     size_t capacity;         // Total allocated capacity of the array
     heap_compare_func cmp;   // The comparison function
+    heap_index_func set_index; // NULL for a plain, non-indexed heap
 } heap_t;
 
 // --- Internal Helper Functions ---
 
+/**
+ * @brief Stores 'item' at slot 'index' and reports its position.
+ */
+static inline void _heap_place(heap_t *h, size_t index, void *item) {
+    h->items[index] = item;
+    if (h->set_index) h->set_index(item, index);
+}
+
 /**
  * @brief Swaps two items in the heap's array.
  */
-static inline void _heap_swap(void **a, void **b) {
-    void *temp = *a;
-    *a = *b;
-    *b = temp;
+static inline void _heap_swap(heap_t *h, size_t a, size_t b) {
+    void *temp = h->items[a];
+    _heap_place(h, a, h->items[b]);
+    _heap_place(h, b, temp);
 }
 
 /**
@@ -63,7 +81,7 @@ static inline void _heap_sift_up(heap_t *h, size_t index) {
 
     // While item is smaller than its parent, swap up
     while (index > 0 && h->cmp(h->items[index], h->items[parent_index]) < 0) {
-        _heap_swap(&h->items[index], &h->items[parent_index]);
+        _heap_swap(h, index, parent_index);
         index = parent_index;
         parent_index = (index - 1) / 2;
     }
@@ -98,7 +116,7 @@ static inline void _heap_sift_down(heap_t *h, size_t index) {
         }
 
         // Otherwise, swap down
-        _heap_swap(&h->items[index], &h->items[min_index]);
+        _heap_swap(h, index, min_index);
         index = min_index;
     }
 }
@@ -120,7 +138,19 @@ static inline heap_t *heap_create(heap_compare_func cmp) {
     h->size = 0;
     h->capacity = 0;
     h->cmp = cmp;
+    h->set_index = NULL;
+
+    return h;
+}
 
+/**
+ * @brief Creates a heap whose items track their own position.
+ * @param set_index Called with each item's index as it moves.
+ * @return A pointer to the new heap, or NULL on failure.
+ */
+static inline heap_t *heap_create_indexed(heap_compare_func cmp, heap_index_func set_index) {
+    heap_t *h = heap_create(cmp);
+    if (h) h->set_index = set_index;
     return h;
 }
 
@@ -136,6 +166,27 @@ static inline void heap_destroy(heap_t *h) {
     free(h);
 }
 
+/**
+ * @brief Makes room for 'n' items in total, so that many pushes never
+ * reallocate.
+ * @return 0 on success, -1 on allocation failure.
+ */
+static inline int heap_reserve(heap_t *h, size_t n) {
+    if (n <= h->capacity) return 0;
+    void **new_items = (void **)realloc(h->items, n * sizeof(void *));
+    if (new_items == NULL) return -1;
+    h->items = new_items;
+    h->capacity = n;
+    return 0;
+}
+
+/**
+ * @brief Empties the heap, keeping its array. The items are not told.
+ */
+static inline void heap_clear(heap_t *h) {
+    h->size = 0;
+}
+
 /**
  * @brief Gets the number of items in the heap.
  */
@@ -153,7 +204,7 @@ static inline int heap_push(heap_t *h, void *item) {
     }
 
     // Add new item to the end
-    h->items[h->size] = item;
+    _heap_place(h, h->size, item);
     h->size++;
 
     // Sift it up to its correct position
@@ -162,6 +213,54 @@ static inline int heap_push(heap_t *h, void *item) {
     return 0;
 }
 
+/**
+ * @brief Removes the item at 'index' (as reported to set_index).
+ * @return The removed item, or NULL if 'index' is out of range.
+ */
+static inline void *heap_remove(heap_t *h, size_t index) {
+    if (h == NULL || index >= h->size) {
+        return NULL;
+    }
+
+    void *item = h->items[index];
+    if (h->set_index) h->set_index(item, HEAP_INDEX_NONE);
+
+    // Move the last item into the hole
+    h->size--;
+    if (index == h->size) {
+        return item;
+    }
+    _heap_place(h, index, h->items[h->size]);
+
+    // The replacement may belong above or below the hole
+    _heap_sift_up(h, index);
+    _heap_sift_down(h, index);
+    return item;
+}
+
+/**
+ * @brief Restores heap order after the priority of the item at 'index'
+ * changed in place.
+ */
+static inline void heap_update(heap_t *h, size_t index) {
+    if (h == NULL || index >= h->size) {
+        return;
+    }
+    _heap_sift_up(h, index);
+    _heap_sift_down(h, index);
+}
+
+/**
+ * @brief Replaces the item at 'index' with one that compares equal to it,
+ * such as the same object after it was moved by realloc().
+ */
+static inline void heap_set(heap_t *h, size_t index, void *item) {
+    if (h == NULL || index >= h->size) {
+        return;
+    }
+    _heap_place(h, index, item);
+}
+
 /**
  * @brief Returns the minimum item from the heap without removing it.
  * @return The minimum item, or NULL if the heap is empty.
@@ -182,19 +281,7 @@ static inline void *heap_pop(heap_t *h) {
         return NULL;
     }
 
-    // The item to return is at the root
-    void *min_item = h->items[0];
-
-    // Move the last item to the root
-    h->items[0] = h->items[h->size - 1];
-    h->size--;
-
-    // Sift the new root down to its correct position
-    if (h->size > 0) {
-        _heap_sift_down(h, 0);
-    }
-
-    return min_item;
+    return heap_remove(h, 0);
 }
 
 #endif // MINHEAP_H
\ No newline at end of file
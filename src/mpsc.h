@@ -0,0 +1,88 @@
+#ifndef MPSC_H
+#define MPSC_H
+
+#include <stddef.h>
+#include <stdatomic.h>
+
+// --- Data Structures ---
+
+/**
+ * @brief Link embedded in every queued item (intrusive, no allocation).
+ */
+typedef struct mpsc_node
+{
+    _Atomic(struct mpsc_node *) next;
+} mpsc_node_t;
+
+/**
+ * @brief Lock-free multi-producer, single-consumer FIFO (Vyukov).
+ * Any thread may push; only the owning thread may pop. A push is one
+ * atomic exchange plus one store, so producers never wait on each other
+ * or on the consumer.
+ */
+typedef struct
+{
+    _Atomic(mpsc_node_t *) head; // Last pushed node, producers swap it
+    mpsc_node_t *tail;           // Next node to pop, consumer only
+    mpsc_node_t stub;
+} mpsc_queue_t;
+
+// --- Operations ---
+
+static inline void mpsc_init(mpsc_queue_t *q)
+{
+    atomic_init(&q->stub.next, NULL);
+    atomic_init(&q->head, &q->stub);
+    q->tail = &q->stub;
+}
+
+/**
+ * @brief Appends 'n'. Safe to call from any thread.
+ */
+static inline void mpsc_push(mpsc_queue_t *q, mpsc_node_t *n)
+{
+    atomic_store_explicit(&n->next, NULL, memory_order_relaxed);
+    mpsc_node_t *prev = atomic_exchange_explicit(&q->head, n, memory_order_acq_rel);
+    atomic_store_explicit(&prev->next, n, memory_order_release);
+}
+
+/**
+ * @brief Removes the oldest node. Consumer thread only.
+ * @return The node, or NULL if the queue is empty or a producer is
+ * half-way through a push (its node shows up on the next call).
+ */
+static inline mpsc_node_t *mpsc_pop(mpsc_queue_t *q)
+{
+    mpsc_node_t *tail = q->tail;
+    mpsc_node_t *next = atomic_load_explicit(&tail->next, memory_order_acquire);
+
+    if (tail == &q->stub)
+    {
+        if (next == NULL)
+            return NULL;
+        q->tail = next;
+        tail = next;
+        next = atomic_load_explicit(&next->next, memory_order_acquire);
+    }
+    if (next)
+    {
+        q->tail = next;
+        return tail;
+    }
+
+    // 'tail' looks like the last node; make sure no push is in flight
+    if (tail != atomic_load_explicit(&q->head, memory_order_acquire))
+        return NULL;
+
+    // Re-queue the stub behind 'tail' so 'tail' can be handed out
+    mpsc_push(q, &q->stub);
+    next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    if (next)
+    {
+        q->tail = next;
+        return tail;
+    }
+    return NULL;
+}
+
+#endif // MPSC_H
@@ -4,75 +4,336 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include "utils.h" // For count_digits()
-
-#define dbg 1 // For debug prints
+#include <strings.h> // For strncasecmp()
+#include "utils.h" // For ll_to_str()
 
 // --- Request Parsing ---
 
-static inline int extract_number(int *ind, const char *str)
+#define RESP_MAX_MULTIBULK_LEN (1024 * 1024)       // Max args per command
+#define RESP_MAX_BULK_LEN (512LL * 1024 * 1024)    // Max size of one arg
+#define RESP_MAX_HEADER_LEN (64 * 1024)            // Max bytes before a '\r\n'
+
+/**
+ * @brief A view of one argument inside the client's input buffer.
+ * Not NUL-terminated and only valid until the command finishes;
+ * handlers must copy whatever they keep.
+ */
+typedef struct
+{
+    char *ptr;
+    size_t len;
+} resp_arg_t;
+
+typedef enum
+{
+    RESP_PARSE_OK,         // A full command is available in the parser
+    RESP_PARSE_INCOMPLETE, // Need more bytes; state is kept for next call
+    RESP_PARSE_ERROR       // Protocol error; p->err describes it
+} resp_status;
+
+/**
+ * @brief Resumable RESP request parser.
+ *
+ * The parser never copies data. It walks the caller's buffer and records
+ * the (offset, length) of every bulk string of the current command. All
+ * offsets are relative to the start of the buffer, so when the caller
+ * discards consumed bytes it must call resp_parser_shift().
+ */
+typedef struct
+{
+    size_t pos;        // Next unparsed byte
+    size_t cmd_start;  // First byte of the command being parsed
+    long multibulk_len; // Args still to read (0 = expecting '*' header)
+    long long bulk_len; // Length of the current bulk (-1 = expecting '$')
+
+    int argc;          // Args in the current (complete) command
+    size_t *arg_off;   // Offset of each arg in the buffer
+    size_t *arg_len;   // Length of each arg
+    resp_arg_t *argv;  // Filled by resp_parser_argv()
+    int arg_cap;
+
+    const char *err;
+} resp_parser_t;
+
+static inline void resp_parser_init(resp_parser_t *p)
+{
+    memset(p, 0, sizeof(*p));
+    p->bulk_len = -1;
+}
+
+static inline void resp_parser_free(resp_parser_t *p)
+{
+    free(p->arg_off);
+    free(p->arg_len);
+    free(p->argv);
+    p->arg_off = NULL;
+    p->arg_len = NULL;
+    p->argv = NULL;
+    p->arg_cap = 0;
+}
+
+/**
+ * @brief Adjusts all offsets after the caller dropped 'n' bytes
+ * from the front of the buffer.
+ */
+static inline void resp_parser_shift(resp_parser_t *p, size_t n)
 {
-    int num = 0;
-    int minus = 1;
-    if(str[*ind] == '-'){
-        minus = -1;
-        (*ind)++;
+    p->pos -= n;
+    p->cmd_start -= n;
+    if (p->multibulk_len > 0) // Only a partial command has live offsets
+        for (int i = 0; i < p->argc; i++)
+            p->arg_off[i] -= n;
+}
+
+/**
+ * @brief Parses a "<prefix><number>\r\n" line starting at p->pos.
+ * @return 1 on success (pos moved past the CRLF), 0 if the line is not
+ * complete yet, -1 if the number is malformed.
+ */
+static inline int _resp_parse_line_number(resp_parser_t *p, const char *buf, size_t len, long long *out)
+{
+    const char *start = buf + p->pos + 1; // Skip the '*' or '$'
+    const char *nl = memchr(start, '\r', len - p->pos - 1);
+    if (nl == NULL || nl + 1 >= buf + len)
+    {
+        if (len - p->pos > RESP_MAX_HEADER_LEN)
+            return -1;
+        return 0;
     }
-    while (str[*ind] - '0' >= 0 && str[*ind] - '0' <= 9)
+    if (nl[1] != '\n')
+        return -1;
+
+    long long num = 0;
+    int minus = 0;
+    const char *c = start;
+    if (c < nl && *c == '-')
+    {
+        minus = 1;
+        c++;
+    }
+    if (c == nl || nl - c > 18)
+        return -1;
+    for (; c < nl; c++)
     {
-        num = num * 10 + (str[(*ind)++] - '0');
+        if (*c < '0' || *c > '9')
+            return -1;
+        num = num * 10 + (*c - '0');
     }
-    return minus*num;
+
+    *out = minus ? -num : num;
+    p->pos = (nl - buf) + 2;
+    return 1;
 }
 
-static inline char *extract_bulk_string(int *ind, const char *str)
+static inline int _resp_parser_reserve(resp_parser_t *p, int n)
 {
-    if (dbg)
-        printf("Extracting bulk string\n");
-    (*ind)++;
-    int bulk_str_size = extract_number(ind, str);
-    if (dbg)
-        printf("bulk_str_size: %d\n", bulk_str_size);
-    (*ind) += 2;
-    char *bulk_str = (char *)malloc(bulk_str_size + 1);
-    if (!bulk_str) return NULL; // Malloc check
+    if (n <= p->arg_cap)
+        return 0;
+    int cap = p->arg_cap ? p->arg_cap : 8;
+    while (cap < n)
+        cap *= 2;
+    size_t *off = (size_t *)realloc(p->arg_off, cap * sizeof(size_t));
+    if (off == NULL)
+        return -1;
+    p->arg_off = off;
+    size_t *lens = (size_t *)realloc(p->arg_len, cap * sizeof(size_t));
+    if (lens == NULL)
+        return -1;
+    p->arg_len = lens;
+    resp_arg_t *argv = (resp_arg_t *)realloc(p->argv, cap * sizeof(resp_arg_t));
+    if (argv == NULL)
+        return -1;
+    p->argv = argv;
+    p->arg_cap = cap;
+    return 0;
+}
+
+/**
+ * @brief Advances the parser over buf[0..len).
+ *
+ * Call repeatedly: every RESP_PARSE_OK yields one command in
+ * p->argc / p->arg_off / p->arg_len, and the next call starts on the
+ * following pipelined command. RESP_PARSE_INCOMPLETE means the rest of
+ * the command has not arrived yet; call again once more bytes are appended.
+ */
+static inline resp_status resp_parse_command(resp_parser_t *p, const char *buf, size_t len)
+{
+    long long num;
+    int rc;
 
-    for (int i = 0; i < bulk_str_size; i++)
+    while (p->multibulk_len == 0)
     {
-        bulk_str[i] = str[(*ind)++];
+        // Start of a new command
+        p->cmd_start = p->pos;
+        p->argc = 0;
+        p->bulk_len = -1;
+        if (p->pos >= len)
+            return RESP_PARSE_INCOMPLETE;
+        if (buf[p->pos] != '*')
+        {
+            p->err = "Protocol error: expected '*'";
+            return RESP_PARSE_ERROR;
+        }
+
+        rc = _resp_parse_line_number(p, buf, len, &num);
+        if (rc == 0)
+            return RESP_PARSE_INCOMPLETE;
+        if (rc < 0 || num > RESP_MAX_MULTIBULK_LEN)
+        {
+            p->err = "Protocol error: invalid multibulk length";
+            return RESP_PARSE_ERROR;
+        }
+        if (num <= 0)
+            continue; // Empty command ("*0" or "*-1"): nothing to run
+        if (_resp_parser_reserve(p, (int)num) != 0)
+        {
+            p->err = "Out of memory";
+            return RESP_PARSE_ERROR;
+        }
+        p->multibulk_len = (long)num;
     }
-    bulk_str[bulk_str_size] = '\0';
-    if (dbg)
-        printf("Extracted string: %s\n", bulk_str);
-    return bulk_str;
+
+    while (p->multibulk_len > 0)
+    {
+        if (p->bulk_len == -1)
+        {
+            if (p->pos >= len)
+                return RESP_PARSE_INCOMPLETE;
+            if (buf[p->pos] != '$')
+            {
+                p->err = "Protocol error: expected '$'";
+                return RESP_PARSE_ERROR;
+            }
+            rc = _resp_parse_line_number(p, buf, len, &num);
+            if (rc == 0)
+                return RESP_PARSE_INCOMPLETE;
+            if (rc < 0 || num < 0 || num > RESP_MAX_BULK_LEN)
+            {
+                p->err = "Protocol error: invalid bulk length";
+                return RESP_PARSE_ERROR;
+            }
+            p->bulk_len = num;
+        }
+
+        // Wait until the payload and its trailing CRLF are buffered
+        if (len - p->pos < (size_t)p->bulk_len + 2)
+            return RESP_PARSE_INCOMPLETE;
+
+        p->arg_off[p->argc] = p->pos;
+        p->arg_len[p->argc] = (size_t)p->bulk_len;
+        p->argc++;
+        p->pos += (size_t)p->bulk_len + 2;
+        p->bulk_len = -1;
+        p->multibulk_len--;
+    }
+
+    return RESP_PARSE_OK;
 }
 
-// --- Response Encoding ---
+/**
+ * @brief Puts the command just parsed back: the next call parses it
+ * again, and the caller must keep its bytes.
+ */
+static inline void resp_parser_rewind(resp_parser_t *p)
+{
+    p->pos = p->cmd_start;
+}
 
-static inline char *encode_bulk_str(const char *str)
+/**
+ * @brief Materialises the last parsed command as views into 'buf'.
+ * The array belongs to the parser (it is sized for p->argc, which the
+ * client picks, so it never lives on the stack) and is overwritten by
+ * the next call.
+ * @return p->argc arguments.
+ */
+static inline resp_arg_t *resp_parser_argv(resp_parser_t *p, char *buf)
 {
-    int str_len = strlen(str);
-    int num_digits_in_size_str = count_digits(str_len);
-    
-    // $ + digits + \r\n + data + \r\n + \0
-    char *encoded_str = (char *)malloc(1 + num_digits_in_size_str + 2 + str_len + 2 + 1);
-    if (encoded_str == NULL)
+    resp_arg_t *argv = p->argv;
+    for (int i = 0; i < p->argc; i++)
     {
-        return NULL; // Handle allocation failure
+        argv[i].ptr = buf + p->arg_off[i];
+        argv[i].len = p->arg_len[i];
     }
-    sprintf(encoded_str, "$%d\r\n%s\r\n", str_len, str);
-    return encoded_str;
+    return argv;
+}
+
+/**
+ * @brief Case-insensitive compare of an argument with a C string.
+ */
+static inline int resp_arg_eq_nocase(const resp_arg_t *a, const char *s)
+{
+    size_t n = strlen(s);
+    return a->len == n && strncasecmp(a->ptr, s, n) == 0;
+}
+
+/**
+ * @brief Byte-wise compare of two arguments.
+ */
+static inline int resp_arg_eq(const resp_arg_t *a, const resp_arg_t *b)
+{
+    return a->len == b->len && memcmp(a->ptr, b->ptr, a->len) == 0;
+}
+
+/**
+ * @brief Bytes still needed to finish the bulk string being parsed,
+ * so the reader can size the buffer for large values in one go.
+ */
+static inline size_t resp_parser_pending_bulk(const resp_parser_t *p, size_t len)
+{
+    if (p->multibulk_len == 0 || p->bulk_len == -1)
+        return 0;
+    size_t need = (size_t)p->bulk_len + 2;
+    size_t have = len - p->pos;
+    return need > have ? need - have : 0;
+}
+
+// --- Response Encoding ---
+// Encoders write into a caller-provided buffer and return the bytes written.
+// The caller sizes the buffer from the RESP_*_MAX constants, so nothing here
+// allocates or rescans its output.
+
+#define RESP_HEADER_MAX (1 + LL_STR_SIZE + 2)        // <type><number>\r\n
+#define RESP_BULK_OVERHEAD_MAX (RESP_HEADER_MAX + 2) // Header + trailing \r\n
+
+/**
+ * @brief Writes "<type><n>\r\n", e.g. ":42\r\n" or "*3\r\n".
+ */
+static inline size_t resp_encode_header(char *dst, char type, long long n)
+{
+    dst[0] = type;
+    size_t len = 1 + ll_to_str(dst + 1, n);
+    dst[len++] = '\r';
+    dst[len++] = '\n';
+    return len;
+}
+
+static inline size_t resp_encode_integer(char *dst, long long val)
+{
+    return resp_encode_header(dst, ':', val);
+}
+
+static inline size_t resp_encode_array_header(char *dst, long long count)
+{
+    return resp_encode_header(dst, '*', count);
+}
+
+static inline size_t resp_encode_bulk_header(char *dst, size_t len)
+{
+    return resp_encode_header(dst, '$', (long long)len);
 }
 
-static inline char *encode_integer(long long val)
+/**
+ * @brief Writes a complete "$len\r\n<data>\r\n".
+ * 'dst' needs room for RESP_BULK_OVERHEAD_MAX + len bytes.
+ */
+static inline size_t resp_encode_bulk(char *dst, const char *str, size_t len)
 {
-    // :<val>\r\n\0
-    // A 64-bit integer is at most 20 digits + sign + 3 chars + null
-    char *encoded_str = (char *)malloc(25);
-    if (encoded_str == NULL)
-        return NULL;
-    sprintf(encoded_str, ":%lld\r\n", val);
-    return encoded_str;
+    size_t n = resp_encode_bulk_header(dst, len);
+    memcpy(dst + n, str, len); // Binary-safe copy
+    n += len;
+    dst[n++] = '\r';
+    dst[n++] = '\n';
+    return n;
 }
 
 #endif // PARSER_H
\ No newline at end of file
@@ -0,0 +1,279 @@
+#ifndef QUICKLIST_H
+#define QUICKLIST_H
+
+#include <stdlib.h>
+#include <string.h>
+#include "listpack.h"
+#include "slab.h"
+
+/**
+ * List of chunks: a doubly linked list of nodes that each hold a listpack
+ * of consecutive elements. Pushes and pops at either end touch only the
+ * edge node, and indexing skips whole nodes by their counts, starting
+ * from whichever end is nearer.
+ */
+
+#define QUICKLIST_NODE_ENTRIES 128 // A node takes no more elements than this...
+#define QUICKLIST_NODE_BYTES 8192  // ...and stays under this size where possible
+
+#define QUICKLIST_HEAD 0
+#define QUICKLIST_TAIL 1
+
+// --- Data Structures ---
+
+typedef struct quicklist_node {
+    struct quicklist_node *prev;
+    struct quicklist_node *next;
+    unsigned char *lp;
+    size_t count; // Cached lp_count(lp)
+} quicklist_node_t;
+
+typedef struct {
+    quicklist_node_t *head;
+    quicklist_node_t *tail;
+    size_t count; // Elements in all nodes
+    size_t len;   // Nodes
+} quicklist_t;
+
+/**
+ * @brief Forward cursor. The list must not be modified while in use.
+ */
+typedef struct {
+    quicklist_t *ql;
+    quicklist_node_t *node;
+    unsigned char *p; // Current entry in node->lp, NULL when exhausted
+} quicklist_iter_t;
+
+// --- Internal ---
+
+static inline quicklist_node_t *_quicklist_node_new(unsigned char *lp) {
+    quicklist_node_t *node = (quicklist_node_t *)slab_alloc(sizeof(quicklist_node_t));
+    if (node == NULL) return NULL;
+    node->prev = node->next = NULL;
+    node->lp = lp;
+    node->count = lp_count(lp);
+    return node;
+}
+
+static inline int _quicklist_node_has_room(const quicklist_node_t *node, size_t len) {
+    if (node->count >= QUICKLIST_NODE_ENTRIES) return 0;
+    // Always accept a first element, so oversized values get a node of their own
+    return node->count == 0 || lp_bytes(node->lp) + _lp_entry_size(len) <= QUICKLIST_NODE_BYTES;
+}
+
+static inline void _quicklist_link(quicklist_t *ql, quicklist_node_t *node, int where) {
+    if (where == QUICKLIST_HEAD) {
+        node->next = ql->head;
+        if (ql->head) ql->head->prev = node;
+        ql->head = node;
+        if (ql->tail == NULL) ql->tail = node;
+    } else {
+        node->prev = ql->tail;
+        if (ql->tail) ql->tail->next = node;
+        ql->tail = node;
+        if (ql->head == NULL) ql->head = node;
+    }
+    ql->len++;
+}
+
+static inline void _quicklist_unlink(quicklist_t *ql, quicklist_node_t *node) {
+    if (node->prev) node->prev->next = node->next;
+    else ql->head = node->next;
+    if (node->next) node->next->prev = node->prev;
+    else ql->tail = node->prev;
+    ql->len--;
+}
+
+// --- Public API ---
+
+static inline quicklist_t *quicklist_create(void) {
+    quicklist_t *ql = (quicklist_t *)slab_alloc(sizeof(quicklist_t));
+    if (ql) {
+        ql->head = ql->tail = NULL;
+        ql->count = 0;
+        ql->len = 0;
+    }
+    return ql;
+}
+
+/**
+ * @brief Builds a one-node quicklist that takes ownership of 'lp'.
+ * @return The list, or NULL if out of memory ('lp' is then not taken).
+ */
+static inline quicklist_t *quicklist_create_from_listpack(unsigned char *lp) {
+    quicklist_t *ql = quicklist_create();
+    if (ql == NULL) return NULL;
+    quicklist_node_t *node = _quicklist_node_new(lp);
+    if (node == NULL) {
+        slab_free(ql, sizeof(quicklist_t));
+        return NULL;
+    }
+    _quicklist_link(ql, node, QUICKLIST_TAIL);
+    ql->count = node->count;
+    return ql;
+}
+
+/**
+ * @brief Appends a whole listpack as a new tail node, taking ownership of
+ * it; for building a list in one pass. An empty listpack is just freed.
+ * @return 0 on success, -1 if out of memory ('lp' is then not taken).
+ */
+static inline int quicklist_append_listpack(quicklist_t *ql, unsigned char *lp) {
+    if (lp_count(lp) == 0) {
+        lp_free(lp);
+        return 0;
+    }
+    quicklist_node_t *node = _quicklist_node_new(lp);
+    if (node == NULL) return -1;
+    _quicklist_link(ql, node, QUICKLIST_TAIL);
+    ql->count += node->count;
+    return 0;
+}
+
+static inline void quicklist_free(quicklist_t *ql) {
+    quicklist_node_t *node = ql->head;
+    while (node) {
+        quicklist_node_t *next = node->next;
+        lp_free(node->lp);
+        slab_free(node, sizeof(quicklist_node_t));
+        node = next;
+    }
+    slab_free(ql, sizeof(quicklist_t));
+}
+
+/**
+ * @brief Frees whole nodes from the head until about '*budget' elements,
+ * which it uses up, are gone; for lazy freeing (lazyfree.h).
+ * @return 1 once the list itself is freed, 0 if nodes remain.
+ */
+static inline int quicklist_free_step(quicklist_t *ql, size_t *budget) {
+    while (ql->head && *budget > 0) {
+        quicklist_node_t *node = ql->head;
+        ql->head = node->next;
+        *budget -= node->count < *budget ? node->count : *budget;
+        lp_free(node->lp);
+        slab_free(node, sizeof(quicklist_node_t));
+    }
+    if (ql->head) return 0;
+    slab_free(ql, sizeof(quicklist_t));
+    return 1;
+}
+
+static inline size_t quicklist_count(const quicklist_t *ql) {
+    return ql->count;
+}
+
+/**
+ * @brief Adds an element at the head or tail.
+ * @return 0 on success, -1 if out of memory.
+ */
+static inline int quicklist_push(quicklist_t *ql, int where, const char *s, size_t len) {
+    quicklist_node_t *node = where == QUICKLIST_HEAD ? ql->head : ql->tail;
+    if (node == NULL || !_quicklist_node_has_room(node, len)) {
+        unsigned char *lp = lp_new();
+        if (lp == NULL) return -1;
+        node = _quicklist_node_new(lp);
+        if (node == NULL) {
+            lp_free(lp);
+            return -1;
+        }
+        _quicklist_link(ql, node, where);
+    }
+
+    unsigned char *lp = lp_insert(node->lp, where == QUICKLIST_HEAD ? lp_first(node->lp) : NULL, s, len);
+    if (lp == NULL) {
+        if (node->count == 0) {
+            _quicklist_unlink(ql, node);
+            lp_free(node->lp);
+            slab_free(node, sizeof(quicklist_node_t));
+        }
+        return -1;
+    }
+    node->lp = lp;
+    node->count++;
+    ql->count++;
+    return 0;
+}
+
+/**
+ * @brief Reads the element at the head or tail without removing it. The
+ * data stays valid until the list is modified.
+ * @return 1 if the list is not empty, 0 otherwise.
+ */
+static inline int quicklist_peek(quicklist_t *ql, int where, const char **s, size_t *len) {
+    if (ql->count == 0) return 0;
+    unsigned char *p = where == QUICKLIST_HEAD ? lp_first(ql->head->lp) : lp_last(ql->tail->lp);
+    *s = lp_get(p, len);
+    return 1;
+}
+
+/**
+ * @brief Removes the element at the head or tail, if any.
+ */
+static inline void quicklist_del(quicklist_t *ql, int where) {
+    if (ql->count == 0) return;
+    quicklist_node_t *node = where == QUICKLIST_HEAD ? ql->head : ql->tail;
+    ql->count--;
+    if (--node->count == 0) {
+        _quicklist_unlink(ql, node);
+        lp_free(node->lp);
+        slab_free(node, sizeof(quicklist_node_t));
+        return;
+    }
+    unsigned char *p = where == QUICKLIST_HEAD ? lp_first(node->lp) : lp_last(node->lp);
+    node->lp = lp_delete(node->lp, p, 1);
+}
+
+/**
+ * @brief Positions 'it' on the element at 'index'; negative indices count
+ * from the tail. Whole nodes are skipped from the nearer end.
+ * @return 1 on success, 0 if 'index' is out of range.
+ */
+static inline int quicklist_seek(quicklist_t *ql, long long index, quicklist_iter_t *it) {
+    long long count = (long long)ql->count;
+    if (index < 0) index += count;
+    it->ql = ql;
+    it->node = NULL;
+    it->p = NULL;
+    if (index < 0 || index >= count) return 0;
+
+    quicklist_node_t *node;
+    size_t offset;
+    if (index < count / 2) {
+        size_t i = (size_t)index;
+        node = ql->head;
+        while (i >= node->count) {
+            i -= node->count;
+            node = node->next;
+        }
+        offset = i;
+    } else {
+        size_t i = (size_t)(count - 1 - index); // Steps back from the tail
+        node = ql->tail;
+        while (i >= node->count) {
+            i -= node->count;
+            node = node->prev;
+        }
+        offset = node->count - 1 - i;
+    }
+    it->node = node;
+    it->p = lp_seek(node->lp, (long long)offset);
+    return 1;
+}
+
+/**
+ * @brief Reads the current element and advances towards the tail.
+ * @return 1 with the element in '*s'/'*len', 0 when exhausted.
+ */
+static inline int quicklist_next(quicklist_iter_t *it, const char **s, size_t *len) {
+    if (it->p == NULL) return 0;
+    *s = lp_get(it->p, len);
+    it->p = lp_next(it->node->lp, it->p);
+    if (it->p == NULL && it->node->next) {
+        it->node = it->node->next;
+        it->p = lp_first(it->node->lp);
+    }
+    return 1;
+}
+
+#endif // QUICKLIST_H
@@ -0,0 +1,1368 @@
+#ifndef RDB_H
+#define RDB_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "handler.h"
+#include "server.h"
+#include "shard.h"
+#include "log.h"
+#include "time_utils.h"
+
+/**
+ * Point-in-time snapshots of the keyspace (SAVE, BGSAVE, --save).
+ *
+ * BGSAVE parks every shard between commands, fork()s and lets them go at
+ * once: the child writes the copy-on-write image of all keyspaces, frozen
+ * at the fork, while the parent keeps serving. The file is written under
+ * a temporary name, fsync()ed and renamed over --dbfilename, so a crash
+ * never leaves a torn snapshot behind. It is loaded at startup.
+ *
+ * Layout (integers little-endian, lengths LEB128 varints as in listpack.h):
+ *
+ *   "RCRDB" <version: 4 digits>
+ *   RESIZE <keys> <keys with a TTL>          Size hint for the loader
+ *   { [EXPIRE_MS <u64 unix ms>] <type> <key: string> <value> } ...
+ *   EOF <u64 CRC-64 of every byte before it>
+ *
+ *   string         = <len> <bytes>
+ *   STRING         : string
+ *   LIST_LISTPACK,
+ *   ZSET_LISTPACK  : the value's listpack as a string
+ *   LIST_QUICKLIST : <nodes>, then each node's listpack as a string
+ *   ZSET           : <count>, then <member: string> <score: 8 raw bytes>
+ *                    pairs in score order
+ */
+
+#define RDB_MAGIC "RCRDB"
+#define RDB_VERSION "0001"
+#define RDB_HEADER_SIZE 9
+#define RDB_BUF_SIZE (64 * 1024)
+#define RDB_MAX_STRING_LEN (512ULL * 1024 * 1024)
+#define RDB_RETRY_DELAY_MS 5000 // After a failed BGSAVE, before --save tries again
+
+#define RDB_TYPE_STRING 0
+#define RDB_TYPE_LIST_QUICKLIST 1
+#define RDB_TYPE_ZSET 2
+#define RDB_TYPE_LIST_LISTPACK 3
+#define RDB_TYPE_ZSET_LISTPACK 4
+
+#define RDB_OP_RESIZE 0xFB
+#define RDB_OP_EXPIRE_MS 0xFC
+#define RDB_OP_EOF 0xFF
+
+// --- Data Structures ---
+
+typedef struct
+{
+    int fd;          // -1: flushed bytes go to 'mem' instead
+    size_t len;      // Bytes in 'buf'
+    uint64_t crc;    // Over everything flushed so far
+    int error;       // errno of the first failed write, 0 if none
+    unsigned char *mem; // malloc()ed, with fd == -1
+    size_t mem_len;
+    size_t mem_cap;
+    unsigned char buf[RDB_BUF_SIZE];
+} rdb_writer_t;
+
+/**
+ * @brief A bounded position in the mapped snapshot.
+ */
+typedef struct
+{
+    const unsigned char *p; // Next unread byte
+    const unsigned char *end;
+    const char *err;        // Why parsing failed
+} rdb_cursor_t;
+
+/**
+ * @brief One shard's share of a snapshot being loaded.
+ */
+typedef struct
+{
+    shard_t *shard;
+    const unsigned char **records; // Its records, in file order
+    size_t n;
+    size_t cap;
+    size_t expires;                // Records with a TTL
+    const unsigned char *end;      // Of the records area
+    long long now_ms;              // Keys that expired by then are dropped
+    pthread_t thread;
+    int threaded;                  // Loaded by 'thread'
+    size_t loaded;
+    const char *err;
+} rdb_load_job_t;
+
+/**
+ * @brief Snapshot bookkeeping. Only shard 0 touches it: SAVE, BGSAVE,
+ * LASTSAVE and INFO run there.
+ */
+typedef struct
+{
+    long long child_start_ms; // Of the running BGSAVE (server.child_pid)
+    long long dirty_at_fork;  // rdb_dirty() as the running BGSAVE saw it
+    long long dirty_saved;    // rdb_dirty() covered by the last good save
+    long long last_save_ms;   // Last good save (or startup)
+    long long last_try_ms;    // Last BGSAVE attempt
+    int last_bgsave_ok;
+    long long last_bgsave_ms; // Duration of the last BGSAVE, -1 if none yet
+} rdb_state_t;
+
+static rdb_state_t rdb_state = {0, 0, 0, 0, 0, 1, -1};
+
+static inline void _rdb_put_u64(unsigned char *p, uint64_t v)
+{
+    for (int i = 0; i < 8; i++)
+        p[i] = (unsigned char)(v >> (8 * i));
+}
+
+static inline uint64_t _rdb_get_u64(const unsigned char *p)
+{
+    uint64_t v = 0;
+    for (int i = 0; i < 8; i++)
+        v |= (uint64_t)p[i] << (8 * i);
+    return v;
+}
+
+// --- Checksum ---
+// CRC-64/Jones (reflected), eight bytes per step ("slicing-by-8"):
+// rdb_crc_table[k][b] is the CRC of byte b followed by k zero bytes.
+
+#define RDB_CRC64_POLY 0x95ac9329ac4bc9b5ULL
+
+static uint64_t rdb_crc_table[8][256];
+
+static inline void rdb_crc_init(void)
+{
+    if (rdb_crc_table[0][1])
+        return;
+    for (int i = 0; i < 256; i++)
+    {
+        uint64_t c = (uint64_t)i;
+        for (int k = 0; k < 8; k++)
+            c = (c & 1) ? (c >> 1) ^ RDB_CRC64_POLY : c >> 1;
+        rdb_crc_table[0][i] = c;
+    }
+    for (int i = 0; i < 256; i++)
+    {
+        for (int k = 1; k < 8; k++)
+        {
+            uint64_t prev = rdb_crc_table[k - 1][i];
+            rdb_crc_table[k][i] = (prev >> 8) ^ rdb_crc_table[0][prev & 0xff];
+        }
+    }
+}
+
+static inline uint64_t rdb_crc64(uint64_t crc, const void *data, size_t len)
+{
+    const unsigned char *p = (const unsigned char *)data;
+    for (; len >= 8; p += 8, len -= 8)
+    {
+        crc ^= _rdb_get_u64(p);
+        crc = rdb_crc_table[7][crc & 0xff] ^ rdb_crc_table[6][(crc >> 8) & 0xff] ^
+              rdb_crc_table[5][(crc >> 16) & 0xff] ^ rdb_crc_table[4][(crc >> 24) & 0xff] ^
+              rdb_crc_table[3][(crc >> 32) & 0xff] ^ rdb_crc_table[2][(crc >> 40) & 0xff] ^
+              rdb_crc_table[1][(crc >> 48) & 0xff] ^ rdb_crc_table[0][crc >> 56];
+    }
+    for (; len > 0; p++, len--)
+        crc = rdb_crc_table[0][(crc ^ *p) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+// --- Writer ---
+
+static inline void rdb_writer_init(rdb_writer_t *w, int fd)
+{
+    w->fd = fd;
+    w->len = 0;
+    w->crc = 0;
+    w->error = 0;
+    w->mem = NULL;
+    w->mem_len = w->mem_cap = 0;
+}
+
+static inline void _rdb_flush(rdb_writer_t *w)
+{
+    w->crc = rdb_crc64(w->crc, w->buf, w->len);
+    if (w->fd < 0 && !w->error)
+    {
+        if (w->mem_cap - w->mem_len < w->len)
+        {
+            size_t cap = w->mem_cap ? w->mem_cap : 256;
+            while (cap - w->mem_len < w->len)
+                cap *= 2;
+            unsigned char *mem = (unsigned char *)realloc(w->mem, cap);
+            if (mem == NULL)
+                w->error = ENOMEM;
+            else
+            {
+                w->mem = mem;
+                w->mem_cap = cap;
+            }
+        }
+        if (!w->error)
+        {
+            memcpy(w->mem + w->mem_len, w->buf, w->len);
+            w->mem_len += w->len;
+        }
+        w->len = 0;
+        return;
+    }
+    size_t off = 0;
+    while (off < w->len && !w->error)
+    {
+        ssize_t n = write(w->fd, w->buf + off, w->len - off);
+        if (n < 0)
+        {
+            if (errno != EINTR)
+                w->error = errno;
+            continue;
+        }
+        off += (size_t)n;
+    }
+    w->len = 0;
+}
+
+static inline void rdb_write(rdb_writer_t *w, const void *data, size_t len)
+{
+    const unsigned char *p = (const unsigned char *)data;
+    while (len > 0)
+    {
+        if (w->len == RDB_BUF_SIZE)
+            _rdb_flush(w);
+        size_t n = RDB_BUF_SIZE - w->len < len ? RDB_BUF_SIZE - w->len : len;
+        memcpy(w->buf + w->len, p, n);
+        w->len += n;
+        p += n;
+        len -= n;
+    }
+}
+
+static inline void rdb_write_u8(rdb_writer_t *w, unsigned char v)
+{
+    rdb_write(w, &v, 1);
+}
+
+static inline void rdb_write_len(rdb_writer_t *w, uint64_t v)
+{
+    unsigned char buf[10];
+    rdb_write(w, buf, _lp_encode_varint(buf, (size_t)v));
+}
+
+static inline void rdb_write_u64(rdb_writer_t *w, uint64_t v)
+{
+    unsigned char buf[8];
+    _rdb_put_u64(buf, v);
+    rdb_write(w, buf, 8);
+}
+
+static inline void rdb_write_string(rdb_writer_t *w, const void *s, size_t len)
+{
+    rdb_write_len(w, len);
+    rdb_write(w, s, len);
+}
+
+static inline unsigned char _rdb_value_type(const db_entry *e)
+{
+    if (e->type == VAL_TYPE_STRING)
+        return RDB_TYPE_STRING;
+    if (e->encoding == VAL_ENC_LISTPACK)
+        return e->type == VAL_TYPE_LIST ? RDB_TYPE_LIST_LISTPACK : RDB_TYPE_ZSET_LISTPACK;
+    return e->type == VAL_TYPE_LIST ? RDB_TYPE_LIST_QUICKLIST : RDB_TYPE_ZSET;
+}
+
+/**
+ * @brief (Internal) Writes the value of 'e', in the form its
+ * _rdb_value_type() names.
+ */
+static inline void _rdb_save_value(rdb_writer_t *w, db_entry *e)
+{
+    if (e->type == VAL_TYPE_STRING)
+    {
+        char buf[LL_STR_SIZE];
+        size_t len;
+        const char *s = db_string_get(e, buf, &len);
+        rdb_write_string(w, s, len);
+    }
+    else if (e->encoding == VAL_ENC_LISTPACK)
+    {
+        unsigned char *lp = (unsigned char *)e->value;
+        rdb_write_string(w, lp, lp_bytes(lp));
+    }
+    else if (e->type == VAL_TYPE_LIST)
+    {
+        quicklist_t *ql = (quicklist_t *)e->value;
+        rdb_write_len(w, ql->len);
+        for (quicklist_node_t *node = ql->head; node; node = node->next)
+            rdb_write_string(w, node->lp, lp_bytes(node->lp));
+    }
+    else
+    {
+        RedisZSet *zset = (RedisZSet *)e->value;
+        rdb_write_len(w, zset_length(zset));
+        zset_iter_t it;
+        zset_elem_t el;
+        zset_iter_seek_rank(&it, zset, 0, 0);
+        while (zset_iter_next(&it, &el))
+        {
+            rdb_write_string(w, el.member, el.member_len);
+            rdb_write(w, &el.score, sizeof(el.score));
+        }
+    }
+}
+
+static inline void _rdb_save_entry(rdb_writer_t *w, db_entry *e, long long now_ms)
+{
+    if (e->expiry_ms != -1)
+    {
+        if (e->expiry_ms <= now_ms)
+            return; // Logically gone already
+        rdb_write_u8(w, RDB_OP_EXPIRE_MS);
+        rdb_write_u64(w, (uint64_t)e->expiry_ms);
+    }
+    rdb_write_u8(w, _rdb_value_type(e));
+    rdb_write_string(w, e->key, e->key_len);
+    _rdb_save_value(w, e);
+}
+
+typedef struct
+{
+    rdb_writer_t *w;
+    long long now_ms;
+} _rdb_save_ctx_t;
+
+static inline void _rdb_save_node(void *privdata, dict_node_t *node)
+{
+    _rdb_save_ctx_t *ctx = (_rdb_save_ctx_t *)privdata;
+    _rdb_save_entry(ctx->w, DB_ENTRY_OF(node), ctx->now_ms);
+}
+
+/**
+ * @brief Writes a whole snapshot of 'dbs' to 'fd'. Nothing may modify
+ * them meanwhile.
+ * @return 0 on success, -1 with errno set on a write error.
+ */
+static inline int rdb_save_fd(int fd, redis_db_t **dbs, int ndbs, long long now_ms)
+{
+    rdb_crc_init();
+    rdb_writer_t w;
+    rdb_writer_init(&w, fd);
+
+    rdb_write(&w, RDB_MAGIC RDB_VERSION, RDB_HEADER_SIZE);
+    size_t keys = 0, expires = 0;
+    for (int i = 0; i < ndbs; i++)
+    {
+        keys += dict_size(&dbs[i]->entries);
+        expires += heap_size(dbs[i]->expiry_heap);
+    }
+    rdb_write_u8(&w, RDB_OP_RESIZE);
+    rdb_write_len(&w, keys);
+    rdb_write_len(&w, expires);
+
+    _rdb_save_ctx_t ctx = {&w, now_ms};
+    for (int i = 0; i < ndbs && !w.error; i++)
+    {
+        // Without concurrent resizes, one cursor pass visits every key once
+        uint64_t cursor = 0;
+        do
+            cursor = dict_scan(&dbs[i]->entries, cursor, _rdb_save_node, &ctx);
+        while (cursor != 0 && !w.error);
+    }
+
+    rdb_write_u8(&w, RDB_OP_EOF);
+    _rdb_flush(&w);
+    _rdb_put_u64(w.buf, w.crc);
+    w.len = 8;
+    _rdb_flush(&w);
+    if (w.error)
+    {
+        errno = w.error;
+        return -1;
+    }
+    return 0;
+}
+
+static inline void _rdb_temp_path(char *buf, size_t cap, const char *path, pid_t pid)
+{
+    snprintf(buf, cap, "%s.tmp-%d", path, (int)pid);
+}
+
+/**
+ * @brief Saves 'dbs' to 'path' through a fsync()ed temporary file renamed
+ * into place. Logs nothing, as it also runs in the BGSAVE child.
+ * @return 0 on success, -1 with errno set.
+ */
+static inline int rdb_save(const char *path, redis_db_t **dbs, int ndbs, long long now_ms)
+{
+    char tmp[4096];
+    _rdb_temp_path(tmp, sizeof(tmp), path, getpid());
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return -1;
+    if (rdb_save_fd(fd, dbs, ndbs, now_ms) != 0 || fsync(fd) != 0)
+    {
+        int err = errno;
+        close(fd);
+        unlink(tmp);
+        errno = err;
+        return -1;
+    }
+    if (close(fd) != 0 || rename(tmp, path) != 0)
+    {
+        int err = errno;
+        unlink(tmp);
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+// --- Reader ---
+// The file is mmap()ed: values are parsed where they lie, and only copied
+// once, into the objects built from them.
+
+static inline int rdb_get_u8(rdb_cursor_t *cur, unsigned char *v)
+{
+    if (cur->p == cur->end)
+    {
+        cur->err = "unexpected end of file";
+        return -1;
+    }
+    *v = *cur->p++;
+    return 0;
+}
+
+static inline int rdb_get_len(rdb_cursor_t *cur, uint64_t *v)
+{
+    uint64_t out = 0;
+    for (int shift = 0; shift < 64; shift += 7)
+    {
+        unsigned char b;
+        if (rdb_get_u8(cur, &b) != 0)
+            return -1;
+        out |= (uint64_t)(b & 127) << shift;
+        if (!(b & 128))
+        {
+            *v = out;
+            return 0;
+        }
+    }
+    cur->err = "malformed length";
+    return -1;
+}
+
+/**
+ * @return The next 'len' bytes, or NULL past the end of the file.
+ */
+static inline const unsigned char *rdb_get_bytes(rdb_cursor_t *cur, uint64_t len)
+{
+    if (len > (uint64_t)(cur->end - cur->p))
+    {
+        cur->err = "unexpected end of file";
+        return NULL;
+    }
+    const unsigned char *p = cur->p;
+    cur->p += len;
+    return p;
+}
+
+static inline int rdb_get_u64(rdb_cursor_t *cur, uint64_t *v)
+{
+    const unsigned char *p = rdb_get_bytes(cur, 8);
+    if (p == NULL)
+        return -1;
+    *v = _rdb_get_u64(p);
+    return 0;
+}
+
+/**
+ * @return The bytes of a length-prefixed string, or NULL on error.
+ */
+static inline const char *rdb_get_string(rdb_cursor_t *cur, size_t *len)
+{
+    uint64_t n;
+    if (rdb_get_len(cur, &n) != 0)
+        return NULL;
+    if (n > RDB_MAX_STRING_LEN)
+    {
+        cur->err = "string too long";
+        return NULL;
+    }
+    *len = (size_t)n;
+    return (const char *)rdb_get_bytes(cur, n);
+}
+
+/**
+ * @brief (Internal) Steps over a value of 'type' without decoding it.
+ * @return 0 on success, -1 with cur->err set.
+ */
+static inline int _rdb_skip_value(rdb_cursor_t *cur, unsigned char type)
+{
+    size_t len;
+    uint64_t n;
+    switch (type)
+    {
+    case RDB_TYPE_STRING:
+    case RDB_TYPE_LIST_LISTPACK:
+    case RDB_TYPE_ZSET_LISTPACK:
+        return rdb_get_string(cur, &len) ? 0 : -1;
+    case RDB_TYPE_LIST_QUICKLIST:
+        if (rdb_get_len(cur, &n) != 0)
+            return -1;
+        for (uint64_t i = 0; i < n; i++)
+        {
+            if (rdb_get_string(cur, &len) == NULL)
+                return -1;
+        }
+        return 0;
+    case RDB_TYPE_ZSET:
+        if (rdb_get_len(cur, &n) != 0)
+            return -1;
+        for (uint64_t i = 0; i < n; i++)
+        {
+            if (rdb_get_string(cur, &len) == NULL || rdb_get_bytes(cur, sizeof(double)) == NULL)
+                return -1;
+        }
+        return 0;
+    default:
+        cur->err = "unknown value type";
+        return -1;
+    }
+}
+
+/**
+ * @brief (Internal) Copies out a listpack string as a value. A sorted
+ * set's listpack must hold (member, 8-byte score) pairs.
+ * @return The listpack, or NULL on error.
+ */
+static inline unsigned char *_rdb_get_listpack(rdb_cursor_t *cur, int zset)
+{
+    size_t len;
+    unsigned char *s = (unsigned char *)rdb_get_string(cur, &len);
+    if (s == NULL)
+        return NULL;
+    if (!lp_validate(s, len) || (zset && lp_count(s) % 2 != 0))
+    {
+        cur->err = "corrupt listpack";
+        return NULL;
+    }
+    if (zset)
+    {
+        for (unsigned char *p = lp_first(s); p; p = lp_next(s, lp_next(s, p)))
+        {
+            size_t n;
+            lp_get(lp_next(s, p), &n);
+            if (n != sizeof(double))
+            {
+                cur->err = "corrupt listpack";
+                return NULL;
+            }
+        }
+    }
+    unsigned char *lp = lp_load(s, len);
+    if (lp == NULL)
+        cur->err = "out of memory";
+    return lp;
+}
+
+/**
+ * @brief (Internal) Decodes one value of 'type' and stores it under 'key'.
+ * Empty collections are dropped.
+ * @return The new entry, NULL if the value was dropped, or NULL with
+ * cur->err set on error.
+ */
+static inline db_entry *_rdb_load_value(rdb_cursor_t *cur, unsigned char type, redis_db_t *db, const resp_arg_t *key)
+{
+    void *value = NULL;
+    int vtype, encoding;
+
+    if (type == RDB_TYPE_STRING)
+    {
+        size_t len;
+        const char *s = rdb_get_string(cur, &len);
+        if (s == NULL)
+            return NULL;
+        db_entry *e = db_set_string(db, NULL, key, s, len);
+        if (e == NULL)
+            cur->err = "out of memory";
+        return e;
+    }
+    else if (type == RDB_TYPE_LIST_LISTPACK || type == RDB_TYPE_ZSET_LISTPACK)
+    {
+        unsigned char *lp = _rdb_get_listpack(cur, type == RDB_TYPE_ZSET_LISTPACK);
+        if (lp == NULL)
+            return NULL;
+        if (lp_count(lp) == 0)
+        {
+            lp_free(lp);
+            return NULL;
+        }
+        value = lp;
+        vtype = type == RDB_TYPE_LIST_LISTPACK ? VAL_TYPE_LIST : VAL_TYPE_ZSET;
+        encoding = VAL_ENC_LISTPACK;
+    }
+    else if (type == RDB_TYPE_LIST_QUICKLIST)
+    {
+        // Nodes come whole and in order: the list is built by appending them
+        uint64_t nodes;
+        if (rdb_get_len(cur, &nodes) != 0)
+            return NULL;
+        quicklist_t *ql = quicklist_create();
+        if (ql == NULL)
+        {
+            cur->err = "out of memory";
+            return NULL;
+        }
+        for (uint64_t i = 0; i < nodes; i++)
+        {
+            unsigned char *lp = _rdb_get_listpack(cur, 0);
+            if (lp == NULL || quicklist_append_listpack(ql, lp) != 0)
+            {
+                if (lp)
+                {
+                    lp_free(lp);
+                    cur->err = "out of memory";
+                }
+                quicklist_free(ql);
+                return NULL;
+            }
+        }
+        if (quicklist_count(ql) == 0)
+        {
+            quicklist_free(ql);
+            return NULL;
+        }
+        value = ql;
+        vtype = VAL_TYPE_LIST;
+        encoding = VAL_ENC_QUICKLIST;
+    }
+    else if (type == RDB_TYPE_ZSET)
+    {
+        // Elements come in score order: the tree is built bottom-up
+        uint64_t count;
+        if (rdb_get_len(cur, &count) != 0)
+            return NULL;
+        zset_builder_t b;
+        if (zset_builder_init(&b, (size_t)count) != 0)
+        {
+            cur->err = "out of memory";
+            return NULL;
+        }
+        for (uint64_t i = 0; i < count; i++)
+        {
+            size_t len;
+            double score;
+            const char *m = rdb_get_string(cur, &len);
+            const unsigned char *sp = m ? rdb_get_bytes(cur, sizeof(score)) : NULL;
+            if (sp == NULL)
+            {
+                zset_builder_discard(&b);
+                return NULL;
+            }
+            memcpy(&score, sp, sizeof(score));
+            int ret = score != score ? -2 : zset_builder_add(&b, score, m, len);
+            if (ret != 0)
+            {
+                cur->err = ret == -1 ? "out of memory" : "sorted set out of order";
+                zset_builder_discard(&b);
+                return NULL;
+            }
+        }
+        if (count == 0)
+        {
+            zset_builder_discard(&b);
+            return NULL;
+        }
+        value = zset_builder_finish(&b);
+        if (value == NULL)
+        {
+            cur->err = "out of memory";
+            return NULL;
+        }
+        vtype = VAL_TYPE_ZSET;
+        encoding = VAL_ENC_TREE;
+    }
+    else
+    {
+        cur->err = "unknown value type";
+        return NULL;
+    }
+
+    db_entry *e = db_add(db, key);
+    if (e == NULL)
+    {
+        db_entry tmp = {0};
+        tmp.value = value;
+        tmp.type = vtype;
+        tmp.encoding = encoding;
+        free_db_value(&tmp);
+        cur->err = "out of memory";
+        return NULL;
+    }
+    e->value = value;
+    e->type = vtype;
+    e->encoding = encoding;
+    return e;
+}
+
+/**
+ * @brief (Internal) Loads one shard's records into its keyspace. Runs on
+ * a loader thread of its own (or the main thread for shard 0), so each
+ * keyspace and slab pool still has a single writer.
+ */
+static inline void *_rdb_load_job(void *arg)
+{
+    rdb_load_job_t *job = (rdb_load_job_t *)arg;
+    redis_db_t *db = &job->shard->db;
+    update_cached_time();
+    slab_use(&db->mem);
+
+    // Sized from the index: no rehash and no heap growth while filling
+    dict_reserve(&db->entries, job->n);
+    if (heap_reserve(db->expiry_heap, job->expires) != 0)
+        job->err = "out of memory";
+
+    for (size_t i = 0; i < job->n && job->err == NULL; i++)
+    {
+        rdb_cursor_t cur = {job->records[i], job->end, NULL};
+        long long expiry = -1;
+        unsigned char type;
+        uint64_t v;
+        size_t key_len;
+        rdb_get_u8(&cur, &type);
+        if (type == RDB_OP_EXPIRE_MS)
+        {
+            rdb_get_u64(&cur, &v);
+            expiry = (long long)v;
+            rdb_get_u8(&cur, &type);
+        }
+        // The index pass already checked the framing up to the value
+        const char *k = rdb_get_string(&cur, &key_len);
+        resp_arg_t key = {(char *)k, key_len};
+
+        db_entry *old = db_find(db, &key);
+        if (old)
+            db_delete(db, old); // Duplicate key: the last one wins
+        db_entry *e = _rdb_load_value(&cur, type, db, &key);
+        if (cur.err)
+        {
+            job->err = cur.err;
+            break;
+        }
+        if (e && expiry != -1)
+        {
+            if (expiry <= job->now_ms)
+            {
+                db_delete(db, e);
+                e = NULL;
+            }
+            else if (db_set_expiry(db, e, expiry) != 0)
+            {
+                job->err = "out of memory";
+                break;
+            }
+        }
+        if (e)
+            job->loaded++;
+    }
+    slab_use(NULL);
+    return NULL;
+}
+
+static inline int _rdb_job_push(rdb_load_job_t *job, const unsigned char *record)
+{
+    if (job->n == job->cap)
+    {
+        size_t cap = job->cap ? job->cap * 2 : 1024;
+        const unsigned char **records = (const unsigned char **)realloc(job->records, cap * sizeof(*records));
+        if (records == NULL)
+            return -1;
+        job->records = records;
+        job->cap = cap;
+    }
+    job->records[job->n++] = record;
+    return 0;
+}
+
+/**
+ * @brief (Internal) The index pass: checks the framing of every record
+ * and files it under the shard that owns its key, counting keys and TTLs
+ * per shard so the keyspaces can be sized before a single insert.
+ * @return 0 on success, -1 with cur->err set.
+ */
+static inline int _rdb_index(rdb_cursor_t *cur, rdb_load_job_t *jobs, int nshards)
+{
+    while (cur->p < cur->end)
+    {
+        const unsigned char *record = cur->p;
+        unsigned char op;
+        uint64_t v, expires;
+        rdb_get_u8(cur, &op);
+        if (op == RDB_OP_RESIZE)
+        {
+            if (rdb_get_len(cur, &v) != 0 || rdb_get_len(cur, &expires) != 0)
+                return -1;
+            // A hint only: the index grows past it if need be. Every key
+            // takes a byte at least, which bounds a bogus count
+            if (v > (uint64_t)(cur->end - cur->p))
+                v = (uint64_t)(cur->end - cur->p);
+            size_t hint = (size_t)(v / (uint64_t)nshards) + 16;
+            for (int i = 0; i < nshards; i++)
+            {
+                if (jobs[i].cap >= hint)
+                    continue;
+                const unsigned char **records = (const unsigned char **)realloc(jobs[i].records, hint * sizeof(*records));
+                if (records)
+                {
+                    jobs[i].records = records;
+                    jobs[i].cap = hint;
+                }
+            }
+            continue;
+        }
+
+        int has_expiry = op == RDB_OP_EXPIRE_MS;
+        if (has_expiry && (rdb_get_u64(cur, &v) != 0 || rdb_get_u8(cur, &op) != 0))
+            return -1;
+        if (op > RDB_TYPE_ZSET_LISTPACK)
+        {
+            cur->err = "unknown value type";
+            return -1;
+        }
+        size_t key_len;
+        const char *k = rdb_get_string(cur, &key_len);
+        if (k == NULL || _rdb_skip_value(cur, op) != 0)
+            return -1;
+        resp_arg_t key = {(char *)k, key_len};
+        rdb_load_job_t *job = &jobs[shard_for_key(&key, nshards)];
+        if (_rdb_job_push(job, record) != 0)
+        {
+            cur->err = "out of memory";
+            return -1;
+        }
+        job->expires += has_expiry;
+    }
+    return 0;
+}
+
+/**
+ * @brief Loads the snapshot at 'path' into the shards before they start.
+ * The file is mmap()ed and its checksum verified first; an index pass
+ * then files every record under its shard, and one loader thread per
+ * shard decodes its records into its pre-sized keyspace. A missing file
+ * is an empty keyspace; keys whose TTL has passed are dropped.
+ * @return 0 on success, -1 on a corrupt or unreadable file (logged).
+ */
+static inline int rdb_load(const char *path, shard_t *shards, int nshards)
+{
+    rdb_crc_init();
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        if (errno == ENOENT)
+            return 0;
+        log_error("Can't open snapshot %s: %s", path, strerror(errno));
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        log_error("Can't stat snapshot %s: %s", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    size_t size = (size_t)st.st_size;
+    if (size < RDB_HEADER_SIZE + 1 + 8)
+    {
+        log_error("Can't load snapshot %s: not a snapshot file", path);
+        close(fd);
+        return -1;
+    }
+    const unsigned char *map = (const unsigned char *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        log_error("Can't map snapshot %s: %s", path, strerror(errno));
+        return -1;
+    }
+    madvise((void *)map, size, MADV_WILLNEED);
+
+    long long start_us = monotonic_us();
+    const char *err = NULL;
+    rdb_load_job_t *jobs = (rdb_load_job_t *)calloc((size_t)nshards, sizeof(rdb_load_job_t));
+    if (jobs == NULL)
+        err = "out of memory";
+    else if (memcmp(map, RDB_MAGIC, 5) != 0)
+        err = "not a snapshot file";
+    else if (memcmp(map + 5, RDB_VERSION, 4) != 0)
+        err = "unsupported version";
+    else if (map[size - 9] != RDB_OP_EOF || rdb_crc64(0, map, size - 8) != _rdb_get_u64(map + size - 8))
+        err = "checksum mismatch";
+
+    if (err == NULL)
+    {
+        rdb_cursor_t cur = {map + RDB_HEADER_SIZE, map + size - 9, NULL};
+        if (_rdb_index(&cur, jobs, nshards) != 0)
+            err = cur.err;
+    }
+
+    size_t loaded = 0;
+    int threads = 0;
+    if (err == NULL)
+    {
+        long long now = current_time_ms();
+        for (int i = 0; i < nshards; i++)
+        {
+            jobs[i].shard = &shards[i];
+            jobs[i].end = map + size - 9;
+            jobs[i].now_ms = now;
+        }
+        // Shard 0 loads here, meanwhile; a shard without a thread loads after it
+        for (int i = 1; i < nshards; i++)
+        {
+            if (jobs[i].n > 0 && pthread_create(&jobs[i].thread, NULL, _rdb_load_job, &jobs[i]) == 0)
+            {
+                jobs[i].threaded = 1;
+                threads++;
+            }
+        }
+        for (int i = 0; i < nshards; i++)
+        {
+            if (jobs[i].threaded)
+                pthread_join(jobs[i].thread, NULL);
+            else
+                _rdb_load_job(&jobs[i]);
+            if (err == NULL)
+                err = jobs[i].err;
+            loaded += jobs[i].loaded;
+        }
+    }
+
+    if (err == NULL)
+        log_info("DB loaded from %s: %zu keys in %.3f seconds (%d loader threads)", path, loaded,
+                 (double)(monotonic_us() - start_us) / 1e6, threads + 1);
+    else
+        log_error("Can't load snapshot %s: %s", path, err);
+
+    for (int i = 0; jobs && i < nshards; i++)
+        free(jobs[i].records);
+    free(jobs);
+    munmap((void *)map, size);
+    return err == NULL ? 0 : -1;
+}
+
+// --- Background Saves ---
+
+/**
+ * @return Write commands run so far over every shard; what --save points
+ * count against.
+ */
+static inline long long rdb_dirty(void)
+{
+    long long n = 0;
+    for (int i = 0; i < server.nshards; i++)
+        n += atomic_load_explicit(&server.shards[i].db.dirty, memory_order_relaxed);
+    return n;
+}
+
+/**
+ * @brief (Internal) Saves every shard synchronously. The caller makes
+ * sure no shard runs meanwhile.
+ */
+static inline int _rdb_save_all(void)
+{
+    redis_db_t *dbs[SHARDS_MAX];
+    for (int i = 0; i < server.nshards; i++)
+        dbs[i] = &server.shards[i].db;
+    long long dirty = rdb_dirty();
+    long long start_us = monotonic_us();
+    if (rdb_save(server.config.dbfilename, dbs, server.nshards, current_time_ms()) != 0)
+    {
+        log_error("Error saving DB to %s: %s", server.config.dbfilename, strerror(errno));
+        return -1;
+    }
+    log_info("DB saved on disk in %.3f seconds", (double)(monotonic_us() - start_us) / 1e6);
+    rdb_state.dirty_saved = dirty;
+    rdb_state.last_save_ms = current_time_ms();
+    return 0;
+}
+
+/**
+ * @brief SAVE: stops every shard for the whole write.
+ * @return 0 on success, -1 on failure (logged).
+ */
+static inline int rdb_save_sync(void)
+{
+    if (shard_pause_others(server.shards, server.nshards, &server.shutdown_asap) != 0)
+        return -1;
+    int ret = _rdb_save_all();
+    shard_resume_others(server.nshards);
+    return ret;
+}
+
+/**
+ * @brief Forks a child that writes the snapshot. The shards are parked
+ * only for the fork() itself; 'at_fork', if set, runs just before it.
+ * @return 0 if the child is running, -1 on failure (logged).
+ */
+static inline int rdb_bgsave(void (*at_fork)(void))
+{
+    if (server.child_type != CHILD_NONE)
+        return -1;
+    if (shard_pause_others(server.shards, server.nshards, &server.shutdown_asap) != 0)
+        return -1;
+
+    if (at_fork)
+        at_fork();
+    long long now = current_time_ms();
+    long long dirty = rdb_dirty();
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        // Only this thread exists here, and every keyspace it sees was at
+        // rest when it was copied. No logging: another thread may have
+        // held the logger's lock at the fork.
+        redis_db_t *dbs[SHARDS_MAX];
+        for (int i = 0; i < server.nshards; i++)
+            dbs[i] = &server.shards[i].db;
+        _exit(rdb_save(server.config.dbfilename, dbs, server.nshards, now) == 0 ? 0 : 1);
+    }
+    shard_resume_others(server.nshards);
+
+    rdb_state.last_try_ms = now;
+    if (pid < 0)
+    {
+        log_error("Can't fork for BGSAVE: %s", strerror(errno));
+        rdb_state.last_bgsave_ok = 0;
+        return -1;
+    }
+    log_info("Background saving started by pid %d", (int)pid);
+    server.child_type = CHILD_RDB;
+    server.child_pid = pid;
+    rdb_state.child_start_ms = now;
+    rdb_state.dirty_at_fork = dirty;
+    return 0;
+}
+
+/**
+ * @brief Runs on shard 0 every loop iteration: reaps a finished BGSAVE
+ * child and starts a new one when a --save point is reached (and no
+ * other child is running).
+ */
+static inline void rdb_cron(void)
+{
+    long long now = cached_time_ms();
+    if (server.child_type == CHILD_RDB)
+    {
+        int status;
+        pid_t pid = waitpid(server.child_pid, &status, WNOHANG);
+        if (pid == 0 || (pid < 0 && errno == EINTR))
+            return;
+        int ok = pid > 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+        rdb_state.last_bgsave_ok = ok;
+        rdb_state.last_bgsave_ms = now - rdb_state.child_start_ms;
+        if (ok)
+        {
+            rdb_state.dirty_saved = rdb_state.dirty_at_fork;
+            rdb_state.last_save_ms = rdb_state.child_start_ms;
+            log_info("Background saving terminated with success");
+        }
+        else
+        {
+            char tmp[4096];
+            _rdb_temp_path(tmp, sizeof(tmp), server.config.dbfilename, server.child_pid);
+            unlink(tmp);
+            log_error("Background saving error");
+        }
+        server.child_type = CHILD_NONE;
+        return;
+    }
+    if (server.child_type != CHILD_NONE)
+        return;
+
+    long long changes = rdb_dirty() - rdb_state.dirty_saved;
+    for (int i = 0; i < server.config.nsave_points; i++)
+    {
+        const save_point_t *sp = &server.config.save_points[i];
+        if (changes >= sp->changes && now - rdb_state.last_save_ms >= sp->seconds * 1000 &&
+            (rdb_state.last_bgsave_ok || now - rdb_state.last_try_ms >= RDB_RETRY_DELAY_MS))
+        {
+            log_info("%lld changes in %lld seconds. Saving...", sp->changes, sp->seconds);
+            rdb_bgsave(NULL);
+            break;
+        }
+    }
+}
+
+/**
+ * @brief At shutdown, once every shard has stopped: abandons a running
+ * BGSAVE and, if --save points are set, saves synchronously.
+ */
+static inline void rdb_shutdown(void)
+{
+    if (server.child_type == CHILD_RDB)
+    {
+        kill(server.child_pid, SIGKILL);
+        waitpid(server.child_pid, NULL, 0);
+        char tmp[4096];
+        _rdb_temp_path(tmp, sizeof(tmp), server.config.dbfilename, server.child_pid);
+        unlink(tmp);
+        server.child_type = CHILD_NONE;
+    }
+    if (server.config.nsave_points > 0)
+        _rdb_save_all();
+}
+
+/**
+ * @brief Appends the persistence section of INFO.
+ * @return Bytes written.
+ */
+static inline size_t rdb_info(char *buf, size_t cap)
+{
+    long long now = current_time_ms();
+    int bgsave = server.child_type == CHILD_RDB;
+    int n = snprintf(buf, cap,
+                     "# Persistence\r\n"
+                     "rdb_changes_since_last_save:%lld\r\n"
+                     "rdb_bgsave_in_progress:%d\r\n"
+                     "rdb_last_save_time:%lld\r\n"
+                     "rdb_last_bgsave_status:%s\r\n"
+                     "rdb_last_bgsave_time_sec:%lld\r\n"
+                     "rdb_current_bgsave_time_sec:%lld\r\n",
+                     rdb_dirty() - rdb_state.dirty_saved, bgsave,
+                     rdb_state.last_save_ms / 1000, rdb_state.last_bgsave_ok ? "ok" : "err",
+                     rdb_state.last_bgsave_ms < 0 ? -1 : rdb_state.last_bgsave_ms / 1000,
+                     bgsave ? (now - rdb_state.child_start_ms) / 1000 : -1);
+    return n < 0 ? 0 : ((size_t)n < cap ? (size_t)n : cap - 1);
+}
+
+// --- DUMP Payloads ---
+// One value on its own, as DUMP returns it and RESTORE (and so MIGRATE)
+// takes it: <type> <value> <version: 4 digits> <u64 CRC-64 of the rest>.
+// The key and its TTL travel as separate arguments.
+
+#define RDB_DUMP_TRAILER_SIZE 12
+
+/**
+ * @brief Serializes the value of 'e'.
+ * @return A malloc()ed payload of '*len' bytes, or NULL if out of memory.
+ */
+static inline unsigned char *rdb_dump_value(db_entry *e, size_t *len)
+{
+    rdb_writer_t *w = (rdb_writer_t *)malloc(sizeof(rdb_writer_t));
+    if (w == NULL)
+        return NULL;
+    rdb_writer_init(w, -1);
+    rdb_write_u8(w, _rdb_value_type(e));
+    _rdb_save_value(w, e);
+    rdb_write(w, RDB_VERSION, 4);
+    _rdb_flush(w);
+    _rdb_put_u64(w->buf, w->crc);
+    w->len = 8;
+    _rdb_flush(w);
+
+    unsigned char *payload = w->mem;
+    *len = w->mem_len;
+    if (w->error)
+    {
+        free(payload);
+        payload = NULL;
+    }
+    free(w);
+    return payload;
+}
+
+/**
+ * @return 0 if the payload's version is ours and its checksum matches.
+ */
+static inline int rdb_dump_verify(const unsigned char *p, size_t len)
+{
+    if (len < 1 + RDB_DUMP_TRAILER_SIZE)
+        return -1;
+    const unsigned char *trailer = p + len - RDB_DUMP_TRAILER_SIZE;
+    if (memcmp(trailer, RDB_VERSION, 4) != 0)
+        return -1;
+    return rdb_crc64(0, p, len - 8) == _rdb_get_u64(trailer + 4) ? 0 : -1;
+}
+
+/**
+ * @brief Stores the value of a verified payload under 'key', which must
+ * not exist.
+ * @return The new entry, or NULL with '*err' set.
+ */
+static inline db_entry *rdb_restore_value(redis_db_t *db, const resp_arg_t *key, const unsigned char *p, size_t len,
+                                          const char **err)
+{
+    rdb_cursor_t cur = {p + 1, p + len - RDB_DUMP_TRAILER_SIZE, NULL};
+    db_entry *e = _rdb_load_value(&cur, p[0], db, key);
+    if (e != NULL && cur.p != cur.end)
+    {
+        db_delete(db, e);
+        e = NULL;
+        cur.err = "trailing bytes";
+    }
+    *err = e ? NULL : cur.err ? cur.err : "empty value";
+    return e;
+}
+
+// --- Handlers ---
+
+static inline void handle_save(redis_db_t *db, client_t *c, const resp_arg_t *argv, int argc)
+{
+    (void)db; (void)argv; (void)argc;
+    if (server.child_type == CHILD_RDB)
+        client_add_reply_str(c, "-ERR Background save already in progress\r\n");
+    else if (rdb_save_sync() == 0)
+        client_add_reply_str(c, REDIS_OK);
+    else
+        client_add_reply_str(c, "-ERR Error saving DB, check the server log\r\n");
+}
+
+static inline void handle_bgsave(redis_db_t *db, client_t *c, const resp_arg_t *argv, int argc)
+{
+    (void)db; (void)argv; (void)argc;
+    if (server.child_type == CHILD_RDB)
+        client_add_reply_str(c, "-ERR Background save already in progress\r\n");
+    else if (server.child_type != CHILD_NONE)
+        client_add_reply_str(c, "-ERR An AOF rewrite is in progress: can't BGSAVE right now\r\n");
+    else if (rdb_bgsave(NULL) == 0)
+        client_add_reply_str(c, "+Background saving started\r\n");
+    else
+        client_add_reply_str(c, "-ERR Can't start a background save, check the server log\r\n");
+}
+
+static inline void handle_lastsave(redis_db_t *db, client_t *c, const resp_arg_t *argv, int argc)
+{
+    (void)db; (void)argv; (void)argc;
+    client_add_reply_integer(c, rdb_state.last_save_ms / 1000);
+}
+
+/**
+ * DUMP key
+ * The value serialized for RESTORE, or nil if there is no such key.
+ */
+static inline void handle_dump(redis_db_t *db, client_t *c, const resp_arg_t *argv, int argc)
+{
+    (void)argc;
+    db_entry *e = db_find(db, &argv[1]);
+    if (e != NULL && db_key_expired(e))
+    {
+        db_delete_propagate(db, e);
+        e = NULL;
+    }
+    if (e == NULL)
+    {
+        client_add_reply_str(c, NULL_BULK_STRING);
+        return;
+    }
+    size_t len;
+    unsigned char *payload = rdb_dump_value(e, &len);
+    if (payload == NULL)
+    {
+        client_add_reply_str(c, "-ERR out of memory\r\n");
+        return;
+    }
+    client_add_reply_bulk(c, (const char *)payload, len);
+    free(payload);
+}
+
+/**
+ * RESTORE key ttl serialized-value [REPLACE] [ABSTTL]
+ * Creates 'key' from a DUMP payload. 'ttl' is in milliseconds (0 = none),
+ * or a unix time in milliseconds with ABSTTL. Logged with ABSTTL and
+ * REPLACE, so a replay restores the same deadline over whatever is there.
+ */
+static inline void handle_restore(redis_db_t *db, client_t *c, const resp_arg_t *argv, int argc)
+{
+    const resp_arg_t *key = &argv[1];
+    int replace = 0, absttl = 0;
+    for (int i = 4; i < argc; i++)
+    {
+        if (resp_arg_eq_nocase(&argv[i], "replace"))
+            replace = 1;
+        else if (resp_arg_eq_nocase(&argv[i], "absttl"))
+            absttl = 1;
+        else
+        {
+            client_add_reply_str(c, REDIS_SYNTAX_ERR);
+            return;
+        }
+    }
+    long long ttl;
+    if (string_to_ll(argv[2].ptr, argv[2].len, &ttl) != 0 || ttl < 0)
+    {
+        client_add_reply_str(c, "-ERR Invalid TTL value, must be >= 0\r\n");
+        return;
+    }
+    const unsigned char *payload = (const unsigned char *)argv[3].ptr;
+    if (rdb_dump_verify(payload, argv[3].len) != 0)
+    {
+        client_add_reply_str(c, "-ERR DUMP payload version or checksum are wrong\r\n");
+        return;
+    }
+
+    db_entry *old = db_find(db, key);
+    if (old != NULL && db_key_expired(old))
+    {
+        db_delete_propagate(db, old);
+        old = NULL;
+    }
+    if (old != NULL && !replace)
+    {
+        client_add_reply_str(c, "-BUSYKEY Target key name already exists.\r\n");
+        return;
+    }
+    long long expiry = ttl == 0 ? -1 : absttl ? ttl : cached_time_ms() + ttl;
+    if (expiry != -1 && expiry <= cached_time_ms())
+    {
+        // Restored and expired at once
+        if (old != NULL)
+            db_delete_propagate(db, old);
+        client_add_reply_str(c, REDIS_OK);
+        return;
+    }
+
+    if (old != NULL)
+        db_delete(db, old);
+    const char *err;
+    db_entry *e = rdb_restore_value(db, key, payload, argv[3].len, &err);
+    if (e != NULL && expiry != -1 && db_set_expiry(db, e, expiry) != 0)
+    {
+        db_delete(db, e);
+        e = NULL;
+        err = "out of memory";
+    }
+    if (e == NULL)
+    {
+        if (old != NULL)
+        {
+            resp_arg_t del[2] = {{(char *)"DEL", 3}, *key};
+            aof_feed(db, del, 2); // The key is gone all the same
+        }
+        char msg[96];
+        int n = snprintf(msg, sizeof(msg), "-ERR Bad data format: %s\r\n", err);
+        client_add_reply(c, msg, (size_t)n);
+        return;
+    }
+
+    char at[LL_STR_SIZE];
+    resp_arg_t logged[6] = {argv[0], *key, {at, ll_to_str(at, expiry == -1 ? 0 : expiry)}, argv[3],
+                            {(char *)"REPLACE", 7}, {(char *)"ABSTTL", 6}};
+    aof_feed(db, logged, 6);
+    if (e->type == VAL_TYPE_LIST)
+        db_signal_ready(db, key);
+    client_add_reply_str(c, REDIS_OK);
+}
+
+#endif // RDB_H
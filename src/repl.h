@@ -0,0 +1,1310 @@
+#ifndef REPL_H
+#define REPL_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/random.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "utils.h"
+#include "parser.h"
+#include "client.h"
+#include "handler.h"
+#include "server.h"
+#include "shard.h"
+#include "rdb.h"
+#include "aof.h"
+#include "log.h"
+#include "time_utils.h"
+
+/**
+ * Primary-replica replication (REPLICAOF, PSYNC, --replicaof).
+ *
+ * A primary streams its writes to its replicas in the form it logs them to
+ * the AOF (aof.h): each shard's flushed buffer is appended to one circular
+ * backlog, and master_repl_offset counts every byte ever appended. Shard 0
+ * owns the replica connections; a PSYNC or REPLCONF arriving on another
+ * shard moves its connection there first. Each iteration shard 0 copies
+ * to every replica the part of the backlog it has not been sent yet.
+ *
+ * PSYNC <replid> <offset> resumes a replica where it stopped (+CONTINUE)
+ * if 'replid' names our history and the bytes after 'offset' are still in
+ * the backlog. Otherwise it gets a full resync: BGSAVE, with every shard's
+ * buffer flushed into the backlog while they are parked for the fork, so
+ * the snapshot holds exactly the stream up to the offset it is sent with.
+ * What streams meanwhile is held until the snapshot has gone out.
+ *
+ * A replica connects from shard 0, receives the snapshot into a temporary
+ * file, loads it over an emptied keyspace and then applies the stream
+ * like a log being replayed: expiry and eviction are left to the primary,
+ * whose DELs arrive in the stream, and clients may not write. Commands
+ * are run on the shard owning their keys without waiting for them to
+ * complete. If the link drops, the replica reconnects and asks to resume
+ * from its applied offset.
+ */
+
+#define REPL_ID_LEN 40
+#define REPL_RETRY_MS 1000        // Between attempts to reach the primary
+#define REPL_ACK_MS 1000          // Between a replica's REPLCONF ACKs
+#define REPL_TIMEOUT_MS 60000     // Longest silence of a primary until it is connected
+#define REPL_LINE_MAX 256         // Longest reply line of the handshake
+#define REPL_TRANSFER_CHUNK (64 * 1024)
+
+// --- Data Structures ---
+
+typedef enum
+{
+    REPLICA_HANDSHAKE,         // REPLCONF seen, no PSYNC yet
+    REPLICA_WAIT_BGSAVE_START, // Full resync: waiting for the background child slot
+    REPLICA_WAIT_BGSAVE_END,   // Full resync: its snapshot is being written
+    REPLICA_SEND_BULK,         // Full resync: the snapshot is being sent
+    REPLICA_ONLINE             // Streaming
+} replica_state;
+
+/**
+ * @brief Primary side: a connection that sent PSYNC (or REPLCONF).
+ * Owned by shard 0, like the connection.
+ */
+typedef struct repl_replica
+{
+    client_t *c;
+    replica_state state;
+    long long offset;      // Stream queued for it so far, from WAIT_BGSAVE_END on
+    long long ack_offset;  // Last REPLCONF ACK
+    long long ack_ms;
+    char ip[INET6_ADDRSTRLEN];
+    int port;              // REPLCONF listening-port, else its own port
+    int rdb_fd;            // SEND_BULK: the snapshot...
+    off_t rdb_off;         // ...how much of it is sent...
+    off_t rdb_size;        // ...and its size
+    aof_buf_t held;        // Stream fed before the snapshot is sent
+} repl_replica_t;
+
+typedef enum
+{
+    REPL_LINK_NONE,       // We are a primary
+    REPL_LINK_CONNECT,    // Must connect (again) to the primary
+    REPL_LINK_CONNECTING, // Non-blocking connect() in progress
+    REPL_LINK_HANDSHAKE,  // Waiting for the REPLCONF and PSYNC replies
+    REPL_LINK_TRANSFER,   // Receiving the snapshot
+    REPL_LINK_CONNECTED   // Applying the stream through the master client
+} repl_link_state;
+
+/**
+ * @brief Replication bookkeeping. Everything but the backlog is shard 0's.
+ */
+typedef struct
+{
+    // Our history: on a replica, the primary's as far as it was applied
+    char replid[REPL_ID_LEN + 1];
+    pthread_mutex_t lock;           // Guards the backlog and master_repl_offset
+    long long master_repl_offset;   // Stream bytes ever produced (or applied)
+    char *backlog;                  // Circular; NULL until the first PSYNC
+    size_t backlog_size;
+    size_t backlog_idx;             // Where the next byte goes
+    size_t backlog_histlen;         // Valid bytes, ending at backlog_idx
+
+    // Primary side
+    repl_replica_t **replicas;
+    size_t nreplicas;
+    size_t replicas_cap;
+    pid_t sync_child;               // BGSAVE serving full resyncs, 0 if none
+    long long sync_offset;          // Stream its snapshot stops at, -1 if unknown
+    long long stat_sync_full;
+    long long stat_sync_partial_ok;
+    long long stat_sync_partial_err;
+
+    // Replica side
+    char master_host[REPL_HOST_MAX];
+    int master_port;                // 0 while we are a primary
+    repl_link_state link;
+    int link_fd;                    // Until the link is CONNECTED
+    long long link_retry_ms;        // When to connect again
+    long long link_io_ms;           // Last sign of life during the handshake
+    long long link_down_ms;         // Since when the link is not CONNECTED
+    char line[REPL_LINE_MAX];       // Handshake reply being read
+    size_t line_len;
+    int replies_due;                // Handshake replies still to read
+    char transfer_replid[REPL_ID_LEN + 1]; // From +FULLRESYNC...
+    long long transfer_offset;      // ...applied once the snapshot is loaded
+    long long transfer_size;        // -1 until the $<size> line
+    long long transfer_read;
+    int transfer_fd;
+    char transfer_tmp[4096];
+    int master_fd;                  // The master client, once CONNECTED
+    unsigned long long master_client_id;
+    long long last_ack_ms;
+    unsigned long long apply_epoch; // Bumped by every load; stale APPLY messages are dropped
+} repl_state_t;
+
+static repl_state_t repl_state = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .sync_offset = -1,
+    .link_fd = -1,
+    .transfer_fd = -1,
+    .master_fd = -1,
+};
+
+// --- Backlog ---
+
+/**
+ * @brief Fills 'id' with REPL_ID_LEN random hex digits and a NUL. Cluster
+ * node ids are made the same way (cluster.h).
+ */
+static inline void repl_random_id(char *id)
+{
+    static const char hex[] = "0123456789abcdef";
+    unsigned char rnd[REPL_ID_LEN / 2];
+    if (getrandom(rnd, sizeof(rnd), 0) != (ssize_t)sizeof(rnd))
+    {
+        uint64_t x = (uint64_t)monotonic_us() ^ ((uint64_t)getpid() << 32);
+        for (size_t i = 0; i < sizeof(rnd); i++)
+        {
+            x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+            rnd[i] = (unsigned char)(x >> 56);
+        }
+    }
+    for (size_t i = 0; i < sizeof(rnd); i++)
+    {
+        id[2 * i] = hex[rnd[i] >> 4];
+        id[2 * i + 1] = hex[rnd[i] & 15];
+    }
+    id[REPL_ID_LEN] = '\0';
+}
+
+static inline void _repl_new_id(void)
+{
+    repl_random_id(repl_state.replid);
+}
+
+/**
+ * @brief Appends flushed stream bytes to the backlog. Called by every
+ * shard from aof_flush() while replicas are attached.
+ */
+static inline void repl_backlog_feed(int shard_id, const char *buf, size_t len)
+{
+    pthread_mutex_lock(&repl_state.lock);
+    if (repl_state.backlog)
+    {
+        size_t size = repl_state.backlog_size;
+        repl_state.master_repl_offset += (long long)len;
+        if (len > size)
+        {
+            buf += len - size; // Only the tail fits
+            len = size;
+        }
+        while (len > 0)
+        {
+            size_t n = size - repl_state.backlog_idx;
+            if (n > len)
+                n = len;
+            memcpy(repl_state.backlog + repl_state.backlog_idx, buf, n);
+            repl_state.backlog_idx = (repl_state.backlog_idx + n) % size;
+            repl_state.backlog_histlen += n;
+            buf += n;
+            len -= n;
+        }
+        if (repl_state.backlog_histlen > size)
+            repl_state.backlog_histlen = size;
+    }
+    pthread_mutex_unlock(&repl_state.lock);
+    if (shard_id != 0)
+        shard_wake(&server.shards[0]); // It sends the new bytes on
+}
+
+/**
+ * @brief (Internal) Creates the backlog at the first PSYNC and starts
+ * feeding it.
+ * @return 0 on success, -1 on allocation failure.
+ */
+static inline int _repl_backlog_create(void)
+{
+    if (repl_state.backlog)
+        return 0;
+    char *b = (char *)malloc(server.config.repl_backlog_size);
+    if (b == NULL)
+        return -1;
+    pthread_mutex_lock(&repl_state.lock);
+    repl_state.backlog = b;
+    repl_state.backlog_size = server.config.repl_backlog_size;
+    repl_state.backlog_idx = 0;
+    repl_state.backlog_histlen = 0;
+    pthread_mutex_unlock(&repl_state.lock);
+    atomic_store_explicit(&aof_state.feed_backlog, 1, memory_order_release);
+    log_info("Replication backlog created, %zu bytes", server.config.repl_backlog_size);
+    return 0;
+}
+
+static inline void _repl_backlog_free(void)
+{
+    pthread_mutex_lock(&repl_state.lock);
+    free(repl_state.backlog);
+    repl_state.backlog = NULL;
+    repl_state.backlog_histlen = 0;
+    pthread_mutex_unlock(&repl_state.lock);
+}
+
+// --- Primary Side ---
+
+static inline const char *_repl_replica_state_name(replica_state s)
+{
+    switch (s)
+    {
+    case REPLICA_WAIT_BGSAVE_START:
+    case REPLICA_WAIT_BGSAVE_END:
+        return "wait_bgsave";
+    case REPLICA_SEND_BULK:
+        return "send_bulk";
+    case REPLICA_ONLINE:
+        return "online";
+    default:
+        return "handshake";
+    }
+}
+
+/**
+ * @return The replica record of 'c', created on first use; NULL on
+ * allocation failure.
+ */
+static inline repl_replica_t *_repl_replica_get(client_t *c)
+{
+    if (c->replica)
+        return c->replica;
+    if (repl_state.nreplicas == repl_state.replicas_cap)
+    {
+        size_t cap = repl_state.replicas_cap ? repl_state.replicas_cap * 2 : 4;
+        repl_replica_t **list = (repl_replica_t **)realloc(repl_state.replicas, cap * sizeof(repl_replica_t *));
+        if (list == NULL)
+            return NULL;
+        repl_state.replicas = list;
+        repl_state.replicas_cap = cap;
+    }
+    repl_replica_t *r = (repl_replica_t *)calloc(1, sizeof(repl_replica_t));
+    if (r == NULL)
+        return NULL;
+    r->c = c;
+    r->state = REPLICA_HANDSHAKE;
+    r->rdb_fd = -1;
+    r->ack_ms = cached_time_ms();
+    strcpy(r->ip, "?");
+
+    struct sockaddr_storage sa;
+    socklen_t salen = sizeof(sa);
+    if (getpeername(c->fd, (struct sockaddr *)&sa, &salen) == 0)
+    {
+        if (sa.ss_family == AF_INET)
+        {
+            struct sockaddr_in *in = (struct sockaddr_in *)&sa;
+            inet_ntop(AF_INET, &in->sin_addr, r->ip, sizeof(r->ip));
+            r->port = ntohs(in->sin_port);
+        }
+        else if (sa.ss_family == AF_INET6)
+        {
+            struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)&sa;
+            inet_ntop(AF_INET6, &in6->sin6_addr, r->ip, sizeof(r->ip));
+            r->port = ntohs(in6->sin6_port);
+        }
+    }
+    c->replica = r;
+    repl_state.replicas[repl_state.nreplicas++] = r;
+    return r;
+}
+
+/**
+ * @brief Forgets the replica record of a connection being closed.
+ */
+static inline void repl_replica_free(client_t *c)
+{
+    repl_replica_t *r = c->replica;
+    for (size_t i = 0; i < repl_state.nreplicas; i++)
+    {
+        if (repl_state.replicas[i] == r)
+        {
+            repl_state.replicas[i] = repl_state.replicas[--repl_state.nreplicas];
+            break;
+        }
+    }
+    if (r->state != REPLICA_HANDSHAKE)
+        log_info("Connection with replica %s:%d lost", r->ip, r->port);
+    if (r->rdb_fd >= 0)
+        close(r->rdb_fd);
+    _aof_buf_free(&r->held);
+    free(r);
+    c->replica = NULL;
+}
+
+/**
+ * @brief (Internal) Drops a replica: it is closed by the next flush.
+ */
+static inline void _repl_replica_drop(repl_replica_t *r, const char *why)
+{
+    log_warn("Dropping replica %s:%d: %s", r->ip, r->port, why);
+    _client_free_replies(r->c);
+    r->c->flags |= CLIENT_CLOSE_ASAP;
+}
+
+/**
+ * @brief (Internal) Queues the stream past r->offset for the replica: as
+ * output once it is online, else in its hold buffer. Under the lock.
+ * @return 0, or -1 if those bytes have left the backlog or the hold
+ * buffer outgrew the output buffer limit.
+ */
+static inline int _repl_replica_catch_up(repl_replica_t *r)
+{
+    long long end = repl_state.master_repl_offset;
+    if (r->offset == end)
+        return 0;
+    if (repl_state.backlog == NULL || r->offset < end - (long long)repl_state.backlog_histlen)
+        return -1;
+
+    size_t size = repl_state.backlog_size;
+    size_t len = (size_t)(end - r->offset);
+    size_t start = (repl_state.backlog_idx + size - len) % size;
+    while (len > 0)
+    {
+        size_t n = size - start;
+        if (n > len)
+            n = len;
+        if (r->state == REPLICA_ONLINE)
+        {
+            client_add_reply(r->c, repl_state.backlog + start, n);
+        }
+        else
+        {
+            if (_aof_buf_reserve(&r->held, n) != 0)
+                return -1;
+            memcpy(r->held.p + r->held.len, repl_state.backlog + start, n);
+            r->held.len += n;
+        }
+        start = (start + n) % size;
+        len -= n;
+    }
+    r->offset = end;
+    if (r->c->obuf_limit && r->held.len > r->c->obuf_limit)
+        return -1;
+    return 0;
+}
+
+/**
+ * @brief Shard 0, every iteration: hands the replica what was streamed
+ * since the last call. One that fell out of the backlog is dropped.
+ * @return 1 if its connection has something to write (or must close).
+ */
+static inline int repl_replica_feed(repl_replica_t *r)
+{
+    client_t *c = r->c;
+    if (r->state >= REPLICA_WAIT_BGSAVE_END && !(c->flags & CLIENT_CLOSE_ASAP))
+    {
+        pthread_mutex_lock(&repl_state.lock);
+        int rc = _repl_replica_catch_up(r);
+        pthread_mutex_unlock(&repl_state.lock);
+        if (rc != 0)
+            _repl_replica_drop(r, "it fell behind the replication backlog");
+    }
+    return client_has_pending_replies(c) || r->state == REPLICA_SEND_BULK || (c->flags & CLIENT_CLOSE_ASAP);
+}
+
+/**
+ * @brief Write half for a replica connection (possibly on an I/O thread):
+ * its output, then the snapshot, then what was held meanwhile.
+ * @return As client_flush().
+ */
+static inline int repl_replica_write(client_t *c)
+{
+    repl_replica_t *r = c->replica;
+    int rc = client_flush(c);
+    if (rc != 1 || r->state != REPLICA_SEND_BULK)
+        return rc;
+
+    while (r->rdb_off < r->rdb_size)
+    {
+        ssize_t n = sendfile(c->fd, r->rdb_fd, &r->rdb_off, (size_t)(r->rdb_size - r->rdb_off));
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            return -1;
+        }
+        if (n == 0)
+        {
+            errno = EIO; // The file shrank under us
+            return -1;
+        }
+    }
+    close(r->rdb_fd);
+    r->rdb_fd = -1;
+    r->state = REPLICA_ONLINE;
+    if (r->held.len)
+        client_add_reply(c, r->held.p, r->held.len);
+    _aof_buf_free(&r->held);
+    log_info("Synchronization with replica %s:%d succeeded", r->ip, r->port);
+    return client_flush(c);
+}
+
+/**
+ * @brief (Internal) Runs just before the full resync fork, with the other
+ * shards parked: everything they logged goes into the backlog first, so
+ * the snapshot holds exactly the stream up to sync_offset.
+ */
+static inline void _repl_at_fork(void)
+{
+    int complete = 1;
+    for (int i = 0; i < server.nshards; i++)
+    {
+        aof_flush(i);
+        if (aof_state.shards[i].pending.len)
+            complete = 0; // An AOF write failed: the offset would be wrong
+    }
+    pthread_mutex_lock(&repl_state.lock);
+    repl_state.sync_offset = complete ? repl_state.master_repl_offset : -1;
+    pthread_mutex_unlock(&repl_state.lock);
+}
+
+/**
+ * @brief (Internal) Starts the BGSAVE that serves every replica waiting
+ * for a full resync.
+ */
+static inline void _repl_sync_start(void)
+{
+    log_info("Starting BGSAVE for the full resynchronization of replicas");
+    int ok = rdb_bgsave(_repl_at_fork) == 0;
+    if (ok)
+        repl_state.sync_child = server.child_pid;
+    for (size_t i = 0; i < repl_state.nreplicas; i++)
+    {
+        repl_replica_t *r = repl_state.replicas[i];
+        if (r->state != REPLICA_WAIT_BGSAVE_START)
+            continue;
+        if (!ok || repl_state.sync_offset < 0)
+        {
+            _repl_replica_drop(r, "BGSAVE for replication failed");
+            continue;
+        }
+        r->state = REPLICA_WAIT_BGSAVE_END;
+        r->offset = repl_state.sync_offset;
+    }
+}
+
+/**
+ * @brief (Internal) The full resync BGSAVE ended: the replicas it served
+ * are sent the snapshot it wrote.
+ */
+static inline void _repl_sync_done(int ok)
+{
+    int fd = -1;
+    struct stat st;
+    if (ok)
+    {
+        fd = open(server.config.dbfilename, O_RDONLY | O_CLOEXEC);
+        if (fd < 0 || fstat(fd, &st) != 0)
+        {
+            log_error("Can't open %s for replication: %s", server.config.dbfilename, strerror(errno));
+            ok = 0;
+        }
+    }
+    for (size_t i = 0; i < repl_state.nreplicas; i++)
+    {
+        repl_replica_t *r = repl_state.replicas[i];
+        if (r->state != REPLICA_WAIT_BGSAVE_END)
+            continue;
+        r->rdb_fd = ok ? fcntl(fd, F_DUPFD_CLOEXEC, 0) : -1;
+        if (r->rdb_fd < 0)
+        {
+            _repl_replica_drop(r, "BGSAVE for replication failed");
+            continue;
+        }
+        r->rdb_off = 0;
+        r->rdb_size = st.st_size;
+        r->state = REPLICA_SEND_BULK;
+        char hdr[REPL_ID_LEN + 2 * LL_STR_SIZE + 32];
+        int n = snprintf(hdr, sizeof(hdr), "+FULLRESYNC %s %lld\r\n$%lld\r\n", repl_state.replid,
+                         repl_state.sync_offset, (long long)st.st_size);
+        client_add_reply(r->c, hdr, (size_t)n);
+    }
+    if (fd >= 0)
+        close(fd);
+}
+
+// --- Replica Side ---
+
+/**
+ * @return The master client on shard 0, or NULL while the link is not
+ * CONNECTED.
+ */
+static inline client_t *repl_master_client(shard_t *sh)
+{
+    client_t *c = client_table_get(&sh->clients, repl_state.master_fd);
+    return c && c->id == repl_state.master_client_id ? c : NULL;
+}
+
+static inline void _repl_transfer_abort(void)
+{
+    if (repl_state.transfer_fd < 0)
+        return;
+    close(repl_state.transfer_fd);
+    repl_state.transfer_fd = -1;
+    unlink(repl_state.transfer_tmp);
+}
+
+/**
+ * @brief (Internal) Tears down the link to the primary, whatever its
+ * state. The caller sets the next state. A master client is closed by
+ * the next flush.
+ */
+static inline void _repl_link_close(void)
+{
+    if (repl_state.link_fd >= 0)
+    {
+        event_del(&server.shards[0].el, repl_state.link_fd);
+        close(repl_state.link_fd);
+        repl_state.link_fd = -1;
+    }
+    _repl_transfer_abort();
+    client_t *m = repl_master_client(&server.shards[0]);
+    if (m)
+    {
+        _client_free_replies(m);
+        m->flags |= CLIENT_CLOSE_ASAP;
+    }
+    if (repl_state.link == REPL_LINK_CONNECTED)
+        repl_state.link_down_ms = cached_time_ms();
+}
+
+/**
+ * @brief (Internal) The link failed before it was established: retry
+ * after REPL_RETRY_MS. The reason was logged by the caller.
+ */
+static inline void _repl_link_retry(void)
+{
+    _repl_link_close();
+    repl_state.link = REPL_LINK_CONNECT;
+    repl_state.link_retry_ms = cached_time_ms() + REPL_RETRY_MS;
+}
+
+/**
+ * @brief A master client is being closed: reconnect, to resume where the
+ * stream stopped.
+ */
+static inline void repl_master_lost(client_t *c)
+{
+    if (c->fd != repl_state.master_fd || c->id != repl_state.master_client_id)
+        return;
+    repl_state.master_fd = -1;
+    repl_state.master_client_id = 0;
+    if (repl_state.link != REPL_LINK_CONNECTED)
+        return; // Replaced on purpose (REPLICAOF)
+    log_warn("Connection with the primary lost, reconnecting");
+    repl_state.link = REPL_LINK_CONNECT;
+    repl_state.link_retry_ms = cached_time_ms();
+    repl_state.link_down_ms = cached_time_ms();
+}
+
+static inline size_t _repl_encode(char *dst, const char *const *args, int n)
+{
+    size_t len = resp_encode_array_header(dst, n);
+    for (int i = 0; i < n; i++)
+        len += resp_encode_bulk(dst + len, args[i], strlen(args[i]));
+    return len;
+}
+
+/**
+ * @brief (Internal) Starts a non-blocking connect to the primary.
+ */
+static inline void _repl_connect(void)
+{
+    char port[8];
+    snprintf(port, sizeof(port), "%d", repl_state.master_port);
+    struct addrinfo hints = {0}, *res;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    int rc = getaddrinfo(repl_state.master_host, port, &hints, &res);
+    if (rc != 0)
+    {
+        log_warn("Can't resolve the primary %s: %s", repl_state.master_host, gai_strerror(rc));
+        _repl_link_retry();
+        return;
+    }
+    int fd = socket(res->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0 || (connect(fd, res->ai_addr, res->ai_addrlen) != 0 && errno != EINPROGRESS))
+    {
+        log_warn("Can't connect to the primary %s:%d: %s", repl_state.master_host, repl_state.master_port,
+                 strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        freeaddrinfo(res);
+        _repl_link_retry();
+        return;
+    }
+    freeaddrinfo(res);
+
+    // Writes that stay unacknowledged this long (our ACKs) mean the primary is gone
+    unsigned int user_timeout = REPL_TIMEOUT_MS;
+    setsockopt(fd, IPPROTO_TCP, TCP_USER_TIMEOUT, &user_timeout, sizeof(user_timeout));
+
+    if (event_add(&server.shards[0].el, fd, EVENT_WRITABLE) < 0)
+    {
+        log_error("event_add: replication link: %s", strerror(errno));
+        close(fd);
+        _repl_link_retry();
+        return;
+    }
+    repl_state.link_fd = fd;
+    repl_state.link = REPL_LINK_CONNECTING;
+    repl_state.link_io_ms = cached_time_ms();
+    log_info("Connecting to the primary %s:%d", repl_state.master_host, repl_state.master_port);
+}
+
+/**
+ * @brief (Internal) Sends REPLCONF listening-port and PSYNC in one go.
+ * @return 0 on success, -1 on failure (errno set).
+ */
+static inline int _repl_send_handshake(void)
+{
+    char port[LL_STR_SIZE], offset[LL_STR_SIZE];
+    port[ll_to_str(port, server.config.port)] = '\0';
+    offset[ll_to_str(offset, repl_state.master_repl_offset + 1)] = '\0';
+    const char *replconf[] = {"REPLCONF", "listening-port", port};
+    const char *psync[] = {"PSYNC", repl_state.replid, offset};
+
+    char buf[REPL_LINE_MAX * 2];
+    size_t len = _repl_encode(buf, replconf, 3);
+    len += _repl_encode(buf + len, psync, 3);
+    return _aof_write_all(repl_state.link_fd, buf, len) == len ? 0 : -1;
+}
+
+/**
+ * @brief (Internal) Reads the link byte by byte, so nothing past the line
+ * is consumed: the snapshot or the stream follows it.
+ * @return 1 with a line (without its CRLF) in repl_state.line, 0 if it has
+ * not fully arrived, -1 on EOF, error or an overlong line.
+ */
+static inline int _repl_read_line(void)
+{
+    for (;;)
+    {
+        char ch;
+        ssize_t n = recv(repl_state.link_fd, &ch, 1, 0);
+        if (n == 0)
+        {
+            errno = ECONNRESET;
+            return -1;
+        }
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        if (ch == '\n')
+        {
+            size_t len = repl_state.line_len;
+            if (len > 0 && repl_state.line[len - 1] == '\r')
+                len--;
+            repl_state.line[len] = '\0';
+            repl_state.line_len = 0;
+            return 1;
+        }
+        if (repl_state.line_len == REPL_LINE_MAX - 1)
+        {
+            errno = EPROTO;
+            return -1;
+        }
+        repl_state.line[repl_state.line_len++] = ch;
+    }
+}
+
+/**
+ * @brief (Internal) Turns the link into the master client that applies
+ * the stream. The fd stays registered with shard 0's event loop as it is.
+ */
+static inline void _repl_link_established(shard_t *sh)
+{
+    int fd = repl_state.link_fd;
+    client_t *c = client_create(fd, 0);
+    if (c == NULL || client_table_set(&sh->clients, fd, c) != 0)
+    {
+        client_free(c);
+        log_error("Can't create the master client: out of memory");
+        _repl_link_retry();
+        return;
+    }
+    c->id = ++sh->next_client_id;
+    c->shard = sh;
+    c->flags |= CLIENT_MASTER;
+    repl_state.master_fd = fd;
+    repl_state.master_client_id = c->id;
+    repl_state.link_fd = -1;
+    repl_state.link = REPL_LINK_CONNECTED;
+    repl_state.last_ack_ms = 0; // Acknowledge at once
+}
+
+/**
+ * @brief (Internal) Replaces every keyspace with the received snapshot,
+ * every other shard parked meanwhile.
+ * @return 0 on success, -1 on failure (logged).
+ */
+static inline int _repl_load_snapshot(const char *path)
+{
+    if (shard_pause_others(server.shards, server.nshards, &server.shutdown_asap) != 0)
+        return -1;
+    for (int i = 0; i < server.nshards; i++)
+    {
+        slab_use(&server.shards[i].db.mem);
+        db_empty(&server.shards[i].db);
+    }
+    int rc = rdb_load(path, server.shards, server.nshards);
+    slab_use(&server.shards[0].db.mem);
+    repl_state.apply_epoch++; // Commands still queued for the old dataset are void
+    shard_resume_others(server.nshards);
+    if (rc != 0)
+        return -1;
+    rdb_state.dirty_saved = rdb_dirty();
+    if (aof_state.fd >= 0)
+        aof_state.rewrite_scheduled = 1; // The log still describes the old dataset
+    return 0;
+}
+
+/**
+ * @brief (Internal) Receives the snapshot of a full resync, then loads it.
+ */
+static inline void _repl_read_transfer(shard_t *sh)
+{
+    if (repl_state.transfer_size < 0)
+    {
+        int rc = _repl_read_line();
+        if (rc == 0)
+            return;
+        long long size;
+        if (rc < 0 || repl_state.line[0] != '$' ||
+            string_to_ll(repl_state.line + 1, strlen(repl_state.line + 1), &size) != 0 || size < 0)
+        {
+            log_warn("Bad snapshot header from the primary: %s", rc < 0 ? strerror(errno) : repl_state.line);
+            _repl_link_retry();
+            return;
+        }
+        snprintf(repl_state.transfer_tmp, sizeof(repl_state.transfer_tmp), "%s.sync-%d", server.config.dbfilename,
+                 (int)getpid());
+        repl_state.transfer_fd = open(repl_state.transfer_tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (repl_state.transfer_fd < 0)
+        {
+            log_error("Can't create %s for the snapshot: %s", repl_state.transfer_tmp, strerror(errno));
+            _repl_link_retry();
+            return;
+        }
+        repl_state.transfer_size = size;
+        repl_state.transfer_read = 0;
+        log_info("Receiving %lld bytes of snapshot from the primary", size);
+    }
+
+    char buf[REPL_TRANSFER_CHUNK];
+    while (repl_state.transfer_read < repl_state.transfer_size)
+    {
+        long long left = repl_state.transfer_size - repl_state.transfer_read;
+        ssize_t n = recv(repl_state.link_fd, buf, left < (long long)sizeof(buf) ? (size_t)left : sizeof(buf), 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if (n <= 0)
+        {
+            log_warn("Lost the primary while receiving the snapshot: %s", n == 0 ? "EOF" : strerror(errno));
+            _repl_link_retry();
+            return;
+        }
+        if (_aof_write_all(repl_state.transfer_fd, buf, (size_t)n) != (size_t)n)
+        {
+            log_error("Can't write the snapshot to %s: %s", repl_state.transfer_tmp, strerror(errno));
+            _repl_link_retry();
+            return;
+        }
+        repl_state.transfer_read += n;
+    }
+
+    if (fsync(repl_state.transfer_fd) != 0 || rename(repl_state.transfer_tmp, server.config.dbfilename) != 0)
+    {
+        log_error("Can't install the snapshot as %s: %s", server.config.dbfilename, strerror(errno));
+        _repl_link_retry();
+        return;
+    }
+    close(repl_state.transfer_fd);
+    repl_state.transfer_fd = -1;
+
+    log_info("Loading the primary's snapshot");
+    if (_repl_load_snapshot(server.config.dbfilename) != 0)
+    {
+        _repl_new_id(); // What we hold matches no history now
+        repl_state.master_repl_offset = 0;
+        _repl_link_retry();
+        return;
+    }
+    memcpy(repl_state.replid, repl_state.transfer_replid, sizeof(repl_state.replid));
+    repl_state.master_repl_offset = repl_state.transfer_offset;
+    _repl_link_established(sh);
+    log_info("Synchronized with the primary, replication id %s offset %lld", repl_state.replid,
+             repl_state.master_repl_offset);
+}
+
+/**
+ * @brief (Internal) Reads the REPLCONF and PSYNC replies.
+ */
+static inline void _repl_read_handshake(shard_t *sh)
+{
+    while (repl_state.replies_due > 0)
+    {
+        int rc = _repl_read_line();
+        if (rc == 0)
+            return;
+        if (rc < 0)
+        {
+            log_warn("Lost the primary during the handshake: %s", strerror(errno));
+            _repl_link_retry();
+            return;
+        }
+        if (repl_state.line[0] == '\0')
+            continue;
+        if (--repl_state.replies_due > 0)
+            continue; // REPLCONF's: an error only means the option is unknown there
+
+        const char *line = repl_state.line;
+        if (strncmp(line, "+FULLRESYNC ", 12) == 0 && strlen(line) > 12 + REPL_ID_LEN &&
+            line[12 + REPL_ID_LEN] == ' ' &&
+            string_to_ll(line + 13 + REPL_ID_LEN, strlen(line + 13 + REPL_ID_LEN), &repl_state.transfer_offset) == 0)
+        {
+            memcpy(repl_state.transfer_replid, line + 12, REPL_ID_LEN);
+            repl_state.transfer_replid[REPL_ID_LEN] = '\0';
+            repl_state.transfer_size = -1;
+            repl_state.link = REPL_LINK_TRANSFER;
+            log_info("Full resynchronization from the primary, offset %lld", repl_state.transfer_offset);
+            _repl_read_transfer(sh);
+            return;
+        }
+        if (strncmp(line, "+CONTINUE", 9) == 0)
+        {
+            if (line[9] == ' ' && strlen(line + 10) == REPL_ID_LEN)
+                memcpy(repl_state.replid, line + 10, REPL_ID_LEN); // The primary's history was renamed
+            log_info("Partial resynchronization from the primary at offset %lld", repl_state.master_repl_offset);
+            _repl_link_established(sh);
+            return;
+        }
+        log_warn("Unexpected reply to PSYNC from the primary: %s", line);
+        _repl_link_retry();
+        return;
+    }
+}
+
+/**
+ * @brief Shard 0: the link to the primary is ready, before it becomes
+ * the master client.
+ */
+static inline void repl_link_event(shard_t *sh)
+{
+    repl_state.link_io_ms = cached_time_ms();
+    if (repl_state.link == REPL_LINK_CONNECTING)
+    {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (getsockopt(repl_state.link_fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+            err = errno;
+        if (err == 0 && _repl_send_handshake() != 0)
+            err = errno;
+        if (err == 0 && event_mod(&sh->el, repl_state.link_fd, EVENT_READABLE) < 0)
+            err = errno;
+        if (err != 0)
+        {
+            log_warn("Can't connect to the primary %s:%d: %s", repl_state.master_host, repl_state.master_port,
+                     strerror(err));
+            _repl_link_retry();
+            return;
+        }
+        repl_state.link = REPL_LINK_HANDSHAKE;
+        repl_state.replies_due = 2;
+        repl_state.line_len = 0;
+        return;
+    }
+    if (repl_state.link == REPL_LINK_HANDSHAKE)
+        _repl_read_handshake(sh);
+    else if (repl_state.link == REPL_LINK_TRANSFER)
+        _repl_read_transfer(sh);
+}
+
+/**
+ * @brief Replica side, shard 0: acknowledges the applied offset to the
+ * primary once every REPL_ACK_MS.
+ * @return 1 if an ACK was queued on 'm'.
+ */
+static inline int repl_send_ack(client_t *m)
+{
+    long long now = cached_time_ms();
+    if (now - repl_state.last_ack_ms < REPL_ACK_MS)
+        return 0;
+    repl_state.last_ack_ms = now;
+    char offset[LL_STR_SIZE];
+    offset[ll_to_str(offset, repl_state.master_repl_offset)] = '\0';
+    const char *ack[] = {"REPLCONF", "ACK", offset};
+    char buf[64];
+    client_add_reply(m, buf, _repl_encode(buf, ack, 3));
+    return 1;
+}
+
+// --- Roles ---
+
+/**
+ * @brief (Internal) Follows host:port from now on. The caller has parked
+ * the other shards, or they do not run yet.
+ */
+static inline void _repl_set_primary(const char *host, size_t host_len, int port)
+{
+    memcpy(repl_state.master_host, host, host_len);
+    repl_state.master_host[host_len] = '\0';
+    repl_state.master_port = port;
+    db_replaying = 1;
+    atomic_store_explicit(&aof_state.feed_backlog, 0, memory_order_relaxed);
+}
+
+/**
+ * @brief (Internal) REPLICAOF host port: our replicas and any former link
+ * go, the stream from the new primary is what counts now.
+ * @return 0 on success, -1 if the shards could not be parked.
+ */
+static inline int _repl_become_replica(const char *host, size_t host_len, int port)
+{
+    if (shard_pause_others(server.shards, server.nshards, &server.shutdown_asap) != 0)
+        return -1;
+    _repl_set_primary(host, host_len, port);
+    shard_resume_others(server.nshards);
+
+    for (size_t i = 0; i < repl_state.nreplicas; i++)
+    {
+        if (!(repl_state.replicas[i]->c->flags & CLIENT_CLOSE_ASAP))
+            _repl_replica_drop(repl_state.replicas[i], "this server now replicates another");
+    }
+    _repl_backlog_free();
+    if (repl_state.link == REPL_LINK_NONE)
+        repl_state.link_down_ms = cached_time_ms();
+    _repl_link_close();
+    repl_state.link = REPL_LINK_CONNECT;
+    repl_state.link_retry_ms = cached_time_ms();
+    log_info("Replicating %s:%d", repl_state.master_host, repl_state.master_port);
+    return 0;
+}
+
+/**
+ * @brief (Internal) REPLICAOF NO ONE: a new history starts here, at the
+ * current offset.
+ * @return 0 on success, -1 if the shards could not be parked.
+ */
+static inline int _repl_become_primary(void)
+{
+    if (shard_pause_others(server.shards, server.nshards, &server.shutdown_asap) != 0)
+        return -1;
+    repl_state.master_port = 0;
+    repl_state.master_host[0] = '\0';
+    db_replaying = 0;
+    shard_resume_others(server.nshards);
+
+    _repl_link_close();
+    repl_state.link = REPL_LINK_NONE;
+    _repl_new_id();
+    log_info("Now a primary, replication id %s offset %lld", repl_state.replid, repl_state.master_repl_offset);
+    return 0;
+}
+
+// --- Startup, Cron and Shutdown ---
+
+/**
+ * @brief Picks our replication id and, with --replicaof, starts following
+ * the primary. Runs once the dataset is loaded, before the shard threads.
+ */
+static inline void repl_init(void)
+{
+    _repl_new_id();
+    if (server.config.replicaof_port == 0)
+        return;
+    _repl_set_primary(server.config.replicaof_host, strlen(server.config.replicaof_host),
+                      server.config.replicaof_port);
+    repl_state.link = REPL_LINK_CONNECT;
+    repl_state.link_retry_ms = 0;
+    repl_state.link_down_ms = current_time_ms();
+}
+
+/**
+ * @brief Runs on shard 0 every loop iteration, after aof_cron(): serves
+ * full resyncs on a primary, (re)connects to the primary on a replica.
+ */
+static inline void repl_cron(void)
+{
+    long long now = cached_time_ms();
+
+    if (repl_state.sync_child && !(server.child_type == CHILD_RDB && server.child_pid == repl_state.sync_child))
+    {
+        repl_state.sync_child = 0;
+        _repl_sync_done(rdb_state.last_bgsave_ok);
+    }
+    if (server.child_type == CHILD_NONE)
+    {
+        for (size_t i = 0; i < repl_state.nreplicas; i++)
+        {
+            if (repl_state.replicas[i]->state == REPLICA_WAIT_BGSAVE_START)
+            {
+                _repl_sync_start();
+                break;
+            }
+        }
+    }
+
+    if (repl_state.link == REPL_LINK_CONNECT && now >= repl_state.link_retry_ms)
+    {
+        _repl_connect();
+    }
+    else if (repl_state.link >= REPL_LINK_CONNECTING && repl_state.link <= REPL_LINK_TRANSFER &&
+             now - repl_state.link_io_ms > REPL_TIMEOUT_MS)
+    {
+        log_warn("Timeout talking to the primary %s:%d", repl_state.master_host, repl_state.master_port);
+        _repl_link_retry();
+    }
+}
+
+/**
+ * @brief At shutdown, once every shard has stopped.
+ */
+static inline void repl_shutdown(void)
+{
+    if (repl_state.link_fd >= 0)
+        close(repl_state.link_fd);
+    _repl_transfer_abort();
+    _repl_backlog_free();
+}
+
+/**
+ * @brief Appends the replication section of INFO.
+ * @return Bytes written.
+ */
+static inline size_t repl_info(char *buf, size_t cap)
+{
+    size_t len = 0;
+    long long now = cached_time_ms();
+#define REPL_INFO(...)                                                 \
+    do                                                                 \
+    {                                                                  \
+        int _n = snprintf(buf + len, cap - len, __VA_ARGS__);          \
+        if (_n > 0)                                                    \
+            len = len + (size_t)_n < cap ? len + (size_t)_n : cap - 1; \
+    } while (0)
+
+    REPL_INFO("# Replication\r\nrole:%s\r\n", repl_state.master_port ? "slave" : "master");
+    if (repl_state.master_port)
+    {
+        int up = repl_state.link == REPL_LINK_CONNECTED;
+        REPL_INFO("master_host:%s\r\n"
+                  "master_port:%d\r\n"
+                  "master_link_status:%s\r\n"
+                  "master_sync_in_progress:%d\r\n"
+                  "master_link_down_since_seconds:%lld\r\n"
+                  "slave_repl_offset:%lld\r\n",
+                  repl_state.master_host, repl_state.master_port, up ? "up" : "down",
+                  repl_state.link == REPL_LINK_TRANSFER, up ? -1 : (now - repl_state.link_down_ms) / 1000,
+                  repl_state.master_repl_offset);
+    }
+    else
+    {
+        int n = 0;
+        for (size_t i = 0; i < repl_state.nreplicas; i++)
+            n += repl_state.replicas[i]->state != REPLICA_HANDSHAKE;
+        REPL_INFO("connected_slaves:%d\r\n", n);
+        n = 0;
+        for (size_t i = 0; i < repl_state.nreplicas; i++)
+        {
+            repl_replica_t *r = repl_state.replicas[i];
+            if (r->state == REPLICA_HANDSHAKE)
+                continue;
+            REPL_INFO("slave%d:ip=%s,port=%d,state=%s,offset=%lld,lag=%lld\r\n", n++, r->ip, r->port,
+                      _repl_replica_state_name(r->state), r->ack_offset, (now - r->ack_ms) / 1000);
+        }
+    }
+
+    pthread_mutex_lock(&repl_state.lock);
+    long long offset = repl_state.master_repl_offset;
+    size_t histlen = repl_state.backlog_histlen;
+    int active = repl_state.backlog != NULL;
+    pthread_mutex_unlock(&repl_state.lock);
+    REPL_INFO("master_replid:%s\r\n"
+              "master_repl_offset:%lld\r\n"
+              "repl_backlog_active:%d\r\n"
+              "repl_backlog_size:%zu\r\n"
+              "repl_backlog_first_byte_offset:%lld\r\n"
+              "repl_backlog_histlen:%zu\r\n"
+              "sync_full:%lld\r\n"
+              "sync_partial_ok:%lld\r\n"
+              "sync_partial_err:%lld\r\n",
+              repl_state.replid, offset, active, server.config.repl_backlog_size,
+              active ? offset - (long long)histlen + 1 : 0, histlen, repl_state.stat_sync_full,
+              repl_state.stat_sync_partial_ok, repl_state.stat_sync_partial_err);
+#undef REPL_INFO
+    return len;
+}
+
+// --- Handlers ---
+
+/**
+ * PSYNC replid offset
+ * Attaches the connection as a replica, resuming after offset - 1 if
+ * 'replid' is ours and the backlog still holds what follows, else with a
+ * full resync. Runs on shard 0, which owns replica connections.
+ */
+static inline void handle_psync(redis_db_t *db, client_t *c, const resp_arg_t *argv, int argc)
+{
+    (void)db; (void)argc;
+    if (repl_state.master_port != 0)
+    {
+        client_add_reply_str(c, "-ERR Can't PSYNC with a replica: chained replication is not supported\r\n");
+        return;
+    }
+    if (c->replica && c->replica->state != REPLICA_HANDSHAKE)
+    {
+        client_add_reply_str(c, "-ERR PSYNC already received\r\n");
+        return;
+    }
+    repl_replica_t *r = _repl_backlog_create() == 0 ? _repl_replica_get(c) : NULL;
+    if (r == NULL)
+    {
+        client_add_reply_str(c, "-ERR out of memory\r\n");
+        return;
+    }
+
+    long long offset = 0;
+    int ours = argv[1].len == REPL_ID_LEN && memcmp(argv[1].ptr, repl_state.replid, REPL_ID_LEN) == 0 &&
+               string_to_ll(argv[2].ptr, argv[2].len, &offset) == 0;
+    pthread_mutex_lock(&repl_state.lock);
+    long long end = repl_state.master_repl_offset;
+    int partial = ours && offset - 1 >= end - (long long)repl_state.backlog_histlen && offset - 1 <= end;
+    pthread_mutex_unlock(&repl_state.lock);
+
+    if (partial)
+    {
+        r->state = REPLICA_ONLINE;
+        r->offset = r->ack_offset = offset - 1;
+        char line[REPL_ID_LEN + 16];
+        int n = snprintf(line, sizeof(line), "+CONTINUE %s\r\n", repl_state.replid);
+        client_add_reply(c, line, (size_t)n);
+        repl_state.stat_sync_partial_ok++;
+        log_info("Replica %s:%d resumed at offset %lld, %lld bytes behind", r->ip, r->port, offset - 1,
+                 end - (offset - 1));
+        return;
+    }
+    if (!(argv[1].len == 1 && argv[1].ptr[0] == '?'))
+        repl_state.stat_sync_partial_err++;
+    repl_state.stat_sync_full++;
+    r->state = REPLICA_WAIT_BGSAVE_START;
+    log_info("Replica %s:%d asks for a full resynchronization", r->ip, r->port);
+}
+
+/**
+ * REPLCONF option value [option value ...]
+ * listening-port: the port the replica serves on (shown by INFO);
+ * ACK offset: what it applied, and gets no reply. Other options are
+ * accepted and ignored.
+ */
+static inline void handle_replconf(redis_db_t *db, client_t *c, const resp_arg_t *argv, int argc)
+{
+    (void)db;
+    if (argc % 2 == 0)
+    {
+        client_add_reply_str(c, REDIS_SYNTAX_ERR);
+        return;
+    }
+    for (int i = 1; i < argc; i += 2)
+    {
+        long long v;
+        if (resp_arg_eq_nocase(&argv[i], "ack"))
+        {
+            if (c->replica && string_to_ll(argv[i + 1].ptr, argv[i + 1].len, &v) == 0)
+            {
+                c->replica->ack_offset = v;
+                c->replica->ack_ms = cached_time_ms();
+            }
+            return;
+        }
+        if (resp_arg_eq_nocase(&argv[i], "listening-port"))
+        {
+            if (string_to_ll(argv[i + 1].ptr, argv[i + 1].len, &v) != 0 || v <= 0 || v > 65535)
+            {
+                client_add_reply_str(c, "-ERR invalid port\r\n");
+                return;
+            }
+            repl_replica_t *r = _repl_replica_get(c);
+            if (r == NULL)
+            {
+                client_add_reply_str(c, "-ERR out of memory\r\n");
+                return;
+            }
+            r->port = (int)v;
+        }
+    }
+    client_add_reply_str(c, REDIS_OK);
+}
+
+/**
+ * REPLICAOF host port | REPLICAOF NO ONE
+ * Starts following another server (dropping our dataset at its full
+ * resync), or stops following and becomes a primary.
+ */
+static inline void handle_replicaof(redis_db_t *db, client_t *c, const resp_arg_t *argv, int argc)
+{
+    (void)db; (void)argc;
+    if (server.config.cluster_enabled)
+    {
+        client_add_reply_str(c, "-ERR REPLICAOF not allowed in cluster mode.\r\n");
+        return;
+    }
+    if (resp_arg_eq_nocase(&argv[1], "no") && resp_arg_eq_nocase(&argv[2], "one"))
+    {
+        if (repl_state.master_port != 0 && _repl_become_primary() != 0)
+        {
+            client_add_reply_str(c, "-ERR shutting down\r\n");
+            return;
+        }
+        client_add_reply_str(c, REDIS_OK);
+        return;
+    }
+
+    long long port;
+    if (string_to_ll(argv[2].ptr, argv[2].len, &port) != 0 || port <= 0 || port > 65535)
+    {
+        client_add_reply_str(c, "-ERR Invalid master port\r\n");
+        return;
+    }
+    if (argv[1].len == 0 || argv[1].len >= REPL_HOST_MAX)
+    {
+        client_add_reply_str(c, "-ERR Invalid master host\r\n");
+        return;
+    }
+    if (repl_state.master_port == port && strlen(repl_state.master_host) == argv[1].len &&
+        strncasecmp(repl_state.master_host, argv[1].ptr, argv[1].len) == 0)
+    {
+        client_add_reply_str(c, "+OK Already connected to specified master\r\n");
+        return;
+    }
+    if (_repl_become_replica(argv[1].ptr, argv[1].len, (int)port) != 0)
+    {
+        client_add_reply_str(c, "-ERR shutting down\r\n");
+        return;
+    }
+    client_add_reply_str(c, REDIS_OK);
+}
+
+#endif // REPL_H
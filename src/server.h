@@ -0,0 +1,540 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+#include "client.h"
+#include "log.h"
+#include "iothreads.h"
+#include "shard.h"
+
+#define DEFAULT_PORT 6379
+#define DEFAULT_CLIENT_OBUF_LIMIT (256ULL * 1024 * 1024) // 256mb
+#define DEFAULT_DBFILENAME "dump.rdb"
+#define DEFAULT_APPENDFILENAME "appendonly.aof"
+#define SAVE_POINTS_MAX 16
+#define DEFAULT_REPL_BACKLOG_SIZE (1024 * 1024) // 1mb
+#define REPL_HOST_MAX 256
+#define DEFAULT_CLUSTER_CONFIG_FILE "nodes.conf"
+#define DEFAULT_CLUSTER_NODE_TIMEOUT 15000 // ms
+#define CLUSTER_PORT_INCR 10000            // The cluster bus listens on port + this
+#define DEFAULT_SLOWLOG_SLOWER_THAN 10000  // us
+#define DEFAULT_SLOWLOG_MAX_LEN 128
+#define DEFAULT_TCP_BACKLOG 511
+
+// What server.child_pid is running (one background child at a time)
+#define CHILD_NONE 0
+#define CHILD_RDB 1       // BGSAVE
+#define CHILD_AOF 2       // BGREWRITEAOF
+#define CHILD_POLL_MS 100 // Longest wait of shard 0 for a child to finish
+
+// --- Data Structures ---
+
+/**
+ * @brief When appended writes reach the disk (--appendfsync, aof.h).
+ */
+typedef enum
+{
+    AOF_FSYNC_NO,
+    AOF_FSYNC_EVERYSEC,
+    AOF_FSYNC_ALWAYS
+} aof_fsync_policy;
+
+/**
+ * @brief Snapshot automatically once 'changes' writes are at least
+ * 'seconds' old (--save).
+ */
+typedef struct
+{
+    long long seconds;
+    long long changes;
+} save_point_t;
+
+/**
+ * @brief Settings taken from the command line.
+ */
+typedef struct
+{
+    int port;
+    size_t client_obuf_limit; // Per-client output buffer cap, 0 = unlimited
+    log_level log_level;
+    const char *log_file;     // NULL = stdout
+    int io_threads;           // 1 = all socket I/O on the main thread
+    int shards;               // Event loops, each owning a slice of the keyspace
+    event_backend event_loop; // How they wait for and do socket I/O (event.h)
+    int tcp_backlog;          // Pending connections per listener
+    zset_engine zset_impl;    // Storage for new sorted sets
+    // Collections at or under these limits stay packed (listpack.h)
+    size_t list_max_listpack_entries;
+    size_t list_max_listpack_value;
+    size_t zset_max_listpack_entries;
+    size_t zset_max_listpack_value;
+    size_t maxmemory;         // Keyspace memory limit, 0 = none (evict.h)
+    maxmemory_policy_t maxmemory_policy;
+    int maxmemory_samples;    // Keys sampled per eviction
+    int lazyfree;             // Free large values lazily on every delete, not just UNLINK (lazyfree.h)
+    const char *dbfilename;   // Snapshot file, loaded at startup (rdb.h)
+    save_point_t save_points[SAVE_POINTS_MAX];
+    int nsave_points;         // 0 = no automatic snapshots
+    int appendonly;           // Log every write to 'appendfilename' (aof.h)
+    const char *appendfilename;
+    aof_fsync_policy appendfsync;
+    char replicaof_host[REPL_HOST_MAX]; // Primary to follow at startup (repl.h)...
+    int replicaof_port;                 // ...0 = start as a primary
+    size_t repl_backlog_size;           // Stream kept for partial resyncs
+    int cluster_enabled;                // Serve only our hash slots of a cluster (cluster.h)
+    const char *cluster_config_file;    // The node table, rewritten as it changes
+    long long cluster_node_timeout;     // ms without a PONG before a node is suspected
+    long long slowlog_slower_than;      // us a command must take to be logged, -1 = never (slowlog.h)
+    size_t slowlog_max_len;             // Entries kept
+} server_config_t;
+
+/**
+ * @brief Process-wide state. Per-loop state lives in the shards.
+ */
+typedef struct
+{
+    server_config_t config;
+    volatile sig_atomic_t shutdown_asap; // Set from SIGINT/SIGTERM
+    shard_t *shards;                     // Shard 0 runs on the main thread
+    int nshards;
+    int child_type;                      // CHILD_NONE, or what 'child_pid' is
+    pid_t child_pid;
+
+    // Stats for INFO, bumped by every shard
+    long long start_time_ms;
+    _Atomic long long stat_clients;      // Connected right now
+    _Atomic long long stat_connections;  // Accepted since startup
+} redis_server_t;
+
+static redis_server_t server;
+
+// --- Config ---
+
+/**
+ * @brief Parses a byte count with an optional kb/mb/gb suffix ("64mb").
+ * @return 0 on success, -1 if malformed.
+ */
+static inline int parse_memory_size(const char *str, size_t *out)
+{
+    char *end;
+    unsigned long long v = strtoull(str, &end, 10);
+    if (end == str)
+        return -1;
+    unsigned long long mul = 1;
+    if (*end == '\0' || !strcasecmp(end, "b"))
+        mul = 1;
+    else if (!strcasecmp(end, "k") || !strcasecmp(end, "kb"))
+        mul = 1024;
+    else if (!strcasecmp(end, "m") || !strcasecmp(end, "mb"))
+        mul = 1024 * 1024;
+    else if (!strcasecmp(end, "g") || !strcasecmp(end, "gb"))
+        mul = 1024ULL * 1024 * 1024;
+    else
+        return -1;
+    *out = (size_t)(v * mul);
+    return 0;
+}
+
+static inline void config_set_defaults(server_config_t *cfg)
+{
+    cfg->port = DEFAULT_PORT;
+    cfg->client_obuf_limit = DEFAULT_CLIENT_OBUF_LIMIT;
+    cfg->log_level = LOG_INFO;
+    cfg->log_file = NULL;
+    cfg->io_threads = 1;
+    cfg->shards = 1;
+    cfg->event_loop = EVENT_BACKEND_EPOLL;
+    cfg->tcp_backlog = DEFAULT_TCP_BACKLOG;
+    cfg->zset_impl = ZSET_ENGINE_AVL;
+    cfg->list_max_listpack_entries = 128;
+    cfg->list_max_listpack_value = 64;
+    cfg->zset_max_listpack_entries = 128;
+    cfg->zset_max_listpack_value = 64;
+    cfg->maxmemory = 0;
+    cfg->maxmemory_policy = MAXMEMORY_NOEVICTION;
+    cfg->maxmemory_samples = EVICT_DEFAULT_SAMPLES;
+    cfg->lazyfree = 0;
+    cfg->dbfilename = DEFAULT_DBFILENAME;
+    cfg->nsave_points = 0;
+    cfg->appendonly = 0;
+    cfg->appendfilename = DEFAULT_APPENDFILENAME;
+    cfg->appendfsync = AOF_FSYNC_EVERYSEC;
+    cfg->replicaof_host[0] = '\0';
+    cfg->replicaof_port = 0;
+    cfg->repl_backlog_size = DEFAULT_REPL_BACKLOG_SIZE;
+    cfg->cluster_enabled = 0;
+    cfg->cluster_config_file = DEFAULT_CLUSTER_CONFIG_FILE;
+    cfg->cluster_node_timeout = DEFAULT_CLUSTER_NODE_TIMEOUT;
+    cfg->slowlog_slower_than = DEFAULT_SLOWLOG_SLOWER_THAN;
+    cfg->slowlog_max_len = DEFAULT_SLOWLOG_MAX_LEN;
+}
+
+/**
+ * @brief Parses a non-negative count.
+ * @return 0 on success, -1 if malformed.
+ */
+static inline int parse_count(const char *str, size_t *out)
+{
+    long long v;
+    if (string_to_ll(str, strlen(str), &v) != 0 || v < 0)
+        return -1;
+    *out = (size_t)v;
+    return 0;
+}
+
+/**
+ * @brief Parses "seconds changes [seconds changes ...]"; "" clears all.
+ * @return 0 on success, -1 if malformed or too many points.
+ */
+static inline int parse_save_points(const char *str, save_point_t *points, int *npoints)
+{
+    int n = 0;
+    const char *p = str;
+    while (1)
+    {
+        while (*p == ' ')
+            p++;
+        if (*p == '\0')
+            break;
+        if (n == SAVE_POINTS_MAX)
+            return -1;
+        long long v[2];
+        for (int k = 0; k < 2; k++)
+        {
+            while (*p == ' ')
+                p++;
+            const char *end = p;
+            while (*end && *end != ' ')
+                end++;
+            if (string_to_ll(p, (size_t)(end - p), &v[k]) != 0 || v[k] < 1)
+                return -1;
+            p = end;
+        }
+        points[n].seconds = v[0];
+        points[n].changes = v[1];
+        n++;
+    }
+    *npoints = n;
+    return 0;
+}
+
+/**
+ * @brief Parses "host port" into 'host' (of 'cap' bytes) and '*port'.
+ * @return 0 on success, -1 if malformed.
+ */
+static inline int parse_host_port(const char *str, char *host, size_t cap, int *port)
+{
+    const char *sp = strchr(str, ' ');
+    if (sp == NULL || sp == str || (size_t)(sp - str) >= cap)
+        return -1;
+    long long v;
+    if (string_to_ll(sp + 1, strlen(sp + 1), &v) != 0 || v <= 0 || v > 65535)
+        return -1;
+    memcpy(host, str, (size_t)(sp - str));
+    host[sp - str] = '\0';
+    *port = (int)v;
+    return 0;
+}
+
+/**
+ * @brief Parses "--name value" pairs from argv.
+ * @return 0 on success, -1 on an unknown or malformed option.
+ */
+static inline int config_parse_args(server_config_t *cfg, int argc, char **argv)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        const char *opt = argv[i];
+        if (i + 1 >= argc)
+        {
+            fprintf(stderr, "Missing value for option %s\n", opt);
+            return -1;
+        }
+        const char *val = argv[++i];
+
+        if (!strcmp(opt, "--port"))
+        {
+            cfg->port = atoi(val);
+            if (cfg->port <= 0 || cfg->port > 65535)
+            {
+                fprintf(stderr, "Invalid port: %s\n", val);
+                return -1;
+            }
+        }
+        else if (!strcmp(opt, "--client-output-buffer-limit"))
+        {
+            if (parse_memory_size(val, &cfg->client_obuf_limit) != 0)
+            {
+                fprintf(stderr, "Invalid client-output-buffer-limit: %s\n", val);
+                return -1;
+            }
+        }
+        else if (!strcmp(opt, "--loglevel"))
+        {
+            if (log_parse_level(val, &cfg->log_level) != 0)
+            {
+                fprintf(stderr, "Invalid loglevel: %s\n", val);
+                return -1;
+            }
+        }
+        else if (!strcmp(opt, "--logfile"))
+        {
+            cfg->log_file = val;
+        }
+        else if (!strcmp(opt, "--io-threads"))
+        {
+            cfg->io_threads = atoi(val);
+            if (cfg->io_threads < 1 || cfg->io_threads > IO_THREADS_MAX)
+            {
+                fprintf(stderr, "Invalid io-threads (1-%d): %s\n", IO_THREADS_MAX, val);
+                return -1;
+            }
+        }
+        else if (!strcmp(opt, "--shards"))
+        {
+            cfg->shards = atoi(val);
+            if (cfg->shards < 1 || cfg->shards > SHARDS_MAX)
+            {
+                fprintf(stderr, "Invalid shards (1-%d): %s\n", SHARDS_MAX, val);
+                return -1;
+            }
+        }
+        else if (!strcmp(opt, "--event-loop"))
+        {
+            if (!strcasecmp(val, "epoll"))
+                cfg->event_loop = EVENT_BACKEND_EPOLL;
+            else if (!strcasecmp(val, "io_uring"))
+                cfg->event_loop = EVENT_BACKEND_IO_URING;
+            else
+            {
+                fprintf(stderr, "Invalid event-loop (epoll|io_uring): %s\n", val);
+                return -1;
+            }
+        }
+        else if (!strcmp(opt, "--tcp-backlog"))
+        {
+            cfg->tcp_backlog = atoi(val);
+            if (cfg->tcp_backlog < 1)
+            {
+                fprintf(stderr, "Invalid tcp-backlog (at least 1): %s\n", val);
+                return -1;
+            }
+        }
+        else if (!strcmp(opt, "--zset-engine"))
+        {
+            if (!strcasecmp(val, "avl"))
+                cfg->zset_impl = ZSET_ENGINE_AVL;
+            else if (!strcasecmp(val, "btree"))
+                cfg->zset_impl = ZSET_ENGINE_BTREE;
+            else
+            {
+                fprintf(stderr, "Invalid zset-engine (avl|btree): %s\n", val);
+                return -1;
+            }
+        }
+        else if (!strcmp(opt, "--list-max-listpack-entries") ||
+                 !strcmp(opt, "--list-max-listpack-value") ||
+                 !strcmp(opt, "--zset-max-listpack-entries") ||
+                 !strcmp(opt, "--zset-max-listpack-value"))
+        {
+            size_t *dst = !strcmp(opt, "--list-max-listpack-entries") ? &cfg->list_max_listpack_entries
+                        : !strcmp(opt, "--list-max-listpack-value")   ? &cfg->list_max_listpack_value
+                        : !strcmp(opt, "--zset-max-listpack-entries") ? &cfg->zset_max_listpack_entries
+                                                                      : &cfg->zset_max_listpack_value;
+            if (parse_count(val, dst) != 0)
+            {
+                fprintf(stderr, "Invalid %s: %s\n", opt + 2, val);
+                return -1;
+            }
+        }
+        else if (!strcmp(opt, "--maxmemory"))
+        {
+            if (parse_memory_size(val, &cfg->maxmemory) != 0)
+            {
+                fprintf(stderr, "Invalid maxmemory: %s\n", val);
+                return -1;
+            }
+        }
+        else if (!strcmp(opt, "--maxmemory-policy"))
+        {
+            int found = 0;
+            for (int p = 0; p < (int)(sizeof(maxmemory_policy_names) / sizeof(maxmemory_policy_names[0])); p++)
+            {
+                if (!strcasecmp(val, maxmemory_policy_names[p]))
+                {
+                    cfg->maxmemory_policy = (maxmemory_policy_t)p;
+                    found = 1;
+                }
+            }
+            if (!found)
+            {
+                fprintf(stderr, "Invalid maxmemory-policy (noeviction|allkeys-lru|allkeys-lfu|volatile-ttl): %s\n", val);
+                return -1;
+            }
+        }
+        else if (!strcmp(opt, "--maxmemory-samples"))
+        {
+            cfg->maxmemory_samples = atoi(val);
+            if (cfg->maxmemory_samples < 1 || cfg->maxmemory_samples > EVICT_MAX_SAMPLES)
+            {
+                fprintf(stderr, "Invalid maxmemory-samples (1-%d): %s\n", EVICT_MAX_SAMPLES, val);
+                return -1;
+            }
+        }
+        else if (!strcmp(opt, "--lazyfree"))
+        {
+            if (!strcasecmp(val, "yes"))
+                cfg->lazyfree = 1;
+            else if (!strcasecmp(val, "no"))
+                cfg->lazyfree = 0;
+            else
+            {
+                fprintf(stderr, "Invalid lazyfree (yes|no): %s\n", val);
+                return -1;
+            }
+        }
+        else if (!strcmp(opt, "--dbfilename"))
+        {
+            if (*val == '\0')
+            {
+                fprintf(stderr, "Invalid dbfilename: empty\n");
+                return -1;
+            }
+            cfg->dbfilename = val;
+        }
+        else if (!strcmp(opt, "--save"))
+        {
+            if (parse_save_points(val, cfg->save_points, &cfg->nsave_points) != 0)
+            {
+                fprintf(stderr, "Invalid save (\"seconds changes ...\", at most %d pairs): %s\n", SAVE_POINTS_MAX, val);
+                return -1;
+            }
+        }
+        else if (!strcmp(opt, "--appendonly"))
+        {
+            if (!strcasecmp(val, "yes"))
+                cfg->appendonly = 1;
+            else if (!strcasecmp(val, "no"))
+                cfg->appendonly = 0;
+            else
+            {
+                fprintf(stderr, "Invalid appendonly (yes|no): %s\n", val);
+                return -1;
+            }
+        }
+        else if (!strcmp(opt, "--appendfilename"))
+        {
+            if (*val == '\0')
+            {
+                fprintf(stderr, "Invalid appendfilename: empty\n");
+                return -1;
+            }
+            cfg->appendfilename = val;
+        }
+        else if (!strcmp(opt, "--appendfsync"))
+        {
+            if (!strcasecmp(val, "always"))
+                cfg->appendfsync = AOF_FSYNC_ALWAYS;
+            else if (!strcasecmp(val, "everysec"))
+                cfg->appendfsync = AOF_FSYNC_EVERYSEC;
+            else if (!strcasecmp(val, "no"))
+                cfg->appendfsync = AOF_FSYNC_NO;
+            else
+            {
+                fprintf(stderr, "Invalid appendfsync (always|everysec|no): %s\n", val);
+                return -1;
+            }
+        }
+        else if (!strcmp(opt, "--replicaof"))
+        {
+            if (parse_host_port(val, cfg->replicaof_host, sizeof(cfg->replicaof_host), &cfg->replicaof_port) != 0)
+            {
+                fprintf(stderr, "Invalid replicaof (\"host port\"): %s\n", val);
+                return -1;
+            }
+        }
+        else if (!strcmp(opt, "--repl-backlog-size"))
+        {
+            if (parse_memory_size(val, &cfg->repl_backlog_size) != 0 || cfg->repl_backlog_size < 16 * 1024)
+            {
+                fprintf(stderr, "Invalid repl-backlog-size (at least 16kb): %s\n", val);
+                return -1;
+            }
+        }
+        else if (!strcmp(opt, "--cluster-enabled"))
+        {
+            if (!strcasecmp(val, "yes"))
+                cfg->cluster_enabled = 1;
+            else if (!strcasecmp(val, "no"))
+                cfg->cluster_enabled = 0;
+            else
+            {
+                fprintf(stderr, "Invalid cluster-enabled (yes|no): %s\n", val);
+                return -1;
+            }
+        }
+        else if (!strcmp(opt, "--cluster-config-file"))
+        {
+            if (*val == '\0')
+            {
+                fprintf(stderr, "Invalid cluster-config-file: empty\n");
+                return -1;
+            }
+            cfg->cluster_config_file = val;
+        }
+        else if (!strcmp(opt, "--cluster-node-timeout"))
+        {
+            if (string_to_ll(val, strlen(val), &cfg->cluster_node_timeout) != 0 || cfg->cluster_node_timeout < 100)
+            {
+                fprintf(stderr, "Invalid cluster-node-timeout (at least 100 ms): %s\n", val);
+                return -1;
+            }
+        }
+        else if (!strcmp(opt, "--slowlog-log-slower-than"))
+        {
+            if (string_to_ll(val, strlen(val), &cfg->slowlog_slower_than) != 0 || cfg->slowlog_slower_than < -1)
+            {
+                fprintf(stderr, "Invalid slowlog-log-slower-than (us, -1 = off): %s\n", val);
+                return -1;
+            }
+        }
+        else if (!strcmp(opt, "--slowlog-max-len"))
+        {
+            if (parse_count(val, &cfg->slowlog_max_len) != 0 || cfg->slowlog_max_len < 1)
+            {
+                fprintf(stderr, "Invalid slowlog-max-len (at least 1): %s\n", val);
+                return -1;
+            }
+        }
+        else
+        {
+            fprintf(stderr, "Unknown option: %s\n", opt);
+            return -1;
+        }
+    }
+    if (cfg->shards > 1 && cfg->io_threads > 1)
+    {
+        // Both scale across cores; mixing them would share I/O threads between loops
+        fprintf(stderr, "--shards and --io-threads are mutually exclusive\n");
+        return -1;
+    }
+    if (cfg->cluster_enabled && cfg->port + CLUSTER_PORT_INCR > 65535)
+    {
+        fprintf(stderr, "Cluster mode needs a port of at most %d, for the cluster bus\n", 65535 - CLUSTER_PORT_INCR);
+        return -1;
+    }
+    if (cfg->cluster_enabled && cfg->replicaof_port != 0)
+    {
+        fprintf(stderr, "--replicaof is not supported in cluster mode\n");
+        return -1;
+    }
+    return 0;
+}
+
+#endif // SERVER_H
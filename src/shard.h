@@ -0,0 +1,365 @@
+#ifndef SHARD_H
+#define SHARD_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/eventfd.h>
+#include "parser.h"
+#include "client.h"
+#include "handler.h"
+#include "keyslot.h"
+#include "mpsc.h"
+#include "event.h"
+#include "log.h"
+
+#define SHARDS_MAX 64
+#define SHARD_CROSSSLOT_ERR "-CROSSSLOT Keys in request don't hash to the same shard\r\n"
+
+// --- Data Structures ---
+
+typedef enum
+{
+    SHARD_MSG_COMMAND, // Origin -> owner: run argv on the owner's keyspace
+    SHARD_MSG_REPLY,   // Owner -> origin: the captured reply
+    SHARD_MSG_CANCEL,  // Origin -> owner: the client is gone, drop its parked pop
+    SHARD_MSG_APPLY,   // Origin -> owner: run argv from the primary's stream, no reply
+    SHARD_MSG_HANDOFF, // Origin -> shard 0: take over 'client' (a replication link)
+    SHARD_MSG_EXEC     // Origin -> owner: run a MULTI queue, argv = EXEC <queued bytes> <count>
+} shard_msg_type;
+
+/**
+ * @brief A command forwarded to the shard that owns its keys.
+ * One allocation holds the header, argv and the argument bytes. The owner
+ * runs it, stores the reply blocks in the same message and sends it back,
+ * so a round trip costs a single malloc/free.
+ */
+typedef struct shard_msg
+{
+    mpsc_node_t node; // Must stay first
+    shard_msg_type type;
+    struct shard *origin;
+    int fd;                        // Client on the origin shard...
+    unsigned long long client_id;  // ...unless the fd was reused since (APPLY: the stream epoch, repl.h)
+    int argc;
+    resp_arg_t *argv;              // Points into data[]
+    int client_flags;              // COMMAND: the origin client's CLIENT_ASKING
+
+    reply_block_t *reply_head;
+    reply_block_t *reply_tail;
+    size_t reply_bytes;
+    client_t *client; // HANDOFF
+
+    char data[];
+} shard_msg_t;
+
+/**
+ * @brief A client named by fd and id, so a stale reference to a closed
+ * (and possibly reused) fd is detected.
+ */
+typedef struct
+{
+    int fd;
+    unsigned long long id;
+} client_ref_t;
+
+/**
+ * @brief What a shard publishes for INFO, which runs on shard 0. Only the
+ * owner writes it, once per loop iteration.
+ */
+typedef struct
+{
+    _Atomic long long keys;
+    _Atomic long long expires;      // Entries in the expiry heap, one per key with a TTL
+    _Atomic long long loop_cycles;  // Event loop iterations
+    _Atomic long long loop_busy_us; // Time spent outside event_wait(), in total...
+    _Atomic long long loop_max_us;  // ...and in the longest iteration
+    _Atomic long long lazyfree_pending; // Unlinked values not yet freed (lazyfree.h)...
+    _Atomic long long lazyfreed;        // ...and those freed since startup
+} shard_stats_t;
+
+/**
+ * @brief One shared-nothing event loop.
+ * Each shard owns an event loop (event.h), a listening socket (SO_REUSEPORT
+ * when there are several), its clients and its slice of the keyspace.
+ * Nothing here is touched by other threads except 'inbox' and the wakeup
+ * eventfd.
+ */
+typedef struct shard
+{
+    int id;
+    pthread_t thread;
+    event_loop_t el;
+    int listen_fd;
+    redis_db_t db;
+    client_table_t clients;
+    unsigned long long next_client_id;
+
+    // Clients with output queued since the last flush
+    client_t **pending_writes;
+    size_t pending_count;
+    size_t pending_cap;
+
+    // Readable clients collected during one event_wait batch
+    client_t **pending_reads;
+    size_t pending_reads_count;
+    size_t pending_reads_cap;
+
+    // Clients served by a blocking pop, whose pipelines resume next
+    client_ref_t *unblocked;
+    size_t unblocked_count;
+    size_t unblocked_cap;
+
+    // Cross-shard messages
+    mpsc_queue_t inbox;
+    int wake_fd;            // eventfd registered with 'el'
+    _Atomic int wake_armed; // Set once a wakeup is in flight
+    client_t *exec_client;  // Collects replies of forwarded commands
+
+    shard_stats_t stats;
+} shard_t;
+
+// --- Routing ---
+
+/**
+ * @brief Shard that owns 'key'. Slots are assigned round-robin, so a
+ * {hash tag} keeps related keys on one shard.
+ */
+static inline int shard_for_key(const resp_arg_t *key, int nshards)
+{
+    return nshards > 1 ? (int)(key_hash_slot(key->ptr, key->len) % (unsigned)nshards) : 0;
+}
+
+// --- Stats ---
+
+/**
+ * @brief Owner side: publishes the keyspace size and the iteration that
+ * just ran, which took 'busy_us' past its wakeup.
+ */
+static inline void shard_stats_publish(shard_t *sh, long long busy_us)
+{
+    shard_stats_t *st = &sh->stats;
+    atomic_store_explicit(&st->keys, (long long)dict_size(&sh->db.entries), memory_order_relaxed);
+    atomic_store_explicit(&st->expires, (long long)heap_size(sh->db.expiry_heap), memory_order_relaxed);
+    atomic_store_explicit(&st->lazyfree_pending, (long long)sh->db.lazyfree.count, memory_order_relaxed);
+    atomic_store_explicit(&st->lazyfreed, sh->db.lazyfree.freed, memory_order_relaxed);
+    atomic_store_explicit(&st->loop_cycles, atomic_load_explicit(&st->loop_cycles, memory_order_relaxed) + 1,
+                          memory_order_relaxed);
+    atomic_store_explicit(&st->loop_busy_us, atomic_load_explicit(&st->loop_busy_us, memory_order_relaxed) + busy_us,
+                          memory_order_relaxed);
+    if (busy_us > atomic_load_explicit(&st->loop_max_us, memory_order_relaxed))
+        atomic_store_explicit(&st->loop_max_us, busy_us, memory_order_relaxed);
+}
+
+// --- Lifecycle ---
+
+/**
+ * @brief Sets up everything except the listener, with an event loop on
+ * 'backend'.
+ * @return 0 on success, -1 on failure.
+ */
+static inline int shard_init(shard_t *sh, int id, event_backend backend)
+{
+    memset(sh, 0, sizeof(*sh));
+    sh->id = id;
+    sh->listen_fd = -1;
+    sh->wake_fd = -1;
+    mpsc_init(&sh->inbox);
+    atomic_init(&sh->wake_armed, 0);
+
+    db_init(&sh->db);
+    sh->db.shard_id = id;
+    sh->db.expiry_heap = expiry_heap_create();
+    sh->db.bpop_heap = bpop_heap_create();
+    sh->exec_client = client_create(-1, 0);
+    int el_rc = event_loop_init(&sh->el, backend);
+    sh->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (sh->db.expiry_heap == NULL || sh->db.bpop_heap == NULL || sh->exec_client == NULL || el_rc != 0 || sh->wake_fd < 0)
+    {
+        log_error("Can't initialize shard %d: %s", id, strerror(errno));
+        return -1;
+    }
+    sh->exec_client->shard = sh;
+
+    if (event_add(&sh->el, sh->wake_fd, EVENT_READABLE) < 0)
+    {
+        log_error("event_add: wake_fd: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+// --- Messaging ---
+
+/**
+ * @brief Copies argv into a new COMMAND message for 'c'.
+ * @return The message, or NULL on allocation failure.
+ */
+static inline shard_msg_t *shard_msg_command(client_t *c, const resp_arg_t *argv, int argc)
+{
+    size_t bytes = 0;
+    for (int i = 0; i < argc; i++)
+        bytes += argv[i].len + 1;
+
+    shard_msg_t *m = (shard_msg_t *)malloc(sizeof(shard_msg_t) + argc * sizeof(resp_arg_t) + bytes);
+    if (m == NULL)
+        return NULL;
+    m->type = SHARD_MSG_COMMAND;
+    m->origin = c->shard;
+    m->fd = c->fd;
+    m->client_id = c->id;
+    m->client_flags = c->flags & CLIENT_ASKING;
+    m->argc = argc;
+    m->argv = (resp_arg_t *)m->data;
+    m->reply_head = m->reply_tail = NULL;
+    m->reply_bytes = 0;
+    m->client = NULL;
+
+    char *p = m->data + argc * sizeof(resp_arg_t);
+    for (int i = 0; i < argc; i++)
+    {
+        memcpy(p, argv[i].ptr, argv[i].len);
+        p[argv[i].len] = '\0';
+        m->argv[i].ptr = p;
+        m->argv[i].len = argv[i].len;
+        p += argv[i].len + 1;
+    }
+    return m;
+}
+
+static inline void shard_msg_free(shard_msg_t *m)
+{
+    reply_block_t *b = m->reply_head;
+    while (b)
+    {
+        reply_block_t *next = b->next;
+        free(b);
+        b = next;
+    }
+    free(m);
+}
+
+/**
+ * @brief Wakes the shard's event loop. Wakeups coalesce: only the first
+ * caller after the shard last drained its inbox pays for the write().
+ */
+static inline void shard_wake(shard_t *sh)
+{
+    if (atomic_exchange(&sh->wake_armed, 1) == 0)
+    {
+        uint64_t one = 1;
+        ssize_t n = write(sh->wake_fd, &one, sizeof(one));
+        (void)n; // EAGAIN means the counter is already non-zero
+    }
+}
+
+/**
+ * @brief Queues 'm' for 'to'. Safe to call from any thread.
+ */
+static inline void shard_send(shard_t *to, shard_msg_t *m)
+{
+    mpsc_push(&to->inbox, &m->node);
+    shard_wake(to);
+}
+
+/**
+ * @brief Consumer side of a wakeup: clears the eventfd and re-arms
+ * shard_wake(). Call before draining the inbox so no message is missed.
+ */
+static inline void shard_ack_wake(shard_t *sh)
+{
+    uint64_t v;
+    ssize_t n = read(sh->wake_fd, &v, sizeof(v));
+    (void)n;
+    atomic_exchange(&sh->wake_armed, 0);
+}
+
+static inline shard_msg_t *shard_inbox_pop(shard_t *sh)
+{
+    return (shard_msg_t *)mpsc_pop(&sh->inbox);
+}
+
+// --- Stop the World ---
+// Snapshots need every keyspace at rest at once. Shard 0 raises the pause
+// flag and wakes the others; each parks at the top of its next loop
+// iteration, between commands, until shard 0 resumes them.
+
+static pthread_mutex_t shard_pause_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t shard_pause_cond = PTHREAD_COND_INITIALIZER;
+static _Atomic int shard_pause_requested = 0;
+static int shard_paused = 0; // Parked shards, under shard_pause_lock
+
+/**
+ * @brief Parks the calling shard while a pause is requested. Called by
+ * every shard but 0 at the top of each loop iteration.
+ */
+static inline void shard_pause_point(void)
+{
+    if (!atomic_load_explicit(&shard_pause_requested, memory_order_acquire))
+        return;
+    pthread_mutex_lock(&shard_pause_lock);
+    shard_paused++;
+    pthread_cond_broadcast(&shard_pause_cond);
+    while (atomic_load_explicit(&shard_pause_requested, memory_order_relaxed))
+        pthread_cond_wait(&shard_pause_cond, &shard_pause_lock);
+    shard_paused--;
+    pthread_cond_broadcast(&shard_pause_cond);
+    pthread_mutex_unlock(&shard_pause_lock);
+}
+
+static inline void shard_resume_others(int nshards)
+{
+    if (nshards == 1)
+        return;
+    pthread_mutex_lock(&shard_pause_lock);
+    atomic_store_explicit(&shard_pause_requested, 0, memory_order_release);
+    pthread_cond_broadcast(&shard_pause_cond);
+    // Wait for everyone to leave, so the next pause counts afresh
+    while (shard_paused > 0)
+        pthread_cond_wait(&shard_pause_cond, &shard_pause_lock);
+    pthread_mutex_unlock(&shard_pause_lock);
+}
+
+/**
+ * @brief From shard 0: waits until every other shard is parked. Gives up
+ * if '*abort' gets set meanwhile (shutdown: shards stop parking once
+ * they leave their loop).
+ * @return 0 once all are parked, -1 if aborted (nothing stays paused).
+ */
+static inline int shard_pause_others(shard_t *shards, int nshards, const volatile sig_atomic_t *abort)
+{
+    if (nshards == 1)
+        return 0;
+    atomic_store_explicit(&shard_pause_requested, 1, memory_order_release);
+    for (int i = 1; i < nshards; i++)
+        shard_wake(&shards[i]);
+
+    pthread_mutex_lock(&shard_pause_lock);
+    while (shard_paused < nshards - 1 && !*abort)
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += 10 * 1000000L;
+        if (ts.tv_nsec >= 1000000000L)
+        {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&shard_pause_cond, &shard_pause_lock, &ts);
+    }
+    int ok = shard_paused == nshards - 1;
+    pthread_mutex_unlock(&shard_pause_lock);
+    if (!ok)
+    {
+        shard_resume_others(nshards);
+        return -1;
+    }
+    return 0;
+}
+
+#endif // SHARD_H
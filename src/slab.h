@@ -0,0 +1,332 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+
+/**
+ * Size-class pools for the small fixed-size objects of the keyspace
+ * (db entries, sorted set nodes and members, quicklist nodes).
+ *
+ * Requests of up to SLAB_MAX_SIZE bytes are rounded up to a multiple of
+ * SLAB_GRANULE and carved out of SLAB_PAGE_SIZE pages that hold one size
+ * class each. Pages are aligned to their size, so freeing finds the page
+ * (and its pool) by masking the pointer. A page that runs empty goes back
+ * to the OS unless it is the last page of its class with free slots, so
+ * RSS follows the live data after churn. Larger requests go to malloc(),
+ * and so do a few structures with their own allocation needs (listpacks,
+ * aligned tree nodes, hash table buckets); those report their sizes with
+ * slab_note_alloc()/slab_note_free(), so that a pool's counters cover all
+ * of its keyspace's memory and maxmemory can be enforced from them.
+ *
+ * Each shard owns one pool and makes it current for its thread with
+ * slab_use(); allocations come from the current pool. An object must be
+ * freed by the thread of the pool that allocated it (or once that thread
+ * has exited), with the size it was allocated with.
+ */
+
+#define SLAB_PAGE_SIZE (64 * 1024) // Power of two
+#define SLAB_GRANULE 16
+#define SLAB_MAX_SIZE 512
+#define SLAB_CLASSES (SLAB_MAX_SIZE / SLAB_GRANULE)
+
+// --- Data Structures ---
+
+struct slab_pool;
+
+/**
+ * @brief Header at the start of every page. Slots follow it; those not yet
+ * handed out lie past 'carved' and are never touched before use.
+ */
+typedef struct slab_page {
+    struct slab_page *prev; // In its class's list of pages with free slots
+    struct slab_page *next;
+    struct slab_pool *pool;
+    void *free;        // Freed slots, linked through their first word
+    uint32_t used;     // Live objects
+    uint32_t carved;   // Slots handed out at least once
+    uint32_t capacity; // Slots in the page
+    uint32_t cls;
+} slab_page_t;
+
+#define SLAB_PAGE_HEADER ((sizeof(slab_page_t) + SLAB_GRANULE - 1) & ~(size_t)(SLAB_GRANULE - 1))
+
+typedef struct {
+    slab_page_t *partial; // Pages with at least one free slot
+} slab_class_t;
+
+/**
+ * @brief Counters of one pool. Only the owning thread writes them, but any
+ * thread may read them (relaxed atomics, so INFO can sum every shard).
+ */
+typedef struct {
+    _Atomic size_t pages;     // Pages held
+    _Atomic size_t used;      // Bytes in live slots (size-class rounded)
+    _Atomic size_t requested; // Bytes actually asked for
+    _Atomic size_t objects;   // Live objects
+    _Atomic size_t heap;      // Bytes of larger objects, held by malloc()
+} slab_stats_t;
+
+typedef struct slab_pool {
+    slab_class_t classes[SLAB_CLASSES];
+    slab_stats_t stats;
+    struct slab_pool *next_pool; // Registry of all pools, for slab_stats_total()
+} slab_pool_t;
+
+/**
+ * @brief Totals over every pool, in bytes.
+ */
+typedef struct {
+    size_t reserved; // Page memory taken from the OS
+    size_t used;
+    size_t requested;
+    size_t objects;
+    size_t pages;
+    size_t heap;
+} slab_totals_t;
+
+// Pools are registered before the shard threads start and never unregistered
+static slab_pool_t *slab_pools = NULL;
+static slab_pool_t slab_default_pool; // For threads that never called slab_use()
+static _Thread_local slab_pool_t *slab_current = NULL;
+
+// --- Internal ---
+
+/**
+ * @brief (Internal) Single-writer counter update: a plain load and store,
+ * atomic only so that readers on other threads see whole values.
+ */
+static inline void _slab_stat_add(_Atomic size_t *counter, size_t delta) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + delta, memory_order_relaxed);
+}
+
+static inline void _slab_stat_sub(_Atomic size_t *counter, size_t delta) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) - delta, memory_order_relaxed);
+}
+
+static inline size_t _slab_class_of(size_t size) {
+    return size == 0 ? 0 : (size - 1) / SLAB_GRANULE;
+}
+
+static inline size_t _slab_class_size(size_t cls) {
+    return (cls + 1) * SLAB_GRANULE;
+}
+
+static inline slab_page_t *_slab_page_of(void *p) {
+    return (slab_page_t *)((uintptr_t)p & ~(uintptr_t)(SLAB_PAGE_SIZE - 1));
+}
+
+/**
+ * @brief (Internal) Maps a size-aligned page: over-map, then trim the ends.
+ */
+static inline void *_slab_map_page(void) {
+    size_t len = 2 * SLAB_PAGE_SIZE;
+    char *raw = (char *)mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED) return NULL;
+    char *page = (char *)(((uintptr_t)raw + SLAB_PAGE_SIZE - 1) & ~(uintptr_t)(SLAB_PAGE_SIZE - 1));
+    if (page > raw) munmap(raw, (size_t)(page - raw));
+    size_t tail = (size_t)(raw + len - (page + SLAB_PAGE_SIZE));
+    if (tail) munmap(page + SLAB_PAGE_SIZE, tail);
+    return page;
+}
+
+static inline void _slab_partial_link(slab_class_t *sc, slab_page_t *page) {
+    page->prev = NULL;
+    page->next = sc->partial;
+    if (sc->partial) sc->partial->prev = page;
+    sc->partial = page;
+}
+
+static inline void _slab_partial_unlink(slab_class_t *sc, slab_page_t *page) {
+    if (page->prev) page->prev->next = page->next;
+    else sc->partial = page->next;
+    if (page->next) page->next->prev = page->prev;
+    page->prev = page->next = NULL;
+}
+
+static inline slab_pool_t *_slab_current(void) {
+    return slab_current ? slab_current : &slab_default_pool;
+}
+
+static inline slab_page_t *_slab_page_new(slab_pool_t *pool, size_t cls) {
+    slab_page_t *page = (slab_page_t *)_slab_map_page();
+    if (page == NULL) return NULL;
+    page->prev = page->next = NULL;
+    page->pool = pool;
+    page->free = NULL;
+    page->used = 0;
+    page->carved = 0;
+    page->capacity = (uint32_t)((SLAB_PAGE_SIZE - SLAB_PAGE_HEADER) / _slab_class_size(cls));
+    page->cls = (uint32_t)cls;
+    _slab_stat_add(&pool->stats.pages, 1);
+    return page;
+}
+
+// --- Public API ---
+
+/**
+ * @brief Initializes 'pool' and adds it to the registry. Call before any
+ * thread reads the totals.
+ */
+static inline void slab_pool_init(slab_pool_t *pool) {
+    memset(pool, 0, sizeof(*pool));
+    pool->next_pool = slab_pools;
+    slab_pools = pool;
+}
+
+/**
+ * @brief Makes 'pool' the one this thread allocates from.
+ */
+static inline void slab_use(slab_pool_t *pool) {
+    slab_current = pool;
+}
+
+/**
+ * @brief Accounts 'size' bytes that the caller took from malloc() for the
+ * current pool's keyspace.
+ */
+static inline void slab_note_alloc(size_t size) {
+    _slab_stat_add(&_slab_current()->stats.heap, size);
+}
+
+/**
+ * @brief Takes back a slab_note_alloc(); on the same thread, same size.
+ */
+static inline void slab_note_free(size_t size) {
+    _slab_stat_sub(&_slab_current()->stats.heap, size);
+}
+
+/**
+ * @return Bytes held for the keyspace of 'pool': live slots plus noted
+ * heap memory. Safe from any thread.
+ */
+static inline size_t slab_pool_used_bytes(slab_pool_t *pool) {
+    return atomic_load_explicit(&pool->stats.used, memory_order_relaxed) +
+           atomic_load_explicit(&pool->stats.heap, memory_order_relaxed);
+}
+
+/**
+ * @return The bytes actually reserved for a 'size'-byte object, all of
+ * which the caller may use.
+ */
+static inline size_t slab_usable_size(size_t size) {
+    return size > SLAB_MAX_SIZE ? size : _slab_class_size(_slab_class_of(size));
+}
+
+/**
+ * @return 'size' bytes, 16-byte aligned, or NULL if out of memory.
+ */
+static inline void *slab_alloc(size_t size) {
+    if (size > SLAB_MAX_SIZE) {
+        void *p = malloc(size);
+        if (p) slab_note_alloc(size);
+        return p;
+    }
+
+    slab_pool_t *pool = _slab_current();
+    size_t cls = _slab_class_of(size);
+    slab_class_t *sc = &pool->classes[cls];
+    slab_page_t *page = sc->partial;
+    if (page == NULL) {
+        page = _slab_page_new(pool, cls);
+        if (page == NULL) return NULL;
+        _slab_partial_link(sc, page);
+    }
+
+    void *p;
+    if (page->free) {
+        p = page->free;
+        memcpy(&page->free, p, sizeof(void *));
+    } else {
+        p = (char *)page + SLAB_PAGE_HEADER + (size_t)page->carved * _slab_class_size(cls);
+        page->carved++;
+    }
+    if (++page->used == page->capacity) _slab_partial_unlink(sc, page);
+
+    _slab_stat_add(&pool->stats.used, _slab_class_size(cls));
+    _slab_stat_add(&pool->stats.requested, size);
+    _slab_stat_add(&pool->stats.objects, 1);
+    return p;
+}
+
+/**
+ * @brief Releases 'p' (NULL is fine), which was allocated with 'size' bytes.
+ */
+static inline void slab_free(void *p, size_t size) {
+    if (p == NULL) return;
+    if (size > SLAB_MAX_SIZE) {
+        slab_note_free(size);
+        free(p);
+        return;
+    }
+
+    slab_page_t *page = _slab_page_of(p);
+    slab_pool_t *pool = page->pool;
+    slab_class_t *sc = &pool->classes[page->cls];
+    _slab_stat_sub(&pool->stats.used, _slab_class_size(page->cls));
+    _slab_stat_sub(&pool->stats.requested, size);
+    _slab_stat_sub(&pool->stats.objects, 1);
+
+    if (page->used-- == page->capacity) _slab_partial_link(sc, page);
+    if (page->used == 0 && (page->prev || page->next)) {
+        // Another page of the class still has room: give this one back
+        _slab_partial_unlink(sc, page);
+        munmap(page, SLAB_PAGE_SIZE);
+        _slab_stat_sub(&pool->stats.pages, 1);
+        return;
+    }
+    memcpy(p, &page->free, sizeof(void *));
+    page->free = p;
+}
+
+/**
+ * @brief Resizes an object from 'old_size' to 'new_size' bytes. Stays in
+ * place when both sizes share a class.
+ * @return The object, or NULL if out of memory ('p' is then unchanged).
+ */
+static inline void *slab_realloc(void *p, size_t old_size, size_t new_size) {
+    if (p == NULL) return slab_alloc(new_size);
+    if (old_size > SLAB_MAX_SIZE && new_size > SLAB_MAX_SIZE) {
+        void *n = realloc(p, new_size);
+        if (n) {
+            slab_note_free(old_size);
+            slab_note_alloc(new_size);
+        }
+        return n;
+    }
+    if (old_size <= SLAB_MAX_SIZE && new_size <= SLAB_MAX_SIZE &&
+        _slab_class_of(old_size) == _slab_class_of(new_size)) {
+        slab_pool_t *pool = _slab_page_of(p)->pool;
+        _slab_stat_add(&pool->stats.requested, new_size);
+        _slab_stat_sub(&pool->stats.requested, old_size);
+        return p;
+    }
+
+    void *n = slab_alloc(new_size);
+    if (n == NULL) return NULL;
+    memcpy(n, p, old_size < new_size ? old_size : new_size);
+    slab_free(p, old_size);
+    return n;
+}
+
+/**
+ * @brief Sums the counters of every registered pool. Safe from any thread;
+ * the result is a consistent-enough snapshot, not an atomic one.
+ */
+static inline void slab_stats_total(slab_totals_t *out) {
+    memset(out, 0, sizeof(*out));
+    for (slab_pool_t *pool = slab_pools; pool; pool = pool->next_pool) {
+        out->pages += atomic_load_explicit(&pool->stats.pages, memory_order_relaxed);
+        out->used += atomic_load_explicit(&pool->stats.used, memory_order_relaxed);
+        out->requested += atomic_load_explicit(&pool->stats.requested, memory_order_relaxed);
+        out->objects += atomic_load_explicit(&pool->stats.objects, memory_order_relaxed);
+        out->heap += atomic_load_explicit(&pool->stats.heap, memory_order_relaxed);
+    }
+    out->reserved = out->pages * SLAB_PAGE_SIZE;
+}
+
+#endif // SLAB_H
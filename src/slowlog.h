@@ -0,0 +1,187 @@
+#ifndef SLOWLOG_H
+#define SLOWLOG_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "parser.h"
+#include "client.h"
+#include "server.h"
+#include "time_utils.h"
+
+#define SLOWLOG_ARGC_MAX 32   // Arguments kept per entry; the last one notes the rest
+#define SLOWLOG_ARG_MAX 128   // Bytes kept per argument
+#define SLOWLOG_GET_DEFAULT 10
+
+// --- Data Structures ---
+
+/**
+ * @brief One logged command. A single allocation holds the entry, its
+ * argv and the (truncated) argument bytes.
+ */
+typedef struct
+{
+    long long id;
+    long long time_s;      // Unix time it ran at
+    long long duration_us;
+    int argc;
+    resp_arg_t *argv;      // Points into data[]
+    char data[];
+} slowlog_entry_t;
+
+/**
+ * @brief Ring of the newest slowlog_max_len entries. Commands on every
+ * shard log here, so it has a lock; only commands over the threshold
+ * ever take it.
+ */
+static struct
+{
+    pthread_mutex_t lock;
+    slowlog_entry_t **ring; // slowlog_max_len slots
+    size_t head;            // Next slot to write
+    size_t count;
+    long long next_id;
+} slowlog = {PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0, 0};
+
+// --- Logging ---
+
+static inline slowlog_entry_t *_slowlog_entry_new(const resp_arg_t *argv, int argc, long long duration_us)
+{
+    int kept = argc > SLOWLOG_ARGC_MAX ? SLOWLOG_ARGC_MAX : argc;
+    char more[64];
+    size_t bytes = sizeof(more);
+    for (int i = 0; i < kept; i++)
+        bytes += (argv[i].len > SLOWLOG_ARG_MAX ? SLOWLOG_ARG_MAX + sizeof(more) : argv[i].len);
+
+    slowlog_entry_t *e = (slowlog_entry_t *)malloc(sizeof(slowlog_entry_t) + kept * sizeof(resp_arg_t) + bytes);
+    if (e == NULL)
+        return NULL;
+    e->time_s = cached_time_ms() / 1000;
+    e->duration_us = duration_us;
+    e->argc = kept;
+    e->argv = (resp_arg_t *)e->data;
+
+    char *p = e->data + kept * sizeof(resp_arg_t);
+    for (int i = 0; i < kept; i++)
+    {
+        e->argv[i].ptr = p;
+        if (i == kept - 1 && kept < argc)
+        {
+            p += snprintf(p, sizeof(more), "... (%d more arguments)", argc - kept + 1);
+        }
+        else if (argv[i].len > SLOWLOG_ARG_MAX)
+        {
+            memcpy(p, argv[i].ptr, SLOWLOG_ARG_MAX);
+            p += SLOWLOG_ARG_MAX;
+            p += snprintf(p, sizeof(more), "... (%zu more bytes)", argv[i].len - SLOWLOG_ARG_MAX);
+        }
+        else
+        {
+            memcpy(p, argv[i].ptr, argv[i].len);
+            p += argv[i].len;
+        }
+        e->argv[i].len = (size_t)(p - e->argv[i].ptr);
+    }
+    return e;
+}
+
+/**
+ * @brief Logs the command if it took at least --slowlog-log-slower-than.
+ */
+static inline void slowlog_maybe_add(const resp_arg_t *argv, int argc, long long duration_us)
+{
+    long long threshold = server.config.slowlog_slower_than;
+    if (threshold < 0 || duration_us < threshold)
+        return;
+    slowlog_entry_t *e = _slowlog_entry_new(argv, argc, duration_us);
+    if (e == NULL)
+        return;
+
+    pthread_mutex_lock(&slowlog.lock);
+    if (slowlog.ring == NULL)
+        slowlog.ring = (slowlog_entry_t **)calloc(server.config.slowlog_max_len, sizeof(slowlog_entry_t *));
+    if (slowlog.ring == NULL)
+    {
+        pthread_mutex_unlock(&slowlog.lock);
+        free(e);
+        return;
+    }
+    e->id = slowlog.next_id++;
+    free(slowlog.ring[slowlog.head]); // The oldest entry, once the ring is full
+    slowlog.ring[slowlog.head] = e;
+    slowlog.head = (slowlog.head + 1) % server.config.slowlog_max_len;
+    if (slowlog.count < server.config.slowlog_max_len)
+        slowlog.count++;
+    pthread_mutex_unlock(&slowlog.lock);
+}
+
+static inline size_t slowlog_len(void)
+{
+    pthread_mutex_lock(&slowlog.lock);
+    size_t n = slowlog.count;
+    pthread_mutex_unlock(&slowlog.lock);
+    return n;
+}
+
+// --- Command ---
+
+/**
+ * SLOWLOG GET [count] | SLOWLOG LEN | SLOWLOG RESET
+ * GET lists the newest entries first (10 by default, all with -1), each
+ * as [id, unix time, duration in us, [args]].
+ */
+static inline void handle_slowlog(redis_db_t *db, client_t *c, const resp_arg_t *argv, int argc)
+{
+    (void)db;
+    const resp_arg_t *sub = &argv[1];
+    if (resp_arg_eq_nocase(sub, "len") && argc == 2)
+    {
+        client_add_reply_integer(c, (long long)slowlog_len());
+    }
+    else if (resp_arg_eq_nocase(sub, "reset") && argc == 2)
+    {
+        pthread_mutex_lock(&slowlog.lock);
+        for (size_t i = 0; slowlog.ring && i < server.config.slowlog_max_len; i++)
+        {
+            free(slowlog.ring[i]);
+            slowlog.ring[i] = NULL;
+        }
+        slowlog.head = 0;
+        slowlog.count = 0;
+        pthread_mutex_unlock(&slowlog.lock);
+        client_add_reply_str(c, REDIS_OK);
+    }
+    else if (resp_arg_eq_nocase(sub, "get") && argc <= 3)
+    {
+        long long want = SLOWLOG_GET_DEFAULT;
+        if (argc == 3 && (string_to_ll(argv[2].ptr, argv[2].len, &want) != 0 || want < -1))
+        {
+            client_add_reply_str(c, "-ERR count should be greater than or equal to -1\r\n");
+            return;
+        }
+
+        pthread_mutex_lock(&slowlog.lock);
+        size_t n = want < 0 || (size_t)want > slowlog.count ? slowlog.count : (size_t)want;
+        size_t max = server.config.slowlog_max_len;
+        client_add_reply_array_len(c, (long long)n);
+        for (size_t i = 0; i < n; i++)
+        {
+            slowlog_entry_t *e = slowlog.ring[(slowlog.head + max - 1 - i) % max];
+            client_add_reply_array_len(c, 4);
+            client_add_reply_integer(c, e->id);
+            client_add_reply_integer(c, e->time_s);
+            client_add_reply_integer(c, e->duration_us);
+            client_add_reply_array_len(c, e->argc);
+            for (int k = 0; k < e->argc; k++)
+                client_add_reply_bulk(c, e->argv[k].ptr, e->argv[k].len);
+        }
+        pthread_mutex_unlock(&slowlog.lock);
+    }
+    else
+    {
+        client_add_reply_str(c, REDIS_SYNTAX_ERR);
+    }
+}
+
+#endif // SLOWLOG_H
@@ -2,11 +2,48 @@
 #define TIME_UTILS_H
 
 #include <sys/time.h>
+#include <time.h>
 
 long long current_time_ms(){
     struct timeval tv;
-    gettimeofday(&tv, nullptr);
+    gettimeofday(&tv, NULL);
     return ((long long)tv.tv_sec * 1000) + (tv.tv_usec / 1000);
 }
 
-#endif
\ No newline at end of file
+/**
+ * Microseconds from a clock that never jumps; use it to measure intervals.
+ */
+long long monotonic_us(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((long long)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+}
+
+// Wall and monotonic clocks sampled once per event loop iteration (per shard thread)
+static _Thread_local long long cached_ms;
+static _Thread_local long long cached_mono_us;
+
+/**
+ * Refreshes the cached clocks. Called by the event loop after every wakeup,
+ * so all commands of one iteration see the same time.
+ */
+void update_cached_time(){
+    cached_ms = current_time_ms();
+    cached_mono_us = monotonic_us();
+}
+
+/**
+ * The cached monotonic clock in us: when the current iteration woke up.
+ */
+long long cached_monotonic_us(){
+    return cached_mono_us;
+}
+
+/**
+ * The cached wall clock in ms: what expiry checks and TTLs are based on.
+ */
+long long cached_time_ms(){
+    return cached_ms;
+}
+
+#endif
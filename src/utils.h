@@ -2,24 +2,70 @@
 #define UTILS_H
 
 #include <ctype.h>
+#include <stdio.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <limits.h>
 
-int count_digits(int n)
-{
-    if (n == 0)
-        return 1;
+#define LL_STR_SIZE 21 // Longest long long: sign + 20 digits
+#define DOUBLE_STR_SIZE 32
 
-    int count = 0;
-    if (n < 0)
-        n = -n; // ignore sign
+/**
+ * Writes the decimal form of 'v' into 'dst' (no NUL terminator).
+ * Emits two digits per step from a 00..99 lookup table instead of
+ * going through printf. 'dst' needs room for LL_STR_SIZE bytes.
+ * @return Number of bytes written.
+ */
+size_t ll_to_str(char *dst, long long v)
+{
+    static const char digits[201] =
+        "0001020304050607080910111213141516171819"
+        "2021222324252627282930313233343536373839"
+        "4041424344454647484950515253545556575859"
+        "6061626364656667686970717273747576777879"
+        "8081828384858687888990919293949596979899";
 
-    while (n > 0)
+    unsigned long long u;
+    size_t neg = 0;
+    if (v < 0)
+    {
+        dst[0] = '-';
+        neg = 1;
+        u = 0 - (unsigned long long)v;
+    }
+    else
     {
-        n /= 10;
-        count++;
+        u = (unsigned long long)v;
     }
 
-    return count;
+    // Count digits first so they can be written back-to-front in place
+    size_t n = 1;
+    for (unsigned long long t = u; t >= 10; t /= 10)
+        n++;
+
+    char *p = dst + neg + n - 1;
+    while (u >= 100)
+    {
+        unsigned idx = (unsigned)(u % 100) * 2;
+        u /= 100;
+        *p-- = digits[idx + 1];
+        *p-- = digits[idx];
+    }
+    if (u < 10)
+    {
+        *p = (char)('0' + u);
+    }
+    else
+    {
+        unsigned idx = (unsigned)u * 2;
+        *p-- = digits[idx + 1];
+        *p = digits[idx];
+    }
+    return neg + n;
 }
+
 void to_lowercase(char *str)
 {
     for (int i = 0; str[i] != '\0'; i++)
@@ -27,4 +73,199 @@ void to_lowercase(char *str)
         str[i] = tolower((unsigned char)str[i]);
     }
 }
+
+/**
+ * Copies 'len' bytes into a fresh NUL-terminated buffer.
+ * The data itself may contain NULs; the terminator is only for printing.
+ */
+char *memdup_cstr(const char *src, size_t len)
+{
+    char *dst = (char *)malloc(len + 1);
+    if (dst == NULL)
+        return NULL;
+    memcpy(dst, src, len);
+    dst[len] = '\0';
+    return dst;
+}
+
+/**
+ * Byte-wise order of two binary-safe buffers; on a common prefix the
+ * shorter one sorts first.
+ */
+int memcmp_len(const char *a, size_t a_len, const char *b, size_t b_len)
+{
+    size_t n = a_len < b_len ? a_len : b_len;
+    int cmp = memcmp(a, b, n);
+    if (cmp != 0)
+        return cmp;
+    return (a_len > b_len) - (a_len < b_len);
+}
+
+/**
+ * Strictly parses a base-10 integer from a non-NUL-terminated buffer.
+ * @return 0 on success, -1 if the buffer is not a valid integer.
+ */
+int string_to_ll(const char *s, size_t len, long long *out)
+{
+    if (len == 0 || len > 20)
+        return -1;
+    size_t i = 0;
+    int neg = 0;
+    if (s[0] == '-' || s[0] == '+')
+    {
+        neg = (s[0] == '-');
+        if (++i == len)
+            return -1;
+    }
+    unsigned long long v = 0;
+    for (; i < len; i++)
+    {
+        if (s[i] < '0' || s[i] > '9')
+            return -1;
+        unsigned long long next = v * 10 + (s[i] - '0');
+        if (next / 10 != v)
+            return -1; // Overflow
+        v = next;
+    }
+    if (neg)
+    {
+        if (v > (unsigned long long)LLONG_MAX + 1)
+            return -1;
+        *out = (long long)(0 - v);
+    }
+    else
+    {
+        if (v > LLONG_MAX)
+            return -1;
+        *out = (long long)v;
+    }
+    return 0;
+}
+
+/**
+ * Parses a double from a non-NUL-terminated buffer.
+ * @return 0 on success, -1 if the buffer is not a valid number.
+ */
+int string_to_double(const char *s, size_t len, double *out)
+{
+    char tmp[128];
+    if (len == 0 || len >= sizeof(tmp))
+        return -1;
+    memcpy(tmp, s, len);
+    tmp[len] = '\0';
+    char *end;
+    double v = strtod(tmp, &end);
+    if (end != tmp + len || v != v) // Trailing junk or NaN
+        return -1;
+    *out = v;
+    return 0;
+}
+
+/**
+ * Writes the shortest decimal form of 'v' that parses back to the same
+ * double, the way Redis prints scores ("inf"/"-inf" for infinities).
+ * 'dst' needs room for DOUBLE_STR_SIZE bytes.
+ * @return Number of bytes written (NUL terminator not counted).
+ */
+size_t double_to_str(char *dst, double v)
+{
+    if (isinf(v))
+        return (size_t)snprintf(dst, DOUBLE_STR_SIZE, "%s", v > 0 ? "inf" : "-inf");
+    int n = 0;
+    for (int prec = 15; prec <= 17; prec++)
+    {
+        n = snprintf(dst, DOUBLE_STR_SIZE, "%.*g", prec, v);
+        if (strtod(dst, NULL) == v)
+            break;
+    }
+    return (size_t)n;
+}
+
+/**
+ * Glob-style match of a binary-safe string, as used by KEYS and SCAN:
+ * '*' matches any run, '?' any byte, '[abc]' or '[^a-z]' a set, and a
+ * backslash escapes the next pattern byte.
+ * @return 1 on a match, 0 otherwise.
+ */
+int string_match_len(const char *pat, size_t plen, const char *str, size_t slen)
+{
+    // Backtracks to the last '*' only, so the worst case stays O(plen * slen)
+    size_t p = 0, s = 0, star_p = (size_t)-1, star_s = 0;
+    while (s < slen)
+    {
+        if (p < plen && pat[p] == '*')
+        {
+            star_p = ++p;
+            star_s = s;
+            continue;
+        }
+        if (p < plen)
+        {
+            int matched = 0;
+            size_t next = p + 1;
+            if (pat[p] == '?')
+            {
+                matched = 1;
+            }
+            else if (pat[p] == '[')
+            {
+                size_t i = p + 1;
+                int negate = i < plen && pat[i] == '^';
+                if (negate)
+                    i++;
+                while (i < plen && pat[i] != ']')
+                {
+                    if (pat[i] == '\\' && i + 1 < plen)
+                    {
+                        i++;
+                        matched |= pat[i] == str[s];
+                    }
+                    else if (i + 2 < plen && pat[i + 1] == '-' && pat[i + 2] != ']')
+                    {
+                        unsigned char lo = (unsigned char)pat[i], hi = (unsigned char)pat[i + 2];
+                        if (lo > hi)
+                        {
+                            unsigned char t = lo;
+                            lo = hi;
+                            hi = t;
+                        }
+                        matched |= (unsigned char)str[s] >= lo && (unsigned char)str[s] <= hi;
+                        i += 2;
+                    }
+                    else
+                    {
+                        matched |= pat[i] == str[s];
+                    }
+                    i++;
+                }
+                if (negate)
+                    matched = !matched;
+                next = i < plen ? i + 1 : i; // Past the ']' (an unclosed set runs to the end)
+            }
+            else if (pat[p] == '\\' && p + 1 < plen)
+            {
+                matched = pat[p + 1] == str[s];
+                next = p + 2;
+            }
+            else
+            {
+                matched = pat[p] == str[s];
+            }
+            if (matched)
+            {
+                p = next;
+                s++;
+                continue;
+            }
+        }
+        if (star_p == (size_t)-1)
+            return 0;
+        // Let the last '*' swallow one more byte and retry from there
+        p = star_p;
+        s = ++star_s;
+    }
+    while (p < plen && pat[p] == '*')
+        p++;
+    return p == plen;
+}
 #endif
\ No newline at end of file
@@ -5,31 +5,85 @@
 #include <stdlib.h>
 #include <string.h>
 #include "uthash.h" // Assumed to be available
+#include "utils.h"  // For memcmp_len()
+#include "zset_btree.h"
+#include "slab.h"
+
+#define ZSET_MAX_HEIGHT 64 // AVL height bound for any set that fits in memory
 
 // --- Data Structures ---
 
 /**
- * @brief AVL tree node.
- * This is the ONLY data structure. It stores the data.
+ * @brief How a sorted set is stored. Both engines sit behind the same
+ * zset_* API, so they can be benchmarked against each other.
+ */
+typedef enum {
+    ZSET_ENGINE_AVL,   // One node per member, rank-augmented AVL tree
+    ZSET_ENGINE_BTREE  // Wide cache-aligned B+tree nodes (zset_btree.h)
+} zset_engine;
+
+// Engine for newly created sets (--zset-engine)
+static zset_engine zset_default_engine = ZSET_ENGINE_AVL;
+
+/**
+ * @brief One member of a sorted set.
+ * The node sits in two indexes at once: the AVL tree (ordered by score,
+ * then member) and the member dictionary ('hh', keyed by 'member').
+ * Both use the same node and the same member string.
  */
 typedef struct ZSetNode {
     double score;
     char *member; // This node *owns* this string
+    size_t member_len; // Members are binary-safe
     
     struct ZSetNode *left;
     struct ZSetNode *right;
     int height;
     size_t count; // Number of nodes in this subtree (for rank)
+
+    UT_hash_handle hh; // member -> node
 } ZSetNode;
 
 /**
- * @brief The main ZSET object
- * Now it only holds the root of the AVL tree.
+ * @brief The main ZSET object. With the AVL engine: the rank-augmented
+ * tree for ordered access plus a member dictionary for O(1) lookups by
+ * member. With the B+tree engine everything lives in 'bt'.
  */
 typedef struct {
+    zset_engine engine;
     ZSetNode *avl_root;
+    ZSetNode *dict; // uthash head
+    zbt_tree_t bt;
 } RedisZSet;
 
+/**
+ * @brief Engine-independent view of one element.
+ */
+typedef struct {
+    const char *member;
+    size_t member_len;
+    double score;
+} zset_elem_t;
+
+/**
+ * @brief In-order cursor over a sorted set.
+ * AVL nodes have no parent pointers, so the cursor keeps the path of
+ * ancestors it still has to visit; 'stack[depth - 1]' is the current
+ * node. B+tree leaves are chained, so a leaf and a slot suffice.
+ * Seeking costs O(log n) and each step is amortized O(1).
+ * The set must not be modified while a cursor is in use.
+ */
+typedef struct {
+    zset_engine engine;
+    int reverse; // Walk from high to low scores
+
+    ZSetNode *stack[ZSET_MAX_HEIGHT];
+    int depth;
+
+    zbt_leaf_t *leaf;
+    int idx;
+} zset_iter_t;
+
 
 // --- Internal AVL Tree Logic ---
 
@@ -44,10 +98,18 @@ static inline void _zset_avl_update(ZSetNode *n) {
     }
 }
 
-static inline ZSetNode* _zset_node_new(double score, const char *member) {
-    ZSetNode *node = (ZSetNode*)malloc(sizeof(ZSetNode));
+static inline ZSetNode* _zset_node_new(double score, const char *member, size_t member_len) {
+    ZSetNode *node = (ZSetNode*)slab_alloc(sizeof(ZSetNode));
+    if (node == NULL) return NULL;
     node->score = score;
-    node->member = strdup(member);
+    node->member = (char*)slab_alloc(member_len + 1);
+    if (node->member == NULL) {
+        slab_free(node, sizeof(ZSetNode));
+        return NULL;
+    }
+    memcpy(node->member, member, member_len);
+    node->member[member_len] = '\0';
+    node->member_len = member_len;
     node->left = NULL;
     node->right = NULL;
     node->height = 1;
@@ -55,12 +117,17 @@ static inline ZSetNode* _zset_node_new(double score, const char *member) {
     return node;
 }
 
-static inline int _zset_avl_cmp(double a_score, const char *a_member,
-                                double b_score, const char *b_member)
+static inline void _zset_node_free(ZSetNode *node) {
+    slab_free(node->member, node->member_len + 1);
+    slab_free(node, sizeof(ZSetNode));
+}
+
+static inline int _zset_avl_cmp(double a_score, const char *a_member, size_t a_len,
+                                double b_score, const char *b_member, size_t b_len)
 {
     if (a_score < b_score) return -1;
     if (a_score > b_score) return 1;
-    return strcmp(a_member, b_member);
+    return memcmp_len(a_member, a_len, b_member, b_len); // Byte-wise member order
 }
 
 static inline ZSetNode* _zset_avl_rotate_right(ZSetNode *y) {
@@ -93,16 +160,35 @@ static inline ZSetNode* _zset_avl_min_node(ZSetNode *node) {
 }
 
 /**
- * @brief (Internal) Recursive find-by-member. O(N)
+ * @brief (Internal) Looks a member up in the dictionary. O(1)
  */
-static inline ZSetNode* _zset_find_by_member(ZSetNode *node, const char *member) {
-    if (node == NULL) return NULL;
-    if (strcmp(node->member, member) == 0) return node;
-    
-    ZSetNode *left = _zset_find_by_member(node->left, member);
-    if (left) return left;
-    
-    return _zset_find_by_member(node->right, member);
+static inline ZSetNode* _zset_find_by_member(RedisZSet *zset, const char *member, size_t member_len) {
+    ZSetNode *node;
+    HASH_FIND(hh, zset->dict, member, member_len, node);
+    return node;
+}
+
+/**
+ * @brief (Internal) Recomputes a node's height/count and restores the
+ * AVL balance. Returns the subtree's new root.
+ */
+static inline ZSetNode* _zset_avl_rebalance(ZSetNode *node) {
+    _zset_avl_update(node);
+    int balance = _zset_avl_get_balance(node);
+
+    if (balance < -1 && _zset_avl_get_balance(node->left) <= 0) // LL
+        return _zset_avl_rotate_right(node);
+    if (balance < -1 && _zset_avl_get_balance(node->left) > 0) { // LR
+        node->left = _zset_avl_rotate_left(node->left);
+        return _zset_avl_rotate_right(node);
+    }
+    if (balance > 1 && _zset_avl_get_balance(node->right) >= 0) // RR
+        return _zset_avl_rotate_left(node);
+    if (balance > 1 && _zset_avl_get_balance(node->right) < 0) { // RL
+        node->right = _zset_avl_rotate_right(node->right);
+        return _zset_avl_rotate_left(node);
+    }
+    return node;
 }
 
 /**
@@ -113,8 +199,8 @@ static inline ZSetNode* _zset_avl_insert(ZSetNode *node, ZSetNode *new_node) {
         return new_node;
     }
 
-    int cmp = _zset_avl_cmp(new_node->score, new_node->member,
-                            node->score, node->member);
+    int cmp = _zset_avl_cmp(new_node->score, new_node->member, new_node->member_len,
+                            node->score, node->member, node->member_len);
     if (cmp < 0) {
         node->left = _zset_avl_insert(node->left, new_node);
     } else {
@@ -125,15 +211,15 @@ static inline ZSetNode* _zset_avl_insert(ZSetNode *node, ZSetNode *new_node) {
     int balance = _zset_avl_get_balance(node);
 
     // Rebalance
-    if (balance < -1 && _zset_avl_cmp(new_node->score, new_node->member, node->left->score, node->left->member) < 0) // LL
+    if (balance < -1 && _zset_avl_cmp(new_node->score, new_node->member, new_node->member_len, node->left->score, node->left->member, node->left->member_len) < 0) // LL
         return _zset_avl_rotate_right(node);
-    if (balance < -1 && _zset_avl_cmp(new_node->score, new_node->member, node->left->score, node->left->member) > 0) { // LR
+    if (balance < -1 && _zset_avl_cmp(new_node->score, new_node->member, new_node->member_len, node->left->score, node->left->member, node->left->member_len) > 0) { // LR
         node->left = _zset_avl_rotate_left(node->left);
         return _zset_avl_rotate_right(node);
     }
-    if (balance > 1 && _zset_avl_cmp(new_node->score, new_node->member, node->right->score, node->right->member) > 0) // RR
+    if (balance > 1 && _zset_avl_cmp(new_node->score, new_node->member, new_node->member_len, node->right->score, node->right->member, node->right->member_len) > 0) // RR
         return _zset_avl_rotate_left(node);
-    if (balance > 1 && _zset_avl_cmp(new_node->score, new_node->member, node->right->score, node->right->member) < 0) { // RL
+    if (balance > 1 && _zset_avl_cmp(new_node->score, new_node->member, new_node->member_len, node->right->score, node->right->member, node->right->member_len) < 0) { // RL
         node->right = _zset_avl_rotate_right(node->right);
         return _zset_avl_rotate_left(node);
     }
@@ -141,146 +227,331 @@ static inline ZSetNode* _zset_avl_insert(ZSetNode *node, ZSetNode *new_node) {
 }
 
 /**
- * @brief (Internal) Recursive remove for AVL tree
- * This is the standard, correct remove. It unlinks the node
- * and frees its memory.
+ * @brief (Internal) Detaches the leftmost node of a subtree into '*min'.
  */
-static inline ZSetNode* _zset_avl_remove(ZSetNode *node, double score, const char *member) {
-    if (node == NULL) return NULL;
+static inline ZSetNode* _zset_avl_detach_min(ZSetNode *node, ZSetNode **min) {
+    if (node->left == NULL) {
+        *min = node;
+        return node->right;
+    }
+    node->left = _zset_avl_detach_min(node->left, min);
+    return _zset_avl_rebalance(node);
+}
 
-    int cmp = _zset_avl_cmp(score, member, node->score, node->member);
+/**
+ * @brief (Internal) Recursive remove for AVL tree.
+ * Unlinks 'target' without freeing it. A node with two children is
+ * replaced by its successor node itself (relinked, not copied), so
+ * every node keeps its member and its dictionary entry stays valid.
+ */
+static inline ZSetNode* _zset_avl_unlink(ZSetNode *node, const ZSetNode *target) {
+    if (node == NULL) return NULL;
 
-    if (cmp < 0) {
-        node->left = _zset_avl_remove(node->left, score, member);
-    } else if (cmp > 0) {
-        node->right = _zset_avl_remove(node->right, score, member);
-    } else {
-        // Node found! This is the one to delete.
-        if (!node->left || !node->right) {
-            // 0 or 1 child
-            ZSetNode *temp = node->left ? node->left : node->right;
-            if (temp == NULL) { // 0 child
-                // Free this node and return NULL to its parent
-                free(node->member);
-                free(node);
-                return NULL;
-            } else { // 1 child
-                // Free this node and return its child to its parent
-                free(node->member);
-                free(node);
-                return temp;
-            }
+    if (node != target) {
+        int cmp = _zset_avl_cmp(target->score, target->member, target->member_len,
+                                node->score, node->member, node->member_len);
+        if (cmp < 0) {
+            node->left = _zset_avl_unlink(node->left, target);
         } else {
-            // 2 children
-            ZSetNode *succ = _zset_avl_min_node(node->right);
-            
-            // Copy successor's data into this node
-            free(node->member); // Free old member string
-            node->score = succ->score;
-            node->member = strdup(succ->member); // Copy new member string
-            
-            // Recursively remove the successor (which is now a duplicate)
-            node->right = _zset_avl_remove(node->right, succ->score, succ->member);
+            node->right = _zset_avl_unlink(node->right, target);
         }
+        return _zset_avl_rebalance(node);
     }
 
-    if (node == NULL) return NULL;
-    
-    _zset_avl_update(node);
-    int balance = _zset_avl_get_balance(node);
-
-    // Rebalance
-    if (balance < -1 && _zset_avl_get_balance(node->left) <= 0) // LL
-        return _zset_avl_rotate_right(node);
-    if (balance < -1 && _zset_avl_get_balance(node->left) > 0) { // LR
-        node->left = _zset_avl_rotate_left(node->left);
-        return _zset_avl_rotate_right(node);
-    }
-    if (balance > 1 && _zset_avl_get_balance(node->right) >= 0) // RR
-        return _zset_avl_rotate_left(node);
-    if (balance > 1 && _zset_avl_get_balance(node->right) < 0) { // RL
-        node->right = _zset_avl_rotate_right(node->right);
-        return _zset_avl_rotate_left(node);
+    // Node found! 0 or 1 child: its child takes its place
+    if (!node->left || !node->right) {
+        return node->left ? node->left : node->right;
     }
-    return node;
+
+    // 2 children: move the successor node into this position
+    ZSetNode *succ;
+    ZSetNode *right = _zset_avl_detach_min(node->right, &succ);
+    succ->left = node->left;
+    succ->right = right;
+    return _zset_avl_rebalance(succ);
+}
+
+static inline void _zset_node_reset_links(ZSetNode *node) {
+    node->left = NULL;
+    node->right = NULL;
+    node->height = 1;
+    node->count = 1;
 }
 
 
 // --- Public API ---
 
-static inline RedisZSet* zset_create() {
-    RedisZSet *zset = (RedisZSet*)malloc(sizeof(RedisZSet));
+static inline RedisZSet* zset_create_engine(zset_engine engine) {
+    RedisZSet *zset = (RedisZSet*)slab_alloc(sizeof(RedisZSet));
     if (zset) {
+        zset->engine = engine;
         zset->avl_root = NULL;
+        zset->dict = NULL;
+        zbt_init(&zset->bt);
     }
     return zset;
 }
 
-static inline void _zset_free_node_recursive(ZSetNode *node) {
-    if (node == NULL) return;
-    _zset_free_node_recursive(node->left);
-    _zset_free_node_recursive(node->right);
-    free(node->member);
-    free(node);
+static inline RedisZSet* zset_create() {
+    return zset_create_engine(zset_default_engine);
+}
+
+/**
+ * @brief Frees the set in slices of about '*budget' members, which it
+ * uses up; for lazy freeing (lazyfree.h). AVL nodes go without a stack:
+ * the root's left child is rotated up until the root has none, then the
+ * root is freed and its right subtree becomes the root.
+ * @return 1 once the set itself is freed, 0 if members remain.
+ */
+static inline int zset_free_step(RedisZSet *zset, size_t *budget) {
+    if (zset->engine == ZSET_ENGINE_BTREE) {
+        if (!zbt_free_step(&zset->bt, budget)) return 0;
+    } else {
+        HASH_CLEAR(hh, zset->dict); // Frees the table; the nodes go below
+        ZSetNode *node = zset->avl_root;
+        while (node && *budget > 0) {
+            if (node->left) {
+                ZSetNode *left = node->left;
+                node->left = left->right;
+                left->right = node;
+                node = left;
+            } else {
+                ZSetNode *right = node->right;
+                _zset_node_free(node);
+                node = right;
+                (*budget)--;
+            }
+        }
+        zset->avl_root = node;
+        if (node) return 0;
+    }
+    slab_free(zset, sizeof(RedisZSet));
+    return 1;
 }
 
 static inline void zset_free(RedisZSet *zset) {
     if (zset == NULL) return;
-    _zset_free_node_recursive(zset->avl_root);
-    free(zset);
+    size_t budget = SIZE_MAX;
+    zset_free_step(zset, &budget);
+}
+
+static inline size_t zset_length(const RedisZSet *zset) {
+    if (zset->engine == ZSET_ENGINE_BTREE) return zset->bt.length;
+    return _zset_avl_count(zset->avl_root);
 }
 
 /**
- * @brief (Corrected) Adds/Updates a member in the Sorted Set.
- * @return 1 if a new element was added, 0 if updated.
+ * @brief Adds/Updates a member in the Sorted Set.
+ * An update relinks the existing node at its new score; the member
+ * string is never copied again.
+ * @return 1 if a new element was added, 0 if updated, -1 out of memory.
  */
-static inline int zset_add(RedisZSet *zset, double score, char *member) {
-    // 1. Find the old node (O(N) search)
-    ZSetNode *old_node = _zset_find_by_member(zset->avl_root, member);
-    int added = 1;
-    
-    if (old_node) {
-        if (old_node->score == score) return 0; // No change
-        
-        // Remove the old node (this frees its memory)
-        zset->avl_root = _zset_avl_remove(zset->avl_root, old_node->score, old_node->member);
-        added = 0; // It's an update
+static inline int zset_add(RedisZSet *zset, double score, const char *member, size_t member_len) {
+    if (zset->engine == ZSET_ENGINE_BTREE) return zbt_add(&zset->bt, score, member, member_len);
+
+    ZSetNode *node = _zset_find_by_member(zset, member, member_len);
+
+    if (node) {
+        if (node->score == score) return 0; // No change
+        zset->avl_root = _zset_avl_unlink(zset->avl_root, node);
+        node->score = score;
+        _zset_node_reset_links(node);
+        zset->avl_root = _zset_avl_insert(zset->avl_root, node);
+        return 0; // It's an update
     }
-    
-    // 2. Add the new node
-    ZSetNode *new_node = _zset_node_new(score, member);
-    zset->avl_root = _zset_avl_insert(zset->avl_root, new_node);
-    return added;
+
+    node = _zset_node_new(score, member, member_len);
+    if (node == NULL) return -1;
+    zset->avl_root = _zset_avl_insert(zset->avl_root, node);
+    HASH_ADD_KEYPTR(hh, zset->dict, node->member, node->member_len, node);
+    return 1;
+}
+
+// --- Bulk Load ---
+
+/**
+ * @brief Builds a sorted set from elements arriving in ascending (score,
+ * member) order, as a snapshot stores them. Elements are only collected
+ * (and indexed by member) as they come; the tree goes up bottom-up in
+ * zset_builder_finish(), perfectly balanced for AVL or with evenly
+ * filled nodes for the B+tree, so no element pays a search or rotation.
+ */
+typedef struct {
+    RedisZSet *zset;
+    void **items; // ZSetNode * or zbt_member_t *, in order
+    size_t n;
+    size_t cap;
+} zset_builder_t;
+
+/**
+ * @brief Starts a set of the default engine for about 'count' elements.
+ * @return 0 on success, -1 out of memory.
+ */
+static inline int zset_builder_init(zset_builder_t *b, size_t count) {
+    b->n = 0;
+    b->cap = count ? count : 16;
+    b->items = NULL;
+    b->zset = zset_create();
+    if (b->zset == NULL) return -1;
+    b->items = (void **)malloc(b->cap * sizeof(void *));
+    if (b->items == NULL) {
+        zset_free(b->zset);
+        b->zset = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @return 0 on success, -1 out of memory, -2 if the element does not sort
+ * after the previous one or its member is already in the set.
+ */
+static inline int zset_builder_add(zset_builder_t *b, double score, const char *member, size_t member_len) {
+    RedisZSet *zset = b->zset;
+    if (b->n == b->cap) {
+        void **items = (void **)realloc(b->items, b->cap * 2 * sizeof(void *));
+        if (items == NULL) return -1;
+        b->items = items;
+        b->cap *= 2;
+    }
+
+    if (zset->engine == ZSET_ENGINE_BTREE) {
+        zbt_member_t *last = b->n ? (zbt_member_t *)b->items[b->n - 1] : NULL;
+        if (last && _zset_avl_cmp(last->score, last->data, last->len, score, member, member_len) >= 0) return -2;
+        if (zbt_find(&zset->bt, member, member_len)) return -2;
+        zbt_member_t *m = _zbt_member_new(score, member, member_len);
+        if (m == NULL) return -1;
+        HASH_ADD_KEYPTR(hh, zset->bt.dict, m->data, m->len, m);
+        zset->bt.length++;
+        b->items[b->n++] = m;
+        return 0;
+    }
+
+    ZSetNode *last = b->n ? (ZSetNode *)b->items[b->n - 1] : NULL;
+    if (last && _zset_avl_cmp(last->score, last->member, last->member_len, score, member, member_len) >= 0) return -2;
+    if (_zset_find_by_member(zset, member, member_len)) return -2;
+    ZSetNode *node = _zset_node_new(score, member, member_len);
+    if (node == NULL) return -1;
+    HASH_ADD_KEYPTR(hh, zset->dict, node->member, node->member_len, node);
+    b->items[b->n++] = node;
+    return 0;
+}
+
+/**
+ * @brief Frees the set being built and everything added to it.
+ */
+static inline void zset_builder_discard(zset_builder_t *b) {
+    RedisZSet *zset = b->zset;
+    if (zset->engine == ZSET_ENGINE_BTREE) {
+        HASH_CLEAR(hh, zset->bt.dict);
+        for (size_t i = 0; i < b->n; i++) _zbt_member_free((zbt_member_t *)b->items[i]);
+    } else {
+        HASH_CLEAR(hh, zset->dict);
+        for (size_t i = 0; i < b->n; i++) _zset_node_free((ZSetNode *)b->items[i]);
+    }
+    zbt_init(&zset->bt);
+    zset->avl_root = NULL;
+    zset_free(zset);
+    free(b->items);
+    b->zset = NULL;
+    b->items = NULL;
+}
+
+/**
+ * @brief (Internal) The balanced tree over 'nodes[0, n)', in order.
+ */
+static inline ZSetNode *_zset_avl_build(ZSetNode **nodes, size_t n) {
+    if (n == 0) return NULL;
+    size_t mid = n / 2;
+    ZSetNode *root = nodes[mid];
+    root->left = _zset_avl_build(nodes, mid);
+    root->right = _zset_avl_build(nodes + mid + 1, n - mid - 1);
+    _zset_avl_update(root);
+    return root;
+}
+
+/**
+ * @return The finished set, or NULL if out of memory (everything is freed).
+ */
+static inline RedisZSet *zset_builder_finish(zset_builder_t *b) {
+    RedisZSet *zset = b->zset;
+    if (zset->engine == ZSET_ENGINE_BTREE) {
+        if (zbt_build(&zset->bt, (zbt_member_t **)b->items, b->n) != 0) {
+            zset_builder_discard(b);
+            return NULL;
+        }
+    } else {
+        zset->avl_root = _zset_avl_build((ZSetNode **)b->items, b->n);
+    }
+    free(b->items);
+    b->zset = NULL;
+    b->items = NULL;
+    return zset;
 }
 
 /**
- * @brief (Corrected) Removes a member from the Sorted Set.
+ * @brief Removes a member from the Sorted Set.
  * @return 1 if removed, 0 if not found.
  */
-static inline int zset_remove(RedisZSet *zset, char *member) {
-    // 1. Find the node (O(N) search)
-    ZSetNode *node = _zset_find_by_member(zset->avl_root, member);
-    
+static inline int zset_remove(RedisZSet *zset, const char *member, size_t member_len) {
+    if (zset->engine == ZSET_ENGINE_BTREE) return zbt_remove(&zset->bt, member, member_len);
+
+    ZSetNode *node = _zset_find_by_member(zset, member, member_len);
     if (node == NULL) {
         return 0; // Not found
     }
-    
-    // 2. Remove it (this also frees its memory)
-    zset->avl_root = _zset_avl_remove(zset->avl_root, node->score, node->member);
-    
+
+    HASH_DEL(zset->dict, node);
+    zset->avl_root = _zset_avl_unlink(zset->avl_root, node);
+    _zset_node_free(node);
     return 1;
 }
 
-static inline ZSetNode* zset_get_by_rank(RedisZSet *zset, size_t rank) {
-    if (zset == NULL || rank >= _zset_avl_count(zset->avl_root)) {
-        return NULL; // Out of bounds
+/**
+ * @brief Looks up the score of 'member'.
+ * @return 1 if found (score stored in '*score'), 0 otherwise.
+ */
+static inline int zset_score(RedisZSet *zset, const char *member, size_t member_len, double *score) {
+    if (zset->engine == ZSET_ENGINE_BTREE) {
+        zbt_member_t *m = zbt_find(&zset->bt, member, member_len);
+        if (m == NULL) return 0;
+        *score = m->score;
+        return 1;
+    }
+
+    ZSetNode *node = _zset_find_by_member(zset, member, member_len);
+    if (node == NULL) return 0;
+    *score = node->score;
+    return 1;
+}
+
+/**
+ * @brief Fetches the element at 'rank' (0 = lowest score).
+ * @return 1 on success, 0 if 'rank' is out of range.
+ */
+static inline int zset_get_by_rank(RedisZSet *zset, size_t rank, zset_elem_t *out) {
+    if (zset == NULL || rank >= zset_length(zset)) {
+        return 0; // Out of bounds
+    }
+
+    if (zset->engine == ZSET_ENGINE_BTREE) {
+        int idx;
+        zbt_leaf_t *leaf = zbt_seek_rank(&zset->bt, rank, &idx);
+        zbt_member_t *m = leaf->pairs[idx].m;
+        out->member = m->data;
+        out->member_len = m->len;
+        out->score = m->score;
+        return 1;
     }
 
     ZSetNode *node = zset->avl_root;
     while (node) {
         size_t left_count = _zset_avl_count(node->left);
         if (rank == left_count) {
-            return node;
+            out->member = node->member;
+            out->member_len = node->member_len;
+            out->score = node->score;
+            return 1;
         }
         if (rank < left_count) {
             node = node->left;
@@ -289,7 +560,134 @@ static inline ZSetNode* zset_get_by_rank(RedisZSet *zset, size_t rank) {
             rank = rank - left_count - 1;
         }
     }
-    return NULL;
+    return 0;
+}
+
+/**
+ * @brief 0-based position of 'member' in score order.
+ * @return 1 if found (rank stored in '*rank'), 0 otherwise.
+ */
+static inline int zset_rank(RedisZSet *zset, const char *member, size_t member_len, size_t *rank) {
+    if (zset->engine == ZSET_ENGINE_BTREE) return zbt_rank(&zset->bt, member, member_len, rank);
+
+    ZSetNode *target = _zset_find_by_member(zset, member, member_len);
+    if (target == NULL) return 0;
+
+    size_t r = 0;
+    ZSetNode *node = zset->avl_root;
+    while (node != target) {
+        int cmp = _zset_avl_cmp(target->score, target->member, target->member_len,
+                                node->score, node->member, node->member_len);
+        if (cmp < 0) {
+            node = node->left;
+        } else {
+            r += _zset_avl_count(node->left) + 1;
+            node = node->right;
+        }
+    }
+    *rank = r + _zset_avl_count(target->left);
+    return 1;
+}
+
+/**
+ * @brief Number of members whose score is below 'score' (or at most
+ * 'score' with 'inclusive'). The members with scores in a range are then
+ * the ranks [count_below(min), count_below(max, inclusive)).
+ */
+static inline size_t zset_count_below(RedisZSet *zset, double score, int inclusive) {
+    if (zset->engine == ZSET_ENGINE_BTREE) return zbt_count_below(&zset->bt, score, inclusive);
+
+    size_t n = 0;
+    ZSetNode *node = zset->avl_root;
+    while (node) {
+        if (node->score < score || (inclusive && node->score == score)) {
+            n += _zset_avl_count(node->left) + 1;
+            node = node->right;
+        } else {
+            node = node->left;
+        }
+    }
+    return n;
+}
+
+// --- Iteration ---
+
+/**
+ * @brief (Internal) Pushes 'node' and its chain of first-visited
+ * descendants (leftmost forwards, rightmost in reverse).
+ */
+static inline void _zset_iter_push_chain(zset_iter_t *it, ZSetNode *node) {
+    while (node) {
+        it->stack[it->depth++] = node;
+        node = it->reverse ? node->right : node->left;
+    }
+}
+
+/**
+ * @brief Positions 'it' on the element 'rank' steps from the start of the
+ * walk: rank 0 is the lowest score forwards, the highest in reverse.
+ * Afterwards zset_iter_next() returns that element first.
+ */
+static inline void zset_iter_seek_rank(zset_iter_t *it, RedisZSet *zset, size_t rank, int reverse) {
+    it->engine = zset->engine;
+    it->depth = 0;
+    it->reverse = reverse;
+    it->leaf = NULL;
+
+    if (zset->engine == ZSET_ENGINE_BTREE) {
+        size_t len = zset->bt.length;
+        if (rank < len) it->leaf = zbt_seek_rank(&zset->bt, reverse ? len - 1 - rank : rank, &it->idx);
+        return;
+    }
+
+    ZSetNode *node = zset->avl_root;
+    while (node) {
+        ZSetNode *near = reverse ? node->right : node->left; // Visited before 'node'
+        ZSetNode *far = reverse ? node->left : node->right;
+        size_t before = _zset_avl_count(near);
+        if (rank < before) {
+            it->stack[it->depth++] = node; // Still to visit, after 'near'
+            node = near;
+        } else if (rank == before) {
+            it->stack[it->depth++] = node;
+            return;
+        } else {
+            rank -= before + 1;
+            node = far;
+        }
+    }
+}
+
+/**
+ * @brief Steps the cursor.
+ * @return 1 with the next element in '*out', 0 when the walk is exhausted.
+ */
+static inline int zset_iter_next(zset_iter_t *it, zset_elem_t *out) {
+    if (it->engine == ZSET_ENGINE_BTREE) {
+        if (it->leaf == NULL) return 0;
+        zbt_member_t *m = it->leaf->pairs[it->idx].m;
+        out->member = m->data;
+        out->member_len = m->len;
+        out->score = m->score;
+        if (it->reverse) {
+            if (--it->idx < 0) {
+                it->leaf = it->leaf->prev;
+                if (it->leaf) it->idx = it->leaf->hdr.n - 1;
+            }
+        } else if (++it->idx == it->leaf->hdr.n) {
+            it->leaf = it->leaf->next;
+            it->idx = 0;
+        }
+        return 1;
+    }
+
+    if (it->depth == 0) return 0;
+    ZSetNode *node = it->stack[--it->depth];
+    _zset_iter_push_chain(it, it->reverse ? node->left : node->right);
+    out->member = node->member;
+    out->member_len = node->member_len;
+    out->score = node->score;
+    return 1;
 }
 
-#endif // ZSET_H
\ No newline at end of file
+#endif // ZSET_H
@@ -0,0 +1,672 @@
+#ifndef ZSET_BTREE_H
+#define ZSET_BTREE_H
+
+#include <stdlib.h>
+#include <string.h>
+#include "uthash.h"
+#include "utils.h" // For memcmp_len()
+#include "slab.h"
+
+/**
+ * B+tree engine for sorted sets.
+ *
+ * Elements live only in the leaves, as contiguous (score, member) pairs;
+ * the score sits next to the member pointer so most comparisons never
+ * leave the node. Inner nodes keep, per child, a lower bound on its keys
+ * (always a copy of one of its elements) and the number of elements below
+ * it, which gives O(log n) rank queries.
+ * Leaves are chained both ways for O(1) in-order steps. Nodes are sized
+ * to whole cache lines (about 1KB) and allocated cache-line aligned.
+ */
+
+#define ZBT_NODE_ALIGN 64
+#define ZBT_LEAF_CAP 62  // Pairs per leaf: 24 + 62 * 16 = 1016 bytes
+#define ZBT_INNER_CAP 31 // Children per inner node: 8 + 31 * 32 = 1000 bytes
+#define ZBT_LEAF_MIN (ZBT_LEAF_CAP / 3)   // Below this a leaf is merged/refilled
+#define ZBT_INNER_MIN (ZBT_INNER_CAP / 3)
+
+// --- Data Structures ---
+
+/**
+ * @brief One member. It is the member dictionary entry, and the leaves
+ * point at it, so the member bytes exist exactly once.
+ */
+typedef struct zbt_member {
+    double score;
+    size_t len;
+    UT_hash_handle hh; // member -> score
+    char data[];       // NUL-terminated for printing; 'len' is authoritative
+} zbt_member_t;
+
+typedef struct {
+    double score;
+    zbt_member_t *m;
+} zbt_pair_t;
+
+/**
+ * @brief Header shared by both node kinds.
+ */
+typedef struct zbt_node {
+    int leaf;
+    int n; // Pairs in a leaf, children in an inner node
+} zbt_node_t;
+
+typedef struct zbt_leaf {
+    zbt_node_t hdr;
+    struct zbt_leaf *prev;
+    struct zbt_leaf *next;
+    zbt_pair_t pairs[ZBT_LEAF_CAP]; // Sorted by (score, member)
+} zbt_leaf_t;
+
+typedef struct zbt_inner {
+    zbt_node_t hdr;
+    zbt_pair_t keys[ZBT_INNER_CAP];   // keys[i] <= every key under child[i], > every key before it
+    size_t counts[ZBT_INNER_CAP];     // Elements under child[i]
+    zbt_node_t *child[ZBT_INNER_CAP];
+} zbt_inner_t;
+
+typedef struct {
+    zbt_node_t *root; // NULL when empty
+    zbt_member_t *dict;
+    size_t length;
+} zbt_tree_t;
+
+// --- Internal Helpers ---
+
+static inline size_t _zbt_alloc_size(size_t size) {
+    return (size + ZBT_NODE_ALIGN - 1) & ~(size_t)(ZBT_NODE_ALIGN - 1);
+}
+
+// Nodes need cache-line alignment, so they come from malloc() and are only
+// accounted to the slab pool
+static inline void *_zbt_alloc(size_t size) {
+    void *p = aligned_alloc(ZBT_NODE_ALIGN, _zbt_alloc_size(size));
+    if (p) slab_note_alloc(_zbt_alloc_size(size));
+    return p;
+}
+
+static inline void _zbt_node_free(zbt_node_t *node) {
+    if (node == NULL) return;
+    slab_note_free(_zbt_alloc_size(node->leaf ? sizeof(zbt_leaf_t) : sizeof(zbt_inner_t)));
+    free(node);
+}
+
+static inline zbt_leaf_t *_zbt_leaf_new(void) {
+    zbt_leaf_t *l = (zbt_leaf_t *)_zbt_alloc(sizeof(zbt_leaf_t));
+    if (l) {
+        l->hdr.leaf = 1;
+        l->hdr.n = 0;
+        l->prev = l->next = NULL;
+    }
+    return l;
+}
+
+static inline zbt_inner_t *_zbt_inner_new(void) {
+    zbt_inner_t *in = (zbt_inner_t *)_zbt_alloc(sizeof(zbt_inner_t));
+    if (in) {
+        in->hdr.leaf = 0;
+        in->hdr.n = 0;
+    }
+    return in;
+}
+
+/**
+ * @brief (score, member) order; 'm' is compared by identity first.
+ */
+static inline int _zbt_cmp(double score, const zbt_member_t *m, const zbt_pair_t *p) {
+    if (score < p->score) return -1;
+    if (score > p->score) return 1;
+    if (m == p->m) return 0;
+    return memcmp_len(m->data, m->len, p->m->data, p->m->len);
+}
+
+static inline size_t _zbt_size(const zbt_node_t *node) {
+    if (node->leaf) return (size_t)node->n;
+    const zbt_inner_t *in = (const zbt_inner_t *)node;
+    size_t total = 0;
+    for (int i = 0; i < in->hdr.n; i++) total += in->counts[i];
+    return total;
+}
+
+/**
+ * @brief A lower bound on the keys of 'node' (its routing key).
+ */
+static inline zbt_pair_t _zbt_min_key(const zbt_node_t *node) {
+    return node->leaf ? ((const zbt_leaf_t *)node)->pairs[0] : ((const zbt_inner_t *)node)->keys[0];
+}
+
+/**
+ * @brief First leaf position whose pair is >= (score, m).
+ */
+static inline int _zbt_leaf_lower_bound(const zbt_leaf_t *l, double score, const zbt_member_t *m) {
+    int lo = 0, hi = l->hdr.n;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (_zbt_cmp(score, m, &l->pairs[mid]) > 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+/**
+ * @brief Child of 'in' whose range covers (score, m): the last child
+ * whose lower bound is <= the key, or child 0.
+ */
+static inline int _zbt_child_for(const zbt_inner_t *in, double score, const zbt_member_t *m) {
+    int lo = 1, hi = in->hdr.n; // Find the first key > (score, m) in keys[1..n)
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (_zbt_cmp(score, m, &in->keys[mid]) >= 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo - 1;
+}
+
+static inline void _zbt_inner_insert_at(zbt_inner_t *in, int pos, zbt_pair_t key, zbt_node_t *child, size_t count) {
+    int move = in->hdr.n - pos;
+    memmove(&in->keys[pos + 1], &in->keys[pos], move * sizeof(zbt_pair_t));
+    memmove(&in->counts[pos + 1], &in->counts[pos], move * sizeof(size_t));
+    memmove(&in->child[pos + 1], &in->child[pos], move * sizeof(zbt_node_t *));
+    in->keys[pos] = key;
+    in->counts[pos] = count;
+    in->child[pos] = child;
+    in->hdr.n++;
+}
+
+static inline void _zbt_inner_remove_at(zbt_inner_t *in, int pos) {
+    int move = in->hdr.n - pos - 1;
+    memmove(&in->keys[pos], &in->keys[pos + 1], move * sizeof(zbt_pair_t));
+    memmove(&in->counts[pos], &in->counts[pos + 1], move * sizeof(size_t));
+    memmove(&in->child[pos], &in->child[pos + 1], move * sizeof(zbt_node_t *));
+    in->hdr.n--;
+}
+
+// --- Insert ---
+
+/**
+ * @brief (Internal) Inserts 'key' below 'node'.
+ * @return The new right sibling if 'node' had to split (the caller links
+ * it in), NULL otherwise. Sets '*oom' if a split could not allocate.
+ */
+static inline zbt_node_t *_zbt_insert(zbt_node_t *node, zbt_pair_t key, int *oom) {
+    if (node->leaf) {
+        zbt_leaf_t *l = (zbt_leaf_t *)node;
+        int pos = _zbt_leaf_lower_bound(l, key.score, key.m);
+        if (l->hdr.n < ZBT_LEAF_CAP) {
+            memmove(&l->pairs[pos + 1], &l->pairs[pos], (l->hdr.n - pos) * sizeof(zbt_pair_t));
+            l->pairs[pos] = key;
+            l->hdr.n++;
+            return NULL;
+        }
+
+        // Full: move the upper half to a new leaf, then insert
+        zbt_leaf_t *r = _zbt_leaf_new();
+        if (r == NULL) {
+            *oom = 1;
+            return NULL;
+        }
+        int mid = ZBT_LEAF_CAP / 2;
+        r->hdr.n = ZBT_LEAF_CAP - mid;
+        memcpy(r->pairs, &l->pairs[mid], r->hdr.n * sizeof(zbt_pair_t));
+        l->hdr.n = mid;
+        r->next = l->next;
+        if (r->next) r->next->prev = r;
+        r->prev = l;
+        l->next = r;
+
+        zbt_leaf_t *dst = pos <= mid ? l : r;
+        if (dst == r) pos -= mid;
+        memmove(&dst->pairs[pos + 1], &dst->pairs[pos], (dst->hdr.n - pos) * sizeof(zbt_pair_t));
+        dst->pairs[pos] = key;
+        dst->hdr.n++;
+        return &r->hdr;
+    }
+
+    zbt_inner_t *in = (zbt_inner_t *)node;
+    int i = _zbt_child_for(in, key.score, key.m);
+    if (_zbt_cmp(key.score, key.m, &in->keys[i]) < 0)
+        in->keys[i] = key; // New minimum: keep keys[i] a lower bound
+
+    // Allocate up front: once the child has split, linking it can't fail
+    zbt_inner_t *r = NULL;
+    if (in->hdr.n == ZBT_INNER_CAP && (r = _zbt_inner_new()) == NULL) {
+        *oom = 1;
+        return NULL;
+    }
+
+    zbt_node_t *split = _zbt_insert(in->child[i], key, oom);
+    if (*oom || split == NULL) {
+        _zbt_node_free((zbt_node_t *)r);
+        if (!*oom) in->counts[i]++;
+        return NULL;
+    }
+
+    size_t split_count = _zbt_size(split);
+    in->counts[i] = in->counts[i] + 1 - split_count;
+    zbt_pair_t split_key = _zbt_min_key(split);
+    if (r == NULL) {
+        _zbt_inner_insert_at(in, i + 1, split_key, split, split_count);
+        return NULL;
+    }
+
+    // Full: move the upper half of the children to the new inner node
+    int mid = ZBT_INNER_CAP / 2;
+    r->hdr.n = ZBT_INNER_CAP - mid;
+    memcpy(r->keys, &in->keys[mid], r->hdr.n * sizeof(zbt_pair_t));
+    memcpy(r->counts, &in->counts[mid], r->hdr.n * sizeof(size_t));
+    memcpy(r->child, &in->child[mid], r->hdr.n * sizeof(zbt_node_t *));
+    in->hdr.n = mid;
+    if (i + 1 <= mid) _zbt_inner_insert_at(in, i + 1, split_key, split, split_count);
+    else _zbt_inner_insert_at(r, i + 1 - mid, split_key, split, split_count);
+    return &r->hdr;
+}
+
+/**
+ * @return 0 on success, -1 out of memory.
+ */
+static inline int _zbt_tree_insert(zbt_tree_t *t, zbt_pair_t key) {
+    if (t->root == NULL) {
+        zbt_leaf_t *l = _zbt_leaf_new();
+        if (l == NULL) return -1;
+        t->root = &l->hdr;
+    }
+
+    // A full root may split; have the new root ready before touching anything
+    zbt_inner_t *root = NULL;
+    if (t->root->n == (t->root->leaf ? ZBT_LEAF_CAP : ZBT_INNER_CAP) && (root = _zbt_inner_new()) == NULL)
+        return -1;
+
+    int oom = 0;
+    zbt_node_t *split = _zbt_insert(t->root, key, &oom);
+    if (oom || split == NULL) {
+        _zbt_node_free((zbt_node_t *)root);
+        return oom ? -1 : 0;
+    }
+    _zbt_inner_insert_at(root, 0, _zbt_min_key(t->root), t->root, _zbt_size(t->root));
+    _zbt_inner_insert_at(root, 1, _zbt_min_key(split), split, _zbt_size(split));
+    t->root = &root->hdr;
+    return 0;
+}
+
+// --- Delete ---
+
+/**
+ * @brief (Internal) Merges or refills the underfull child 'i' of 'in'
+ * with a neighbour.
+ */
+static inline void _zbt_fix_child(zbt_inner_t *in, int i) {
+    if (in->hdr.n < 2) return; // The root; collapsed by the caller
+    int li = i > 0 ? i - 1 : i;
+    int ri = li + 1;
+
+    if (in->child[li]->leaf) {
+        zbt_leaf_t *l = (zbt_leaf_t *)in->child[li];
+        zbt_leaf_t *r = (zbt_leaf_t *)in->child[ri];
+        int total = l->hdr.n + r->hdr.n;
+        if (total <= ZBT_LEAF_CAP) {
+            memcpy(&l->pairs[l->hdr.n], r->pairs, r->hdr.n * sizeof(zbt_pair_t));
+            l->hdr.n = total;
+            l->next = r->next;
+            if (l->next) l->next->prev = l;
+            in->counts[li] = total;
+            in->keys[li] = l->pairs[0]; // 'l' may have been the empty one
+            _zbt_inner_remove_at(in, ri);
+            _zbt_node_free(&r->hdr);
+            return;
+        }
+        int want = total / 2; // New size of 'l'
+        if (l->hdr.n > want) {
+            int k = l->hdr.n - want;
+            memmove(&r->pairs[k], r->pairs, r->hdr.n * sizeof(zbt_pair_t));
+            memcpy(r->pairs, &l->pairs[want], k * sizeof(zbt_pair_t));
+        } else {
+            int k = want - l->hdr.n;
+            memcpy(&l->pairs[l->hdr.n], r->pairs, k * sizeof(zbt_pair_t));
+            memmove(r->pairs, &r->pairs[k], (r->hdr.n - k) * sizeof(zbt_pair_t));
+        }
+        l->hdr.n = want;
+        r->hdr.n = total - want;
+        in->counts[li] = l->hdr.n;
+        in->counts[ri] = r->hdr.n;
+        in->keys[li] = l->pairs[0];
+        in->keys[ri] = r->pairs[0];
+        return;
+    }
+
+    zbt_inner_t *l = (zbt_inner_t *)in->child[li];
+    zbt_inner_t *r = (zbt_inner_t *)in->child[ri];
+    int total = l->hdr.n + r->hdr.n;
+    if (total <= ZBT_INNER_CAP) {
+        memcpy(&l->keys[l->hdr.n], r->keys, r->hdr.n * sizeof(zbt_pair_t));
+        memcpy(&l->counts[l->hdr.n], r->counts, r->hdr.n * sizeof(size_t));
+        memcpy(&l->child[l->hdr.n], r->child, r->hdr.n * sizeof(zbt_node_t *));
+        l->hdr.n = total;
+        in->counts[li] += in->counts[ri];
+        in->keys[li] = l->keys[0];
+        _zbt_inner_remove_at(in, ri);
+        _zbt_node_free(&r->hdr);
+        return;
+    }
+    int want = total / 2;
+    if (l->hdr.n > want) {
+        int k = l->hdr.n - want;
+        memmove(&r->keys[k], r->keys, r->hdr.n * sizeof(zbt_pair_t));
+        memmove(&r->counts[k], r->counts, r->hdr.n * sizeof(size_t));
+        memmove(&r->child[k], r->child, r->hdr.n * sizeof(zbt_node_t *));
+        memcpy(r->keys, &l->keys[want], k * sizeof(zbt_pair_t));
+        memcpy(r->counts, &l->counts[want], k * sizeof(size_t));
+        memcpy(r->child, &l->child[want], k * sizeof(zbt_node_t *));
+    } else {
+        int k = want - l->hdr.n;
+        memcpy(&l->keys[l->hdr.n], r->keys, k * sizeof(zbt_pair_t));
+        memcpy(&l->counts[l->hdr.n], r->counts, k * sizeof(size_t));
+        memcpy(&l->child[l->hdr.n], r->child, k * sizeof(zbt_node_t *));
+        memmove(r->keys, &r->keys[k], (r->hdr.n - k) * sizeof(zbt_pair_t));
+        memmove(r->counts, &r->counts[k], (r->hdr.n - k) * sizeof(size_t));
+        memmove(r->child, &r->child[k], (r->hdr.n - k) * sizeof(zbt_node_t *));
+    }
+    l->hdr.n = want;
+    r->hdr.n = total - want;
+    in->counts[li] = _zbt_size(&l->hdr);
+    in->counts[ri] = _zbt_size(&r->hdr);
+    in->keys[li] = l->keys[0];
+    in->keys[ri] = r->keys[0];
+}
+
+/**
+ * @brief (Internal) Removes the pair (score, m) below 'node'.
+ * @return 1 if it was found.
+ */
+static inline int _zbt_delete(zbt_node_t *node, double score, const zbt_member_t *m) {
+    if (node->leaf) {
+        zbt_leaf_t *l = (zbt_leaf_t *)node;
+        int pos = _zbt_leaf_lower_bound(l, score, m);
+        if (pos >= l->hdr.n || l->pairs[pos].m != m) return 0;
+        memmove(&l->pairs[pos], &l->pairs[pos + 1], (l->hdr.n - pos - 1) * sizeof(zbt_pair_t));
+        l->hdr.n--;
+        return 1;
+    }
+
+    zbt_inner_t *in = (zbt_inner_t *)node;
+    int i = _zbt_child_for(in, score, m);
+    if (!_zbt_delete(in->child[i], score, m)) return 0;
+    in->counts[i]--;
+    zbt_node_t *c = in->child[i];
+    // Bounds are copies of real elements; never keep one pointing at 'm'
+    if (c->n > 0 && in->keys[i].m == m)
+        in->keys[i] = _zbt_min_key(c);
+    if (c->n < (c->leaf ? ZBT_LEAF_MIN : ZBT_INNER_MIN))
+        _zbt_fix_child(in, i);
+    return 1;
+}
+
+static inline void _zbt_tree_delete(zbt_tree_t *t, double score, const zbt_member_t *m) {
+    if (t->root == NULL || !_zbt_delete(t->root, score, m)) return;
+
+    // Shrink the tree from the top
+    while (!t->root->leaf && t->root->n == 1) {
+        zbt_node_t *old = t->root;
+        t->root = ((zbt_inner_t *)old)->child[0];
+        _zbt_node_free(old);
+    }
+    if (t->root->leaf && t->root->n == 0) {
+        _zbt_node_free(t->root);
+        t->root = NULL;
+    }
+}
+
+// --- Public API ---
+
+static inline void zbt_init(zbt_tree_t *t) {
+    t->root = NULL;
+    t->dict = NULL;
+    t->length = 0;
+}
+
+/**
+ * @return A member in no index yet, or NULL if out of memory.
+ */
+static inline zbt_member_t *_zbt_member_new(double score, const char *member, size_t member_len) {
+    zbt_member_t *m = (zbt_member_t *)slab_alloc(sizeof(zbt_member_t) + member_len + 1);
+    if (m == NULL) return NULL;
+    m->score = score;
+    m->len = member_len;
+    memcpy(m->data, member, member_len);
+    m->data[member_len] = '\0';
+    return m;
+}
+
+static inline void _zbt_member_free(zbt_member_t *m) {
+    slab_free(m, sizeof(zbt_member_t) + m->len + 1);
+}
+
+/**
+ * @brief Frees the tree in slices of about '*budget' members, which it
+ * uses up. Each pass walks the rightmost path down from the root (a few
+ * levels) and frees the leaf, or inner node emptied earlier, at its end.
+ * @return 1 once the tree is empty (and reinitialized), 0 if nodes remain.
+ */
+static inline int zbt_free_step(zbt_tree_t *t, size_t *budget) {
+    HASH_CLEAR(hh, t->dict); // Frees the table; members go with the leaves
+    while (t->root && *budget > 0) {
+        zbt_inner_t *parent = NULL;
+        zbt_node_t *node = t->root;
+        while (!node->leaf && node->n > 0) {
+            parent = (zbt_inner_t *)node;
+            node = parent->child[parent->hdr.n - 1];
+        }
+        if (node->leaf) {
+            zbt_leaf_t *l = (zbt_leaf_t *)node;
+            for (int i = 0; i < l->hdr.n; i++) _zbt_member_free(l->pairs[i].m);
+            *budget -= (size_t)l->hdr.n < *budget ? (size_t)l->hdr.n : *budget;
+        }
+        _zbt_node_free(node);
+        if (parent) parent->hdr.n--;
+        else t->root = NULL;
+    }
+    if (t->root) return 0;
+    zbt_init(t);
+    return 1;
+}
+
+static inline void zbt_free(zbt_tree_t *t) {
+    size_t budget = SIZE_MAX;
+    zbt_free_step(t, &budget);
+}
+
+static inline zbt_member_t *zbt_find(zbt_tree_t *t, const char *member, size_t member_len) {
+    zbt_member_t *m;
+    HASH_FIND(hh, t->dict, member, member_len, m);
+    return m;
+}
+
+/**
+ * @return 1 if a new element was added, 0 if updated, -1 out of memory.
+ */
+static inline int zbt_add(zbt_tree_t *t, double score, const char *member, size_t member_len) {
+    zbt_member_t *m = zbt_find(t, member, member_len);
+    if (m) {
+        if (m->score == score) return 0;
+        _zbt_tree_delete(t, m->score, m);
+        m->score = score;
+        zbt_pair_t key = {score, m};
+        if (_zbt_tree_insert(t, key) != 0) {
+            // Out of memory: drop the member rather than leave it half-indexed
+            HASH_DEL(t->dict, m);
+            _zbt_member_free(m);
+            t->length--;
+            return -1;
+        }
+        return 0;
+    }
+
+    m = _zbt_member_new(score, member, member_len);
+    if (m == NULL) return -1;
+    zbt_pair_t key = {score, m};
+    if (_zbt_tree_insert(t, key) != 0) {
+        _zbt_member_free(m);
+        return -1;
+    }
+    HASH_ADD_KEYPTR(hh, t->dict, m->data, m->len, m);
+    t->length++;
+    return 1;
+}
+
+/**
+ * @return 1 if removed, 0 if not found.
+ */
+static inline int zbt_remove(zbt_tree_t *t, const char *member, size_t member_len) {
+    zbt_member_t *m = zbt_find(t, member, member_len);
+    if (m == NULL) return 0;
+    _zbt_tree_delete(t, m->score, m);
+    HASH_DEL(t->dict, m);
+    _zbt_member_free(m);
+    t->length--;
+    return 1;
+}
+
+/**
+ * @return 1 if found (0-based rank stored in '*rank'), 0 otherwise.
+ */
+static inline int zbt_rank(zbt_tree_t *t, const char *member, size_t member_len, size_t *rank) {
+    zbt_member_t *m = zbt_find(t, member, member_len);
+    if (m == NULL) return 0;
+
+    size_t r = 0;
+    zbt_node_t *node = t->root;
+    while (!node->leaf) {
+        zbt_inner_t *in = (zbt_inner_t *)node;
+        int i = _zbt_child_for(in, m->score, m);
+        for (int j = 0; j < i; j++) r += in->counts[j];
+        node = in->child[i];
+    }
+    *rank = r + (size_t)_zbt_leaf_lower_bound((zbt_leaf_t *)node, m->score, m);
+    return 1;
+}
+
+/**
+ * @brief Number of elements scored below 'score' (at most 'score' with
+ * 'inclusive').
+ */
+static inline size_t zbt_count_below(zbt_tree_t *t, double score, int inclusive) {
+    size_t n = 0;
+    zbt_node_t *node = t->root;
+    if (node == NULL) return 0;
+    while (!node->leaf) {
+        zbt_inner_t *in = (zbt_inner_t *)node;
+        // Every child before the last one starting below the bound is fully counted
+        int i = in->hdr.n - 1;
+        while (i > 0 && !(in->keys[i].score < score || (inclusive && in->keys[i].score == score))) i--;
+        for (int j = 0; j < i; j++) n += in->counts[j];
+        node = in->child[i];
+    }
+    zbt_leaf_t *l = (zbt_leaf_t *)node;
+    for (int i = 0; i < l->hdr.n; i++) {
+        if (!(l->pairs[i].score < score || (inclusive && l->pairs[i].score == score))) break;
+        n++;
+    }
+    return n;
+}
+
+/**
+ * @brief Leaf and slot of the element at 'rank'.
+ * @return The leaf, or NULL if 'rank' is out of range.
+ */
+static inline zbt_leaf_t *zbt_seek_rank(zbt_tree_t *t, size_t rank, int *idx) {
+    if (rank >= t->length) return NULL;
+    zbt_node_t *node = t->root;
+    while (!node->leaf) {
+        zbt_inner_t *in = (zbt_inner_t *)node;
+        int i = 0;
+        while (rank >= in->counts[i]) {
+            rank -= in->counts[i];
+            i++;
+        }
+        node = in->child[i];
+    }
+    *idx = (int)rank;
+    return (zbt_leaf_t *)node;
+}
+
+// --- Bulk Load ---
+
+/**
+ * @brief (Internal) Frees the nodes below and including 'node', but not
+ * the members in its leaves.
+ */
+static inline void _zbt_free_skeleton(zbt_node_t *node) {
+    if (!node->leaf) {
+        zbt_inner_t *in = (zbt_inner_t *)node;
+        for (int i = 0; i < in->hdr.n; i++) _zbt_free_skeleton(in->child[i]);
+    }
+    _zbt_node_free(node);
+}
+
+/**
+ * @brief Builds the tree bottom-up over 'members', which must be in
+ * strictly ascending (score, member) order. The tree must be empty; the
+ * members' dictionary and length are the caller's business.
+ * Each level is split into runs whose sizes differ by at most one, so no
+ * node but the root is ever underfull, and nothing is searched or split.
+ * @return 0 on success, -1 out of memory (the tree stays empty).
+ */
+static inline int zbt_build(zbt_tree_t *t, zbt_member_t **members, size_t n) {
+    if (n == 0) return 0;
+    size_t nodes = (n + ZBT_LEAF_CAP - 1) / ZBT_LEAF_CAP;
+    zbt_node_t **level = (zbt_node_t **)malloc(nodes * sizeof(zbt_node_t *));
+    if (level == NULL) return -1;
+
+    zbt_leaf_t *prev = NULL;
+    size_t pos = 0;
+    for (size_t i = 0; i < nodes; i++) {
+        zbt_leaf_t *l = _zbt_leaf_new();
+        if (l == NULL) {
+            for (size_t k = 0; k < i; k++) _zbt_node_free(level[k]);
+            free(level);
+            return -1;
+        }
+        int take = (int)(n / nodes + (i < n % nodes));
+        for (int k = 0; k < take; k++) {
+            l->pairs[k].score = members[pos + k]->score;
+            l->pairs[k].m = members[pos + k];
+        }
+        l->hdr.n = take;
+        pos += take;
+        l->prev = prev;
+        if (prev) prev->next = l;
+        prev = l;
+        level[i] = &l->hdr;
+    }
+
+    while (nodes > 1) {
+        size_t parents = (nodes + ZBT_INNER_CAP - 1) / ZBT_INNER_CAP;
+        pos = 0;
+        for (size_t i = 0; i < parents; i++) {
+            zbt_inner_t *in = _zbt_inner_new();
+            if (in == NULL) {
+                // level[0, i) are new parents; level[pos, nodes) are still orphans
+                for (size_t k = 0; k < i; k++) _zbt_free_skeleton(level[k]);
+                for (size_t k = pos; k < nodes; k++) _zbt_free_skeleton(level[k]);
+                free(level);
+                return -1;
+            }
+            int take = (int)(nodes / parents + (i < nodes % parents));
+            for (int k = 0; k < take; k++) {
+                zbt_node_t *child = level[pos + k];
+                in->keys[k] = _zbt_min_key(child);
+                in->counts[k] = _zbt_size(child);
+                in->child[k] = child;
+            }
+            in->hdr.n = take;
+            pos += take;
+            level[i] = &in->hdr; // Never ahead of 'pos': every parent takes a child
+        }
+        nodes = parents;
+    }
+
+    t->root = level[0];
+    free(level);
+    return 0;
+}
+
+#endif // ZSET_BTREE_H
@@ -0,0 +1,236 @@
+/**
+ * keyspace-test: runs commands against one shard's keyspace, with no
+ * sockets in the way, and checks their replies and what is left behind.
+ * Exits non-zero on the first failed check.
+ */
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "command.h"
+
+static shard_t test_shard;
+static client_t *test_client;
+
+static size_t reply_len; // Of the last reply, which may hold NUL bytes
+
+/**
+ * Runs a command and returns its reply, valid until the next call.
+ */
+static const char *run_argv(resp_arg_t *argv, int argc)
+{
+    static char reply[4096];
+    command_dispatch(&test_shard.db, test_client, argv, argc);
+    size_t len = 0;
+    for (reply_block_t *b = test_client->reply_head; b && len + b->used < sizeof(reply); b = b->next)
+    {
+        memcpy(reply + len, b->buf, b->used);
+        len += b->used;
+    }
+    reply[len] = '\0';
+    reply_len = len;
+    _client_free_replies(test_client);
+    return reply;
+}
+
+/**
+ * run_argv() for arguments given as strings, NULL-terminated.
+ */
+static const char *run(const char *arg0, ...)
+{
+    resp_arg_t argv[64];
+    int argc = 0;
+    va_list ap;
+    va_start(ap, arg0);
+    for (const char *a = arg0; a != NULL && argc < 64; a = va_arg(ap, const char *))
+        argv[argc++] = (resp_arg_t){(char *)a, strlen(a)};
+    va_end(ap);
+    return run_argv(argv, argc);
+}
+
+static int failures = 0;
+
+static void expect(const char *what, const char *got, const char *want)
+{
+    if (strcmp(got, want) == 0)
+        return;
+    fprintf(stderr, "FAIL %s\n  got:  %s\n  want: %s\n", what, got, want);
+    failures++;
+}
+
+static void sleep_ms(long ms)
+{
+    struct timespec ts = {ms / 1000, (ms % 1000) * 1000000L};
+    nanosleep(&ts, NULL);
+    update_cached_time();
+}
+
+/**
+ * Fails unless the shard's slab pool holds 'want' live objects: a double
+ * free shows up here long before it corrupts a later key.
+ */
+static void expect_live_objects(const char *what, size_t want)
+{
+    size_t got = test_shard.db.mem.stats.objects;
+    if (got == want)
+        return;
+    fprintf(stderr, "FAIL %s: %zd live slab objects, want %zu\n", what, (ssize_t)got, want);
+    failures++;
+}
+
+// --- Repeated Expired Keys ---
+
+// A key repeated in a batched lookup is found as the same entry each
+// time; once expired, it must be deleted only once
+static void test_mget_repeated_expired_key(void)
+{
+    size_t live = test_shard.db.mem.stats.objects;
+    run("SET", "k", "vv", "PX", "5", NULL);
+    sleep_ms(20);
+    expect("MGET k k x k", run("MGET", "k", "k", "x", "k", NULL), "*4\r\n$-1\r\n$-1\r\n$-1\r\n$-1\r\n");
+    run("SET", "a", "1", NULL);
+    run("SET", "b", "2", NULL);
+    run("SET", "c", "3", NULL);
+    expect("GET a", run("GET", "a", NULL), "$1\r\n1\r\n");
+    expect("GET b", run("GET", "b", NULL), "$1\r\n2\r\n");
+    expect("GET c", run("GET", "c", NULL), "$1\r\n3\r\n");
+    if (dict_size(&test_shard.db.entries) != 3)
+    {
+        fprintf(stderr, "FAIL MGET: %zu keys left, want 3\n", (size_t)dict_size(&test_shard.db.entries));
+        failures++;
+    }
+    run("DEL", "a", "b", "c", NULL);
+    expect_live_objects("MGET", live);
+}
+
+static void test_msetnx_repeated_expired_key(void)
+{
+    size_t live = test_shard.db.mem.stats.objects;
+    run("SET", "k", "vv", "PX", "5", NULL);
+    sleep_ms(20);
+    expect("MSETNX k 1 k 2", run("MSETNX", "k", "1", "k", "2", NULL), ":1\r\n");
+    expect("GET k", run("GET", "k", NULL), "$1\r\n2\r\n");
+    run("SET", "a", "1", NULL);
+    run("SET", "b", "2", NULL);
+    expect("GET a", run("GET", "a", NULL), "$1\r\n1\r\n");
+    expect("GET b", run("GET", "b", NULL), "$1\r\n2\r\n");
+    if (dict_size(&test_shard.db.entries) != 3)
+    {
+        fprintf(stderr, "FAIL MSETNX: %zu keys left, want 3\n", (size_t)dict_size(&test_shard.db.entries));
+        failures++;
+    }
+    run("DEL", "k", "a", "b", NULL);
+    expect_live_objects("MSETNX", live);
+}
+
+// An expired key is absent to a push, whatever type it held
+static void test_push_onto_expired_key(void)
+{
+    size_t live = test_shard.db.mem.stats.objects;
+    run("SET", "k", "vv", "PX", "5", NULL);
+    sleep_ms(20);
+    expect("LPUSH k x", run("LPUSH", "k", "x", NULL), ":1\r\n");
+    expect("LRANGE k", run("LRANGE", "k", "0", "-1", NULL), "*1\r\n$1\r\nx\r\n");
+    run("DEL", "k", NULL);
+    expect_live_objects("LPUSH", live);
+}
+
+// A sorted set given a TTL (here by RESTORE) is not served once expired
+static void test_read_expired_zset(void)
+{
+    size_t live = test_shard.db.mem.stats.objects;
+    run("ZADD", "z", "1", "m", "2", "n", NULL);
+    const char *dump = run("DUMP", "z", NULL);
+    const char *payload = strstr(dump, "\r\n") + 2;
+    char copy[1024];
+    size_t len = reply_len - (size_t)(payload - dump) - 2;
+    memcpy(copy, payload, len);
+    run("DEL", "z", NULL);
+    resp_arg_t restore[4] = {{(char *)"RESTORE", 7}, {(char *)"z", 1}, {(char *)"5", 1}, {copy, len}};
+    expect("RESTORE z 5", run_argv(restore, 4), "+OK\r\n");
+    expect("ZSCORE z m", run("ZSCORE", "z", "m", NULL), "$1\r\n1\r\n");
+
+    sleep_ms(20);
+    expect("ZRANGE z", run("ZRANGE", "z", "0", "-1", NULL), "*0\r\n");
+    expect("ZSCORE z m", run("ZSCORE", "z", "m", NULL), "$-1\r\n");
+    if (dict_size(&test_shard.db.entries) != 0)
+    {
+        fprintf(stderr, "FAIL ZRANGE: %zu keys left, want 0\n", (size_t)dict_size(&test_shard.db.entries));
+        failures++;
+    }
+    expect_live_objects("ZRANGE", live);
+}
+
+// A finite timeout too large for a deadline in ms is rejected up front
+static void test_bpop_timeout_out_of_range(void)
+{
+    expect("BLPOP q 1e300", run("BLPOP", "q", "1e300", NULL), "-ERR timeout is out of range\r\n");
+    expect("BRPOP q 1e16", run("BRPOP", "q", "1e16", NULL), "-ERR timeout is out of range\r\n");
+}
+
+// --- Eviction And Lazy Freeing ---
+
+// Values queued by UNLINK still count as used memory; eviction reclaims
+// only as much of them as it needs, not the whole queue
+static void test_evict_reclaims_lazyfree_in_slices(void)
+{
+    char member[16];
+    for (int i = 0; i < 20000; i++)
+    {
+        snprintf(member, sizeof(member), "m%d", i);
+        run("RPUSH", "big", member, NULL);
+    }
+    run("SET", "a", "1", NULL);
+    long long evicted = evicted_keys;
+
+    expect("UNLINK big", run("UNLINK", "big", NULL), ":1\r\n");
+    maxmemory = db_used_memory(&test_shard.db) - 1;
+    maxmemory_policy = MAXMEMORY_ALLKEYS_LRU;
+    expect("SET b", run("SET", "b", "2", NULL), "+OK\r\n");
+    maxmemory = 0;
+    maxmemory_policy = MAXMEMORY_NOEVICTION;
+
+    expect("GET a", run("GET", "a", NULL), "$1\r\n1\r\n");
+    if (evicted_keys != evicted)
+    {
+        fprintf(stderr, "FAIL evict: %lld keys evicted, want 0\n", (long long)(evicted_keys - evicted));
+        failures++;
+    }
+    if (test_shard.db.lazyfree.count != 1)
+    {
+        fprintf(stderr, "FAIL evict: %zu values queued, want 1 (partly reclaimed)\n", test_shard.db.lazyfree.count);
+        failures++;
+    }
+    while (lazyfree_slice(&test_shard.db.lazyfree))
+        ;
+    run("DEL", "a", "b", NULL);
+}
+
+int main(void)
+{
+    config_set_defaults(&server.config);
+    log_init(LOG_WARNING, NULL);
+    command_table_init();
+    update_cached_time();
+    if (shard_init(&test_shard, 0, EVENT_BACKEND_EPOLL) != 0)
+        return 1;
+    test_shard.db.nshards = 1;
+    server.shards = &test_shard;
+    server.nshards = 1;
+    slab_use(&test_shard.db.mem);
+    test_client = client_create(-1, 0);
+    test_client->shard = &test_shard;
+
+    test_mget_repeated_expired_key();
+    test_msetnx_repeated_expired_key();
+    test_push_onto_expired_key();
+    test_read_expired_zset();
+    test_bpop_timeout_out_of_range();
+    test_evict_reclaims_lazyfree_in_slices();
+
+    if (failures)
+        return 1;
+    printf("keyspace-test: all checks passed\n");
+    return 0;
+}